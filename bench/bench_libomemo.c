@@ -0,0 +1,322 @@
+/*
+ * Benchmarks the full round trip of a message:
+ * prepare_encryption -> add_recipient * N -> export_encrypted -> prepare_decryption -> get_encrypted_key -> export_decrypted
+ *
+ * The results are written to stdout as JSON, one entry per combination of crypto provider, body size and recipient amount.
+ *
+ * Usage: bench_libomemo [-n max_iterations] [-t max_seconds_per_case]
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libomemo.h"
+#include "libomemo_crypto.h"
+#include "libomemo_crypto_gcm128.h"
+#ifdef OMEMO_WITH_OPENSSL
+#include "libomemo_crypto_openssl.h"
+#endif
+
+#define BENCH_DEFAULT_MAX_ITERATIONS 1000
+#define BENCH_DEFAULT_MAX_SECONDS 0.5
+#define BENCH_MIN_ITERATIONS 5
+
+static const size_t body_sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+static const size_t recipient_amounts[] = {1, 10, 100, 500};
+
+typedef struct bench_provider {
+  const char * name;
+  omemo_crypto_provider crypto;
+} bench_provider;
+
+static const bench_provider providers[] = {
+  {
+    "gcrypt",
+    {
+      .random_bytes_func = omemo_default_crypto_random_bytes,
+      .aes_gcm_encrypt_func = omemo_default_crypto_aes_gcm_encrypt,
+      .aes_gcm_decrypt_func = omemo_default_crypto_aes_gcm_decrypt,
+      .user_data_p = (void *) 0,
+      .aes_gcm_encrypt_into_func = omemo_default_crypto_aes_gcm_encrypt_into,
+      .aes_gcm_decrypt_into_func = omemo_default_crypto_aes_gcm_decrypt_into,
+      .random_bytes_into_func = omemo_default_crypto_random_bytes_into
+    }
+  },
+  {
+    "gcrypt-alloc",
+    {
+      .random_bytes_func = omemo_default_crypto_random_bytes,
+      .aes_gcm_encrypt_func = omemo_default_crypto_aes_gcm_encrypt,
+      .aes_gcm_decrypt_func = omemo_default_crypto_aes_gcm_decrypt,
+      .user_data_p = (void *) 0
+    }
+  },
+  {
+    "gcm128",
+    {
+      .random_bytes_func = omemo_default_crypto_random_bytes,
+      .aes_gcm_encrypt_func = omemo_gcm128_crypto_aes_gcm_encrypt,
+      .aes_gcm_decrypt_func = omemo_gcm128_crypto_aes_gcm_decrypt,
+      .user_data_p = (void *) 0,
+      .aes_gcm_encrypt_into_func = omemo_gcm128_crypto_aes_gcm_encrypt_into,
+      .aes_gcm_decrypt_into_func = omemo_gcm128_crypto_aes_gcm_decrypt_into,
+      .random_bytes_into_func = omemo_default_crypto_random_bytes_into
+    }
+#ifdef OMEMO_WITH_OPENSSL
+  },
+  {
+    "openssl",
+    {
+      .random_bytes_func = omemo_openssl_crypto_random_bytes,
+      .aes_gcm_encrypt_func = omemo_openssl_crypto_aes_gcm_encrypt,
+      .aes_gcm_decrypt_func = omemo_openssl_crypto_aes_gcm_decrypt,
+      .user_data_p = (void *) 0,
+      .aes_gcm_encrypt_into_func = omemo_openssl_crypto_aes_gcm_encrypt_into,
+      .aes_gcm_decrypt_into_func = omemo_openssl_crypto_aes_gcm_decrypt_into,
+      .random_bytes_into_func = omemo_openssl_crypto_random_bytes_into
+    }
+#endif
+  }
+};
+
+/*
+ * Allocations are counted by interposing the allocator, which also catches the ones in the library and its dependencies.
+ * This only works with glibc, elsewhere the counts are reported as null.
+ */
+static uint64_t alloc_count = 0;
+
+#ifdef __GLIBC__
+#define BENCH_COUNTS_ALLOCS 1
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+void * malloc(size_t size) {
+  alloc_count++;
+  return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size) {
+  alloc_count++;
+  return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+  alloc_count++;
+  return __libc_realloc(ptr, size);
+}
+#else
+#define BENCH_COUNTS_ALLOCS 0
+#endif
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int uint64_cmp(const void * a_p, const void * b_p) {
+  uint64_t a = *(const uint64_t *) a_p;
+  uint64_t b = *(const uint64_t *) b_p;
+  return (a > b) - (a < b);
+}
+
+// nearest-rank percentile of sorted samples
+static uint64_t percentile(const uint64_t * sorted_p, size_t len, unsigned int p) {
+  size_t rank = (len * p + 99) / 100;
+  return sorted_p[rank ? rank - 1 : 0];
+}
+
+static char * create_stanza(size_t body_len) {
+  static const char prefix[] = "<message xmlns='jabber:client' type='chat' to='bob@example.com' from='alice@example.com/bench'><body>";
+  static const char suffix[] = "</body></message>";
+
+  char * stanza = malloc(strlen(prefix) + body_len + strlen(suffix) + 1);
+  if (!stanza) {
+    return (void *) 0;
+  }
+
+  char * w_p = stanza;
+  memcpy(w_p, prefix, strlen(prefix));
+  w_p += strlen(prefix);
+  for (size_t i = 0; i < body_len; i++) {
+    *w_p++ = 'a' + (i % 26);
+  }
+  memcpy(w_p, suffix, strlen(suffix) + 1);
+
+  return stanza;
+}
+
+/**
+ * Runs one full round trip. The last recipient is the one the message is decrypted for.
+ *
+ * @return 0 on success, negative on error.
+ */
+static int round_trip(char * stanza, size_t recipients, const omemo_crypto_provider * crypto_p) {
+  int ret_val = 0;
+
+  const uint32_t sid = 1111;
+  omemo_message * msg_out_p = (void *) 0;
+  omemo_message * msg_in_p = (void *) 0;
+  char * xml_out = (void *) 0;
+  char * xml_in = (void *) 0;
+  uint8_t * key_p = (void *) 0;
+  size_t key_len = 0;
+
+  ret_val = omemo_message_prepare_encryption(stanza, sid, crypto_p, OMEMO_STRIP_ALL, &msg_out_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  // the "encrypted" key is the plain one, there is no libsignal involved here
+  for (size_t i = 0; i < recipients; i++) {
+    ret_val = omemo_message_add_recipient(msg_out_p, 1000 + i, omemo_message_get_key(msg_out_p), omemo_message_get_key_len(msg_out_p));
+    if (ret_val) {
+      goto cleanup;
+    }
+  }
+
+  ret_val = omemo_message_export_encrypted(msg_out_p, OMEMO_ADD_MSG_EME, &xml_out);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = omemo_message_prepare_decryption(xml_out, &msg_in_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = omemo_message_get_encrypted_key(msg_in_p, 1000 + recipients - 1, &key_p, &key_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+  if (!key_p) {
+    ret_val = OMEMO_ERR;
+    goto cleanup;
+  }
+
+  ret_val = omemo_message_export_decrypted(msg_in_p, key_p, key_len, crypto_p, &xml_in);
+
+cleanup:
+  omemo_message_destroy(msg_out_p);
+  omemo_message_destroy(msg_in_p);
+  free(xml_out);
+  free(xml_in);
+  free(key_p);
+
+  return ret_val;
+}
+
+static int run_case(const bench_provider * provider_p, size_t body_len, size_t recipients, size_t max_iterations, double max_seconds, bool first) {
+  int ret_val = 0;
+
+  char * stanza = (void *) 0;
+  uint64_t * samples_p = (void *) 0;
+  size_t iterations = 0;
+  uint64_t total_ns = 0;
+  uint64_t allocs = 0;
+
+  stanza = create_stanza(body_len);
+  samples_p = malloc(sizeof(uint64_t) * max_iterations);
+  if (!stanza || !samples_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  // warm up caches, pools and the allocator
+  ret_val = round_trip(stanza, recipients, &provider_p->crypto);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  while (iterations < max_iterations && (iterations < BENCH_MIN_ITERATIONS || total_ns < max_seconds * 1e9)) {
+    uint64_t allocs_before = alloc_count;
+    uint64_t start = now_ns();
+
+    ret_val = round_trip(stanza, recipients, &provider_p->crypto);
+
+    uint64_t elapsed = now_ns() - start;
+    allocs += alloc_count - allocs_before;
+    if (ret_val) {
+      goto cleanup;
+    }
+
+    samples_p[iterations++] = elapsed;
+    total_ns += elapsed;
+  }
+
+  qsort(samples_p, iterations, sizeof(uint64_t), uint64_cmp);
+
+  printf("%s    {\"provider\": \"%s\", \"body_size\": %zu, \"recipients\": %zu, \"iterations\": %zu, "
+         "\"ops_per_sec\": %.2f, \"latency_ns\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64 "}, ",
+         first ? "" : ",\n",
+         provider_p->name, body_len, recipients, iterations,
+         total_ns ? iterations * 1e9 / total_ns : 0.0,
+         percentile(samples_p, iterations, 50), percentile(samples_p, iterations, 99));
+  if (BENCH_COUNTS_ALLOCS) {
+    printf("\"allocs_per_op\": %.1f}", (double) allocs / iterations);
+  } else {
+    printf("\"allocs_per_op\": null}");
+  }
+  fflush(stdout);
+
+cleanup:
+  if (ret_val) {
+    fprintf(stderr, "%s, body size %zu, %zu recipients: failed with %d\n", provider_p->name, body_len, recipients, ret_val);
+  }
+  free(stanza);
+  free(samples_p);
+
+  return ret_val;
+}
+
+int main(int argc, char ** argv) {
+  size_t max_iterations = BENCH_DEFAULT_MAX_ITERATIONS;
+  double max_seconds = BENCH_DEFAULT_MAX_SECONDS;
+  int ret_val = 0;
+  bool first = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      max_iterations = strtoul(argv[++i], (void *) 0, 10);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      max_seconds = strtod(argv[++i], (void *) 0);
+    } else {
+      fprintf(stderr, "usage: %s [-n max_iterations] [-t max_seconds_per_case]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (max_iterations == 0) {
+    max_iterations = 1;
+  }
+
+  omemo_default_crypto_init();
+
+  printf("{\n  \"benchmark\": \"omemo_message_round_trip\",\n  \"version\": \"%s\",\n  \"results\": [\n", OMEMO_BENCH_VERSION);
+
+  for (size_t p = 0; p < sizeof(providers) / sizeof(providers[0]); p++) {
+    for (size_t b = 0; b < sizeof(body_sizes) / sizeof(body_sizes[0]); b++) {
+      for (size_t r = 0; r < sizeof(recipient_amounts) / sizeof(recipient_amounts[0]); r++) {
+        ret_val = run_case(&providers[p], body_sizes[b], recipient_amounts[r], max_iterations, max_seconds, first);
+        if (ret_val) {
+          goto cleanup;
+        }
+        first = false;
+      }
+    }
+  }
+
+cleanup:
+  printf("\n  ]\n}\n");
+  omemo_default_crypto_teardown();
+#ifdef OMEMO_WITH_OPENSSL
+  omemo_openssl_crypto_teardown();
+#endif
+
+  return ret_val ? EXIT_FAILURE : EXIT_SUCCESS;
+}
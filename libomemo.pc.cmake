@@ -8,6 +8,6 @@ Version: @PROJECT_VERSION@
 Description: OMEMO library for C
 URL: https://github.com/gkdr/libomemo
 Requires: glib-2.0
-Requires.private: libgcrypt mxml sqlite3
+Requires.private: libgcrypt mxml sqlite3@_OMEMO_PKGCONF_REQUIRES_OPENSSL@
 Cflags: -I${includedir}/libomemo
 Libs: -L${libdir} -lomemo
@@ -5,11 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <glib.h> // b64, glist
+#include <glib.h> // glist
 
 #include <mxml.h>
 
 #include "libomemo.h"
+#include "libomemo_b64.h"
 
 #define HINTS_XMLNS "urn:xmpp:hints"
 
@@ -65,21 +66,70 @@
 #define EME_NAMESPACE_ATTR_NAME "namespace"
 #define EME_NAME_ATTR_NAME "name"
 
+typedef struct omemo_bundle_pre_key {
+  uint32_t id;
+  size_t data_offset; // into pre_key_data_p of the bundle
+  size_t data_len;
+  size_t xml_offset; // of its <preKeyPublic> element in the export cache, only valid as long as that is
+  size_t xml_len;
+} omemo_bundle_pre_key;
+
+// a growing string, also usable as omemo_write_func
+typedef struct string_sink {
+  char * str_p;
+  size_t len;
+  size_t cap;
+} string_sink;
+
+// a public key or signature, data_p is NULL as long as it was not set
+typedef struct omemo_bundle_data {
+  uint8_t * data_p;
+  size_t data_len;
+} omemo_bundle_data;
+
 struct omemo_bundle {
   char * device_id;
-  mxml_node_t * signed_pk_node_p;
-  mxml_node_t * signature_node_p;
-  mxml_node_t * identity_key_node_p;
-  mxml_node_t * pre_keys_node_p;
+  uint32_t signed_pre_key_id;
+  omemo_bundle_data signed_pre_key;
+  omemo_bundle_data signature;
+  omemo_bundle_data identity_key;
   size_t pre_keys_amount;
+  omemo_bundle_pre_key * pre_keys_p;
+  size_t pre_keys_cap;
+  uint8_t * pre_key_data_p; // the data of all pre keys, back to back
+  size_t pre_key_data_len;
+  size_t pre_key_data_cap;
+  uint32_t pre_key_id_last; // where omemo_bundle_next_pre_key_ids() continues
+  uint32_t * consumed_ids_p; // removed pre keys, sorted, not handed out again by omemo_bundle_next_pre_key_ids()
+  size_t consumed_ids_len;
+  size_t consumed_ids_cap;
+  // the last export, str_p is NULL if it has to be written again
+  string_sink export_cache;
+  size_t export_cache_pre_keys_end; // offset of </prekeys>
 };
 
 struct omemo_devicelist {
   char * from;
-  GList * id_list_p;
+  uint32_t * ids_p; // sorted in ascending order, without duplicates
+  size_t ids_len;
+  size_t ids_cap;
   mxml_node_t * list_node_p;
 };
 
+// a region of the stanza, from the start of an element up to (excluding) end
+typedef struct omemo_message_span {
+  size_t start;
+  size_t end;
+} omemo_message_span;
+
+// entry of the rid -> <key> element index of a message
+typedef struct omemo_key_index_entry {
+  uint32_t rid;
+  bool prekey;
+  const char * key_b64; // points into the <key> element, i.e. only valid as long as the header
+  bool used;
+} omemo_key_index_entry;
+
 struct omemo_message {
   mxml_node_t * message_node_p;
   mxml_node_t * header_node_p;
@@ -89,6 +139,22 @@ struct omemo_message {
   uint8_t * iv_p;
   size_t iv_len;
   size_t tag_len; //tag is appended to key buf, i.e. tag_p = key_p + key_len
+  uint8_t key_material[OMEMO_AES_GCM_IV_LENGTH + OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH]; // iv_p and key_p point into this
+  omemo_key_index_entry * key_index_p; // open addressing hash table, NULL if not built yet
+  size_t key_index_cap; // power of two
+  size_t key_index_len;
+
+  // only set for messages from omemo_message_prepare_decryption_streaming(), in which case the nodes above are NULL
+  char * stanza_p; // private copy of the stanza, the parts inside cut out elements are modified in place
+  size_t stanza_len;
+  omemo_message_span cuts[4]; // elements left out on export, sorted by offset
+  size_t cuts_amount;
+  size_t root_end_tag_pos; // offset of the end tag of the root element, where the decrypted body is inserted
+  const char * sid;
+  const char * iv_b64;
+  const char * payload_b64;
+  char * from;
+  char * to;
 };
 
 /**
@@ -160,356 +226,1124 @@ static int expect_next_node(mxml_node_t * node_p, mxml_node_t * (*next_node_func
     } \
   } while(0)
 
-int omemo_bundle_create(omemo_bundle ** bundle_pp) {
-  omemo_bundle * bundle_p = malloc(sizeof(omemo_bundle));
-  if (!bundle_p) {
-    return OMEMO_ERR_NOMEM;
-  }
-  memset(bundle_p, 0, sizeof(omemo_bundle));
-
-  *bundle_pp = bundle_p;
+/*
+ * Minimal pull tokenizer for the code paths that do not need a DOM.
+ * It works on offsets into a buffer and does not allocate.
+ * Only as much of XML as appears in stanzas is supported: elements, attributes, text,
+ * comments, CDATA sections, processing instructions and declarations (the latter are skipped).
+ */
 
-  return 0;
+typedef enum xml_token_type {
+  XML_TOKEN_START, // <name ...>
+  XML_TOKEN_EMPTY, // <name .../>
+  XML_TOKEN_END,   // </name>
+  XML_TOKEN_TEXT,
+  XML_TOKEN_OTHER  // comments, CDATA, processing instructions, declarations
+} xml_token_type;
+
+typedef struct xml_token {
+  xml_token_type type;
+  size_t start;      // offset of the first byte of the token
+  size_t end;        // offset after the last byte of the token
+  size_t name_start; // only for element tokens
+  size_t name_len;
+} xml_token;
+
+static bool xml_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
-int omemo_bundle_set_device_id(omemo_bundle * bundle_p, uint32_t device_id) {
-  char * id_string = (void *) 0;
-  int ret = int_to_string(device_id, &id_string);
-  if (ret <= 0) {
-    return ret;
-  }
+static bool xml_is_name_end(char c) {
+  return xml_is_space(c) || c == '>' || c == '/' || c == '=';
+}
 
-  bundle_p->device_id = id_string;
+// finds the next occurrence of the terminator at or after pos, returns the offset after it or 0 if there is none
+static size_t xml_skip_past(const char * buf, size_t len, size_t pos, const char * terminator) {
+  size_t term_len = strlen(terminator);
 
-  return OMEMO_SUCCESS;
-}
+  while (pos + term_len <= len) {
+    if (!memcmp(buf + pos, terminator, term_len)) {
+      return pos + term_len;
+    }
+    pos++;
+  }
 
-uint32_t omemo_bundle_get_device_id(omemo_bundle * bundle_p) {
-  return strtol(bundle_p->device_id, (void *) 0, 0);
+  return 0;
 }
 
-int omemo_bundle_set_signed_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id, uint8_t * data_p, size_t data_len) {
-  int ret_val = 0;
-
-  mxml_node_t * signed_pre_key_node_p = (void *) 0;
-  char * pre_key_id_string = (void *) 0;
-  gchar * b64_string = (void *) 0;
+/**
+ * Reads the next token.
+ *
+ * @param buf The XML data.
+ * @param len Length of the XML data.
+ * @param pos_p Offset to start at, will be advanced past the token.
+ * @param tok_p Will be filled with the token.
+ * @return 1 if a token was read, 0 at the end of the input, OMEMO_ERR_MALFORMED_XML on error.
+ */
+static int xml_next_token(const char * buf, size_t len, size_t * pos_p, xml_token * tok_p) {
+  size_t pos = *pos_p;
 
-  signed_pre_key_node_p = mxmlNewElement(MXML_NO_PARENT, SIGNED_PRE_KEY_NODE_NAME);
-  if (int_to_string(pre_key_id, &pre_key_id_string) <= 0) {
-    ret_val = -1;
-    goto cleanup;
+  if (pos >= len) {
+    return 0;
   }
-  mxmlElementSetAttr(signed_pre_key_node_p, SIGNED_PRE_KEY_NODE_ID_ATTR_NAME, pre_key_id_string);
 
-  b64_string = g_base64_encode(data_p, data_len);
-  (void) mxmlNewOpaque(signed_pre_key_node_p, b64_string);
+  memset(tok_p, 0, sizeof(xml_token));
+  tok_p->start = pos;
 
-  bundle_p->signed_pk_node_p = signed_pre_key_node_p;
-
-cleanup:
-  if (ret_val < 0) {
-    mxmlDelete(signed_pre_key_node_p);
+  if (buf[pos] != '<') {
+    const char * lt_p = memchr(buf + pos, '<', len - pos);
+    tok_p->type = XML_TOKEN_TEXT;
+    tok_p->end = lt_p ? (size_t) (lt_p - buf) : len;
+    *pos_p = tok_p->end;
+    return 1;
   }
-  g_free(b64_string);
-  free(pre_key_id_string);
 
-  return ret_val;
-}
+  if (pos + 1 >= len) {
+    return OMEMO_ERR_MALFORMED_XML;
+  }
 
-int omemo_bundle_get_signed_pre_key(omemo_bundle * bundle_p, uint32_t * pre_key_id_p, uint8_t ** data_pp, size_t * data_len_p) {
-  int ret_val = 0;
+  if (buf[pos + 1] == '!' || buf[pos + 1] == '?') {
+    const char * terminator = ">";
+    if (len - pos >= 4 && !memcmp(buf + pos, "<!--", 4)) {
+      terminator = "-->";
+    } else if (len - pos >= 9 && !memcmp(buf + pos, "<![CDATA[", 9)) {
+      terminator = "]]>";
+    } else if (buf[pos + 1] == '?') {
+      terminator = "?>";
+    }
 
-  const char * b64_string = (void *) 0;
-  guchar * data_p = (void *) 0;
-  gsize len = 0;
-  const char * pre_key_id_string = (void *) 0;
+    tok_p->type = XML_TOKEN_OTHER;
+    tok_p->end = xml_skip_past(buf, len, pos + 2, terminator);
+    if (!tok_p->end) {
+      return OMEMO_ERR_MALFORMED_XML;
+    }
+    *pos_p = tok_p->end;
+    return 1;
+  }
 
-  if (!bundle_p || !bundle_p->signed_pk_node_p) {
-    ret_val = OMEMO_ERR_NULL;
-    goto cleanup;
+  if (buf[pos + 1] == '/') {
+    tok_p->type = XML_TOKEN_END;
+    pos += 2;
+  } else {
+    tok_p->type = XML_TOKEN_START;
+    pos += 1;
   }
 
-  b64_string = mxmlGetOpaque(bundle_p->signed_pk_node_p);
-  if (!b64_string) {
-    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_SPK_DATA;
-    goto cleanup;
+  tok_p->name_start = pos;
+  while (pos < len && !xml_is_name_end(buf[pos])) {
+    pos++;
+  }
+  tok_p->name_len = pos - tok_p->name_start;
+  if (tok_p->name_len == 0) {
+    return OMEMO_ERR_MALFORMED_XML;
   }
 
-  pre_key_id_string = mxmlElementGetAttr(bundle_p->signed_pk_node_p, SIGNED_PRE_KEY_NODE_ID_ATTR_NAME);
-  if (!pre_key_id_string) {
-    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_SPK_ID_ATTR;
-    goto cleanup;
+  // attribute values may contain '>', so quotes have to be skipped as a whole
+  while (pos < len && buf[pos] != '>') {
+    if (buf[pos] == '"' || buf[pos] == '\'') {
+      const char * quote_p = memchr(buf + pos + 1, buf[pos], len - pos - 1);
+      if (!quote_p) {
+        return OMEMO_ERR_MALFORMED_XML;
+      }
+      pos = quote_p - buf;
+    }
+    pos++;
+  }
+  if (pos >= len) {
+    return OMEMO_ERR_MALFORMED_XML;
   }
 
-  data_p = g_base64_decode(b64_string, &len);
+  if (tok_p->type == XML_TOKEN_START && buf[pos - 1] == '/') {
+    tok_p->type = XML_TOKEN_EMPTY;
+  }
 
-  *pre_key_id_p = strtol(pre_key_id_string, (void *) 0, 0);
-  *data_pp = data_p;
-  *data_len_p = len;
+  tok_p->end = pos + 1;
+  *pos_p = tok_p->end;
 
-cleanup:
+  return 1;
+}
 
-  return ret_val;
+static bool xml_token_name_is(const char * buf, const xml_token * tok_p, const char * name) {
+  return tok_p->name_len == strlen(name) && !memcmp(buf + tok_p->name_start, name, tok_p->name_len);
 }
 
-int omemo_bundle_set_signature(omemo_bundle * bundle_p, uint8_t * data_p, size_t data_len) {
-  mxml_node_t * signature_node_p = mxmlNewElement(MXML_NO_PARENT, SIGNATURE_NODE_NAME);
+/**
+ * Looks up an attribute of a start tag.
+ *
+ * @param buf The XML data.
+ * @param tok_p Pointer to a start or empty element token.
+ * @param name The name of the attribute.
+ * @param val_start_p Will be set to the offset of the (still escaped) value.
+ * @param val_len_p Will be set to the length of the value.
+ * @return 1 if the attribute was found, 0 if not.
+ */
+static int xml_token_get_attr(const char * buf, const xml_token * tok_p, const char * name, size_t * val_start_p, size_t * val_len_p) {
+  size_t name_len = strlen(name);
+  size_t pos = tok_p->name_start + tok_p->name_len;
+
+  while (pos < tok_p->end) {
+    while (pos < tok_p->end && (xml_is_space(buf[pos]) || buf[pos] == '/')) {
+      pos++;
+    }
 
-  gchar * b64_string = g_base64_encode(data_p, data_len);
-  (void) mxmlNewOpaque(signature_node_p, b64_string);
+    size_t attr_start = pos;
+    while (pos < tok_p->end && !xml_is_name_end(buf[pos])) {
+      pos++;
+    }
+    size_t attr_len = pos - attr_start;
+
+    while (pos < tok_p->end && xml_is_space(buf[pos])) {
+      pos++;
+    }
+    if (attr_len == 0 || pos >= tok_p->end || buf[pos] != '=') {
+      return 0;
+    }
+    pos++;
+    while (pos < tok_p->end && xml_is_space(buf[pos])) {
+      pos++;
+    }
+    if (pos >= tok_p->end || (buf[pos] != '"' && buf[pos] != '\'')) {
+      return 0;
+    }
+
+    const char * quote_p = memchr(buf + pos + 1, buf[pos], tok_p->end - pos - 1);
+    if (!quote_p) {
+      return 0;
+    }
 
-  bundle_p->signature_node_p = signature_node_p;
+    if (attr_len == name_len && !memcmp(buf + attr_start, name, name_len)) {
+      *val_start_p = pos + 1;
+      *val_len_p = (quote_p - buf) - (pos + 1);
+      return 1;
+    }
 
-  g_free(b64_string);
+    pos = (quote_p - buf) + 1;
+  }
 
   return 0;
 }
 
-int omemo_bundle_get_signature(omemo_bundle * bundle_p, uint8_t ** data_pp, size_t * data_len_p) {
-  int ret_val = 0;
+/**
+ * Copies a string while replacing the predefined XML entities and character references.
+ *
+ * @param in_p Pointer to the escaped string.
+ * @param in_len Its length.
+ * @return The unescaped, null-terminated copy which has to be free()d, or NULL if out of memory.
+ */
+static char * xml_unescape_dup(const char * in_p, size_t in_len) {
+  static const struct {
+    const char * entity;
+    char c;
+  } entities[] = {{"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}};
+
+  char * out_p = malloc(in_len + 1);
+  if (!out_p) {
+    return (void *) 0;
+  }
+
+  size_t out_len = 0;
+  size_t i = 0;
+  while (i < in_len) {
+    if (in_p[i] != '&') {
+      out_p[out_len++] = in_p[i++];
+      continue;
+    }
 
-  const char * b64_string = (void *) 0;
-  guchar * data_p = (void *) 0;
-  gsize len = 0;
+    bool replaced = false;
+    for (size_t e = 0; e < sizeof(entities) / sizeof(entities[0]); e++) {
+      size_t entity_len = strlen(entities[e].entity);
+      if (in_len - i >= entity_len && !memcmp(in_p + i, entities[e].entity, entity_len)) {
+        out_p[out_len++] = entities[e].c;
+        i += entity_len;
+        replaced = true;
+        break;
+      }
+    }
 
-  if (!bundle_p || !bundle_p->signature_node_p) {
-    ret_val = OMEMO_ERR_NULL;
-    goto cleanup;
-  }
+    if (!replaced && in_len - i > 3 && in_p[i + 1] == '#') {
+      const char * semicolon_p = memchr(in_p + i, ';', in_len - i);
+      char * end_p = (void *) 0;
+      unsigned long cp = (in_p[i + 2] == 'x') ? strtoul(in_p + i + 3, &end_p, 16) : strtoul(in_p + i + 2, &end_p, 10);
+      // only characters that fit into the space of the reference are written, which any UTF-8 sequence does
+      if (semicolon_p && end_p == semicolon_p && cp > 0 && cp <= 0x10FFFF) {
+        if (cp < 0x80) {
+          out_p[out_len++] = cp;
+        } else if (cp < 0x800) {
+          out_p[out_len++] = 0xC0 | (cp >> 6);
+          out_p[out_len++] = 0x80 | (cp & 0x3F);
+        } else if (cp < 0x10000) {
+          out_p[out_len++] = 0xE0 | (cp >> 12);
+          out_p[out_len++] = 0x80 | ((cp >> 6) & 0x3F);
+          out_p[out_len++] = 0x80 | (cp & 0x3F);
+        } else {
+          out_p[out_len++] = 0xF0 | (cp >> 18);
+          out_p[out_len++] = 0x80 | ((cp >> 12) & 0x3F);
+          out_p[out_len++] = 0x80 | ((cp >> 6) & 0x3F);
+          out_p[out_len++] = 0x80 | (cp & 0x3F);
+        }
+        i = (semicolon_p - in_p) + 1;
+        replaced = true;
+      }
+    }
 
-  b64_string = mxmlGetOpaque(bundle_p->signature_node_p);
-  if (!b64_string) {
-    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_SIG_DATA;
-    goto cleanup;
+    if (!replaced) {
+      out_p[out_len++] = in_p[i++];
+    }
   }
+  out_p[out_len] = '\0';
 
-  data_p = g_base64_decode(b64_string, &len);
-
-  *data_pp = data_p;
-  *data_len_p = len;
+  return out_p;
+}
 
-cleanup:
+// the characters mxml escapes when writing text
+static const char * xml_escape_entity(char c) {
+  switch (c) {
+    case '&':
+      return "&amp;";
+    case '<':
+      return "&lt;";
+    case '>':
+      return "&gt;";
+    case '"':
+      return "&quot;";
+    default:
+      return (void *) 0;
+  }
+}
 
-  return ret_val;
+/*
+ * Serializes an mxml tree through an omemo_write_func instead of into one allocated string.
+ * Small pieces are collected in the buffer, so that the callback is not called for every tag and attribute.
+ * The output is equivalent to what mxml writes, but without its line wrapping.
+ */
+typedef struct xml_writer {
+  omemo_write_func write_func;
+  void * user_data_p;
+  char buf[1024];
+  size_t buf_len;
+  int ret_val;
+} xml_writer;
+
+static void xml_writer_init(xml_writer * w_p, omemo_write_func write_func, void * user_data_p) {
+  w_p->write_func = write_func;
+  w_p->user_data_p = user_data_p;
+  w_p->buf_len = 0;
+  w_p->ret_val = 0;
 }
 
-int omemo_bundle_set_identity_key(omemo_bundle * bundle_p, uint8_t * data_p, size_t data_len) {
-  mxml_node_t * identity_node_p = mxmlNewElement(MXML_NO_PARENT, IDENTITY_KEY_NODE_NAME);
+static int xml_writer_flush(xml_writer * w_p) {
+  if (!w_p->ret_val && w_p->buf_len) {
+    w_p->ret_val = w_p->write_func(w_p->buf, w_p->buf_len, w_p->user_data_p);
+  }
+  w_p->buf_len = 0;
 
-  gchar * b64_string = g_base64_encode(data_p, data_len);
-  (void) mxmlNewOpaque(identity_node_p, b64_string);
+  return w_p->ret_val;
+}
 
-  bundle_p->identity_key_node_p = identity_node_p;
+static void xml_writer_put(xml_writer * w_p, const char * data_p, size_t data_len) {
+  if (w_p->ret_val) {
+    return;
+  }
 
-  g_free(b64_string);
+  if (w_p->buf_len + data_len > sizeof(w_p->buf)) {
+    if (xml_writer_flush(w_p)) {
+      return;
+    }
+    // long runs such as the payload are passed through as they are
+    if (data_len > sizeof(w_p->buf)) {
+      w_p->ret_val = w_p->write_func(data_p, data_len, w_p->user_data_p);
+      return;
+    }
+  }
 
-  return 0;
+  memcpy(w_p->buf + w_p->buf_len, data_p, data_len);
+  w_p->buf_len += data_len;
 }
 
-int omemo_bundle_get_identity_key(omemo_bundle * bundle_p, uint8_t ** data_pp, size_t * data_len_p) {
-  int ret_val = 0;
+static void xml_writer_put_str(xml_writer * w_p, const char * str) {
+  xml_writer_put(w_p, str, strlen(str));
+}
 
-  const char * b64_string = (void *) 0;
-  guchar * data_p = (void *) 0;
-  gsize len = 0;
+static void xml_writer_put_escaped(xml_writer * w_p, const char * str) {
+  const char * run_p = str;
+  const char * c_p = str;
 
-  if (!bundle_p || !bundle_p->identity_key_node_p) {
-    ret_val = OMEMO_ERR_NULL;
-    goto cleanup;
+  for (; *c_p; c_p++) {
+    const char * entity = xml_escape_entity(*c_p);
+    if (entity) {
+      xml_writer_put(w_p, run_p, c_p - run_p);
+      xml_writer_put_str(w_p, entity);
+      run_p = c_p + 1;
+    }
   }
+  xml_writer_put(w_p, run_p, c_p - run_p);
+}
 
-  b64_string = mxmlGetOpaque(bundle_p->identity_key_node_p);
-  if (!b64_string) {
-    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_IK_DATA;
-    goto cleanup;
+static void xml_writer_put_node(xml_writer * w_p, mxml_node_t * node_p) {
+  const char * name = (void *) 0;
+  const char * value = (void *) 0;
+  int whitespace = 0;
+
+  switch (mxmlGetType(node_p)) {
+    case MXML_ELEMENT:
+      name = mxmlGetElement(node_p);
+      xml_writer_put_str(w_p, "<");
+      xml_writer_put_str(w_p, name);
+      // comments, declarations and CDATA are stored with their delimiters as the element name
+      if (name[0] == '!' || name[0] == '?') {
+        xml_writer_put_str(w_p, ">");
+        break;
+      }
+
+      for (int i = 0; i < mxmlElementGetAttrCount(node_p); i++) {
+        const char * attr_name = (void *) 0;
+        value = mxmlElementGetAttrByIndex(node_p, i, &attr_name);
+        xml_writer_put_str(w_p, " ");
+        xml_writer_put_str(w_p, attr_name);
+        xml_writer_put_str(w_p, "=\"");
+        xml_writer_put_escaped(w_p, value ? value : "");
+        xml_writer_put_str(w_p, "\"");
+      }
+
+      if (!mxmlGetFirstChild(node_p)) {
+        xml_writer_put_str(w_p, "/>");
+        break;
+      }
+
+      xml_writer_put_str(w_p, ">");
+      for (mxml_node_t * child_p = mxmlGetFirstChild(node_p); child_p; child_p = mxmlGetNextSibling(child_p)) {
+        xml_writer_put_node(w_p, child_p);
+      }
+      xml_writer_put_str(w_p, "</");
+      xml_writer_put_str(w_p, name);
+      xml_writer_put_str(w_p, ">");
+      break;
+    case MXML_OPAQUE:
+      value = mxmlGetOpaque(node_p);
+      xml_writer_put_escaped(w_p, value ? value : "");
+      break;
+    case MXML_TEXT:
+      value = mxmlGetText(node_p, &whitespace);
+      if (whitespace) {
+        xml_writer_put_str(w_p, " ");
+      }
+      xml_writer_put_escaped(w_p, value ? value : "");
+      break;
+    default:
+      // numbers and custom nodes are never created here
+      break;
   }
+}
 
-  data_p = g_base64_decode(b64_string, &len);
-
-  *data_pp = data_p;
-  *data_len_p = len;
+// writes the tree starting at node_p and flushes the writer
+static int xml_writer_write_tree(xml_writer * w_p, mxml_node_t * node_p) {
+  xml_writer_put_node(w_p, node_p);
 
-cleanup:
-  return ret_val;
+  return xml_writer_flush(w_p);
 }
 
-int omemo_bundle_add_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id, uint8_t * data_p, size_t data_len) {
-  int ret_val = 0;
+static void xml_writer_put_uint(xml_writer * w_p, uint32_t in) {
+  char buf[11];
+  int len = snprintf(buf, sizeof(buf), "%" PRIu32, in);
+  xml_writer_put(w_p, buf, len);
+}
 
-  mxml_node_t * prekeys_node_p = (void *) 0;
-  mxml_node_t * pre_key_node_p = (void *) 0;
-  char * pre_key_id_string = (void *) 0;
-  gchar * b64_string = (void *) 0;
+// encodes the data in pieces that fit the buffer of the writer
+static void xml_writer_put_b64(xml_writer * w_p, const uint8_t * data_p, size_t data_len) {
+  char b64[(768 / 3) * 4 + 1];
+  size_t b64_len = 0;
 
-  prekeys_node_p = bundle_p->pre_keys_node_p;
-  if (!prekeys_node_p) {
-    prekeys_node_p = mxmlNewElement(MXML_NO_PARENT, PREKEYS_NODE_NAME);
+  while (data_len && !w_p->ret_val) {
+    size_t chunk_len = data_len < 768 ? data_len : 768;
+    (void) omemo_b64_encode_into(data_p, chunk_len, b64, sizeof(b64), &b64_len);
+    xml_writer_put(w_p, b64, b64_len);
+    data_p += chunk_len;
+    data_len -= chunk_len;
   }
+}
 
-  pre_key_node_p = mxmlNewElement(MXML_NO_PARENT, PRE_KEY_NODE_NAME);
-  if (int_to_string(pre_key_id, &pre_key_id_string) <= 0) {
-    ret_val = -1;
-    goto cleanup;
-  }
-  mxmlElementSetAttr(pre_key_node_p, PRE_KEY_NODE_ID_ATTR_NAME, pre_key_id_string);
+// makes sure that data_len more bytes and the terminating null byte fit
+static int string_sink_reserve(string_sink * sink_p, size_t data_len) {
+  if (sink_p->len + data_len + 1 > sink_p->cap) {
+    size_t cap = sink_p->cap ? sink_p->cap : 256;
+    while (cap < sink_p->len + data_len + 1) {
+      cap *= 2;
+    }
 
-  b64_string = g_base64_encode(data_p, data_len);
-  (void) mxmlNewOpaque(pre_key_node_p, b64_string);
+    char * str_p = realloc(sink_p->str_p, cap);
+    if (!str_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    sink_p->str_p = str_p;
+    sink_p->cap = cap;
+  }
 
-  mxmlAdd(prekeys_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, pre_key_node_p);
+  return 0;
+}
 
-  bundle_p->pre_keys_node_p = prekeys_node_p;
-  bundle_p->pre_keys_amount++;
+static int string_sink_write(const char * data_p, size_t data_len, void * user_data_p) {
+  string_sink * sink_p = user_data_p;
 
-cleanup:
-  if (ret_val < 0) {
-    mxmlDelete(pre_key_node_p);
+  int ret_val = string_sink_reserve(sink_p, data_len);
+  if (ret_val) {
+    return ret_val;
   }
-  g_free(b64_string);
-  free(pre_key_id_string);
 
-  return ret_val;
+  memcpy(sink_p->str_p + sink_p->len, data_p, data_len);
+  sink_p->len += data_len;
+  sink_p->str_p[sink_p->len] = '\0';
+
+  return 0;
 }
 
+int omemo_bundle_create(omemo_bundle ** bundle_pp) {
+  omemo_bundle * bundle_p = malloc(sizeof(omemo_bundle));
+  if (!bundle_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(bundle_p, 0, sizeof(omemo_bundle));
+
+  *bundle_pp = bundle_p;
 
-int omemo_bundle_get_random_pre_key(omemo_bundle * bundle_p, uint32_t * pre_key_id_p, uint8_t ** data_pp, size_t * data_len_p) {
-  int ret_val = 0;
+  return 0;
+}
 
-  mxml_node_t * pre_key_node_p = (void *) 0;
-  gint32 random = 0;
-  mxml_node_t * next_p = (void *) 0;
-  const char * b64_string = (void *) 0;
-  guchar * data_p = (void *) 0;
-  gsize len = 0;
-  const char * pre_key_id_string = (void *) 0;
+// has to be called by everything that changes the bundle
+static void bundle_export_cache_clear(omemo_bundle * bundle_p) {
+  free(bundle_p->export_cache.str_p);
+  memset(&bundle_p->export_cache, 0, sizeof(string_sink));
+  bundle_p->export_cache_pre_keys_end = 0;
+}
 
-  if (!bundle_p || !bundle_p->pre_keys_node_p) {
-    ret_val = OMEMO_ERR_NULL;
-    goto cleanup;
-  }
+#define PRE_KEY_XML_START "<" PRE_KEY_NODE_NAME " " PRE_KEY_NODE_ID_ATTR_NAME "=\""
+#define PRE_KEY_XML_END "</" PRE_KEY_NODE_NAME ">"
+#define BUNDLE_XML_END "</" PREKEYS_NODE_NAME "></" BUNDLE_NODE_NAME "></" ITEM_NODE_NAME "></" PUBLISH_NODE_NAME ">"
 
-  ret_val = expect_next_node(bundle_p->pre_keys_node_p, mxmlGetFirstChild, PRE_KEY_NODE_NAME, &pre_key_node_p);
+/**
+ * Inserts the <preKeyPublic> element of a pre key at the end of the <prekeys> in the export cache,
+ * so that a new pre key only has to be encoded itself and not the whole bundle again.
+ */
+static int bundle_export_cache_insert_pre_key(omemo_bundle * bundle_p, omemo_bundle_pre_key * pre_key_p) {
+  string_sink * cache_p = &bundle_p->export_cache;
+  char id_string[11];
+  size_t id_len = snprintf(id_string, sizeof(id_string), "%" PRIu32, pre_key_p->id);
+  size_t b64_len = omemo_b64_encoded_len(pre_key_p->data_len);
+  size_t xml_len = strlen(PRE_KEY_XML_START) + id_len + strlen("\">") + b64_len + strlen(PRE_KEY_XML_END);
+
+  int ret_val = string_sink_reserve(cache_p, xml_len);
   if (ret_val) {
-    goto cleanup;
+    return ret_val;
   }
 
-  random = g_random_int_range(0, bundle_p->pre_keys_amount);
-  next_p = pre_key_node_p;
-  for (int i = 0; i < random; i++) {
-    next_p = mxmlGetNextSibling(next_p);
-    if (!next_p) {
-      log_err("failed to forward pointer to desired item %d out of %zu items at index %d", random, bundle_p->pre_keys_amount, i);
-      ret_val = OMEMO_ERR_MALFORMED_BUNDLE;
-      goto cleanup;
-    }
-  }
+  // behind it are only the closing tags
+  char * pos_p = cache_p->str_p + bundle_p->export_cache_pre_keys_end;
+  memmove(pos_p + xml_len, pos_p, cache_p->len - bundle_p->export_cache_pre_keys_end + 1);
 
-  pre_key_id_string = mxmlElementGetAttr(next_p, PRE_KEY_NODE_ID_ATTR_NAME);
-  if (!pre_key_id_string) {
-    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_PREKEY_ID_ATTR;
-    goto cleanup;
-  }
+  memcpy(pos_p, PRE_KEY_XML_START, strlen(PRE_KEY_XML_START));
+  pos_p += strlen(PRE_KEY_XML_START);
+  memcpy(pos_p, id_string, id_len);
+  pos_p += id_len;
+  memcpy(pos_p, "\">", strlen("\">"));
+  pos_p += strlen("\">");
+  // the null byte is overwritten by the end tag
+  (void) omemo_b64_encode_into(bundle_p->pre_key_data_p + pre_key_p->data_offset, pre_key_p->data_len, pos_p, b64_len + 1, (void *) 0);
+  pos_p += b64_len;
+  memcpy(pos_p, PRE_KEY_XML_END, strlen(PRE_KEY_XML_END));
 
-  b64_string = mxmlGetOpaque(next_p);
-  if (!b64_string) {
-    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_PREKEY_DATA;
-    goto cleanup;
-  }
+  pre_key_p->xml_offset = bundle_p->export_cache_pre_keys_end;
+  pre_key_p->xml_len = xml_len;
+  bundle_p->export_cache_pre_keys_end += xml_len;
+  cache_p->len += xml_len;
 
-  data_p = g_base64_decode(b64_string, &len);
+  return 0;
+}
 
-  *pre_key_id_p = strtol(pre_key_id_string, (void *) 0, 0);
-  *data_pp = data_p;
-  *data_len_p = len;
+// cuts the element of the pre key at the index out of the export cache
+static void bundle_export_cache_remove_pre_key(omemo_bundle * bundle_p, size_t index) {
+  string_sink * cache_p = &bundle_p->export_cache;
+  const omemo_bundle_pre_key * pre_key_p = &bundle_p->pre_keys_p[index];
+  char * pos_p = cache_p->str_p + pre_key_p->xml_offset;
+  size_t xml_len = pre_key_p->xml_len;
 
-cleanup:
+  memmove(pos_p, pos_p + xml_len, cache_p->len - (pre_key_p->xml_offset + xml_len) + 1);
+  cache_p->len -= xml_len;
+  bundle_p->export_cache_pre_keys_end -= xml_len;
 
-  return ret_val;
+  for (size_t i = index + 1; i < bundle_p->pre_keys_amount; i++) {
+    bundle_p->pre_keys_p[i].xml_offset -= xml_len;
+  }
 }
 
-int omemo_bundle_export(omemo_bundle * bundle_p, char ** publish) {
-  int ret_val = 0;
-
-  char * node_value = (void *) 0;
-  const char * format = "%s%s%s%s%s";
-  size_t len = 0;
-  mxml_node_t * publish_node_p = (void *) 0;
-  mxml_node_t * item_node_p = (void *) 0;
-  mxml_node_t * bundle_node_p = (void *) 0;
-  char * out = (void *) 0;
-
-  if (!bundle_p->device_id || !bundle_p->signed_pk_node_p || !bundle_p->signature_node_p || !bundle_p->identity_key_node_p || !bundle_p->pre_keys_node_p) {
-    ret_val = -1;
-    goto cleanup;
+static int bundle_data_set(omemo_bundle * bundle_p, omemo_bundle_data * bd_p, const uint8_t * data_p, size_t data_len) {
+  if (!data_p && data_len) {
+    return OMEMO_ERR_NULL;
   }
-  if (bundle_p->pre_keys_amount < 20) {
-    ret_val = -2;
-    goto cleanup;
+
+  // an empty key still has to be marked as set
+  uint8_t * copy_p = malloc(data_len ? data_len : 1);
+  if (!copy_p) {
+    return OMEMO_ERR_NOMEM;
   }
-  if (bundle_p->pre_keys_amount < 100) {
-    //TODO: maybe issue warning
-    //FIXME: numbers into constants
+  if (data_len) {
+    memcpy(copy_p, data_p, data_len);
   }
 
-  len = snprintf((void *) 0, 0, format, OMEMO_NS, OMEMO_NS_SEPARATOR, BUNDLE_PEP_NAME, OMEMO_NS_SEPARATOR_FINAL, bundle_p->device_id) + 1;
-  node_value = malloc(len);
-  if (snprintf(node_value, len, format, OMEMO_NS, OMEMO_NS_SEPARATOR, BUNDLE_PEP_NAME, OMEMO_NS_SEPARATOR_FINAL, bundle_p->device_id) <= 0) {
-    ret_val = -4;
-    goto cleanup;
-  }
+  free(bd_p->data_p);
+  bd_p->data_p = copy_p;
+  bd_p->data_len = data_len;
+  bundle_export_cache_clear(bundle_p);
+
+  return 0;
+}
 
-  publish_node_p = mxmlNewElement(MXML_NO_PARENT, PUBLISH_NODE_NAME);
-  mxmlElementSetAttr(publish_node_p, PUBLISH_NODE_NODE_ATTR_NAME, node_value);
+static int bundle_data_get(const omemo_bundle * bundle_p, const omemo_bundle_data * bd_p, uint8_t ** data_pp, size_t * data_len_p) {
+  if (!bundle_p || !bd_p->data_p || !data_pp || !data_len_p) {
+    return OMEMO_ERR_NULL;
+  }
 
-  item_node_p = mxmlNewElement(publish_node_p, ITEM_NODE_NAME);
+  uint8_t * data_p = malloc(bd_p->data_len ? bd_p->data_len : 1);
+  if (!data_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memcpy(data_p, bd_p->data_p, bd_p->data_len);
 
-  bundle_node_p = mxmlNewElement(item_node_p, BUNDLE_NODE_NAME);
-  mxmlElementSetAttr(bundle_node_p, "xmlns", OMEMO_NS);
+  *data_pp = data_p;
+  *data_len_p = bd_p->data_len;
 
-  mxmlAdd(bundle_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, bundle_p->signed_pk_node_p);
-  mxmlAdd(bundle_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, bundle_p->signature_node_p);
-  mxmlAdd(bundle_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, bundle_p->identity_key_node_p);
-  mxmlAdd(bundle_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, bundle_p->pre_keys_node_p);
+  return 0;
+}
 
-  out = mxmlSaveAllocString(publish_node_p, MXML_NO_CALLBACK);
-  if (!out) {
-    ret_val = -5;
-    goto cleanup;
+int omemo_bundle_set_device_id(omemo_bundle * bundle_p, uint32_t device_id) {
+  char * id_string = (void *) 0;
+  int ret = int_to_string(device_id, &id_string);
+  if (ret <= 0) {
+    return ret;
   }
 
-  *publish = out;
+  free(bundle_p->device_id);
+  bundle_p->device_id = id_string;
+  bundle_export_cache_clear(bundle_p);
 
-cleanup:
-  free(node_value);
+  return OMEMO_SUCCESS;
+}
 
-  return ret_val;
+uint32_t omemo_bundle_get_device_id(omemo_bundle * bundle_p) {
+  return strtol(bundle_p->device_id, (void *) 0, 0);
 }
 
-int omemo_bundle_import (const char * received_bundle, omemo_bundle ** bundle_pp) {
-  int ret_val = 0;
+int omemo_bundle_set_signed_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id, uint8_t * data_p, size_t data_len) {
+  int ret_val = bundle_data_set(bundle_p, &bundle_p->signed_pre_key, data_p, data_len);
+  if (ret_val) {
+    return ret_val;
+  }
 
-  omemo_bundle * bundle_p = (void *) 0;
-  mxml_node_t * items_node_p = (void *) 0;
-  mxml_node_t * item_node_p = (void *) 0;
-  mxml_node_t * bundle_node_p = (void *) 0;
-  const char * bundle_node_name = (void *) 0;
-  char ** split = (void *) 0;
-  char * device_id = (void *) 0;
-  mxml_node_t * signed_pk_node_p = (void *) 0;
-  mxml_node_t * signature_node_p = (void *) 0;
-  mxml_node_t * identity_key_node_p = (void *) 0;
-  mxml_node_t * prekeys_node_p = (void *) 0;
-  mxml_node_t * pre_key_node_p = (void *) 0;
-  size_t pre_keys_count = 0;
+  bundle_p->signed_pre_key_id = pre_key_id;
 
-  ret_val = omemo_bundle_create(&bundle_p);
+  return 0;
+}
+
+int omemo_bundle_get_signed_pre_key(omemo_bundle * bundle_p, uint32_t * pre_key_id_p, uint8_t ** data_pp, size_t * data_len_p) {
+  if (!bundle_p || !pre_key_id_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = bundle_data_get(bundle_p, &bundle_p->signed_pre_key, data_pp, data_len_p);
   if (ret_val) {
-    goto cleanup;
+    return ret_val;
   }
 
-  items_node_p = mxmlLoadString((void *) 0, received_bundle, MXML_OPAQUE_CALLBACK);
-  if (!items_node_p) {
+  *pre_key_id_p = bundle_p->signed_pre_key_id;
+
+  return 0;
+}
+
+int omemo_bundle_set_signature(omemo_bundle * bundle_p, uint8_t * data_p, size_t data_len) {
+  return bundle_data_set(bundle_p, &bundle_p->signature, data_p, data_len);
+}
+
+int omemo_bundle_get_signature(omemo_bundle * bundle_p, uint8_t ** data_pp, size_t * data_len_p) {
+  if (!bundle_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  return bundle_data_get(bundle_p, &bundle_p->signature, data_pp, data_len_p);
+}
+
+int omemo_bundle_set_identity_key(omemo_bundle * bundle_p, uint8_t * data_p, size_t data_len) {
+  return bundle_data_set(bundle_p, &bundle_p->identity_key, data_p, data_len);
+}
+
+int omemo_bundle_get_identity_key(omemo_bundle * bundle_p, uint8_t ** data_pp, size_t * data_len_p) {
+  if (!bundle_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  return bundle_data_get(bundle_p, &bundle_p->identity_key, data_pp, data_len_p);
+}
+
+static int uint32_cmp(const void * a_p, const void * b_p) {
+  uint32_t a = *((const uint32_t *) a_p);
+  uint32_t b = *((const uint32_t *) b_p);
+
+  return (a > b) - (a < b);
+}
+
+// sorts the IDs and removes duplicates, returns the new length
+static size_t ids_sort_unique(uint32_t * ids_p, size_t ids_len) {
+  // also keeps an empty, possibly NULL array away from qsort()
+  if (ids_len < 2) {
+    return ids_len;
+  }
+
+  qsort(ids_p, ids_len, sizeof(uint32_t), uint32_cmp);
+
+  size_t unique_len = 0;
+  for (size_t i = 0; i < ids_len; i++) {
+    if (unique_len == 0 || ids_p[unique_len - 1] != ids_p[i]) {
+      ids_p[unique_len++] = ids_p[i];
+    }
+  }
+
+  return unique_len;
+}
+
+// makes sure there is space for the given amount of additional pre keys and bytes of their data
+static int bundle_pre_keys_reserve(omemo_bundle * bundle_p, size_t keys_amount, size_t data_len) {
+  if (bundle_p->pre_keys_amount + keys_amount > bundle_p->pre_keys_cap) {
+    size_t cap = bundle_p->pre_keys_cap ? bundle_p->pre_keys_cap : 16;
+    while (cap < bundle_p->pre_keys_amount + keys_amount) {
+      cap *= 2;
+    }
+
+    omemo_bundle_pre_key * pre_keys_p = realloc(bundle_p->pre_keys_p, sizeof(omemo_bundle_pre_key) * cap);
+    if (!pre_keys_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    bundle_p->pre_keys_p = pre_keys_p;
+    bundle_p->pre_keys_cap = cap;
+  }
+
+  if (bundle_p->pre_key_data_len + data_len > bundle_p->pre_key_data_cap) {
+    size_t cap = bundle_p->pre_key_data_cap ? bundle_p->pre_key_data_cap : 16 * 33;
+    while (cap < bundle_p->pre_key_data_len + data_len) {
+      cap *= 2;
+    }
+
+    uint8_t * data_p = realloc(bundle_p->pre_key_data_p, cap);
+    if (!data_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    bundle_p->pre_key_data_p = data_p;
+    bundle_p->pre_key_data_cap = cap;
+  }
+
+  return 0;
+}
+
+// appends a pre key to the array, there has to be space reserved for it and its data already
+static void bundle_pre_key_append(omemo_bundle * bundle_p, uint32_t pre_key_id, size_t data_len) {
+  omemo_bundle_pre_key * pre_key_p = &bundle_p->pre_keys_p[bundle_p->pre_keys_amount++];
+  pre_key_p->id = pre_key_id;
+  pre_key_p->data_offset = bundle_p->pre_key_data_len;
+  pre_key_p->data_len = data_len;
+  bundle_p->pre_key_data_len += data_len;
+
+  if (pre_key_id > bundle_p->pre_key_id_last) {
+    bundle_p->pre_key_id_last = pre_key_id;
+  }
+}
+
+int omemo_bundle_add_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id, uint8_t * data_p, size_t data_len) {
+  if (!bundle_p || (!data_p && data_len)) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = bundle_pre_keys_reserve(bundle_p, 1, data_len);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  if (data_len) {
+    memcpy(bundle_p->pre_key_data_p + bundle_p->pre_key_data_len, data_p, data_len);
+  }
+  bundle_pre_key_append(bundle_p, pre_key_id, data_len);
+
+  // if there is no memory for it, the cache can just as well be written again later
+  if (bundle_p->export_cache.str_p
+      && bundle_export_cache_insert_pre_key(bundle_p, &bundle_p->pre_keys_p[bundle_p->pre_keys_amount - 1])) {
+    bundle_export_cache_clear(bundle_p);
+  }
+
+  return 0;
+}
+
+/**
+ * Finds the position of the ID in the sorted array of consumed pre key IDs, or where it would have to be inserted.
+ */
+static size_t bundle_consumed_lower_bound(const omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  size_t lo = 0;
+  size_t hi = bundle_p->consumed_ids_len;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (bundle_p->consumed_ids_p[mid] < pre_key_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+static bool bundle_is_consumed(const omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  size_t pos = bundle_consumed_lower_bound(bundle_p, pre_key_id);
+
+  return pos < bundle_p->consumed_ids_len && bundle_p->consumed_ids_p[pos] == pre_key_id;
+}
+
+static int bundle_consumed_add(omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  size_t pos = bundle_consumed_lower_bound(bundle_p, pre_key_id);
+  if (pos < bundle_p->consumed_ids_len && bundle_p->consumed_ids_p[pos] == pre_key_id) {
+    return 0;
+  }
+
+  if (bundle_p->consumed_ids_len == bundle_p->consumed_ids_cap) {
+    size_t new_cap = bundle_p->consumed_ids_cap ? bundle_p->consumed_ids_cap * 2 : 16;
+    uint32_t * ids_p = realloc(bundle_p->consumed_ids_p, sizeof(uint32_t) * new_cap);
+    if (!ids_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    bundle_p->consumed_ids_p = ids_p;
+    bundle_p->consumed_ids_cap = new_cap;
+  }
+
+  memmove(&bundle_p->consumed_ids_p[pos + 1], &bundle_p->consumed_ids_p[pos], sizeof(uint32_t) * (bundle_p->consumed_ids_len - pos));
+  bundle_p->consumed_ids_p[pos] = pre_key_id;
+  bundle_p->consumed_ids_len++;
+
+  return 0;
+}
+
+int omemo_bundle_remove_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  if (!bundle_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  size_t index = 0;
+  while (index < bundle_p->pre_keys_amount && bundle_p->pre_keys_p[index].id != pre_key_id) {
+    index++;
+  }
+  if (index == bundle_p->pre_keys_amount) {
+    return OMEMO_ERR;
+  }
+
+  // before anything is changed, so that the key is still there if this fails
+  int ret_val = bundle_consumed_add(bundle_p, pre_key_id);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  if (bundle_p->export_cache.str_p) {
+    bundle_export_cache_remove_pre_key(bundle_p, index);
+  }
+
+  // the order stays the same, so that it still matches the cached XML
+  const omemo_bundle_pre_key removed = bundle_p->pre_keys_p[index];
+  uint8_t * data_p = bundle_p->pre_key_data_p + removed.data_offset;
+  memmove(data_p, data_p + removed.data_len, bundle_p->pre_key_data_len - (removed.data_offset + removed.data_len));
+  bundle_p->pre_key_data_len -= removed.data_len;
+
+  memmove(&bundle_p->pre_keys_p[index], &bundle_p->pre_keys_p[index + 1], sizeof(omemo_bundle_pre_key) * (bundle_p->pre_keys_amount - index - 1));
+  bundle_p->pre_keys_amount--;
+  for (size_t i = index; i < bundle_p->pre_keys_amount; i++) {
+    bundle_p->pre_keys_p[i].data_offset -= removed.data_len;
+  }
+
+  return 0;
+}
+
+static bool bundle_has_pre_key(const omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  for (size_t i = 0; i < bundle_p->pre_keys_amount; i++) {
+    if (bundle_p->pre_keys_p[i].id == pre_key_id) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int omemo_bundle_next_pre_key_ids(omemo_bundle * bundle_p, uint32_t * ids_p, size_t ids_cap, size_t * ids_len_p) {
+  if (!bundle_p || (!ids_p && ids_cap) || !ids_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  size_t missing = bundle_p->pre_keys_amount < OMEMO_BUNDLE_PRE_KEYS_TARGET ? OMEMO_BUNDLE_PRE_KEYS_TARGET - bundle_p->pre_keys_amount : 0;
+  size_t ids_len = missing < ids_cap ? missing : ids_cap;
+  uint32_t id = bundle_p->pre_key_id_last;
+  size_t tried = 0;
+
+  for (size_t i = 0; i < ids_len; i++) {
+    do {
+      // every ID is either in the bundle or consumed
+      if (tried++ == OMEMO_BUNDLE_PRE_KEY_ID_MAX) {
+        return OMEMO_ERR;
+      }
+      id = (id >= OMEMO_BUNDLE_PRE_KEY_ID_MAX) ? 1 : id + 1;
+    } while (bundle_has_pre_key(bundle_p, id) || bundle_is_consumed(bundle_p, id));
+    ids_p[i] = id;
+  }
+
+  bundle_p->pre_key_id_last = id;
+  *ids_len_p = ids_len;
+
+  return 0;
+}
+
+int omemo_bundle_get_pre_key_id_last(const omemo_bundle * bundle_p, uint32_t * pre_key_id_p) {
+  if (!bundle_p || !pre_key_id_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  *pre_key_id_p = bundle_p->pre_key_id_last;
+
+  return 0;
+}
+
+int omemo_bundle_set_pre_key_id_last(omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  if (!bundle_p) {
+    return OMEMO_ERR_NULL;
+  }
+  if (pre_key_id > OMEMO_BUNDLE_PRE_KEY_ID_MAX) {
+    return OMEMO_ERR;
+  }
+
+  bundle_p->pre_key_id_last = pre_key_id;
+
+  return 0;
+}
+
+int omemo_bundle_get_consumed_pre_key_ids(const omemo_bundle * bundle_p, const uint32_t ** ids_pp, size_t * ids_len_p) {
+  if (!bundle_p || !ids_pp || !ids_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  *ids_pp = bundle_p->consumed_ids_p;
+  *ids_len_p = bundle_p->consumed_ids_len;
+
+  return 0;
+}
+
+int omemo_bundle_set_consumed_pre_key_ids(omemo_bundle * bundle_p, const uint32_t * ids_p, size_t ids_len) {
+  if (!bundle_p || (!ids_p && ids_len)) {
+    return OMEMO_ERR_NULL;
+  }
+
+  uint32_t * consumed_ids_p = (void *) 0;
+  if (ids_len) {
+    consumed_ids_p = malloc(sizeof(uint32_t) * ids_len);
+    if (!consumed_ids_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    memcpy(consumed_ids_p, ids_p, sizeof(uint32_t) * ids_len);
+  }
+
+  free(bundle_p->consumed_ids_p);
+  bundle_p->consumed_ids_p = consumed_ids_p;
+  bundle_p->consumed_ids_len = ids_sort_unique(consumed_ids_p, ids_len);
+  bundle_p->consumed_ids_cap = ids_len;
+
+  return 0;
+}
+
+size_t omemo_bundle_get_pre_key_amount(const omemo_bundle * bundle_p) {
+  return bundle_p ? bundle_p->pre_keys_amount : 0;
+}
+
+int omemo_bundle_get_pre_key(const omemo_bundle * bundle_p, size_t index, uint32_t * pre_key_id_p, const uint8_t ** data_pp, size_t * data_len_p) {
+  if (!bundle_p || !pre_key_id_p || !data_pp || !data_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  if (index >= bundle_p->pre_keys_amount) {
+    return OMEMO_ERR;
+  }
+
+  const omemo_bundle_pre_key * pre_key_p = &bundle_p->pre_keys_p[index];
+  *pre_key_id_p = pre_key_p->id;
+  *data_pp = bundle_p->pre_key_data_p + pre_key_p->data_offset;
+  *data_len_p = pre_key_p->data_len;
+
+  return 0;
+}
+
+
+int omemo_bundle_get_random_pre_key(omemo_bundle * bundle_p, uint32_t * pre_key_id_p, uint8_t ** data_pp, size_t * data_len_p) {
+  if (!bundle_p || !bundle_p->pre_keys_amount || !pre_key_id_p || !data_pp || !data_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  const omemo_bundle_pre_key * pre_key_p = &bundle_p->pre_keys_p[g_random_int_range(0, bundle_p->pre_keys_amount)];
+
+  // an empty key still has to be returned as a valid pointer
+  uint8_t * data_p = malloc(pre_key_p->data_len ? pre_key_p->data_len : 1);
+  if (!data_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memcpy(data_p, bundle_p->pre_key_data_p + pre_key_p->data_offset, pre_key_p->data_len);
+
+  *pre_key_id_p = pre_key_p->id;
+  *data_pp = data_p;
+  *data_len_p = pre_key_p->data_len;
+
+  return 0;
+}
+
+// writes the <publish> element with the bundle up to and including the <prekeys> start tag
+static void bundle_write_head(const omemo_bundle * bundle_p, xml_writer * w_p) {
+  xml_writer_put_str(w_p, "<" PUBLISH_NODE_NAME " " PUBLISH_NODE_NODE_ATTR_NAME "=\""
+                          OMEMO_NS OMEMO_NS_SEPARATOR BUNDLE_PEP_NAME OMEMO_NS_SEPARATOR_FINAL);
+  xml_writer_put_escaped(w_p, bundle_p->device_id);
+  xml_writer_put_str(w_p, "\"><" ITEM_NODE_NAME "><" BUNDLE_NODE_NAME " " XMLNS_ATTR_NAME "=\"" OMEMO_NS "\">");
+
+  xml_writer_put_str(w_p, "<" SIGNED_PRE_KEY_NODE_NAME " " SIGNED_PRE_KEY_NODE_ID_ATTR_NAME "=\"");
+  xml_writer_put_uint(w_p, bundle_p->signed_pre_key_id);
+  xml_writer_put_str(w_p, "\">");
+  xml_writer_put_b64(w_p, bundle_p->signed_pre_key.data_p, bundle_p->signed_pre_key.data_len);
+  xml_writer_put_str(w_p, "</" SIGNED_PRE_KEY_NODE_NAME "><" SIGNATURE_NODE_NAME ">");
+  xml_writer_put_b64(w_p, bundle_p->signature.data_p, bundle_p->signature.data_len);
+  xml_writer_put_str(w_p, "</" SIGNATURE_NODE_NAME "><" IDENTITY_KEY_NODE_NAME ">");
+  xml_writer_put_b64(w_p, bundle_p->identity_key.data_p, bundle_p->identity_key.data_len);
+  xml_writer_put_str(w_p, "</" IDENTITY_KEY_NODE_NAME "><" PREKEYS_NODE_NAME ">");
+}
+
+/**
+ * Serializes the bundle unless the result of the last time is still valid.
+ * Only the binary data is kept in the bundle, so this is the only place where base64 is encoded,
+ * besides adding single pre keys to an existing cache.
+ */
+static int bundle_export_cache_update(omemo_bundle * bundle_p) {
+  int ret_val = 0;
+
+  string_sink * cache_p = &bundle_p->export_cache;
+  xml_writer writer;
+
+  if (!bundle_p->device_id || !bundle_p->signed_pre_key.data_p || !bundle_p->signature.data_p || !bundle_p->identity_key.data_p || !bundle_p->pre_keys_amount) {
+    return -1;
+  }
+  if (bundle_p->pre_keys_amount < OMEMO_BUNDLE_PRE_KEYS_MIN) {
+    return -2;
+  }
+  if (cache_p->str_p) {
+    return 0;
+  }
+
+  // about the final size, so that the string usually does not have to be moved while writing
+  ret_val = string_sink_reserve(cache_p, 256 + bundle_p->pre_keys_amount * 64
+                                         + omemo_b64_encoded_len(bundle_p->signed_pre_key.data_len + bundle_p->signature.data_len
+                                                                 + bundle_p->identity_key.data_len + bundle_p->pre_key_data_len));
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  xml_writer_init(&writer, string_sink_write, cache_p);
+  bundle_write_head(bundle_p, &writer);
+  ret_val = xml_writer_flush(&writer);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  bundle_p->export_cache_pre_keys_end = cache_p->len;
+  ret_val = string_sink_write(BUNDLE_XML_END, strlen(BUNDLE_XML_END), cache_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i < bundle_p->pre_keys_amount; i++) {
+    ret_val = bundle_export_cache_insert_pre_key(bundle_p, &bundle_p->pre_keys_p[i]);
+    if (ret_val) {
+      goto cleanup;
+    }
+  }
+
+cleanup:
+  if (ret_val) {
+    bundle_export_cache_clear(bundle_p);
+  }
+
+  return ret_val;
+}
+
+int omemo_bundle_export(omemo_bundle * bundle_p, char ** publish) {
+  if (!bundle_p || !publish) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = bundle_export_cache_update(bundle_p);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  char * out = malloc(bundle_p->export_cache.len + 1);
+  if (!out) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memcpy(out, bundle_p->export_cache.str_p, bundle_p->export_cache.len + 1);
+
+  *publish = out;
+
+  return 0;
+}
+
+int omemo_bundle_export_to(omemo_bundle * bundle_p, omemo_write_func write_func, void * user_data_p) {
+  if (!bundle_p || !write_func) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = bundle_export_cache_update(bundle_p);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  return write_func(bundle_p->export_cache.str_p, bundle_p->export_cache.len, user_data_p);
+}
+
+// decodes the text of a received bundle element
+static int bundle_data_import(omemo_bundle_data * bd_p, mxml_node_t * node_p, int no_data_err) {
+  const char * b64_string = mxmlGetOpaque(node_p);
+  if (!b64_string) {
+    return no_data_err;
+  }
+
+  return omemo_b64_decode(b64_string, &bd_p->data_p, &bd_p->data_len);
+}
+
+int omemo_bundle_import (const char * received_bundle, omemo_bundle ** bundle_pp) {
+  int ret_val = 0;
+
+  omemo_bundle * bundle_p = (void *) 0;
+  mxml_node_t * items_node_p = (void *) 0;
+  mxml_node_t * item_node_p = (void *) 0;
+  mxml_node_t * bundle_node_p = (void *) 0;
+  const char * bundle_node_name = (void *) 0;
+  char ** split = (void *) 0;
+  char * device_id = (void *) 0;
+  mxml_node_t * signed_pk_node_p = (void *) 0;
+  const char * signed_pk_id_string = (void *) 0;
+  mxml_node_t * signature_node_p = (void *) 0;
+  mxml_node_t * identity_key_node_p = (void *) 0;
+  mxml_node_t * prekeys_node_p = (void *) 0;
+  mxml_node_t * pre_key_node_p = (void *) 0;
+  size_t pre_keys_count = 0;
+  size_t pre_keys_data_len_max = 0;
+
+  ret_val = omemo_bundle_create(&bundle_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  items_node_p = mxmlLoadString((void *) 0, received_bundle, MXML_OPAQUE_CALLBACK);
+  if (!items_node_p) {
     log_err("received bundle response is invalid XML: %s", received_bundle);
     ret_val = OMEMO_ERR_MALFORMED_XML;
     goto cleanup;
@@ -553,7 +1387,16 @@ int omemo_bundle_import (const char * received_bundle, omemo_bundle ** bundle_pp
     goto cleanup;
   }
   signed_pk_node_p = mxmlGetParent(signed_pk_node_p);
-  bundle_p->signed_pk_node_p = signed_pk_node_p;
+  signed_pk_id_string = mxmlElementGetAttr(signed_pk_node_p, SIGNED_PRE_KEY_NODE_ID_ATTR_NAME);
+  if (!signed_pk_id_string) {
+    ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_SPK_ID_ATTR;
+    goto cleanup;
+  }
+  bundle_p->signed_pre_key_id = strtol(signed_pk_id_string, (void *) 0, 0);
+  ret_val = bundle_data_import(&bundle_p->signed_pre_key, signed_pk_node_p, OMEMO_ERR_MALFORMED_BUNDLE_NO_SPK_DATA);
+  if (ret_val) {
+    goto cleanup;
+  }
 
   signature_node_p = mxmlFindPath(bundle_node_p, SIGNATURE_NODE_NAME);
   if (!signature_node_p) {
@@ -561,7 +1404,10 @@ int omemo_bundle_import (const char * received_bundle, omemo_bundle ** bundle_pp
     goto cleanup;
   }
   signature_node_p = mxmlGetParent(signature_node_p);
-  bundle_p->signature_node_p = signature_node_p;
+  ret_val = bundle_data_import(&bundle_p->signature, signature_node_p, OMEMO_ERR_MALFORMED_BUNDLE_NO_SIG_DATA);
+  if (ret_val) {
+    goto cleanup;
+  }
 
   identity_key_node_p = mxmlFindPath(bundle_node_p, IDENTITY_KEY_NODE_NAME);
   if (!identity_key_node_p) {
@@ -569,14 +1415,16 @@ int omemo_bundle_import (const char * received_bundle, omemo_bundle ** bundle_pp
     goto cleanup;
   }
   identity_key_node_p = mxmlGetParent(identity_key_node_p);
-  bundle_p->identity_key_node_p = identity_key_node_p;
+  ret_val = bundle_data_import(&bundle_p->identity_key, identity_key_node_p, OMEMO_ERR_MALFORMED_BUNDLE_NO_IK_DATA);
+  if (ret_val) {
+    goto cleanup;
+  }
 
   prekeys_node_p = mxmlFindPath(bundle_node_p, PREKEYS_NODE_NAME);
   if (!prekeys_node_p) {
     ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_PREKEYS_ELEM;
     goto cleanup;
   }
-  bundle_p->pre_keys_node_p = prekeys_node_p;
 
   pre_key_node_p = mxmlFindPath(prekeys_node_p, PRE_KEY_NODE_NAME);
   if (!pre_key_node_p) {
@@ -584,19 +1432,48 @@ int omemo_bundle_import (const char * received_bundle, omemo_bundle ** bundle_pp
     goto cleanup;
   }
   pre_key_node_p = mxmlGetParent(pre_key_node_p);
-  pre_keys_count++;
-  pre_key_node_p = mxmlGetNextSibling(pre_key_node_p);
 
-  while (pre_key_node_p) {
+  // everything is decoded once here, the bundle only keeps the binary data
+  for (mxml_node_t * node_p = pre_key_node_p; node_p; node_p = mxmlGetNextSibling(node_p)) {
+    if (mxmlGetType(node_p) != MXML_ELEMENT) {
+      continue;
+    }
+    const char * b64_string = mxmlGetOpaque(node_p);
     pre_keys_count++;
-    pre_key_node_p = mxmlGetNextSibling(pre_key_node_p);
+    pre_keys_data_len_max += b64_string ? omemo_b64_decoded_len_max(strlen(b64_string)) : 0;
+  }
+  ret_val = bundle_pre_keys_reserve(bundle_p, pre_keys_count, pre_keys_data_len_max);
+  if (ret_val) {
+    goto cleanup;
   }
-  bundle_p->pre_keys_amount = pre_keys_count;
 
-  mxmlRemove(signed_pk_node_p);
-  mxmlRemove(signature_node_p);
-  mxmlRemove(identity_key_node_p);
-  mxmlRemove(prekeys_node_p);
+  for (; pre_key_node_p; pre_key_node_p = mxmlGetNextSibling(pre_key_node_p)) {
+    if (mxmlGetType(pre_key_node_p) != MXML_ELEMENT) {
+      continue;
+    }
+    const char * pre_key_id_string = mxmlElementGetAttr(pre_key_node_p, PRE_KEY_NODE_ID_ATTR_NAME);
+    if (!pre_key_id_string) {
+      ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_PREKEY_ID_ATTR;
+      goto cleanup;
+    }
+
+    const char * b64_string = mxmlGetOpaque(pre_key_node_p);
+    if (!b64_string) {
+      ret_val = OMEMO_ERR_MALFORMED_BUNDLE_NO_PREKEY_DATA;
+      goto cleanup;
+    }
+
+    size_t data_len = 0;
+    ret_val = omemo_b64_decode_into(b64_string, strlen(b64_string),
+                                    bundle_p->pre_key_data_p + bundle_p->pre_key_data_len,
+                                    bundle_p->pre_key_data_cap - bundle_p->pre_key_data_len,
+                                    &data_len);
+    if (ret_val) {
+      goto cleanup;
+    }
+
+    bundle_pre_key_append(bundle_p, strtol(pre_key_id_string, (void *) 0, 0), data_len);
+  }
 
   *bundle_pp = bundle_p;
 
@@ -632,15 +1509,75 @@ int omemo_bundle_get_pep_node_name(uint32_t device_id, char ** node_name_p) {
 
 void omemo_bundle_destroy(omemo_bundle * bundle_p) {
   if (bundle_p) {
-    mxmlDelete(bundle_p->signed_pk_node_p);
-    mxmlDelete(bundle_p->signature_node_p);
-    mxmlDelete(bundle_p->identity_key_node_p);
-    mxmlDelete(bundle_p->pre_keys_node_p);
+    free(bundle_p->signed_pre_key.data_p);
+    free(bundle_p->signature.data_p);
+    free(bundle_p->identity_key.data_p);
+    free(bundle_p->pre_keys_p);
+    free(bundle_p->pre_key_data_p);
+    free(bundle_p->consumed_ids_p);
     free(bundle_p->device_id);
+    free(bundle_p->export_cache.str_p);
     free(bundle_p);
   }
 }
 
+/**
+ * Finds the position of the ID in the sorted ID array, or where it would have to be inserted.
+ */
+static size_t devicelist_lower_bound(const omemo_devicelist * dl_p, uint32_t device_id) {
+  size_t lo = 0;
+  size_t hi = dl_p->ids_len;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (dl_p->ids_p[mid] < device_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/**
+ * Makes sure the ID array has room for at least one more ID.
+ */
+static int devicelist_grow(omemo_devicelist * dl_p) {
+  if (dl_p->ids_len < dl_p->ids_cap) {
+    return 0;
+  }
+
+  size_t new_cap = dl_p->ids_cap ? dl_p->ids_cap * 2 : 8;
+  uint32_t * ids_p = realloc(dl_p->ids_p, sizeof(uint32_t) * new_cap);
+  if (!ids_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  dl_p->ids_p = ids_p;
+  dl_p->ids_cap = new_cap;
+
+  return 0;
+}
+
+/**
+ * Adds a <device> element for the ID to the list node, without touching the ID array.
+ */
+static int devicelist_node_add(omemo_devicelist * dl_p, uint32_t device_id) {
+  char * id_string;
+  int id_string_len = int_to_string(device_id, &id_string);
+  if (id_string_len < 1) {
+    return OMEMO_ERR;
+  }
+
+  mxml_node_t * device_node_p = mxmlNewElement(MXML_NO_PARENT, DEVICE_NODE_NAME);
+  mxmlElementSetAttr(device_node_p, DEVICE_NODE_ID_ATTR_NAME, id_string);
+  mxmlAdd(dl_p->list_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, device_node_p);
+  free(id_string);
+
+  return 0;
+}
+
 int omemo_devicelist_create(const char * from, omemo_devicelist ** dl_pp) {
   if (!from || !dl_pp) {
     return OMEMO_ERR_NULL;
@@ -668,7 +1605,9 @@ int omemo_devicelist_create(const char * from, omemo_devicelist ** dl_pp) {
   mxmlElementSetAttr(list_node_p, XMLNS_ATTR_NAME, OMEMO_NS);
 
   dl_p->list_node_p = list_node_p;
-  dl_p->id_list_p = (void *) 0;
+  dl_p->ids_p = (void *) 0;
+  dl_p->ids_len = 0;
+  dl_p->ids_cap = 0;
   dl_p->from = from_dup;
   *dl_pp = dl_p;
 
@@ -692,7 +1631,6 @@ int omemo_devicelist_import(char * received_devicelist, const char * from, omemo
   mxml_node_t * item_node_p = (void *) 0;
   mxml_node_t * list_node_p = (void *) 0;
   mxml_node_t * device_node_p = (void *) 0;
-  GList * id_list_p = (void *) 0;
 
   ret_val = omemo_devicelist_create(from, &dl_p);
   if (ret_val) {
@@ -756,52 +1694,227 @@ int omemo_devicelist_import(char * received_devicelist, const char * from, omemo
       goto cleanup;
     }
 
-    uint32_t * id_temp_p = malloc(sizeof(uint32_t));
-    if (!id_temp_p) {
-      ret_val = OMEMO_ERR_NOMEM;
+    ret_val = devicelist_grow(dl_p);
+    if (ret_val) {
       goto cleanup;
     }
 
-    *id_temp_p = strtol(id_string, (void *) 0, 0);
-    id_list_p = g_list_append(id_list_p, id_temp_p);
+    dl_p->ids_p[dl_p->ids_len++] = strtol(id_string, (void *) 0, 0);
 
     device_node_p = mxmlGetNextSibling(device_node_p);
   }
-  dl_p->id_list_p = id_list_p;
+
+  // sort once and drop duplicates instead of keeping the array sorted on every insert
+  dl_p->ids_len = ids_sort_unique(dl_p->ids_p, dl_p->ids_len);
 
   *dl_pp = dl_p;
 
 cleanup:
   if (ret_val) {
     omemo_devicelist_destroy(dl_p);
-    g_list_free_full(id_list_p, free);
   }
   mxmlDelete(items_node_p);
   return ret_val;
 }
 
+// the device IDs found by devicelist_scan_ids(), on the stack unless there are more than fit there
+typedef struct devicelist_scan {
+  uint32_t * ids_p;
+  size_t ids_len;
+  size_t ids_cap;
+  uint32_t ids_local[64];
+} devicelist_scan;
+
+static int devicelist_scan_push(devicelist_scan * scan_p, uint32_t device_id) {
+  if (scan_p->ids_len == scan_p->ids_cap) {
+    size_t new_cap = scan_p->ids_cap * 2;
+    uint32_t * ids_p = (scan_p->ids_p == scan_p->ids_local) ? malloc(sizeof(uint32_t) * new_cap)
+                                                              : realloc(scan_p->ids_p, sizeof(uint32_t) * new_cap);
+    if (!ids_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    if (scan_p->ids_p == scan_p->ids_local) {
+      memcpy(ids_p, scan_p->ids_local, sizeof(scan_p->ids_local));
+    }
+    scan_p->ids_p = ids_p;
+    scan_p->ids_cap = new_cap;
+  }
+
+  scan_p->ids_p[scan_p->ids_len++] = device_id;
+
+  return 0;
+}
+
+/**
+ * Collects the IDs of the <device> elements in a received devicelist with the tokenizer.
+ * The structure is checked the same way omemo_devicelist_import() does: the <list> in the first <item> is used,
+ * and an <items> element without any children is a valid empty list.
+ *
+ * @param buf The received devicelist.
+ * @param len Its length.
+ * @param scan_p Pointer to the initialized scan state the IDs are appended to, unsorted.
+ * @return 0 on success, negative on error.
+ */
+static int devicelist_scan_ids(const char * buf, size_t len, devicelist_scan * scan_p) {
+  int tok_ret = 0;
+  size_t pos = 0;
+  size_t depth = 0;
+  bool root_seen = false;
+  bool item_seen = false;
+  bool list_seen = false;
+  size_t list_depth = 0;
+  bool list_open = false;
+  xml_token tok;
+
+  while ((tok_ret = xml_next_token(buf, len, &pos, &tok)) > 0) {
+    if (tok.type == XML_TOKEN_START || tok.type == XML_TOKEN_EMPTY) {
+      if (depth == 0) {
+        if (root_seen) {
+          return OMEMO_ERR_MALFORMED_XML;
+        }
+        root_seen = true;
+        if (!xml_token_name_is(buf, &tok, ITEMS_NODE_NAME)) {
+          return OMEMO_ERR_MALFORMED_DEVICELIST_NO_ITEMS_ELEM;
+        }
+      } else if (depth == 1 && !item_seen) {
+        item_seen = true;
+        if (!xml_token_name_is(buf, &tok, ITEM_NODE_NAME)) {
+          return OMEMO_ERR_MALFORMED_DEVICELIST_NO_ITEM_ELEM;
+        }
+        if (tok.type == XML_TOKEN_EMPTY) {
+          return OMEMO_ERR_MALFORMED_DEVICELIST_NO_LIST_ELEM;
+        }
+      } else if (depth == 2 && item_seen && !list_seen) {
+        list_seen = true;
+        if (!xml_token_name_is(buf, &tok, LIST_NODE_NAME)) {
+          return OMEMO_ERR_MALFORMED_DEVICELIST_NO_LIST_ELEM;
+        }
+        list_open = (tok.type == XML_TOKEN_START);
+        list_depth = depth;
+      } else if (list_open && depth == list_depth + 1 && xml_token_name_is(buf, &tok, DEVICE_NODE_NAME)) {
+        size_t val_start = 0;
+        size_t val_len = 0;
+        if (!xml_token_get_attr(buf, &tok, DEVICE_NODE_ID_ATTR_NAME, &val_start, &val_len)) {
+          log_err("device element #%zu does not have an ID attribute", scan_p->ids_len + 1);
+          return OMEMO_ERR_MALFORMED_DEVICELIST_NO_DEVICE_ID_ATTR;
+        }
+
+        // the value ends with the quote, which strtol() stops at
+        int ret_val = devicelist_scan_push(scan_p, strtol(buf + val_start, (void *) 0, 0));
+        if (ret_val) {
+          return ret_val;
+        }
+      }
+
+      if (tok.type == XML_TOKEN_START) {
+        depth++;
+      }
+    } else if (tok.type == XML_TOKEN_END) {
+      if (depth == 0) {
+        return OMEMO_ERR_MALFORMED_XML;
+      }
+      depth--;
+      if (list_open && depth == list_depth) {
+        list_open = false;
+      } else if (depth == 1 && item_seen && !list_seen) {
+        // an <item> has to contain a <list>
+        return OMEMO_ERR_MALFORMED_DEVICELIST_NO_LIST_ELEM;
+      }
+    }
+  }
+  if (tok_ret) {
+    return tok_ret;
+  }
+
+  if (!root_seen || depth != 0) {
+    return OMEMO_ERR_MALFORMED_XML;
+  }
+
+  return 0;
+}
+
+int omemo_devicelist_import_if_changed(const char * received_devicelist, const char * from,
+                                       const omemo_devicelist * prev_dl_p, omemo_devicelist ** dl_pp) {
+  if (!received_devicelist || !from || !dl_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  omemo_devicelist * dl_p = (void *) 0;
+  devicelist_scan scan;
+  scan.ids_p = scan.ids_local;
+  scan.ids_len = 0;
+  scan.ids_cap = sizeof(scan.ids_local) / sizeof(scan.ids_local[0]);
+
+  ret_val = devicelist_scan_ids(received_devicelist, strlen(received_devicelist), &scan);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  scan.ids_len = ids_sort_unique(scan.ids_p, scan.ids_len);
+
+  if (prev_dl_p && prev_dl_p->from && !strcmp(prev_dl_p->from, from) && prev_dl_p->ids_len == scan.ids_len
+      && (scan.ids_len == 0 || !memcmp(prev_dl_p->ids_p, scan.ids_p, sizeof(uint32_t) * scan.ids_len))) {
+    ret_val = OMEMO_DEVICELIST_UNCHANGED;
+    goto cleanup;
+  }
+
+  ret_val = omemo_devicelist_create(from, &dl_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  if (scan.ids_len) {
+    dl_p->ids_p = malloc(sizeof(uint32_t) * scan.ids_len);
+    if (!dl_p->ids_p) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    dl_p->ids_cap = scan.ids_len;
+  }
+
+  for (size_t i = 0; i < scan.ids_len; i++) {
+    ret_val = devicelist_node_add(dl_p, scan.ids_p[i]);
+    if (ret_val) {
+      goto cleanup;
+    }
+    dl_p->ids_p[dl_p->ids_len++] = scan.ids_p[i];
+  }
+
+  *dl_pp = dl_p;
+
+cleanup:
+  if (ret_val < 0) {
+    omemo_devicelist_destroy(dl_p);
+  }
+  if (scan.ids_p != scan.ids_local) {
+    free(scan.ids_p);
+  }
+  return ret_val;
+}
+
 int omemo_devicelist_add(omemo_devicelist * dl_p, uint32_t device_id) {
   if (!dl_p || !dl_p->list_node_p) {
     return OMEMO_ERR_NULL;
   }
 
-  uint32_t * id_p = malloc(sizeof(uint32_t));
-  if (!id_p) {
+  size_t pos = devicelist_lower_bound(dl_p, device_id);
+  if (pos < dl_p->ids_len && dl_p->ids_p[pos] == device_id) {
+    return 0;
+  }
+
+  if (devicelist_grow(dl_p)) {
     return OMEMO_ERR_NOMEM;
   }
-  *id_p = device_id;
 
-  char * id_string;
-  int id_string_len = int_to_string(device_id, &id_string);
-  if (id_string_len < 1) {
-    free(id_p);
+  if (devicelist_node_add(dl_p, device_id)) {
     return OMEMO_ERR;
   }
 
-  mxml_node_t * device_node_p = mxmlNewElement(MXML_NO_PARENT, DEVICE_NODE_NAME);
-  mxmlElementSetAttr(device_node_p, DEVICE_NODE_ID_ATTR_NAME, id_string);
-  mxmlAdd(dl_p->list_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, device_node_p);
-  dl_p->id_list_p = g_list_append(dl_p->id_list_p, id_p);
+  memmove(&dl_p->ids_p[pos + 1], &dl_p->ids_p[pos], sizeof(uint32_t) * (dl_p->ids_len - pos));
+  dl_p->ids_p[pos] = device_id;
+  dl_p->ids_len++;
 
   return 0;
 }
@@ -811,16 +1924,9 @@ int omemo_devicelist_contains_id(const omemo_devicelist * dl_p, uint32_t device_
     return 0;
   }
 
-  GList * curr = dl_p->id_list_p;
-  while(curr) {
-    if (*((uint32_t *) curr->data) == device_id) {
-      return 1;
-    }
+  size_t pos = devicelist_lower_bound(dl_p, device_id);
 
-    curr = curr->next;
-  }
-
-  return 0;
+  return (pos < dl_p->ids_len && dl_p->ids_p[pos] == device_id) ? 1 : 0;
 }
 
 int omemo_devicelist_remove(omemo_devicelist * dl_p, uint32_t device_id) {
@@ -831,8 +1937,7 @@ int omemo_devicelist_remove(omemo_devicelist * dl_p, uint32_t device_id) {
 
   char * device_id_str = (void *) 0;
   mxml_node_t * device_node_p = (void *) 0;
-  GList * curr_p = (void *) 0;
-  uint32_t * remove_id_p = (void *) 0;
+  size_t pos = 0;
 
   ret_val = int_to_string(device_id, &device_id_str);
   if (ret_val < 1) {
@@ -847,22 +1952,81 @@ int omemo_devicelist_remove(omemo_devicelist * dl_p, uint32_t device_id) {
   }
   mxmlDelete(device_node_p);
 
-  for (curr_p = dl_p->id_list_p; curr_p; curr_p = curr_p->next) {
-    if (omemo_devicelist_list_data(curr_p) == device_id) {
-      remove_id_p = curr_p->data;
-      break;
-    }
+  pos = devicelist_lower_bound(dl_p, device_id);
+  if (pos < dl_p->ids_len && dl_p->ids_p[pos] == device_id) {
+    memmove(&dl_p->ids_p[pos], &dl_p->ids_p[pos + 1], sizeof(uint32_t) * (dl_p->ids_len - pos - 1));
+    dl_p->ids_len--;
   }
 
-  dl_p->id_list_p = g_list_remove(dl_p->id_list_p, remove_id_p);
-
 cleanup:
   free(device_id_str);
   return ret_val;
 }
 
 int omemo_devicelist_is_empty(omemo_devicelist * dl_p) {
-  return dl_p->id_list_p ? 0 : 1;
+  return dl_p->ids_len ? 0 : 1;
+}
+
+int omemo_devicelist_diff_ids(const omemo_devicelist * dl_a_p, const omemo_devicelist * dl_b_p,
+                              uint32_t * a_minus_b_p, size_t * a_minus_b_len_p,
+                              uint32_t * b_minus_a_p, size_t * b_minus_a_len_p) {
+  if (!dl_a_p || !dl_b_p || !a_minus_b_len_p || !b_minus_a_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  size_t amb_cap = a_minus_b_p ? *a_minus_b_len_p : 0;
+  size_t bma_cap = b_minus_a_p ? *b_minus_a_len_p : 0;
+  size_t amb_len = 0;
+  size_t bma_len = 0;
+  size_t i = 0;
+  size_t j = 0;
+
+  // both arrays are sorted, so a single merge pass finds all differences
+  while (i < dl_a_p->ids_len || j < dl_b_p->ids_len) {
+    if (j == dl_b_p->ids_len || (i < dl_a_p->ids_len && dl_a_p->ids_p[i] < dl_b_p->ids_p[j])) {
+      if (amb_len < amb_cap) {
+        a_minus_b_p[amb_len] = dl_a_p->ids_p[i];
+      }
+      amb_len++;
+      i++;
+    } else if (i == dl_a_p->ids_len || dl_b_p->ids_p[j] < dl_a_p->ids_p[i]) {
+      if (bma_len < bma_cap) {
+        b_minus_a_p[bma_len] = dl_b_p->ids_p[j];
+      }
+      bma_len++;
+      j++;
+    } else {
+      i++;
+      j++;
+    }
+  }
+
+  *a_minus_b_len_p = amb_len;
+  *b_minus_a_len_p = bma_len;
+
+  return (amb_len > amb_cap || bma_len > bma_cap) ? OMEMO_ERR_BUFFER_TOO_SMALL : 0;
+}
+
+/**
+ * Builds a GList of individually allocated IDs as returned by the GList based API.
+ */
+static int id_array_to_list(const uint32_t * ids_p, size_t ids_len, GList ** list_pp) {
+  GList * list_p = (void *) 0;
+
+  for (size_t i = ids_len; i > 0; i--) {
+    uint32_t * id_p = malloc(sizeof(uint32_t));
+    if (!id_p) {
+      g_list_free_full(list_p, free);
+      return OMEMO_ERR_NOMEM;
+    }
+    *id_p = ids_p[i - 1];
+
+    list_p = g_list_prepend(list_p, id_p);
+  }
+
+  *list_pp = list_p;
+
+  return 0;
 }
 
 int omemo_devicelist_diff(const omemo_devicelist * dl_a_p, const omemo_devicelist * dl_b_p, GList ** a_minus_b_pp, GList ** b_minus_a_pp) {
@@ -870,45 +2034,80 @@ int omemo_devicelist_diff(const omemo_devicelist * dl_a_p, const omemo_devicelis
     return OMEMO_ERR_NULL;
   }
 
-  GList * a_l_p = (void *) 0;
-  GList * b_l_p = (void *) 0;
+  int ret_val = 0;
+
+  uint32_t * buf_p = (void *) 0;
+  uint32_t * bma_buf_p = (void *) 0;
+  size_t amb_len = dl_a_p->ids_len;
+  size_t bma_len = dl_b_p->ids_len;
   GList * amb_p = (void *) 0;
   GList * bma_p = (void *) 0;
-  GList * curr_p = (void *) 0;
-  GList * temp_p = (void *) 0;
 
-  a_l_p = omemo_devicelist_get_id_list(dl_a_p);
-  b_l_p = omemo_devicelist_get_id_list(dl_b_p);
+  if (amb_len + bma_len > 0) {
+    buf_p = malloc(sizeof(uint32_t) * (amb_len + bma_len));
+    if (!buf_p) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    bma_buf_p = buf_p + dl_a_p->ids_len;
+  }
+
+  ret_val = omemo_devicelist_diff_ids(dl_a_p, dl_b_p, buf_p, &amb_len, bma_buf_p, &bma_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = id_array_to_list(buf_p, amb_len, &amb_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = id_array_to_list(bma_buf_p, bma_len, &bma_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  *a_minus_b_pp = amb_p;
+  *b_minus_a_pp = bma_p;
+
+cleanup:
+  if (ret_val) {
+    g_list_free_full(amb_p, free);
+  }
+  free(buf_p);
+
+  return ret_val;
+}
+
+// builds the <publish> element around the list and serializes it either into a string or through the writer
+static int devicelist_export(omemo_devicelist * dl_p, char ** xml_p, xml_writer * writer_p) {
+  int ret_val = 0;
+  char * xml = (void *) 0;
+
+  mxml_node_t * publish_node_p = mxmlNewElement(MXML_NO_PARENT, PUBLISH_NODE_NAME);
+  mxmlElementSetAttr(publish_node_p, PUBLISH_NODE_NODE_ATTR_NAME, OMEMO_DEVICELIST_PEP_NODE);
+
+  mxml_node_t * item_node_p = mxmlNewElement(publish_node_p, ITEM_NODE_NAME);
+  mxmlAdd(item_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, dl_p->list_node_p);
 
-  curr_p = a_l_p;
-  while (curr_p) {
-    temp_p = curr_p;
-    curr_p = curr_p->next;
-    if (!omemo_devicelist_contains_id(dl_b_p, omemo_devicelist_list_data(temp_p))) {
-      a_l_p = g_list_remove_link(a_l_p, temp_p);
-      amb_p = g_list_prepend(amb_p, temp_p->data);
-      g_list_free_1(temp_p);
-    }
+  if (writer_p) {
+    ret_val = xml_writer_write_tree(writer_p, publish_node_p);
+    goto cleanup;
   }
 
-  curr_p = b_l_p;
-  while (curr_p) {
-    temp_p = curr_p;
-    curr_p = curr_p->next;
-    if (!omemo_devicelist_contains_id(dl_a_p, omemo_devicelist_list_data(temp_p))) {
-      b_l_p = g_list_remove_link(b_l_p, temp_p);
-      bma_p = g_list_prepend(bma_p, temp_p->data);
-      g_list_free_1(temp_p);
-    }
+  xml = mxmlSaveAllocString(publish_node_p, MXML_NO_CALLBACK);
+  if (!xml) {
+    ret_val = OMEMO_ERR;
+    goto cleanup;
   }
 
-  *a_minus_b_pp = amb_p;
-  *b_minus_a_pp = bma_p;
+  *xml_p = xml;
 
-  g_list_free_full(a_l_p, free);
-  g_list_free_full(b_l_p, free);
+cleanup:
+  mxmlRemove(dl_p->list_node_p);
+  mxmlDelete(publish_node_p);
 
-  return 0;
+  return ret_val;
 }
 
 int omemo_devicelist_export(omemo_devicelist * dl_p, char ** xml_p) {
@@ -916,42 +2115,52 @@ int omemo_devicelist_export(omemo_devicelist * dl_p, char ** xml_p) {
     return OMEMO_ERR_NULL;
   }
 
-  mxml_node_t * publish_node_p = mxmlNewElement(MXML_NO_PARENT, PUBLISH_NODE_NAME);
-  mxmlElementSetAttr(publish_node_p, PUBLISH_NODE_NODE_ATTR_NAME, OMEMO_DEVICELIST_PEP_NODE);
-
-  mxml_node_t * item_node_p = mxmlNewElement(publish_node_p, ITEM_NODE_NAME);
-  mxmlAdd(item_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, dl_p->list_node_p);
+  return devicelist_export(dl_p, xml_p, (void *) 0);
+}
 
-  char * xml = mxmlSaveAllocString(publish_node_p, MXML_NO_CALLBACK);
-  if (!xml) {
-    return OMEMO_ERR;
+int omemo_devicelist_export_to(omemo_devicelist * dl_p, omemo_write_func write_func, void * user_data_p) {
+  if (!dl_p || !dl_p->list_node_p || !write_func) {
+    return OMEMO_ERR_NULL;
   }
 
-  *xml_p = xml;
-  return 0;
+  xml_writer writer;
+  xml_writer_init(&writer, write_func, user_data_p);
+
+  return devicelist_export(dl_p, (void *) 0, &writer);
 }
 
 GList * omemo_devicelist_get_id_list(const omemo_devicelist * dl_p) {
   GList * new_l_p = (void *) 0;
-  GList * curr_p = (void *) 0;
   uint32_t * cpy_p = (void *) 0;
 
-  for (curr_p = dl_p->id_list_p; curr_p; curr_p = curr_p->next) {
+  // prepend from the back so that building the list stays linear
+  for (size_t i = dl_p->ids_len; i > 0; i--) {
     cpy_p = malloc(sizeof(uint32_t));
     if (!cpy_p) {
       g_list_free_full(new_l_p, free);
       return (void *) 0;
     }
-    memcpy(cpy_p, curr_p->data, (sizeof(uint32_t)));
+    *cpy_p = dl_p->ids_p[i - 1];
 
-    new_l_p = g_list_append(new_l_p, cpy_p);
+    new_l_p = g_list_prepend(new_l_p, cpy_p);
   }
 
   return new_l_p;
 }
 
+int omemo_devicelist_get_ids(const omemo_devicelist * dl_p, const uint32_t ** ids_pp, size_t * ids_len_p) {
+  if (!dl_p || !ids_pp || !ids_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  *ids_pp = dl_p->ids_p;
+  *ids_len_p = dl_p->ids_len;
+
+  return 0;
+}
+
 int omemo_devicelist_has_id_list(const omemo_devicelist * dl_p) {
-  return (dl_p->id_list_p) ? 1 : 0;
+  return (dl_p->ids_len) ? 1 : 0;
 }
 
 const char * omemo_devicelist_get_owner(const omemo_devicelist * dl_p) {
@@ -980,27 +2189,218 @@ int omemo_devicelist_get_pep_node_name(char ** node_name_p) {
 
 void omemo_devicelist_destroy(omemo_devicelist * dl_p) {
   if (dl_p) {
-    g_list_free_full(dl_p->id_list_p, free);
+    free(dl_p->ids_p);
     mxmlDelete(dl_p->list_node_p);
     free(dl_p->from);
     free(dl_p);
   }
 }
 
+// fills the buffer with random bytes, using whichever function the provider offers
+static int random_bytes_fill(const omemo_crypto_provider * crypto_p, uint8_t * buf_p, size_t buf_len) {
+  if (crypto_p->random_bytes_into_func) {
+    return crypto_p->random_bytes_into_func(buf_p, buf_len, crypto_p->user_data_p);
+  }
+
+  uint8_t * random_p = (void *) 0;
+  int ret_val = crypto_p->random_bytes_func(&random_p, buf_len, crypto_p->user_data_p);
+  if (!ret_val) {
+    memcpy(buf_p, random_p, buf_len);
+  }
+  if (random_p) {
+    memset(random_p, 0, buf_len);
+    free(random_p);
+  }
+
+  return ret_val;
+}
+
+// encrypts a payload with a 128 bit key, the tag is written to tag_p
+static int payload_encrypt(const uint8_t * pt_p, size_t pt_len, const uint8_t * iv_p, const uint8_t * key_p,
+                           const omemo_crypto_provider * crypto_p, uint8_t ** ct_pp, size_t * ct_len_p, uint8_t * tag_p) {
+  int ret_val = 0;
+
+  uint8_t * ct_p = (void *) 0;
+  size_t ct_len = 0;
+  uint8_t * tag_alloc_p = (void *) 0;
+
+  if (crypto_p->aes_gcm_encrypt_into_func) {
+    ct_len = pt_len;
+    // an empty ciphertext still needs a valid pointer
+    ct_p = malloc(sizeof(uint8_t) * (ct_len ? ct_len : 1));
+    if (!ct_p) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+
+    ret_val = crypto_p->aes_gcm_encrypt_into_func(pt_p, pt_len,
+                                                  iv_p, OMEMO_AES_GCM_IV_LENGTH,
+                                                  key_p, OMEMO_AES_128_KEY_LENGTH,
+                                                  crypto_p->user_data_p,
+                                                  ct_p,
+                                                  tag_p, OMEMO_AES_GCM_TAG_LENGTH);
+    if (ret_val) {
+      goto cleanup;
+    }
+  } else {
+    ret_val = crypto_p->aes_gcm_encrypt_func(pt_p, pt_len,
+                                             iv_p, OMEMO_AES_GCM_IV_LENGTH,
+                                             key_p, OMEMO_AES_128_KEY_LENGTH,
+                                             OMEMO_AES_GCM_TAG_LENGTH,
+                                             crypto_p->user_data_p,
+                                             &ct_p, &ct_len,
+                                             &tag_alloc_p);
+    if (ret_val) {
+      goto cleanup;
+    }
+
+    memcpy(tag_p, tag_alloc_p, OMEMO_AES_GCM_TAG_LENGTH);
+  }
+
+  *ct_pp = ct_p;
+  *ct_len_p = ct_len;
+
+cleanup:
+  if (ret_val) {
+    free(ct_p);
+  }
+  free(tag_alloc_p);
+
+  return ret_val;
+}
+
+// finds the tag, which is either appended to the key or at the end of the payload, and the lengths without it
+static int payload_split_tag(const uint8_t * payload_p, size_t payload_len, const uint8_t * key_p, size_t key_len,
+                             size_t * ct_len_p, size_t * aes_key_len_p, const uint8_t ** tag_pp) {
+  if (key_len == OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH) {
+    *aes_key_len_p = OMEMO_AES_128_KEY_LENGTH;
+    *ct_len_p = payload_len;
+    *tag_pp = key_p + OMEMO_AES_128_KEY_LENGTH;
+  } else if (key_len == OMEMO_AES_128_KEY_LENGTH) {
+    if (payload_len < OMEMO_AES_GCM_TAG_LENGTH) {
+      return OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_PAYLOAD_DATA;
+    }
+    *aes_key_len_p = key_len;
+    *ct_len_p = payload_len - OMEMO_AES_GCM_TAG_LENGTH;
+    *tag_pp = payload_p + (payload_len - OMEMO_AES_GCM_TAG_LENGTH);
+  } else {
+    return OMEMO_ERR_UNSUPPORTED_KEY_LEN;
+  }
+
+  return 0;
+}
+
+/*
+ * Decrypts a payload into a caller-supplied buffer and null-terminates it.
+ * If the key has no tag appended, the tag is expected at the end of the payload.
+ * If the buffer is too small, the needed length without the null byte is still written to pt_len_p.
+ */
+static int payload_decrypt_into(const uint8_t * payload_p, size_t payload_len, const uint8_t * iv_p, size_t iv_len,
+                                const uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p,
+                                uint8_t * out_p, size_t out_size, size_t * pt_len_p) {
+  int ret_val = 0;
+
+  size_t key_len_actual = 0;
+  size_t payload_len_actual = 0;
+  const uint8_t * tag_p = (void *) 0;
+  uint8_t * pt_p = (void *) 0;
+  size_t pt_len = 0;
+
+  ret_val = payload_split_tag(payload_p, payload_len, key_p, key_len, &payload_len_actual, &key_len_actual, &tag_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  if (out_size < payload_len_actual + 1) {
+    *pt_len_p = payload_len_actual;
+    ret_val = OMEMO_ERR_BUFFER_TOO_SMALL;
+    goto cleanup;
+  }
+
+  if (crypto_p->aes_gcm_decrypt_into_func) {
+    // decrypting straight into the output saves copying the plaintext
+    ret_val = crypto_p->aes_gcm_decrypt_into_func(payload_p, payload_len_actual,
+                                                  iv_p, iv_len,
+                                                  key_p, key_len_actual,
+                                                  tag_p, OMEMO_AES_GCM_TAG_LENGTH,
+                                                  crypto_p->user_data_p,
+                                                  out_p);
+    if (ret_val) {
+      goto cleanup;
+    }
+    pt_len = payload_len_actual;
+  } else {
+    ret_val = crypto_p->aes_gcm_decrypt_func(payload_p, payload_len_actual,
+                                             iv_p, iv_len,
+                                             key_p, key_len_actual,
+                                             (uint8_t *) tag_p, OMEMO_AES_GCM_TAG_LENGTH,
+                                             crypto_p->user_data_p,
+                                             &pt_p, &pt_len);
+    if (ret_val) {
+      goto cleanup;
+    }
+
+    if (out_size < pt_len + 1) {
+      *pt_len_p = pt_len;
+      ret_val = OMEMO_ERR_BUFFER_TOO_SMALL;
+      goto cleanup;
+    }
+    memcpy(out_p, pt_p, pt_len);
+  }
+  out_p[pt_len] = '\0';
+
+  *pt_len_p = pt_len;
+
+cleanup:
+  if (pt_p) {
+    memset(pt_p, 0, pt_len);
+    free(pt_p);
+  }
+
+  return ret_val;
+}
+
+// like payload_decrypt_into(), but allocates the null-terminated output
+static int payload_decrypt(const uint8_t * payload_p, size_t payload_len, const uint8_t * iv_p, size_t iv_len,
+                           const uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p,
+                           char ** pt_str_p, size_t * pt_len_p) {
+  int ret_val = 0;
+
+  char * pt_str = (void *) 0;
+  size_t pt_len = 0;
+
+  // the plaintext is never longer than the payload
+  pt_str = malloc(payload_len + 1);
+  if (!pt_str) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  ret_val = payload_decrypt_into(payload_p, payload_len, iv_p, iv_len, key_p, key_len, crypto_p,
+                                 (uint8_t *) pt_str, payload_len + 1, &pt_len);
+  if (ret_val) {
+    free(pt_str);
+    return ret_val;
+  }
+
+  *pt_str_p = pt_str;
+  *pt_len_p = pt_len;
+
+  return 0;
+}
+
 int omemo_message_create(uint32_t sender_device_id, const omemo_crypto_provider * crypto_p, omemo_message ** message_pp) {
-  if (!crypto_p || !crypto_p->random_bytes_func || !crypto_p->aes_gcm_encrypt_func || !message_pp) {
+  if (!crypto_p || (!crypto_p->random_bytes_func && !crypto_p->random_bytes_into_func) || !crypto_p->aes_gcm_encrypt_func || !message_pp) {
     return OMEMO_ERR_NULL;
   }
 
   int ret_val = 0;
 
   omemo_message * msg_p = (void *) 0;
-  uint8_t * iv_p = (void *) 0;
-  gchar * iv_b64 = (void *) 0;
+  char iv_b64[(OMEMO_AES_GCM_IV_LENGTH + 2) / 3 * 4 + 1];
   char * device_id_string = (void *) 0;
   mxml_node_t * header_node_p = (void *) 0;
   mxml_node_t * iv_node_p = (void *) 0;
-  uint8_t * key_p = (void *) 0;
+  const size_t random_len = OMEMO_AES_GCM_IV_LENGTH + OMEMO_AES_128_KEY_LENGTH;
 
   msg_p = malloc(sizeof(omemo_message));
   if (!msg_p) {
@@ -1009,13 +2409,21 @@ int omemo_message_create(uint32_t sender_device_id, const omemo_crypto_provider
   }
   memset(msg_p, 0, sizeof(omemo_message));
 
-  ret_val = crypto_p->random_bytes_func(&iv_p, OMEMO_AES_GCM_IV_LENGTH, crypto_p->user_data_p);
+  // IV and key are drawn at once, the space for the tag is filled in when encrypting
+  ret_val = random_bytes_fill(crypto_p, msg_p->key_material, random_len);
   if (ret_val) {
     goto cleanup;
   }
-  msg_p->iv_p = iv_p;
+
+  msg_p->iv_p = msg_p->key_material;
   msg_p->iv_len = OMEMO_AES_GCM_IV_LENGTH;
-  iv_b64 = g_base64_encode(iv_p, OMEMO_AES_GCM_IV_LENGTH);
+  msg_p->key_p = msg_p->key_material + OMEMO_AES_GCM_IV_LENGTH;
+  msg_p->key_len = OMEMO_AES_128_KEY_LENGTH;
+  msg_p->tag_len = 0;
+  ret_val = omemo_b64_encode_into(msg_p->iv_p, OMEMO_AES_GCM_IV_LENGTH, iv_b64, sizeof(iv_b64), (void *) 0);
+  if (ret_val) {
+    goto cleanup;
+  }
 
   if (int_to_string(sender_device_id, &device_id_string) <= 0) {
     ret_val = -1;
@@ -1028,15 +2436,6 @@ int omemo_message_create(uint32_t sender_device_id, const omemo_crypto_provider
   (void) mxmlNewOpaque(iv_node_p, iv_b64);
   msg_p->header_node_p = header_node_p;
 
-  ret_val = crypto_p->random_bytes_func(&key_p, OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH, crypto_p->user_data_p);
-  if (ret_val) {
-    goto cleanup;
-  }
-
-  msg_p->key_p = key_p;
-  msg_p->key_len = OMEMO_AES_128_KEY_LENGTH;
-  msg_p->tag_len = 0;
-
   *message_pp = msg_p;
 
 cleanup:
@@ -1045,7 +2444,6 @@ cleanup:
   }
 
   free(device_id_string);
-  g_free(iv_b64);
 
   return ret_val;
 }
@@ -1073,7 +2471,7 @@ int omemo_message_strip_possible_plaintext(omemo_message * msg_p) {
 }
 
 int omemo_message_prepare_encryption(char * outgoing_message, uint32_t sender_device_id, const omemo_crypto_provider * crypto_p, int strip, omemo_message ** message_pp) {
-  if (!outgoing_message || !crypto_p || !crypto_p->random_bytes_func || !crypto_p->aes_gcm_encrypt_func || !message_pp) {
+  if (!outgoing_message || !crypto_p || (!crypto_p->random_bytes_func && !crypto_p->random_bytes_into_func) || !crypto_p->aes_gcm_encrypt_func || !message_pp) {
     return OMEMO_ERR_NULL;
   }
 
@@ -1087,11 +2485,9 @@ int omemo_message_prepare_encryption(char * outgoing_message, uint32_t sender_de
   uint8_t * ct_p = (void *) 0;
   size_t ct_len = 0;
 
-  gchar * payload_b64 = (void *) 0;
+  char * payload_b64 = (void *) 0;
   mxml_node_t * payload_node_p = (void *) 0;
 
-  uint8_t * tag_p = (void *) 0;
-
   ret_val = omemo_message_create(sender_device_id, crypto_p, &msg_p);
   if (ret_val) {
     goto cleanup;
@@ -1117,19 +2513,14 @@ int omemo_message_prepare_encryption(char * outgoing_message, uint32_t sender_de
     goto cleanup;
   }
 
-  ret_val = crypto_p->aes_gcm_encrypt_func((uint8_t *) msg_text, strlen(msg_text),
-                                           msg_p->iv_p, msg_p->iv_len,
-                                           msg_p->key_p, msg_p->key_len,
-                                           OMEMO_AES_GCM_TAG_LENGTH,
-                                           crypto_p->user_data_p,
-                                           &ct_p, &ct_len,
-                                           &tag_p);
+  // the tag goes right behind the key, where it is sent along with it
+  ret_val = payload_encrypt((const uint8_t *) msg_text, strlen(msg_text), msg_p->iv_p, msg_p->key_p, crypto_p,
+                            &ct_p, &ct_len, msg_p->key_p + msg_p->key_len);
   if (ret_val) {
     goto cleanup;
   }
 
   msg_p->tag_len = OMEMO_AES_GCM_TAG_LENGTH;
-  memcpy(msg_p->key_p + msg_p->key_len, tag_p, msg_p->tag_len);
 
   // to delete it, go one level up
   ret_val = expect_next_node(body_node_p, mxmlGetParent, BODY_NODE_NAME, &body_node_p);
@@ -1141,7 +2532,10 @@ int omemo_message_prepare_encryption(char * outgoing_message, uint32_t sender_de
 
   mxmlRemove(body_node_p);
 
-  payload_b64 = g_base64_encode(ct_p, ct_len);
+  ret_val = omemo_b64_encode(ct_p, ct_len, &payload_b64);
+  if (ret_val) {
+    goto cleanup;
+  }
   payload_node_p = mxmlNewElement(MXML_NO_PARENT, PAYLOAD_NODE_NAME);
   (void) mxmlNewOpaque(payload_node_p, payload_b64);
   msg_p->payload_node_p = payload_node_p;
@@ -1158,8 +2552,7 @@ cleanup:
   }
 
   free(ct_p);
-  g_free(payload_b64);
-  free(tag_p);
+  free(payload_b64);
 
   return ret_val;
 }
@@ -1172,6 +2565,169 @@ size_t omemo_message_get_key_len(omemo_message * msg_p) {
   return msg_p->key_len + msg_p->tag_len;
 }
 
+static size_t key_index_slot(uint32_t rid, size_t cap) {
+  // Fibonacci hashing, as rids are random anyway but may be chosen to collide on the lower bits.
+  // The capacity is a power of two, so multiplying by it and dropping the low 32 bits keeps the top log2(cap) bits.
+  uint32_t hash = rid * 2654435769u;
+  return (size_t) (((uint64_t) hash * cap) >> 32);
+}
+
+static void key_index_free(omemo_message * msg_p) {
+  free(msg_p->key_index_p);
+  msg_p->key_index_p = (void *) 0;
+  msg_p->key_index_cap = 0;
+  msg_p->key_index_len = 0;
+}
+
+static int key_index_init(omemo_message * msg_p, size_t cap) {
+  omemo_key_index_entry * index_p = malloc(sizeof(omemo_key_index_entry) * cap);
+  if (!index_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(index_p, 0, sizeof(omemo_key_index_entry) * cap);
+
+  key_index_free(msg_p);
+  msg_p->key_index_p = index_p;
+  msg_p->key_index_cap = cap;
+
+  return 0;
+}
+
+/**
+ * Adds an entry to the key index, growing it if it is more than half full.
+ * If the rid is already in the index, the existing entry is kept.
+ */
+static int key_index_insert(omemo_message * msg_p, uint32_t rid, bool prekey, const char * key_b64) {
+  if ((msg_p->key_index_len + 1) * 2 > msg_p->key_index_cap) {
+    omemo_key_index_entry * old_p = msg_p->key_index_p;
+    size_t old_cap = msg_p->key_index_cap;
+
+    msg_p->key_index_p = (void *) 0;
+    if (key_index_init(msg_p, old_cap * 2)) {
+      msg_p->key_index_p = old_p;
+      msg_p->key_index_cap = old_cap;
+      return OMEMO_ERR_NOMEM;
+    }
+
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old_p[i].used) {
+        (void) key_index_insert(msg_p, old_p[i].rid, old_p[i].prekey, old_p[i].key_b64);
+      }
+    }
+    free(old_p);
+  }
+
+  size_t slot = key_index_slot(rid, msg_p->key_index_cap);
+  while (msg_p->key_index_p[slot].used) {
+    if (msg_p->key_index_p[slot].rid == rid) {
+      return 0;
+    }
+    slot = (slot + 1) & (msg_p->key_index_cap - 1);
+  }
+
+  msg_p->key_index_p[slot].rid = rid;
+  msg_p->key_index_p[slot].prekey = prekey;
+  msg_p->key_index_p[slot].key_b64 = key_b64;
+  msg_p->key_index_p[slot].used = true;
+  msg_p->key_index_len++;
+
+  return 0;
+}
+
+/**
+ * Parses the rid of a <key> element.
+ *
+ * @return 0 on success, negative if it is missing or not a decimal 32 bit number.
+ */
+static int key_rid_parse(const char * rid_string, uint32_t * rid_p) {
+  if (!rid_string || !*rid_string) {
+    return OMEMO_ERR;
+  }
+
+  char * end_p = (void *) 0;
+  unsigned long rid = strtoul(rid_string, &end_p, 10);
+  if (*end_p || rid > UINT32_MAX) {
+    return OMEMO_ERR;
+  }
+
+  *rid_p = rid;
+
+  return 0;
+}
+
+static bool key_prekey_attr_is_true(const char * prekey_attr_val) {
+  // according to https://www.w3.org/TR/xmlschema-2/#boolean "1" can also be a boolean that means true
+  return prekey_attr_val
+         && (!strncmp(prekey_attr_val, KEY_NODE_PREKEY_ATTR_VAL_TRUE, strlen(KEY_NODE_PREKEY_ATTR_VAL_TRUE)) || !strncmp(prekey_attr_val, "1", strlen("1")));
+}
+
+/**
+ * Builds the index of all <key> elements in the header, so that they can be looked up by rid in O(1).
+ * If a rid appears more than once, the first element wins.
+ * Elements without a valid numeric rid are skipped.
+ */
+static int key_index_build(omemo_message * msg_p) {
+  int ret_val = 0;
+  mxml_node_t * node_p = (void *) 0;
+  uint32_t rid = 0;
+
+  ret_val = key_index_init(msg_p, 16);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  for (node_p = mxmlGetFirstChild(msg_p->header_node_p); node_p; node_p = mxmlGetNextSibling(node_p)) {
+    if (mxmlGetType(node_p) != MXML_ELEMENT || strcmp(mxmlGetElement(node_p), KEY_NODE_NAME)) {
+      continue;
+    }
+
+    if (key_rid_parse(mxmlElementGetAttr(node_p, KEY_NODE_RID_ATTR_NAME), &rid)) {
+      continue;
+    }
+
+    ret_val = key_index_insert(msg_p, rid, key_prekey_attr_is_true(mxmlElementGetAttr(node_p, KEY_NODE_PREKEY_ATTR_NAME)), mxmlGetOpaque(node_p));
+    if (ret_val) {
+      key_index_free(msg_p);
+      return ret_val;
+    }
+  }
+
+  return 0;
+}
+
+// Finds the index entry for the given recipient device ID, building the index first if necessary.
+static int omemo_message_find_key_entry(omemo_message * msg_p, uint32_t rid, const omemo_key_index_entry ** entry_pp) {
+  if (!msg_p || !entry_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  if (!msg_p->key_index_p) {
+    if (!msg_p->header_node_p) {
+      return OMEMO_ERR_NULL;
+    }
+
+    ret_val = key_index_build(msg_p);
+    if (ret_val) {
+      return ret_val;
+    }
+  }
+
+  *entry_pp = (void *) 0;
+
+  size_t slot = key_index_slot(rid, msg_p->key_index_cap);
+  while (msg_p->key_index_p[slot].used) {
+    if (msg_p->key_index_p[slot].rid == rid) {
+      *entry_pp = &msg_p->key_index_p[slot];
+      break;
+    }
+    slot = (slot + 1) & (msg_p->key_index_cap - 1);
+  }
+
+  return 0;
+}
+
 // adds a "key" element with the given parameters to the header.
 static int add_recipient(omemo_message * msg_p, uint32_t device_id, const uint8_t * encrypted_key_p, size_t key_len, bool prekey) {
   if (!msg_p || !msg_p->header_node_p || !encrypted_key_p) {
@@ -1183,7 +2739,12 @@ static int add_recipient(omemo_message * msg_p, uint32_t device_id, const uint8_
     return OMEMO_ERR;
   }
 
-  gchar * key_b64 = g_base64_encode(encrypted_key_p, key_len);
+  char * key_b64 = (void *) 0;
+  int ret_val = omemo_b64_encode(encrypted_key_p, key_len, &key_b64);
+  if (ret_val) {
+    free(device_id_string);
+    return ret_val;
+  }
   mxml_node_t * key_node_p =  mxmlNewElement(MXML_NO_PARENT, KEY_NODE_NAME);
   mxmlElementSetAttr(key_node_p, KEY_NODE_RID_ATTR_NAME, device_id_string);
   (void) mxmlNewOpaque(key_node_p, key_b64);
@@ -1192,26 +2753,103 @@ static int add_recipient(omemo_message * msg_p, uint32_t device_id, const uint8_
     mxmlElementSetAttr(key_node_p, KEY_NODE_PREKEY_ATTR_NAME, KEY_NODE_PREKEY_ATTR_VAL_TRUE);
   }
 
-  mxmlAdd(msg_p->header_node_p, MXML_ADD_BEFORE, MXML_ADD_TO_PARENT, key_node_p);
+  mxmlAdd(msg_p->header_node_p, MXML_ADD_BEFORE, MXML_ADD_TO_PARENT, key_node_p);
+  key_index_free(msg_p);
+
+  free(device_id_string);
+  free(key_b64);
+  return 0;
+}
+
+int omemo_message_add_recipient(omemo_message * msg_p, uint32_t device_id, const uint8_t * encrypted_key_p, size_t key_len) {
+  return add_recipient(msg_p, device_id, encrypted_key_p, key_len, false);
+}
+
+int omemo_message_add_recipient_w_prekey(omemo_message * msg_p, uint32_t device_id, const uint8_t * encrypted_key_p, size_t key_len) {
+  return add_recipient(msg_p, device_id, encrypted_key_p, key_len, true);
+}
+
+int omemo_message_add_recipients(omemo_message * msg_p, const omemo_raw_recipient * recipients_p, size_t recipients_len) {
+  if (!msg_p || !msg_p->header_node_p || (!recipients_p && recipients_len)) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  // decimal digits of UINT32_MAX and the null byte
+  const size_t id_string_size = 11;
+  size_t arena_size = 0;
+  char * arena_p = (void *) 0;
+  char * arena_pos_p = (void *) 0;
+  mxml_node_t * keys_node_p = (void *) 0;
+  mxml_node_t * key_node_p = (void *) 0;
+
+  if (!recipients_len) {
+    return 0;
+  }
+
+  // the strings of all keys are built in one buffer, sized beforehand
+  for (size_t i = 0; i < recipients_len; i++) {
+    if (!recipients_p[i].encrypted_key_p) {
+      return OMEMO_ERR_NULL;
+    }
+    arena_size += id_string_size + omemo_b64_encoded_len(recipients_p[i].encrypted_key_len) + 1;
+  }
+
+  arena_p = malloc(arena_size);
+  if (!arena_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  arena_pos_p = arena_p;
+
+  // the elements are collected in a detached one first, so that nothing is added to the header on failure
+  keys_node_p = mxmlNewElement(MXML_NO_PARENT, HEADER_NODE_NAME);
+  if (!keys_node_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
 
-  free(device_id_string);
-  g_free(key_b64);
-  return 0;
-}
+  for (size_t i = 0; i < recipients_len; i++) {
+    const omemo_raw_recipient * recipient_p = &recipients_p[i];
+    char * device_id_string = arena_pos_p;
+    char * key_b64 = arena_pos_p + id_string_size;
+    size_t key_b64_len = 0;
 
-int omemo_message_add_recipient(omemo_message * msg_p, uint32_t device_id, const uint8_t * encrypted_key_p, size_t key_len) {
-  return add_recipient(msg_p, device_id, encrypted_key_p, key_len, false);
-}
+    (void) snprintf(device_id_string, id_string_size, "%" PRIu32, recipient_p->device_id);
+    ret_val = omemo_b64_encode_into(recipient_p->encrypted_key_p, recipient_p->encrypted_key_len,
+                                    key_b64, arena_size - (key_b64 - arena_p), &key_b64_len);
+    if (ret_val) {
+      goto cleanup;
+    }
+    arena_pos_p = key_b64 + key_b64_len + 1;
 
-int omemo_message_add_recipient_w_prekey(omemo_message * msg_p, uint32_t device_id, const uint8_t * encrypted_key_p, size_t key_len) {
-  return add_recipient(msg_p, device_id, encrypted_key_p, key_len, true);
-}
+    key_node_p = mxmlNewElement(keys_node_p, KEY_NODE_NAME);
+    if (!key_node_p || !mxmlNewOpaque(key_node_p, key_b64)) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    mxmlElementSetAttr(key_node_p, KEY_NODE_RID_ATTR_NAME, device_id_string);
+    if (recipient_p->prekey) {
+      mxmlElementSetAttr(key_node_p, KEY_NODE_PREKEY_ATTR_NAME, KEY_NODE_PREKEY_ATTR_VAL_TRUE);
+    }
+  }
 
-int omemo_message_export_encrypted(omemo_message * msg_p, int add_msg, char ** msg_xml) {
-  if (!msg_p || !msg_p->message_node_p || !msg_p->header_node_p || !msg_p->payload_node_p || !msg_xml) {
-    return OMEMO_ERR_NULL;
+  // same order as adding them one by one, each in front of the previous ones
+  while ((key_node_p = mxmlGetFirstChild(keys_node_p))) {
+    mxmlAdd(msg_p->header_node_p, MXML_ADD_BEFORE, MXML_ADD_TO_PARENT, key_node_p);
   }
+  key_index_free(msg_p);
 
+cleanup:
+  mxmlDelete(keys_node_p);
+  free(arena_p);
+
+  return ret_val;
+}
+
+// adds the OMEMO elements to the stanza, serializes it either into a string or through the writer, and removes them again
+static int message_export_encrypted(omemo_message * msg_p, int add_msg, char ** msg_xml, xml_writer * writer_p) {
   int ret_val = 0;
 
   mxml_node_t * body_node_p = (void *) 0;
@@ -1241,6 +2879,11 @@ int omemo_message_export_encrypted(omemo_message * msg_p, int add_msg, char ** m
   store_node_p = mxmlNewElement(msg_p->message_node_p, STORE_NODE_NAME);
   mxmlElementSetAttr(store_node_p, XMLNS_ATTR_NAME, HINTS_XMLNS);
 
+  if (writer_p) {
+    ret_val = xml_writer_write_tree(writer_p, msg_p->message_node_p);
+    goto cleanup;
+  }
+
   xml_str = mxmlSaveAllocString(msg_p->message_node_p, MXML_NO_CALLBACK);
   if (!xml_str) {
     ret_val = OMEMO_ERR;
@@ -1250,10 +2893,8 @@ int omemo_message_export_encrypted(omemo_message * msg_p, int add_msg, char ** m
   *msg_xml = xml_str;
 
 cleanup:
-  if (!ret_val) {
-    mxmlRemove(msg_p->header_node_p);
-    mxmlRemove(msg_p->payload_node_p);
-  }
+  mxmlRemove(msg_p->header_node_p);
+  mxmlRemove(msg_p->payload_node_p);
   mxmlDelete(body_node_p);
   mxmlDelete(encrypted_node_p);
   mxmlDelete(store_node_p);
@@ -1262,6 +2903,25 @@ cleanup:
   return ret_val;
 }
 
+int omemo_message_export_encrypted(omemo_message * msg_p, int add_msg, char ** msg_xml) {
+  if (!msg_p || !msg_p->message_node_p || !msg_p->header_node_p || !msg_p->payload_node_p || !msg_xml) {
+    return OMEMO_ERR_NULL;
+  }
+
+  return message_export_encrypted(msg_p, add_msg, msg_xml, (void *) 0);
+}
+
+int omemo_message_export_encrypted_to(omemo_message * msg_p, int add_msg, omemo_write_func write_func, void * user_data_p) {
+  if (!msg_p || !msg_p->message_node_p || !msg_p->header_node_p || !msg_p->payload_node_p || !write_func) {
+    return OMEMO_ERR_NULL;
+  }
+
+  xml_writer writer;
+  xml_writer_init(&writer, write_func, user_data_p);
+
+  return message_export_encrypted(msg_p, add_msg, (void *) 0, &writer);
+}
+
 int omemo_message_prepare_decryption(char * incoming_message, omemo_message ** msg_pp) {
   if (!incoming_message || !msg_pp) {
     return OMEMO_ERR_NULL;
@@ -1316,294 +2976,935 @@ int omemo_message_prepare_decryption(char * incoming_message, omemo_message ** m
     ret_val = OMEMO_ERR_NOMEM;
     goto cleanup;
   }
-  memset(msg_p, 0, sizeof(omemo_message));
+  memset(msg_p, 0, sizeof(omemo_message));
+
+  if (body_node_p) {
+    mxmlDelete(body_node_p);
+  }
+
+  if (eme_node_p) {
+    mxmlDelete(eme_node_p);
+  }
+
+  if (store_node_p) {
+    mxmlDelete(store_node_p);
+  }
+
+  mxmlRemove(header_node_p);
+  msg_p->header_node_p = header_node_p;
+
+  if (payload_node_p) {
+    payload_node_p = mxmlGetParent(payload_node_p);
+    mxmlRemove(payload_node_p);
+    msg_p->payload_node_p = payload_node_p;
+  }
+
+  mxmlDelete(encrypted_node_p);
+  msg_p->message_node_p = message_node_p;
+
+  ret_val = key_index_build(msg_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  *msg_pp = msg_p;
+
+cleanup:
+  if (ret_val) {
+    if (msg_p) {
+      omemo_message_destroy(msg_p);
+    } else {
+      mxmlDelete(message_node_p);
+    }
+  }
+  return ret_val;
+}
+
+// state of one of the elements the streaming parser is looking for
+typedef struct stream_elem {
+  bool seen;
+  bool open;
+  size_t depth;
+  size_t start;
+  size_t end;
+  size_t text_start;
+} stream_elem;
+
+static void stream_elem_begin(stream_elem * elem_p, const xml_token * tok_p, size_t depth) {
+  elem_p->seen = true;
+  elem_p->open = (tok_p->type == XML_TOKEN_START);
+  elem_p->depth = depth;
+  elem_p->start = tok_p->start;
+  elem_p->end = tok_p->end;
+  elem_p->text_start = tok_p->end;
+}
+
+/**
+ * Ends the element if the end tag belongs to it.
+ * The text content is null-terminated in place by overwriting the '<' of the end tag.
+ *
+ * @param elem_p Pointer to the element state.
+ * @param buf The stanza.
+ * @param tok_p Pointer to the end tag token.
+ * @param depth Depth of the element the end tag belongs to.
+ * @param name Name of the element.
+ * @param text_pp If not NULL, will be set to the text content if the element was ended and has some, NULL otherwise.
+ * @return 0 on success, OMEMO_ERR_MALFORMED_XML if the end tag does not match.
+ */
+static int stream_elem_end(stream_elem * elem_p, char * buf, const xml_token * tok_p, size_t depth, const char * name, char ** text_pp) {
+  if (text_pp) {
+    *text_pp = (void *) 0;
+  }
+
+  if (!elem_p->open || elem_p->depth != depth) {
+    return 0;
+  }
+
+  if (!xml_token_name_is(buf, tok_p, name)) {
+    return OMEMO_ERR_MALFORMED_XML;
+  }
+
+  elem_p->open = false;
+  elem_p->end = tok_p->end;
+
+  if (text_pp && tok_p->start != elem_p->text_start) {
+    buf[tok_p->start] = '\0';
+    *text_pp = buf + elem_p->text_start;
+  }
+
+  return 0;
+}
+
+/**
+ * Null-terminates attribute values in place by overwriting their closing quotes.
+ * All values are looked up first, as a terminated value cannot be skipped anymore.
+ *
+ * @param buf The stanza.
+ * @param tok_p Pointer to the start tag token.
+ * @param names The names of the attributes.
+ * @param vals Will be set to the values, or NULL for missing attributes.
+ * @param amount The amount of attributes.
+ */
+static void stream_attrs_terminate(char * buf, const xml_token * tok_p, const char * const * names, const char ** vals, size_t amount) {
+  size_t val_starts[2];
+  size_t val_lens[2];
+  bool found[2];
+
+  for (size_t i = 0; i < amount; i++) {
+    found[i] = xml_token_get_attr(buf, tok_p, names[i], &val_starts[i], &val_lens[i]);
+  }
+
+  for (size_t i = 0; i < amount; i++) {
+    vals[i] = (void *) 0;
+    if (found[i]) {
+      buf[val_starts[i] + val_lens[i]] = '\0';
+      vals[i] = buf + val_starts[i];
+    }
+  }
+}
+
+static char * stream_attr_dup(const char * buf, const xml_token * tok_p, const char * name, int * ret_val_p) {
+  size_t val_start = 0;
+  size_t val_len = 0;
+  char * val_p = (void *) 0;
+
+  if (!xml_token_get_attr(buf, tok_p, name, &val_start, &val_len)) {
+    return (void *) 0;
+  }
+
+  val_p = xml_unescape_dup(buf + val_start, val_len);
+  if (!val_p) {
+    *ret_val_p = OMEMO_ERR_NOMEM;
+  }
+
+  return val_p;
+}
+
+int omemo_message_prepare_decryption_streaming(const char * incoming_message, omemo_message ** msg_pp) {
+  if (!incoming_message || !msg_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  omemo_message * msg_p = (void *) 0;
+  char * buf = (void *) 0;
+  size_t len = strlen(incoming_message);
+  size_t pos = 0;
+  size_t depth = 0;
+  int tok_ret = 0;
+  bool root_seen = false;
+  bool root_done = false;
+  xml_token tok;
+  stream_elem body = {0}, eme = {0}, store = {0}, encrypted = {0}, header = {0}, key = {0}, iv = {0}, payload = {0};
+  uint32_t key_rid = 0;
+  bool key_rid_valid = false;
+  bool key_prekey = false;
+  char * text_p = (void *) 0;
+  const char * const key_attr_names[] = {KEY_NODE_RID_ATTR_NAME, KEY_NODE_PREKEY_ATTR_NAME};
+  const char * key_attr_vals[2];
+
+  msg_p = malloc(sizeof(omemo_message));
+  if (!msg_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  memset(msg_p, 0, sizeof(omemo_message));
+
+  buf = malloc(len + 1);
+  if (!buf) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  memcpy(buf, incoming_message, len + 1);
+  msg_p->stanza_p = buf;
+  msg_p->stanza_len = len;
+
+  ret_val = key_index_init(msg_p, 16);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  while ((tok_ret = xml_next_token(buf, len, &pos, &tok)) > 0) {
+    if (tok.type == XML_TOKEN_START || tok.type == XML_TOKEN_EMPTY) {
+      if (depth == 0) {
+        if (root_seen) {
+          ret_val = OMEMO_ERR_MALFORMED_XML;
+          goto cleanup;
+        }
+        root_seen = true;
+
+        msg_p->from = stream_attr_dup(buf, &tok, MESSAGE_NODE_FROM_ATTR_NAME, &ret_val);
+        msg_p->to = stream_attr_dup(buf, &tok, MESSAGE_NODE_TO_ATTR_NAME, &ret_val);
+        if (ret_val) {
+          goto cleanup;
+        }
+      }
+
+      // same elements as found by mxmlFindPath() in the DOM variant, i.e. the first one in document order
+      if (depth == 0) {
+        // the root element itself is never cut out
+      } else if (!body.seen && xml_token_name_is(buf, &tok, BODY_NODE_NAME)) {
+        stream_elem_begin(&body, &tok, depth);
+      } else if (!eme.seen && xml_token_name_is(buf, &tok, EME_NODE_NAME)) {
+        stream_elem_begin(&eme, &tok, depth);
+      } else if (!store.seen && xml_token_name_is(buf, &tok, STORE_NODE_NAME)) {
+        stream_elem_begin(&store, &tok, depth);
+      } else if (!encrypted.seen && xml_token_name_is(buf, &tok, ENCRYPTED_NODE_NAME)) {
+        stream_elem_begin(&encrypted, &tok, depth);
+      } else if (encrypted.open) {
+        // everything in here is cut out on export, so it can be modified in place
+        if (!header.seen && xml_token_name_is(buf, &tok, HEADER_NODE_NAME)) {
+          stream_elem_begin(&header, &tok, depth);
+          stream_attrs_terminate(buf, &tok, (const char * const []) {HEADER_NODE_SID_ATTR_NAME}, &msg_p->sid, 1);
+        } else if (header.open && depth == header.depth + 1 && xml_token_name_is(buf, &tok, KEY_NODE_NAME)) {
+          stream_elem_begin(&key, &tok, depth);
+          stream_attrs_terminate(buf, &tok, key_attr_names, key_attr_vals, 2);
+          key_rid_valid = !key_rid_parse(key_attr_vals[0], &key_rid);
+          key_prekey = key_prekey_attr_is_true(key_attr_vals[1]);
+          if (!key.open && key_rid_valid) {
+            ret_val = key_index_insert(msg_p, key_rid, key_prekey, (void *) 0);
+          }
+        } else if (header.open && !iv.seen && xml_token_name_is(buf, &tok, IV_NODE_NAME)) {
+          stream_elem_begin(&iv, &tok, depth);
+        } else if (!payload.seen && xml_token_name_is(buf, &tok, PAYLOAD_NODE_NAME)) {
+          stream_elem_begin(&payload, &tok, depth);
+        }
+      }
+
+      if (ret_val) {
+        goto cleanup;
+      }
+
+      if (tok.type == XML_TOKEN_START) {
+        depth++;
+      } else if (depth == 0) {
+        root_done = true;
+      }
+    } else if (tok.type == XML_TOKEN_END) {
+      if (depth == 0) {
+        ret_val = OMEMO_ERR_MALFORMED_XML;
+        goto cleanup;
+      }
+      depth--;
+
+      bool key_ends = key.open && key.depth == depth;
+      bool iv_ends = iv.open && iv.depth == depth;
+      bool payload_ends = payload.open && payload.depth == depth;
+
+      if (stream_elem_end(&body, buf, &tok, depth, BODY_NODE_NAME, (void *) 0)
+          || stream_elem_end(&eme, buf, &tok, depth, EME_NODE_NAME, (void *) 0)
+          || stream_elem_end(&store, buf, &tok, depth, STORE_NODE_NAME, (void *) 0)
+          || stream_elem_end(&encrypted, buf, &tok, depth, ENCRYPTED_NODE_NAME, (void *) 0)
+          || stream_elem_end(&header, buf, &tok, depth, HEADER_NODE_NAME, (void *) 0)
+          || stream_elem_end(&key, buf, &tok, depth, KEY_NODE_NAME, &text_p)
+          || stream_elem_end(&iv, buf, &tok, depth, IV_NODE_NAME, iv_ends ? (char **) &msg_p->iv_b64 : (void *) 0)
+          || stream_elem_end(&payload, buf, &tok, depth, PAYLOAD_NODE_NAME, payload_ends ? (char **) &msg_p->payload_b64 : (void *) 0)) {
+        ret_val = OMEMO_ERR_MALFORMED_XML;
+        goto cleanup;
+      }
+
+      if (key_ends && key_rid_valid) {
+        ret_val = key_index_insert(msg_p, key_rid, key_prekey, text_p);
+        if (ret_val) {
+          goto cleanup;
+        }
+      }
+
+      if (depth == 0) {
+        msg_p->root_end_tag_pos = tok.start;
+        root_done = true;
+      }
+    } else if (tok.type == XML_TOKEN_TEXT && depth == 0 && root_done) {
+      // only whitespace may follow the root element
+      for (size_t i = tok.start; i < tok.end; i++) {
+        if (!xml_is_space(buf[i])) {
+          ret_val = OMEMO_ERR_MALFORMED_XML;
+          goto cleanup;
+        }
+      }
+    }
+  }
+  if (tok_ret) {
+    ret_val = tok_ret;
+    goto cleanup;
+  }
+
+  if (!root_done || depth != 0) {
+    ret_val = OMEMO_ERR_MALFORMED_XML;
+    goto cleanup;
+  }
+
+  if (!encrypted.seen) {
+    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_ENCRYPTED_ELEM;
+    goto cleanup;
+  }
+
+  if (!header.seen) {
+    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_HEADER_ELEM;
+    goto cleanup;
+  }
+
+  // the elements are collected in document order, so sorting is a simple insertion sort
+  stream_elem * cut_elems[] = {&body, &eme, &store, &encrypted};
+  for (size_t i = 0; i < sizeof(cut_elems) / sizeof(cut_elems[0]); i++) {
+    if (!cut_elems[i]->seen) {
+      continue;
+    }
+
+    size_t j = msg_p->cuts_amount;
+    while (j > 0 && msg_p->cuts[j - 1].start > cut_elems[i]->start) {
+      msg_p->cuts[j] = msg_p->cuts[j - 1];
+      j--;
+    }
+    msg_p->cuts[j].start = cut_elems[i]->start;
+    msg_p->cuts[j].end = cut_elems[i]->end;
+    msg_p->cuts_amount++;
+  }
+
+  *msg_pp = msg_p;
+
+cleanup:
+  if (ret_val) {
+    if (ret_val == OMEMO_ERR_MALFORMED_XML) {
+      log_err("incoming message is invalid XML: %s", incoming_message);
+    }
+    omemo_message_destroy(msg_p);
+  }
+
+  return ret_val;
+}
+
+int omemo_message_has_payload(omemo_message * msg_p) {
+  return (msg_p->payload_node_p || msg_p->payload_b64) ? 1 : 0;
+}
+
+uint32_t omemo_message_get_sender_id(omemo_message * msg_p) {
+  const char * sid_string = msg_p->stanza_p ? msg_p->sid : mxmlElementGetAttr(msg_p->header_node_p, HEADER_NODE_SID_ATTR_NAME);
+  return sid_string ? strtol(sid_string, (void *) 0, 0) : 0;
+}
+
+static char * jid_strip_resource(const char * full_jid) {
+  char ** split = (void *) 0;
+  split = g_strsplit(full_jid, "/", -1);
+  char * ret = g_strndup(split[0], strlen(split[0]));
+
+  g_strfreev(split);
+
+  return ret;
+}
+
+const char * omemo_message_get_sender_name_full(omemo_message * msg_p) {
+  return msg_p->stanza_p ? msg_p->from : mxmlElementGetAttr(msg_p->message_node_p, MESSAGE_NODE_FROM_ATTR_NAME);
+}
+
+char * omemo_message_get_sender_name_bare(omemo_message * msg_p) {
+  return jid_strip_resource(omemo_message_get_sender_name_full(msg_p));
+}
+
+const char * omemo_message_get_recipient_name_full(omemo_message * msg_p) {
+  return msg_p->stanza_p ? msg_p->to : mxmlElementGetAttr(msg_p->message_node_p, MESSAGE_NODE_TO_ATTR_NAME);
+}
+
+char * omemo_message_get_recipient_name_bare(omemo_message * msg_p) {
+  return jid_strip_resource(omemo_message_get_recipient_name_full(msg_p));
+}
+
+int omemo_message_get_encrypted_key(omemo_message * msg_p, uint32_t own_device_id, uint8_t ** key_pp, size_t * key_len_p ) {
+  if (!msg_p || !key_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  const omemo_key_index_entry * entry_p = (void *) 0;
+  const char * key_b64 = (void *) 0;
+  uint8_t * key_p = (void *) 0;
+  size_t key_len = 0;
+
+  ret_val = omemo_message_find_key_entry(msg_p, own_device_id, &entry_p);
+  if (ret_val || !entry_p) {
+    goto cleanup;
+  }
+
+  key_b64 = entry_p->key_b64;
+  if (!key_b64) {
+    *key_pp = (void *) 0;
+    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_KEY_DATA;
+    goto cleanup;
+  }
+
+  ret_val = omemo_b64_decode(key_b64, &key_p, &key_len);
+
+cleanup:
+  *key_pp = key_p;
+  *key_len_p = key_len;
+  
+  return ret_val;
+}
+
+int omemo_message_is_encrypted_key_prekey(omemo_message * msg_p, uint32_t key_id, bool * is_prekey_p) {
+  if (!msg_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  const omemo_key_index_entry * entry_p = (void *) 0;
+
+  ret_val = omemo_message_find_key_entry(msg_p, key_id, &entry_p);
+  if (ret_val || !entry_p) {
+    *is_prekey_p = false;
+    goto cleanup;
+  }
+
+  *is_prekey_p = entry_p->prekey;
+
+cleanup:
+  return ret_val;
+}
+
+/**
+ * Writes the stanza of a streamed message with the OMEMO elements cut out and a body with the plaintext appended.
+ *
+ * @param msg_p Pointer to a message from omemo_message_prepare_decryption_streaming().
+ * @param pt_str The plaintext, not yet escaped.
+ * @param xml_pp Will be set to the resulting stanza, free() it when done.
+ * @return 0 on success, negative on error.
+ */
+static int message_stream_export(const omemo_message * msg_p, const char * pt_str, char ** xml_pp) {
+  static const char body_start[] = "<" BODY_NODE_NAME ">";
+  static const char body_end[] = "</" BODY_NODE_NAME ">";
+
+  const char * stanza_p = msg_p->stanza_p;
+  size_t out_len = 0;
+  size_t pos = 0;
+  char * out_p = (void *) 0;
+  char * w_p = (void *) 0;
+
+  // first pass only computes the size, so the result can be allocated at once
+  for (size_t i = 0; i <= msg_p->cuts_amount; i++) {
+    size_t next = (i < msg_p->cuts_amount) ? msg_p->cuts[i].start : msg_p->root_end_tag_pos;
+    if (next > pos) {
+      out_len += next - pos;
+    }
+    if (i < msg_p->cuts_amount && msg_p->cuts[i].end > pos) {
+      pos = msg_p->cuts[i].end;
+    }
+  }
+  out_len += strlen(body_start) + strlen(body_end) + (msg_p->stanza_len - msg_p->root_end_tag_pos);
+  for (const char * c_p = pt_str; *c_p; c_p++) {
+    const char * entity = xml_escape_entity(*c_p);
+    out_len += entity ? strlen(entity) : 1;
+  }
 
-  if (body_node_p) {
-    mxmlDelete(body_node_p);
+  out_p = malloc(out_len + 1);
+  if (!out_p) {
+    return OMEMO_ERR_NOMEM;
   }
+  w_p = out_p;
 
-  if (eme_node_p) {
-    mxmlDelete(eme_node_p);
+  // cuts are sorted by start and can only overlap if one element is inside another
+  pos = 0;
+  for (size_t i = 0; i <= msg_p->cuts_amount; i++) {
+    size_t next = (i < msg_p->cuts_amount) ? msg_p->cuts[i].start : msg_p->root_end_tag_pos;
+    if (next > pos) {
+      memcpy(w_p, stanza_p + pos, next - pos);
+      w_p += next - pos;
+    }
+    if (i < msg_p->cuts_amount && msg_p->cuts[i].end > pos) {
+      pos = msg_p->cuts[i].end;
+    }
   }
 
-  if (store_node_p) {
-    mxmlDelete(store_node_p);
+  memcpy(w_p, body_start, strlen(body_start));
+  w_p += strlen(body_start);
+  for (const char * c_p = pt_str; *c_p; c_p++) {
+    const char * entity = xml_escape_entity(*c_p);
+    if (entity) {
+      memcpy(w_p, entity, strlen(entity));
+      w_p += strlen(entity);
+    } else {
+      *w_p++ = *c_p;
+    }
   }
+  memcpy(w_p, body_end, strlen(body_end));
+  w_p += strlen(body_end);
 
-  mxmlRemove(header_node_p);
-  msg_p->header_node_p = header_node_p;
+  memcpy(w_p, stanza_p + msg_p->root_end_tag_pos, msg_p->stanza_len - msg_p->root_end_tag_pos);
+  w_p += msg_p->stanza_len - msg_p->root_end_tag_pos;
+  *w_p = '\0';
 
-  if (payload_node_p) {
-    payload_node_p = mxmlGetParent(payload_node_p);
-    mxmlRemove(payload_node_p);
-    msg_p->payload_node_p = payload_node_p;
+  *xml_pp = out_p;
+
+  return 0;
+}
+
+// decodes payload and IV of an incoming message, either from the tree or from the streamed stanza
+static int message_payload_decode(const omemo_message * msg_p, uint8_t ** payload_pp, size_t * payload_len_p, uint8_t ** iv_pp, size_t * iv_len_p) {
+  int ret_val = 0;
+
+  const char * payload_b64 = (void *) 0;
+  mxml_node_t * iv_node_p = (void *) 0;
+  const char * iv_b64 = (void *) 0;
+
+  payload_b64 = msg_p->stanza_p ? msg_p->payload_b64 : mxmlGetOpaque(msg_p->payload_node_p);
+  if (!payload_b64) {
+    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_PAYLOAD_DATA;
+    goto cleanup;
+  }
+  ret_val = omemo_b64_decode(payload_b64, payload_pp, payload_len_p);
+  if (ret_val) {
+    goto cleanup;
   }
 
-  mxmlDelete(encrypted_node_p);
-  msg_p->message_node_p = message_node_p;
+  if (msg_p->stanza_p) {
+    iv_b64 = msg_p->iv_b64;
+  } else {
+    iv_node_p = mxmlFindElement(msg_p->header_node_p, msg_p->header_node_p, IV_NODE_NAME, NULL, NULL, MXML_DESCEND);
+    if (!iv_node_p) {
+      ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_IV_ELEM;
+      goto cleanup;
+    }
 
-  *msg_pp = msg_p;
+    iv_b64 = mxmlGetOpaque(iv_node_p);
+  }
+  if (!iv_b64) {
+    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_IV_DATA;
+    goto cleanup;
+  }
+  ret_val = omemo_b64_decode(iv_b64, iv_pp, iv_len_p);
 
 cleanup:
   if (ret_val) {
-    mxmlDelete(message_node_p);
-    free(msg_p);
+    free(*payload_pp);
+    *payload_pp = (void *) 0;
   }
+
   return ret_val;
 }
 
-int omemo_message_has_payload(omemo_message * msg_p) {
-  return (msg_p->payload_node_p) ? 1 : 0;
-}
+// exports the original stanza with a body holding the plaintext
+static int message_export_plaintext(omemo_message * msg_p, const char * pt_str, char ** msg_xml_p) {
+  int ret_val = 0;
 
-uint32_t omemo_message_get_sender_id(omemo_message * msg_p) {
-  const char * sid_string = mxmlElementGetAttr(msg_p->header_node_p, HEADER_NODE_SID_ATTR_NAME);
-  return strtol(sid_string, (void *) 0, 0);
-}
+  mxml_node_t * body_node_p = (void *) 0;
+  char * xml = (void *) 0;
 
-static char * jid_strip_resource(const char * full_jid) {
-  char ** split = (void *) 0;
-  split = g_strsplit(full_jid, "/", -1);
-  char * ret = g_strndup(split[0], strlen(split[0]));
+  if (msg_p->stanza_p) {
+    return message_stream_export(msg_p, pt_str, msg_xml_p);
+  }
 
-  g_strfreev(split);
+  body_node_p = mxmlNewElement(MXML_NO_PARENT, BODY_NODE_NAME);
+  (void) mxmlNewText(body_node_p, 0, pt_str);
 
-  return ret;
-}
 
-const char * omemo_message_get_sender_name_full(omemo_message * msg_p) {
-  return mxmlElementGetAttr(msg_p->message_node_p, MESSAGE_NODE_FROM_ATTR_NAME);
-}
+  mxmlAdd(msg_p->message_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, body_node_p);
 
-char * omemo_message_get_sender_name_bare(omemo_message * msg_p) {
-  return jid_strip_resource(omemo_message_get_sender_name_full(msg_p));
-}
+  xml = mxmlSaveAllocString(msg_p->message_node_p, MXML_NO_CALLBACK);
+  if (!xml) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
 
-const char * omemo_message_get_recipient_name_full(omemo_message * msg_p) {
-  return mxmlElementGetAttr(msg_p->message_node_p, MESSAGE_NODE_TO_ATTR_NAME);
-}
+  *msg_xml_p = xml;
 
-char * omemo_message_get_recipient_name_bare(omemo_message * msg_p) {
-  return jid_strip_resource(omemo_message_get_recipient_name_full(msg_p));
+cleanup:
+  mxmlDelete(body_node_p);
+
+  return ret_val;
 }
 
-// Finds the key element for the given recipient device ID.
-static int omemo_message_find_key_element(omemo_message * msg_p, uint32_t rid, mxml_node_t ** key_node_pp) {
-  if (!msg_p || !key_node_pp) {
+int omemo_message_export_decrypted(omemo_message * msg_p, uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p, char ** msg_xml_p) {
+  if (!msg_p || !key_p || !crypto_p || !msg_xml_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  if (!msg_p->stanza_p && (!msg_p->header_node_p || !msg_p->payload_node_p || !msg_p->message_node_p)) {
     return OMEMO_ERR_NULL;
   }
 
   int ret_val = 0;
-  mxml_node_t * key_node_p = (void *) 0;
-  char * rid_string = (void *) 0;
 
-  key_node_p = mxmlFindElement(msg_p->header_node_p, msg_p->header_node_p, KEY_NODE_NAME, NULL, NULL, MXML_DESCEND);
-  if (!key_node_p) {
-    // if there is not at least one key, skip the rest of the function
-    ret_val = 0;
-    *key_node_pp = (void *) 0;
+  uint8_t * payload_p = (void *) 0;
+  size_t payload_len = 0;
+  uint8_t * iv_p = (void *) 0;
+  size_t iv_len = 0;
+  size_t pt_len = 0;
+  char * pt_str = (void *) 0;
+
+  ret_val = message_payload_decode(msg_p, &payload_p, &payload_len, &iv_p, &iv_len);
+  if (ret_val) {
     goto cleanup;
   }
 
-  if (int_to_string(rid, &rid_string) <= 0) {
-    ret_val = OMEMO_ERR_NOMEM;
+  ret_val = payload_decrypt(payload_p, payload_len, iv_p, iv_len, key_p, key_len, crypto_p, &pt_str, &pt_len);
+  if (ret_val) {
     goto cleanup;
   }
 
-  while (key_node_p) {
-    if (!strncmp(rid_string, mxmlElementGetAttr(key_node_p, KEY_NODE_RID_ATTR_NAME), strlen(rid_string))) {
-      *key_node_pp = key_node_p;
-        break;
-    }
-
-    ret_val = expect_next_node(key_node_p, mxmlGetNextSibling, KEY_NODE_NAME, &key_node_p);
-    if (ret_val) {
-      key_node_p = (void *) 0;
-      ret_val = 0;
-    }
-  }
+  ret_val = message_export_plaintext(msg_p, pt_str, msg_xml_p);
 
-  
 cleanup:
-  free(rid_string);
+  free(payload_p);
+  free(iv_p);
+  free(pt_str);
 
   return ret_val;
 }
 
-int omemo_message_get_encrypted_key(omemo_message * msg_p, uint32_t own_device_id, uint8_t ** key_pp, size_t * key_len_p ) {
-  if (!msg_p || !key_pp) {
+// decoded payload of a batch entry, kept until its plaintext is exported
+typedef struct decrypt_batch_item {
+  uint8_t * payload_p;
+  uint8_t * iv_p;
+  char * pt_str;
+  size_t pt_len;
+  omemo_aes_gcm_op * op_p; // NULL if it is not part of the provider batch
+} decrypt_batch_item;
+
+int omemo_message_export_decrypted_batch(omemo_decrypt_batch_entry * entries_p, size_t entries_len, const omemo_crypto_provider * crypto_p) {
+  if (!entries_p || !crypto_p) {
     return OMEMO_ERR_NULL;
   }
 
   int ret_val = 0;
 
-  mxml_node_t * key_node_p = (void *) 0;
-  const char * key_b64 = (void *) 0;
-  uint8_t * key_p = (void *) 0;
-  size_t key_len = 0;
+  decrypt_batch_item * items_p = (void *) 0;
+  omemo_aes_gcm_op * ops_p = (void *) 0;
+  size_t ops_len = 0;
 
-  ret_val = omemo_message_find_key_element(msg_p, own_device_id, &key_node_p);
-  if (ret_val || !key_node_p) {
-    goto cleanup;
+  for (size_t i = 0; i < entries_len; i++) {
+    entries_p[i].msg_xml = (void *) 0;
+    entries_p[i].status = 0;
   }
 
-  key_b64 = mxmlGetOpaque(key_node_p);
-  if (!key_b64) {
-    *key_pp = (void *) 0;
-    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_KEY_DATA;
+  items_p = malloc(sizeof(decrypt_batch_item) * (entries_len ? entries_len : 1));
+  if (crypto_p->aes_gcm_decrypt_batch_func) {
+    ops_p = malloc(sizeof(omemo_aes_gcm_op) * (entries_len ? entries_len : 1));
+  }
+  if (!items_p || (crypto_p->aes_gcm_decrypt_batch_func && !ops_p)) {
+    for (size_t i = 0; i < entries_len; i++) {
+      entries_p[i].status = OMEMO_ERR_NOMEM;
+    }
+    ret_val = OMEMO_ERR_NOMEM;
     goto cleanup;
   }
+  memset(items_p, 0, sizeof(decrypt_batch_item) * (entries_len ? entries_len : 1));
+
+  for (size_t i = 0; i < entries_len; i++) {
+    omemo_decrypt_batch_entry * entry_p = &entries_p[i];
+    decrypt_batch_item * item_p = &items_p[i];
+    size_t payload_len = 0;
+    size_t iv_len = 0;
+    size_t ct_len = 0;
+    size_t aes_key_len = 0;
+    const uint8_t * tag_p = (void *) 0;
+
+    if (!entry_p->msg_p || !entry_p->key_p
+        || (!entry_p->msg_p->stanza_p && (!entry_p->msg_p->header_node_p || !entry_p->msg_p->payload_node_p || !entry_p->msg_p->message_node_p))) {
+      entry_p->status = OMEMO_ERR_NULL;
+      continue;
+    }
+
+    entry_p->status = message_payload_decode(entry_p->msg_p, &item_p->payload_p, &payload_len, &item_p->iv_p, &iv_len);
+    if (entry_p->status) {
+      continue;
+    }
+
+    entry_p->status = payload_split_tag(item_p->payload_p, payload_len, entry_p->key_p, entry_p->key_len, &ct_len, &aes_key_len, &tag_p);
+    if (entry_p->status) {
+      continue;
+    }
+
+    item_p->pt_str = malloc(ct_len + 1);
+    if (!item_p->pt_str) {
+      entry_p->status = OMEMO_ERR_NOMEM;
+      continue;
+    }
+
+    if (!ops_p) {
+      entry_p->status = payload_decrypt_into(item_p->payload_p, payload_len, item_p->iv_p, iv_len, entry_p->key_p, entry_p->key_len,
+                                             crypto_p, (uint8_t *) item_p->pt_str, ct_len + 1, &item_p->pt_len);
+      continue;
+    }
+
+    item_p->op_p = &ops_p[ops_len++];
+    item_p->op_p->iv_p = item_p->iv_p;
+    item_p->op_p->iv_len = iv_len;
+    item_p->op_p->key_p = entry_p->key_p;
+    item_p->op_p->key_len = aes_key_len;
+    item_p->op_p->in_p = item_p->payload_p;
+    item_p->op_p->len = ct_len;
+    item_p->op_p->out_p = (uint8_t *) item_p->pt_str;
+    item_p->op_p->tag_p = (uint8_t *) tag_p;
+    item_p->op_p->tag_len = OMEMO_AES_GCM_TAG_LENGTH;
+    item_p->op_p->status = 0;
+  }
+
+  // the statuses of the operations are what counts, not the summary
+  if (ops_len) {
+    (void) crypto_p->aes_gcm_decrypt_batch_func(ops_p, ops_len, crypto_p->user_data_p);
+  }
+
+  for (size_t i = 0; i < entries_len; i++) {
+    omemo_decrypt_batch_entry * entry_p = &entries_p[i];
+    decrypt_batch_item * item_p = &items_p[i];
+
+    if (item_p->op_p) {
+      entry_p->status = item_p->op_p->status;
+      if (!entry_p->status) {
+        item_p->pt_len = item_p->op_p->len;
+        item_p->pt_str[item_p->pt_len] = '\0';
+      }
+    }
+
+    if (!entry_p->status) {
+      entry_p->status = message_export_plaintext(entry_p->msg_p, item_p->pt_str, &entry_p->msg_xml);
+    }
 
-  key_p = g_base64_decode(key_b64, &key_len);
+    if (entry_p->status && !ret_val) {
+      ret_val = entry_p->status;
+    }
+  }
 
 cleanup:
-  *key_pp = key_p;
-  *key_len_p = key_len;
-  
+  if (items_p) {
+    for (size_t i = 0; i < entries_len; i++) {
+      free(items_p[i].payload_p);
+      free(items_p[i].iv_p);
+      if (items_p[i].pt_str) {
+        memset(items_p[i].pt_str, 0, items_p[i].pt_len);
+        free(items_p[i].pt_str);
+      }
+    }
+    free(items_p);
+  }
+  free(ops_p);
+
   return ret_val;
 }
 
-int omemo_message_is_encrypted_key_prekey(omemo_message * msg_p, uint32_t key_id, bool * is_prekey_p) {
-  if (!msg_p) {
+static bool message_is_decryptable(const omemo_message * msg_p) {
+  return msg_p->stanza_p || (msg_p->header_node_p && msg_p->payload_node_p);
+}
+
+int omemo_message_decrypt_body(omemo_message * msg_p, const uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p, char ** body_pp, size_t * body_len_p) {
+  if (!msg_p || !key_p || !crypto_p || !body_pp || !body_len_p) {
     return OMEMO_ERR_NULL;
   }
 
-  int ret_val = 0;
-  mxml_node_t * key_node_p = (void *) 0;
-  const char * prekey_attr_val = (void *) 0;
-
-  ret_val = omemo_message_find_key_element(msg_p, key_id, &key_node_p);
-  if (ret_val || !key_node_p) {
-    *is_prekey_p = false;
-    goto cleanup;
+  if (!message_is_decryptable(msg_p)) {
+    return OMEMO_ERR_NULL;
   }
 
+  int ret_val = 0;
 
-  prekey_attr_val = mxmlElementGetAttr(key_node_p, KEY_NODE_PREKEY_ATTR_NAME);
-  if (prekey_attr_val) {
-    // according to https://www.w3.org/TR/xmlschema-2/#boolean "1" can also be a boolean that means true
-    if (!strncmp(prekey_attr_val, KEY_NODE_PREKEY_ATTR_VAL_TRUE, strlen(KEY_NODE_PREKEY_ATTR_VAL_TRUE)) || !strncmp(prekey_attr_val, "1", strlen("1"))) {
-      *is_prekey_p = true;
-      goto cleanup;
-    }
+  uint8_t * payload_p = (void *) 0;
+  size_t payload_len = 0;
+  uint8_t * iv_p = (void *) 0;
+  size_t iv_len = 0;
+
+  ret_val = message_payload_decode(msg_p, &payload_p, &payload_len, &iv_p, &iv_len);
+  if (ret_val) {
+    goto cleanup;
   }
 
-  *is_prekey_p = false;
+  ret_val = payload_decrypt(payload_p, payload_len, iv_p, iv_len, key_p, key_len, crypto_p, body_pp, body_len_p);
 
 cleanup:
+  free(payload_p);
+  free(iv_p);
+
   return ret_val;
 }
 
-int omemo_message_export_decrypted(omemo_message * msg_p, uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p, char ** msg_xml_p) {
-  if (!msg_p || !msg_p->header_node_p || !msg_p->payload_node_p || !msg_p->message_node_p || !key_p || !crypto_p || !msg_xml_p) {
+int omemo_message_decrypt_body_into(omemo_message * msg_p, const uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p,
+                                    char * body_p, size_t body_size, size_t * body_len_p) {
+  if (!msg_p || !key_p || !crypto_p || !body_p || !body_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  if (!message_is_decryptable(msg_p)) {
     return OMEMO_ERR_NULL;
   }
 
   int ret_val = 0;
 
-  const char * payload_b64 = (void *) 0;
   uint8_t * payload_p = (void *) 0;
   size_t payload_len = 0;
-  mxml_node_t * iv_node_p = (void *) 0;
-  const char * iv_b64 = (void *) 0;
   uint8_t * iv_p = (void *) 0;
   size_t iv_len = 0;
-  size_t key_len_actual = 0;
-  size_t payload_len_actual = 0;
-  uint8_t * tag_p = (void *) 0;
-  uint8_t * pt_p = (void *) 0;
-  size_t pt_len = 0;
-  char * pt_str = (void *) 0;
-  mxml_node_t * body_node_p = (void *) 0;
-  char * xml = (void *) 0;
 
-  payload_b64 = mxmlGetOpaque(msg_p->payload_node_p);
-  if (!payload_b64) {
-    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_PAYLOAD_DATA;
+  ret_val = message_payload_decode(msg_p, &payload_p, &payload_len, &iv_p, &iv_len);
+  if (ret_val) {
     goto cleanup;
   }
-  payload_p = g_base64_decode(payload_b64, &payload_len);
 
-  iv_node_p = mxmlFindElement(msg_p->header_node_p, msg_p->header_node_p, IV_NODE_NAME, NULL, NULL, MXML_DESCEND);
-  if (!iv_node_p) {
-    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_IV_ELEM;
-    goto cleanup;
+  ret_val = payload_decrypt_into(payload_p, payload_len, iv_p, iv_len, key_p, key_len, crypto_p,
+                                 (uint8_t *) body_p, body_size, body_len_p);
+
+cleanup:
+  free(payload_p);
+  free(iv_p);
+
+  return ret_val;
+}
+
+void omemo_message_destroy(omemo_message * msg_p) {
+  if (msg_p) {
+    mxmlDelete(msg_p->message_node_p);
+    mxmlDelete(msg_p->header_node_p);
+    mxmlDelete(msg_p->payload_node_p);
+    memset(msg_p->key_material, 0, sizeof(msg_p->key_material));
+    key_index_free(msg_p);
+    free(msg_p->stanza_p);
+    free(msg_p->from);
+    free(msg_p->to);
+    free(msg_p);
   }
+}
 
-  iv_b64 = mxmlGetOpaque(iv_node_p);
-  if (!iv_b64) {
-    ret_val = OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_IV_DATA;
-    goto cleanup;
+int omemo_message_encrypt_raw(const uint8_t * plaintext_p, size_t plaintext_len, uint32_t sender_device_id, const omemo_crypto_provider * crypto_p, omemo_raw_message ** raw_pp) {
+  if (!plaintext_p || !crypto_p || (!crypto_p->random_bytes_func && !crypto_p->random_bytes_into_func) || !crypto_p->aes_gcm_encrypt_func || !raw_pp) {
+    return OMEMO_ERR_NULL;
   }
-  iv_p = g_base64_decode(iv_b64, &iv_len);
 
-  if (key_len == OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH) {
-    key_len_actual = OMEMO_AES_128_KEY_LENGTH;
-    payload_len_actual = payload_len;
-    tag_p = key_p + OMEMO_AES_128_KEY_LENGTH;
-  } else if (key_len == OMEMO_AES_128_KEY_LENGTH) {
-    key_len_actual = key_len;
-    payload_len_actual = payload_len - OMEMO_AES_GCM_TAG_LENGTH;
-    tag_p = payload_p + (payload_len - OMEMO_AES_GCM_TAG_LENGTH);
-  } else {
-    ret_val = OMEMO_ERR_UNSUPPORTED_KEY_LEN;
+  int ret_val = 0;
+
+  omemo_raw_message * raw_p = (void *) 0;
+  uint8_t random[OMEMO_AES_GCM_IV_LENGTH + OMEMO_AES_128_KEY_LENGTH];
+
+  raw_p = malloc(sizeof(omemo_raw_message));
+  if (!raw_p) {
+    ret_val = OMEMO_ERR_NOMEM;
     goto cleanup;
   }
+  memset(raw_p, 0, sizeof(omemo_raw_message));
+  raw_p->sender_device_id = sender_device_id;
 
-  ret_val = crypto_p->aes_gcm_decrypt_func(payload_p, payload_len_actual,
-                                           iv_p, iv_len,
-                                           key_p, key_len_actual,
-                                           tag_p, OMEMO_AES_GCM_TAG_LENGTH,
-                                           crypto_p->user_data_p,
-                                           &pt_p, &pt_len);
+  ret_val = random_bytes_fill(crypto_p, random, sizeof(random));
   if (ret_val) {
     goto cleanup;
   }
+  memcpy(raw_p->iv, random, OMEMO_AES_GCM_IV_LENGTH);
+  memcpy(raw_p->key, random + OMEMO_AES_GCM_IV_LENGTH, OMEMO_AES_128_KEY_LENGTH);
 
-  pt_str = malloc(pt_len + 1);
-  if (!pt_str) {
-    ret_val = OMEMO_ERR_NOMEM;
+  ret_val = payload_encrypt(plaintext_p, plaintext_len, raw_p->iv, raw_p->key, crypto_p,
+                            &raw_p->ciphertext_p, &raw_p->ciphertext_len, raw_p->key + OMEMO_AES_128_KEY_LENGTH);
+  if (ret_val) {
     goto cleanup;
   }
-  memcpy(pt_str, pt_p, pt_len);
-  pt_str[pt_len] = '\0';
 
-  body_node_p = mxmlNewElement(MXML_NO_PARENT, BODY_NODE_NAME);
-  (void) mxmlNewText(body_node_p, 0, pt_str);
+  *raw_pp = raw_p;
 
+cleanup:
+  if (ret_val) {
+    omemo_raw_message_destroy(raw_p);
+  }
+  memset(random, 0, sizeof(random));
 
-  mxmlAdd(msg_p->message_node_p, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, body_node_p);
+  return ret_val;
+}
 
-  xml = mxmlSaveAllocString(msg_p->message_node_p, MXML_NO_CALLBACK);
-  if (!xml) {
-    ret_val = OMEMO_ERR_NOMEM;
-    goto cleanup;
+int omemo_raw_message_add_recipient(omemo_raw_message * raw_p, uint32_t device_id, bool prekey, const uint8_t * encrypted_key_p, size_t key_len) {
+  if (!raw_p || !encrypted_key_p) {
+    return OMEMO_ERR_NULL;
   }
 
-  *msg_xml_p = xml;
+  if (raw_p->recipients_len == raw_p->recipients_cap) {
+    size_t cap = raw_p->recipients_cap ? raw_p->recipients_cap * 2 : 8;
+    omemo_raw_recipient * recipients_p = realloc(raw_p->recipients_p, sizeof(omemo_raw_recipient) * cap);
+    if (!recipients_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    raw_p->recipients_p = recipients_p;
+    raw_p->recipients_cap = cap;
+  }
 
-cleanup:
-  g_free(payload_p);
-  g_free(iv_p);
-  free(pt_p);
-  free(pt_str);
-  mxmlDelete(body_node_p);
+  uint8_t * key_copy_p = malloc(sizeof(uint8_t) * (key_len ? key_len : 1));
+  if (!key_copy_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memcpy(key_copy_p, encrypted_key_p, key_len);
 
-  return ret_val;
+  omemo_raw_recipient * recipient_p = &raw_p->recipients_p[raw_p->recipients_len++];
+  recipient_p->device_id = device_id;
+  recipient_p->prekey = prekey;
+  recipient_p->encrypted_key_p = key_copy_p;
+  recipient_p->encrypted_key_len = key_len;
+
+  return 0;
 }
 
-void omemo_message_destroy(omemo_message * msg_p) {
-  if (msg_p) {
-    mxmlDelete(msg_p->message_node_p);
-    mxmlDelete(msg_p->header_node_p);
-    mxmlDelete(msg_p->payload_node_p);
-    if (msg_p->key_p) {
-      memset(msg_p->key_p, 0, msg_p->key_len);
-      free(msg_p->key_p);
-    }
-    if (msg_p->iv_p) {
-      memset(msg_p->iv_p, 0, msg_p->iv_len);
-      free(msg_p->iv_p);
+void omemo_raw_message_destroy(omemo_raw_message * raw_p) {
+  if (raw_p) {
+    for (size_t i = 0; i < raw_p->recipients_len; i++) {
+      free(raw_p->recipients_p[i].encrypted_key_p);
     }
+    free(raw_p->recipients_p);
+    free(raw_p->ciphertext_p);
+    memset(raw_p->key, 0, sizeof(raw_p->key));
+    free(raw_p);
+  }
+}
+
+int omemo_message_decrypt_raw(const uint8_t * ciphertext_p, size_t ciphertext_len,
+                              const uint8_t * iv_p, size_t iv_len,
+                              const uint8_t * key_p, size_t key_len,
+                              const omemo_crypto_provider * crypto_p,
+                              uint8_t ** plaintext_pp, size_t * plaintext_len_p) {
+  if (!ciphertext_p || !iv_p || !key_p || !crypto_p || !crypto_p->aes_gcm_decrypt_func || !plaintext_pp || !plaintext_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  char * pt_str = (void *) 0;
+  size_t pt_len = 0;
+
+  int ret_val = payload_decrypt(ciphertext_p, ciphertext_len, iv_p, iv_len, key_p, key_len, crypto_p, &pt_str, &pt_len);
+  if (ret_val) {
+    return ret_val;
   }
+
+  *plaintext_pp = (uint8_t *) pt_str;
+  *plaintext_len_p = pt_len;
+
+  return 0;
 }
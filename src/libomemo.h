@@ -1,5 +1,5 @@
 /**
- * LIBOMEMO 0.8.1
+ * LIBOMEMO 1.0.0
  */
 
 
@@ -14,6 +14,27 @@ typedef struct omemo_bundle omemo_bundle;
 typedef struct omemo_devicelist omemo_devicelist;
 typedef struct omemo_message omemo_message;
 
+/**
+ * One AES-GCM operation of a batch, as passed to the batch functions of the crypto provider.
+ */
+typedef struct omemo_aes_gcm_op {
+  const uint8_t * iv_p;
+  size_t iv_len;
+  const uint8_t * key_p;
+  size_t key_len;
+  const uint8_t * in_p; // the plaintext when encrypting, the ciphertext when decrypting
+  size_t len;           // length of the input, which is also the length of the output
+  uint8_t * out_p;      // buffer of len bytes the output is written to, can be the same as in_p
+  uint8_t * tag_p;      // written to when encrypting, checked when decrypting
+  size_t tag_len;
+  int status;           // set to 0 on success, negative on error
+} omemo_aes_gcm_op;
+
+/**
+ * The functions the library uses for random bytes and AES-GCM.
+ * Members marked as optional are checked for NULL, so start from a zeroed struct
+ * (e.g. with memset() or an initializer) and only set the ones provided.
+ */
 typedef struct omemo_crypto_provider {
   /**
    * Gets cryptographically strong preudo-random bytes.
@@ -76,6 +97,98 @@ typedef struct omemo_crypto_provider {
    * Pointer to the user data that will be passed to the functions.
    */
   void * user_data_p;
+
+  /**
+   * Optional. Encrypts a byte buffer into caller-supplied buffers instead of allocating them.
+   * Since 1.0.0, earlier versions of the struct end before it.
+   * If set, it is used instead of aes_gcm_encrypt_func.
+   * The ciphertext has the same length as the plaintext, and encrypting in place (ciphertext_p == plaintext_p) must work.
+   *
+   * @param plaintext_p Pointer to the plaintext buffer.
+   * @param plaintext_len The length of the buffer.
+   * @param iv_p Pointer to the IV buffer.
+   * @param iv_len Length of the IV buffer.
+   * @param key_p Pointer to the key buffer.
+   * @param key_len Length of the key buffer.
+   * @param user_data_p Pointer to the user data set in the crypto provider.
+   * @param ciphertext_p Pointer to a buffer of plaintext_len bytes the ciphertext is written to.
+   * @param tag_p Pointer to a buffer of tag_len bytes the tag is written to.
+   * @param tag_len Length of the tag to generate.
+   * @return 0 on success, negative on error.
+   */
+  int (*aes_gcm_encrypt_into_func)(const uint8_t * plaintext_p, size_t plaintext_len,
+                                   const uint8_t * iv_p, size_t iv_len,
+                                   const uint8_t * key_p, size_t key_len,
+                                   void * user_data_p,
+                                   uint8_t * ciphertext_p,
+                                   uint8_t * tag_p, size_t tag_len);
+
+  /**
+   * Optional. Decrypts a ciphertext byte buffer into a caller-supplied buffer instead of allocating it.
+   * Since 1.0.0, earlier versions of the struct end before it.
+   * If set, it is used instead of aes_gcm_decrypt_func.
+   * The plaintext has the same length as the ciphertext, and decrypting in place (plaintext_p == ciphertext_p) must work.
+   * If the tag does not match, the output buffer must not contain any plaintext afterwards.
+   *
+   * @param ciphertext_p Pointer to the ciphertext buffer.
+   * @param ciphertext_len Length of the ciphertext buffer.
+   * @param iv_p Pointer to the IV buffer.
+   * @param iv_len Length of the IV buffer.
+   * @param key_p Pointer to the key buffer.
+   * @param key_len Length of the key buffer.
+   * @param tag_p Pointer to the tag buffer.
+   * @param tag_len Length of the tag buffer.
+   * @param user_data_p Pointer to the user data set in the crypto provider.
+   * @param plaintext_p Pointer to a buffer of ciphertext_len bytes the plaintext is written to.
+   * @return 0 on success, OMEMO_ERR_AUTH_FAIL if the tag does not match, negative on other errors.
+   */
+  int (*aes_gcm_decrypt_into_func)(const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                   const uint8_t * iv_p, size_t iv_len,
+                                   const uint8_t * key_p, size_t key_len,
+                                   const uint8_t * tag_p, size_t tag_len,
+                                   void * user_data_p,
+                                   uint8_t * plaintext_p);
+
+  /**
+   * Optional. Fills a caller-supplied buffer with cryptographically strong pseudo-random bytes.
+   * Since 1.0.0, earlier versions of the struct end before it.
+   * If set, it is used instead of random_bytes_func.
+   *
+   * @param buf_p Pointer to the buffer to fill.
+   * @param buf_len The length of the buffer.
+   * @param user_data_p Pointer to the user data set in the crypto provider.
+   * @return 0 on success, negative on error.
+   */
+  int (*random_bytes_into_func)(uint8_t * buf_p, size_t buf_len, void * user_data_p);
+
+  /**
+   * Optional. Encrypts several byte buffers with one call, each with its own key and IV.
+   * Since 1.0.0, earlier versions of the struct end before it.
+   * Not called by the library yet, as every message only has one payload to encrypt.
+   * The same rules as for aes_gcm_encrypt_into_func apply to each operation.
+   * A failing operation must not stop the others.
+   *
+   * @param ops_p Pointer to the array of operations. The status of each one is set.
+   * @param ops_len Length of the array.
+   * @param user_data_p Pointer to the user data set in the crypto provider.
+   * @return 0 if all operations succeeded, otherwise the status of the first one that failed.
+   */
+  int (*aes_gcm_encrypt_batch_func)(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
+
+  /**
+   * Optional. Decrypts several ciphertext byte buffers with one call, each with its own key and IV.
+   * Since 1.0.0, earlier versions of the struct end before it.
+   * If set, it is used by omemo_message_export_decrypted_batch().
+   * The same rules as for aes_gcm_decrypt_into_func apply to each operation,
+   * i.e. an operation whose tag does not match gets OMEMO_ERR_AUTH_FAIL and no plaintext in its output.
+   * A failing operation must not stop the others.
+   *
+   * @param ops_p Pointer to the array of operations. The status of each one is set.
+   * @param ops_len Length of the array.
+   * @param user_data_p Pointer to the user data set in the crypto provider.
+   * @return 0 if all operations succeeded, otherwise the status of the first one that failed.
+   */
+  int (*aes_gcm_decrypt_batch_func)(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
 } omemo_crypto_provider;
 
 #define OMEMO_AES_128_KEY_LENGTH 16
@@ -93,6 +206,7 @@ typedef struct omemo_crypto_provider {
 #define OMEMO_ERR                                                 -10000
 #define OMEMO_ERR_NOMEM                                           -10001
 #define OMEMO_ERR_NULL                                            -10002
+#define OMEMO_ERR_BUFFER_TOO_SMALL                                -10003
 #define OMEMO_ERR_CRYPTO                                          -10010
 #define OMEMO_ERR_AUTH_FAIL                                       -10020
 #define OMEMO_ERR_UNSUPPORTED_KEY_LEN                             -10030
@@ -118,6 +232,7 @@ typedef struct omemo_crypto_provider {
 
 // the errors below were also initially all equal to the first one
 #define OMEMO_ERR_MALFORMED_XML                                   -12000
+#define OMEMO_ERR_MALFORMED_BASE64                                -12001
 #define OMEMO_ERR_MALFORMED_DEVICELIST_NO_ITEMS_ELEM              -12101
 #define OMEMO_ERR_MALFORMED_DEVICELIST_NO_ITEM_ELEM               -12102
 #define OMEMO_ERR_MALFORMED_DEVICELIST_NO_LIST_ELEM               -12103
@@ -140,8 +255,28 @@ typedef struct omemo_crypto_provider {
 #define OMEMO_STRIP_ALL  1
 #define OMEMO_STRIP_NONE 0
 
+// a bundle needs at least OMEMO_BUNDLE_PRE_KEYS_MIN pre keys to be exported, and should have OMEMO_BUNDLE_PRE_KEYS_TARGET
+#define OMEMO_BUNDLE_PRE_KEYS_MIN    20
+#define OMEMO_BUNDLE_PRE_KEYS_TARGET 100
+// highest ID handed out by omemo_bundle_next_pre_key_ids(), the same range libsignal-protocol-c generates pre keys in
+#define OMEMO_BUNDLE_PRE_KEY_ID_MAX  0xFFFFFF
+
+// returned by omemo_devicelist_import_if_changed() if the received devicelist has the same devices as the previous one
+#define OMEMO_DEVICELIST_UNCHANGED 1
+
 #define omemo_devicelist_list_data(X) (*((uint32_t *) X->data))
 
+/**
+ * Receives the serialized XML piece by piece from the *_export_to() functions,
+ * e.g. to append it to an output buffer or write queue without allocating the whole string first.
+ *
+ * @param data_p Pointer to the next piece of XML. Not null-terminated, and only valid during the call.
+ * @param data_len Length of the piece.
+ * @param user_data_p The user data passed to the export function.
+ * @return 0 on success. Anything else aborts the export, which then returns this value.
+ */
+typedef int (*omemo_write_func)(const char * data_p, size_t data_len, void * user_data_p);
+
 /*-------------------- BUNDLE --------------------*/
 
 /**
@@ -242,6 +377,79 @@ int omemo_bundle_get_identity_key(omemo_bundle * bundle_p, uint8_t ** data_pp, s
  */
 int omemo_bundle_add_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id, uint8_t * data_p, size_t data_len);
 
+/**
+ * Removes a pre key from the bundle, e.g. after it was used to establish a session.
+ * Its ID is remembered as consumed, see omemo_bundle_get_consumed_pre_key_ids().
+ * If the bundle was exported before, only the element of this pre key is cut out of the cached XML.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param pre_key_id The ID of the pre key.
+ * @return 0 on success, OMEMO_ERR if the bundle does not contain it, negative on other errors.
+ */
+int omemo_bundle_remove_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id);
+
+/**
+ * Hands out the IDs for the pre keys that should be generated to fill the bundle up to OMEMO_BUNDLE_PRE_KEYS_TARGET again.
+ * They continue after the highest ID that was added or handed out so far and are not handed out again by the next call,
+ * so generate the keys and add them with omemo_bundle_add_pre_key().
+ * After OMEMO_BUNDLE_PRE_KEY_ID_MAX, they start over at 1, skipping the ones still in the bundle and the consumed ones.
+ *
+ * An imported bundle only knows the pre keys it contains, so to not hand out the ID of a consumed pre key again
+ * after a restart, persist and restore the state with the functions below.
+ *
+ * Each added pre key is encoded and inserted into the XML cached by the last export, so the cost of
+ * republishing after removing and replacing some pre keys depends on their amount and not on the size of the bundle.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param ids_p Pointer to the array the IDs are written to.
+ * @param ids_cap How many IDs fit into the array. OMEMO_BUNDLE_PRE_KEYS_TARGET is always enough.
+ * @param ids_len_p Will be set to the amount of IDs written, 0 if the bundle is full.
+ * @return 0 on success, OMEMO_ERR if there are no unused IDs left, negative on other errors.
+ */
+int omemo_bundle_next_pre_key_ids(omemo_bundle * bundle_p, uint32_t * ids_p, size_t ids_cap, size_t * ids_len_p);
+
+/**
+ * Gets the highest pre key ID the bundle knows of, i.e. where omemo_bundle_next_pre_key_ids() continues.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param pre_key_id_p Will be set to the ID, 0 if there was none yet.
+ * @return 0 on success, negative on error.
+ */
+int omemo_bundle_get_pre_key_id_last(const omemo_bundle * bundle_p, uint32_t * pre_key_id_p);
+
+/**
+ * Sets where omemo_bundle_next_pre_key_ids() continues, e.g. to the value persisted before a restart.
+ * Adding a pre key with a higher ID raises it again.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param pre_key_id The ID. The next one handed out is the one after it.
+ * @return 0 on success, OMEMO_ERR if it is higher than OMEMO_BUNDLE_PRE_KEY_ID_MAX, negative on other errors.
+ */
+int omemo_bundle_set_pre_key_id_last(omemo_bundle * bundle_p, uint32_t pre_key_id);
+
+/**
+ * Gives access to the IDs of the pre keys removed with omemo_bundle_remove_pre_key(), which are not handed out again
+ * by omemo_bundle_next_pre_key_ids(), without copying them.
+ * The IDs are in ascending order. The array is only valid until the bundle is changed or destroyed.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param ids_pp Will be set to the ID array, which may be NULL if there are none.
+ * @param ids_len_p Will be set to the amount of IDs in the array.
+ * @return 0 on success, negative on error.
+ */
+int omemo_bundle_get_consumed_pre_key_ids(const omemo_bundle * bundle_p, const uint32_t ** ids_pp, size_t * ids_len_p);
+
+/**
+ * Replaces the IDs of the consumed pre keys, e.g. with the ones persisted before a restart.
+ * IDs can also be left out to allow handing them out again, once no message for them can arrive anymore.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param ids_p Pointer to the ID array, in any order. Can be NULL if ids_len is 0.
+ * @param ids_len The amount of IDs in the array.
+ * @return 0 on success, negative on error.
+ */
+int omemo_bundle_set_consumed_pre_key_ids(omemo_bundle * bundle_p, const uint32_t * ids_p, size_t ids_len);
+
 /**
  * Gets a random pre key from the specified bundle.
  *
@@ -253,8 +461,32 @@ int omemo_bundle_add_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id, uint8
  */
 int omemo_bundle_get_random_pre_key(omemo_bundle * bundle_p, uint32_t * pre_key_id_p, uint8_t ** data_pp, size_t * data_len_p);
 
+/**
+ * Gets the amount of pre keys in the bundle, e.g. for iterating over them with omemo_bundle_get_pre_key().
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @return The amount of pre keys, 0 if bundle_p is NULL.
+ */
+size_t omemo_bundle_get_pre_key_amount(const omemo_bundle * bundle_p);
+
+/**
+ * Gets the pre key at the specified index without copying or decoding it again.
+ * The order is the one in which they were added or appeared in the imported XML.
+ *
+ * @param bundle_p Pointer to the bundle.
+ * @param index Index of the pre key, less than omemo_bundle_get_pre_key_amount().
+ * @param pre_key_id_p Will be set to the ID of the pre key.
+ * @param data_pp Will be set to a pointer to the serialized public key data inside the bundle.
+ *                Must not be freed, and is only valid until the bundle is changed or destroyed.
+ * @param data_len_p Will be set to the length of the data.
+ * @return 0 on success, negative on error, e.g. if the index is out of range.
+ */
+int omemo_bundle_get_pre_key(const omemo_bundle * bundle_p, size_t index, uint32_t * pre_key_id_p, const uint8_t ** data_pp, size_t * data_len_p);
+
 /**
  * "Exports" the bundle into XML for publishing via PEP.
+ * The XML is kept in the bundle, so exporting it again without changing it in between only copies the string.
+ * Fails if there are less than OMEMO_BUNDLE_PRE_KEYS_MIN pre keys.
  *
  * @param bundle_p Pointer to the complete bundle with at least the minimum amount of prekeys.
  * @param publish Will be set to the XML string starting at the <publish> node.
@@ -262,6 +494,16 @@ int omemo_bundle_get_random_pre_key(omemo_bundle * bundle_p, uint32_t * pre_key_
  */
 int omemo_bundle_export(omemo_bundle * bundle_p, char ** publish);
 
+/**
+ * Like omemo_bundle_export(), but passes the XML to a write function instead of returning it as one string.
+ *
+ * @param bundle_p Pointer to the complete bundle with at least the minimum amount of prekeys.
+ * @param write_func The function the XML is written to.
+ * @param user_data_p Passed to the write function.
+ * @return 0 on success, the return value of write_func if it failed, negative on other errors.
+ */
+int omemo_bundle_export_to(omemo_bundle * bundle_p, omemo_write_func write_func, void * user_data_p);
+
 /**
  * Parses the received XML bundle information and returns a bundle struct to work with.
  * Does some basic validity checks and returns OMEMO_ERR_MALFORMED_XML if something is wrong.
@@ -310,8 +552,26 @@ int omemo_devicelist_create(const char * from, omemo_devicelist ** dl_pp);
  */
 int omemo_devicelist_import(char * received_devicelist, const char * from, omemo_devicelist ** dl_pp);
 
+/**
+ * Imports a devicelist only if it contains other devices than a previously imported one,
+ * e.g. to handle the PEP notifications that are sent for every republish of an unchanged list.
+ * The received XML is scanned for the device IDs without building an XML tree, and these are compared to the previous list
+ * regardless of their order. Only if they differ, a devicelist is created. Other attributes of the <device> elements,
+ * such as labels, are not kept in it.
+ *
+ * @param received_devicelist The devicelist as received by the PEP update, starting at the <items> node.
+ * @param from The owner of the devicelist ("from" attribute of the <message> stanza).
+ * @param prev_dl_p Pointer to the previous devicelist of the owner. Can be NULL, then the list is always imported.
+ * @param dl_pp Will be set to the pointer to the created devicelist struct. Not touched if the list is unchanged.
+ * @return 0 if a devicelist was created, OMEMO_DEVICELIST_UNCHANGED if the devices are the same as on the previous list,
+ *         negative on error.
+ */
+int omemo_devicelist_import_if_changed(const char * received_devicelist, const char * from,
+                                       const omemo_devicelist * prev_dl_p, omemo_devicelist ** dl_pp);
+
 /**
  * Adds a device to a devicelist (e.g. the own device to the own list).
+ * Adding an ID which is already in the list does nothing.
  *
  * @param dl_p Pointer to an initialized devicelist.
  * @param device_id The ID to add to the list.
@@ -356,6 +616,26 @@ int omemo_devicelist_is_empty(omemo_devicelist * dl_p);
  */
 int omemo_devicelist_diff(const omemo_devicelist * dl_a_p, const omemo_devicelist * dl_b_p, GList ** a_minus_b_pp, GList ** b_minus_a_pp);
 
+/**
+ * Compares two devicelists in a single pass and writes the differences into caller-provided arrays.
+ * Both results are in ascending order.
+ *
+ * If an array is too small, as many IDs as fit are written, both lengths are set to the needed amount,
+ * and OMEMO_ERR_BUFFER_TOO_SMALL is returned. Passing NULL arrays can therefore be used to query the sizes.
+ * A\B never has more entries than A, and B\A never more than B.
+ *
+ * @param dl_a_p Pointer to devicelist A.
+ * @param dl_b_p Pointer to devicelist B.
+ * @param a_minus_b_p Array for the IDs that are contained in A, but not in B (i.e. A\B). Can be NULL.
+ * @param a_minus_b_len_p In: capacity of the A\B array. Out: amount of IDs in A\B.
+ * @param b_minus_a_p Array for the IDs that are contained in B, but not in A (i.e. B\A). Can be NULL.
+ * @param b_minus_a_len_p In: capacity of the B\A array. Out: amount of IDs in B\A.
+ * @return 0 on success, OMEMO_ERR_BUFFER_TOO_SMALL if an array is too small, negative on other errors.
+ */
+int omemo_devicelist_diff_ids(const omemo_devicelist * dl_a_p, const omemo_devicelist * dl_b_p,
+                              uint32_t * a_minus_b_p, size_t * a_minus_b_len_p,
+                              uint32_t * b_minus_a_p, size_t * b_minus_a_len_p);
+
 /**
  * Exports the devicelist to an XML string, as needed to publish it via PEP.
  *
@@ -365,9 +645,21 @@ int omemo_devicelist_diff(const omemo_devicelist * dl_a_p, const omemo_devicelis
  */
 int omemo_devicelist_export(omemo_devicelist * dl_p, char ** xml_p);
 
+/**
+ * Like omemo_devicelist_export(), but passes the XML to a write function instead of returning it as one string.
+ *
+ * @param dl_p Pointer to the devicelist.
+ * @param write_func The function the XML is written to.
+ * @param user_data_p Passed to the write function.
+ * @return 0 on success, the return value of write_func if it failed, negative on other errors.
+ */
+int omemo_devicelist_export_to(omemo_devicelist * dl_p, omemo_write_func write_func, void * user_data_p);
+
 /**
  * Returns a copy of the internally kept list of IDs for easy iterating.
+ * The IDs are in ascending order.
  * Has to be freed using g_list_free_full(list_p, free).
+ * See omemo_devicelist_get_ids() for a way without copying.
  *
  * "data" is a pointer to the uint32_t, so to acces it either:
  *  - cast the pointer to an uint32_t * and then dereference it
@@ -378,6 +670,18 @@ int omemo_devicelist_export(omemo_devicelist * dl_p, char ** xml_p);
  */
 GList * omemo_devicelist_get_id_list(const omemo_devicelist * dl_p);
 
+/**
+ * Gives access to the internally kept array of IDs without copying it.
+ * The IDs are in ascending order and do not contain duplicates.
+ * The array is only valid until the devicelist is changed or destroyed.
+ *
+ * @param dl_p Pointer to the devicelist.
+ * @param ids_pp Will be set to the ID array, which may be NULL if the list is empty.
+ * @param ids_len_p Will be set to the amount of IDs in the array.
+ * @return 0 on success, negative on error.
+ */
+int omemo_devicelist_get_ids(const omemo_devicelist * dl_p, const uint32_t ** ids_pp, size_t * ids_len_p);
+
 /**
  * Checks if the devicelist struct contains any IDs.
  *
@@ -415,6 +719,44 @@ void omemo_devicelist_destroy(omemo_devicelist * dl_p);
 
 /*-------------------- MESSAGE --------------------*/
 
+/**
+ * A recipient device and the key encrypted for it,
+ * as passed to omemo_message_add_recipients() and stored in an omemo_raw_message.
+ */
+typedef struct omemo_raw_recipient {
+  uint32_t device_id;
+  bool prekey;
+  uint8_t * encrypted_key_p;
+  size_t encrypted_key_len;
+} omemo_raw_recipient;
+
+/**
+ * An encrypted message without any XML, for applications which build their stanzas themselves.
+ * The fields map directly to the elements of an OMEMO message.
+ */
+typedef struct omemo_raw_message {
+  uint32_t sender_device_id;
+  uint8_t iv[OMEMO_AES_GCM_IV_LENGTH];
+  uint8_t * ciphertext_p;
+  size_t ciphertext_len;
+  // the key with the tag appended, to be encrypted for each recipient
+  uint8_t key[OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH];
+  omemo_raw_recipient * recipients_p;
+  size_t recipients_len;
+  size_t recipients_cap;
+} omemo_raw_message;
+
+/**
+ * A message to decrypt with omemo_message_export_decrypted_batch(), and its result.
+ */
+typedef struct omemo_decrypt_batch_entry {
+  omemo_message * msg_p; // the parsed message
+  const uint8_t * key_p; // the decrypted symmetric key, as for omemo_message_export_decrypted()
+  size_t key_len;
+  char * msg_xml;        // will be set to the decrypted stanza, or NULL if status is not 0. free() when done.
+  int status;            // will be set to 0 on success, negative on error
+} omemo_decrypt_batch_entry;
+
 /**
  * Creates a message without a payload for use as a KeyTransportElement.
  *
@@ -499,6 +841,20 @@ int omemo_message_add_recipient(omemo_message * msg_p, uint32_t device_id, const
  */
 int omemo_message_add_recipient_w_prekey(omemo_message * msg_p, uint32_t device_id, const uint8_t * encrypted_key_p, size_t key_len);
 
+/**
+ * Adds the encrypted keys for many devices at once, e.g. for all participants of a group chat.
+ * The result is the same as calling omemo_message_add_recipient() or omemo_message_add_recipient_w_prekey()
+ * for each entry in order, but the strings for all keys are prepared in a single allocation.
+ * If an error occurs, none of the keys are added.
+ * Only makes sense on outgoing messages.
+ *
+ * @param msg_p Pointer to the message to add to.
+ * @param recipients_p Array of the recipient device IDs and their encrypted keys. The prekey flag is respected.
+ * @param recipients_len Length of the array.
+ * @return 0 on success, negative on error.
+ */
+int omemo_message_add_recipients(omemo_message * msg_p, const omemo_raw_recipient * recipients_p, size_t recipients_len);
+
 /**
  * After all recipients have been added, this function can be used to export the resulting <message> stanza.
  * Also adds a <store> hint.
@@ -510,6 +866,17 @@ int omemo_message_add_recipient_w_prekey(omemo_message * msg_p, uint32_t device_
  */
 int omemo_message_export_encrypted(omemo_message * msg_p, int add_msg, char ** msg_xml);
 
+/**
+ * Like omemo_message_export_encrypted(), but passes the XML to a write function instead of returning it as one string.
+ *
+ * @param msg_p Pointer to the message.
+ * @param add_msg One of ADD_MSG_* constants. For optionally adding a body, EME, or both.
+ * @param write_func The function the XML is written to.
+ * @param user_data_p Passed to the write function.
+ * @return 0 on success, the return value of write_func if it failed, negative on other errors.
+ */
+int omemo_message_export_encrypted_to(omemo_message * msg_p, int add_msg, omemo_write_func write_func, void * user_data_p);
+
 /**
  * Prepares an intercepted <message> stanza for decryption by parsing it.
  * Afterwards, the encrypted symmetric key can be retrieved, and the decrypted key used to decrypt the payload.
@@ -520,6 +887,20 @@ int omemo_message_export_encrypted(omemo_message * msg_p, int add_msg, char ** m
  */
 int omemo_message_prepare_decryption(char * incoming_message, omemo_message ** msg_pp);
 
+/**
+ * Like omemo_message_prepare_decryption(), but reads the stanza in a single pass without building an XML tree.
+ * Only the OMEMO parts are extracted, the rest of the stanza is copied through unchanged by omemo_message_export_decrypted(),
+ * which removes the <encrypted>, <encryption> and <store> elements as well as any fallback <body> and appends the decrypted one.
+ *
+ * The returned message can only be used for decryption:
+ * omemo_message_add_recipient() and omemo_message_export_encrypted() are not supported on it.
+ *
+ * @param incoming_message The incoming <message> stanza xml as a string.
+ * @param msg_pp Will be set to the created message.
+ * @return 0 on success, negative on error.
+ */
+int omemo_message_prepare_decryption_streaming(const char * incoming_message, omemo_message ** msg_pp);
+
 /**
  * Checks if the message has a payload, i.e. whether it is a MessageElement or KeyTransportElement.
  *
@@ -604,9 +985,109 @@ int omemo_message_is_encrypted_key_prekey(omemo_message * msg_p, uint32_t recipi
  */
 int omemo_message_export_decrypted(omemo_message * msg_p, uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p, char ** msg_xml_p);
 
+/**
+ * Like omemo_message_export_decrypted(), but only returns the decrypted body text instead of the whole stanza.
+ * Nothing is added to or serialized from the XML tree, which makes this the cheaper choice if only the text is needed.
+ *
+ * @param msg_p Pointer to the message.
+ * @param key_p Pointer to the decrypted symmetric key.
+ * @param key_len Length of the key data.
+ * @param crypto_p Pointer to the crypto provider.
+ * @param body_pp Will be set to the null-terminated body text, not XML-escaped. free() when done.
+ * @param body_len_p Will be set to the length of the body text.
+ * @return 0 on success, OMEMO_ERR_AUTH_FAIL if the tag does not match, negative on other errors.
+ */
+int omemo_message_decrypt_body(omemo_message * msg_p, const uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p, char ** body_pp, size_t * body_len_p);
+
+/**
+ * Like omemo_message_decrypt_body(), but writes the body text into a caller-supplied buffer.
+ * With a crypto provider that has aes_gcm_decrypt_into_func set, it is decrypted straight into it.
+ *
+ * @param msg_p Pointer to the message.
+ * @param key_p Pointer to the decrypted symmetric key.
+ * @param key_len Length of the key data.
+ * @param crypto_p Pointer to the crypto provider.
+ * @param body_p Pointer to the buffer the null-terminated body text is written to.
+ * @param body_size Size of the buffer. The decoded payload length + 1 is always enough.
+ * @param body_len_p Will be set to the length of the body text.
+ *                   If the buffer is too small, it is set to the needed length without the null byte.
+ * @return 0 on success, OMEMO_ERR_BUFFER_TOO_SMALL if the buffer is too small,
+ *         OMEMO_ERR_AUTH_FAIL if the tag does not match, negative on other errors.
+ */
+int omemo_message_decrypt_body_into(omemo_message * msg_p, const uint8_t * key_p, size_t key_len, const omemo_crypto_provider * crypto_p,
+                                    char * body_p, size_t body_size, size_t * body_len_p);
+
+/**
+ * Decrypts several messages and exports the original stanzas as by omemo_message_export_decrypted(),
+ * e.g. the archive fetched after a reconnect.
+ * With a crypto provider that has aes_gcm_decrypt_batch_func set, all payloads are decrypted with a single call of it.
+ * A message that fails does not stop the others.
+ *
+ * @param entries_p Pointer to the array of entries. The msg_xml and status of each one are set.
+ * @param entries_len Length of the array.
+ * @param crypto_p Pointer to the crypto provider.
+ * @return 0 if all messages were decrypted, otherwise the status of the first entry that failed.
+ */
+int omemo_message_export_decrypted_batch(omemo_decrypt_batch_entry * entries_p, size_t entries_len, const omemo_crypto_provider * crypto_p);
+
 /**
  * Frees the memory of everything contained in the message struct as well as the struct itself.
  *
  * @param msg_p Pointer to the message.
  */
 void omemo_message_destroy(omemo_message * msg_p);
+
+/**
+ * Encrypts a plaintext without going through any XML.
+ * Like with omemo_message_prepare_encryption(), the recipients have to be added afterwards,
+ * using the key in the result.
+ *
+ * @param plaintext_p Pointer to the plaintext, i.e. the content of the <body>.
+ * @param plaintext_len Length of the plaintext.
+ * @param sender_device_id The own device ID.
+ * @param crypto_p Pointer to a crypto provider.
+ * @param raw_pp Will be set to the encrypted message. Use omemo_raw_message_destroy() when done.
+ * @return 0 on success, negative on error.
+ */
+int omemo_message_encrypt_raw(const uint8_t * plaintext_p, size_t plaintext_len, uint32_t sender_device_id, const omemo_crypto_provider * crypto_p, omemo_raw_message ** raw_pp);
+
+/**
+ * Adds the encrypted key for a recipient device to the raw message. The data is copied.
+ *
+ * @param raw_p Pointer to the raw message.
+ * @param device_id The recipient device ID.
+ * @param prekey Whether the key is the first message of a session, see omemo_message_add_recipient_w_prekey().
+ * @param encrypted_key_p The encrypted key data.
+ * @param key_len Length of the encrypted key data.
+ * @return 0 on success, negative on error.
+ */
+int omemo_raw_message_add_recipient(omemo_raw_message * raw_p, uint32_t device_id, bool prekey, const uint8_t * encrypted_key_p, size_t key_len);
+
+/**
+ * Frees the raw message including its ciphertext and recipients. The key is overwritten.
+ *
+ * @param raw_p Pointer to the raw message.
+ */
+void omemo_raw_message_destroy(omemo_raw_message * raw_p);
+
+/**
+ * Decrypts a payload without going through any XML, the counterpart to omemo_message_encrypt_raw().
+ * The key is expected the same way as by omemo_message_export_decrypted(), i.e. either with the tag appended
+ * or without one, in which case the tag is expected at the end of the ciphertext.
+ *
+ * @param ciphertext_p Pointer to the decoded payload.
+ * @param ciphertext_len Length of the payload.
+ * @param iv_p Pointer to the decoded IV.
+ * @param iv_len Length of the IV.
+ * @param key_p Pointer to the decrypted symmetric key.
+ * @param key_len Length of the key data.
+ * @param crypto_p Pointer to the crypto provider.
+ * @param plaintext_pp Will be set to the plaintext, which is also null-terminated. free() when done.
+ * @param plaintext_len_p Will be set to the length of the plaintext, without the terminating null byte.
+ * @return 0 on success, OMEMO_ERR_AUTH_FAIL if the tag does not match, negative on other errors.
+ */
+int omemo_message_decrypt_raw(const uint8_t * ciphertext_p, size_t ciphertext_len,
+                              const uint8_t * iv_p, size_t iv_len,
+                              const uint8_t * key_p, size_t key_len,
+                              const omemo_crypto_provider * crypto_p,
+                              uint8_t ** plaintext_pp, size_t * plaintext_len_p);
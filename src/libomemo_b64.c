@@ -0,0 +1,436 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libomemo.h"
+#include "libomemo_b64.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_X86 1
+#include <immintrin.h>
+#else
+#define B64_X86 0
+#endif
+
+#define B64_PAD '='
+#define B64_INVALID 0xFF
+#define B64_SPACE 0xFE
+
+static const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// maps characters to their 6 bit values, or one of the markers above
+static const uint8_t b64_values[256] = {
+  ['\t'] = B64_SPACE, ['\n'] = B64_SPACE, ['\r'] = B64_SPACE, [' '] = B64_SPACE,
+  ['A'] = 1 + 0, ['B'] = 1 + 1, ['C'] = 1 + 2, ['D'] = 1 + 3, ['E'] = 1 + 4, ['F'] = 1 + 5, ['G'] = 1 + 6, ['H'] = 1 + 7,
+  ['I'] = 1 + 8, ['J'] = 1 + 9, ['K'] = 1 + 10, ['L'] = 1 + 11, ['M'] = 1 + 12, ['N'] = 1 + 13, ['O'] = 1 + 14, ['P'] = 1 + 15,
+  ['Q'] = 1 + 16, ['R'] = 1 + 17, ['S'] = 1 + 18, ['T'] = 1 + 19, ['U'] = 1 + 20, ['V'] = 1 + 21, ['W'] = 1 + 22, ['X'] = 1 + 23,
+  ['Y'] = 1 + 24, ['Z'] = 1 + 25, ['a'] = 1 + 26, ['b'] = 1 + 27, ['c'] = 1 + 28, ['d'] = 1 + 29, ['e'] = 1 + 30, ['f'] = 1 + 31,
+  ['g'] = 1 + 32, ['h'] = 1 + 33, ['i'] = 1 + 34, ['j'] = 1 + 35, ['k'] = 1 + 36, ['l'] = 1 + 37, ['m'] = 1 + 38, ['n'] = 1 + 39,
+  ['o'] = 1 + 40, ['p'] = 1 + 41, ['q'] = 1 + 42, ['r'] = 1 + 43, ['s'] = 1 + 44, ['t'] = 1 + 45, ['u'] = 1 + 46, ['v'] = 1 + 47,
+  ['w'] = 1 + 48, ['x'] = 1 + 49, ['y'] = 1 + 50, ['z'] = 1 + 51, ['0'] = 1 + 52, ['1'] = 1 + 53, ['2'] = 1 + 54, ['3'] = 1 + 55,
+  ['4'] = 1 + 56, ['5'] = 1 + 57, ['6'] = 1 + 58, ['7'] = 1 + 59, ['8'] = 1 + 60, ['9'] = 1 + 61, ['+'] = 1 + 62, ['/'] = 1 + 63
+};
+
+/*
+ * The table above stores values offset by one, so that all characters not listed are 0.
+ * This looks up the actual value or marker.
+ */
+static uint8_t b64_value(char c) {
+  uint8_t v = b64_values[(uint8_t) c];
+  if (v == B64_SPACE) {
+    return B64_SPACE;
+  }
+  return v ? v - 1 : B64_INVALID;
+}
+
+size_t omemo_b64_encoded_len(size_t data_len) {
+  return (data_len + 2) / 3 * 4;
+}
+
+size_t omemo_b64_decoded_len_max(size_t b64_len) {
+  return (b64_len + 3) / 4 * 3;
+}
+
+/**
+ * Encodes as many complete 3 byte groups as possible, without padding.
+ *
+ * @return The amount of input bytes consumed, which is a multiple of 3.
+ */
+static size_t b64_encode_scalar(const uint8_t * data_p, size_t data_len, char * out_p) {
+  size_t i = 0;
+
+  for (; i + 3 <= data_len; i += 3) {
+    uint32_t triple = (uint32_t) data_p[i] << 16 | (uint32_t) data_p[i + 1] << 8 | data_p[i + 2];
+    *out_p++ = b64_alphabet[(triple >> 18) & 0x3F];
+    *out_p++ = b64_alphabet[(triple >> 12) & 0x3F];
+    *out_p++ = b64_alphabet[(triple >> 6) & 0x3F];
+    *out_p++ = b64_alphabet[triple & 0x3F];
+  }
+
+  return i;
+}
+
+#if B64_X86
+
+/*
+ * The vector kernels follow the approach by Wojciech Muła and Daniel Lemire:
+ * bytes are shuffled so that each 32 bit lane holds one group of 3, the 6 bit values are split out with multiplications,
+ * and translated into ASCII (or back) with small lookup tables indexed by pshufb.
+ */
+
+__attribute__((target("ssse3")))
+static __m128i b64_enc_reshuffle_ssse3(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static __m128i b64_enc_translate_ssse3(__m128i indices) {
+  const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+  __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+
+  return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, result), indices);
+}
+
+// reads 16 bytes for every 12 that are encoded
+__attribute__((target("ssse3")))
+static size_t b64_encode_ssse3(const uint8_t * data_p, size_t data_len, char * out_p) {
+  size_t i = 0;
+
+  for (; i + 16 <= data_len; i += 12) {
+    const __m128i in = _mm_loadu_si128((const __m128i *) (data_p + i));
+    _mm_storeu_si128((__m128i *) out_p, b64_enc_translate_ssse3(b64_enc_reshuffle_ssse3(in)));
+    out_p += 16;
+  }
+
+  return i;
+}
+
+// reads 28 bytes for every 24 that are encoded
+__attribute__((target("avx2")))
+static size_t b64_encode_avx2(const uint8_t * data_p, size_t data_len, char * out_p) {
+  const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                          10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                             'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+
+  for (; i + 28 <= data_len; i += 24) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *) (data_p + i));
+    const __m128i hi = _mm_loadu_si128((const __m128i *) (data_p + i + 12));
+    __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    in = _mm256_shuffle_epi8(in, shuffle);
+
+    const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i indices = _mm256_or_si256(t1, t3);
+
+    __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    result = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, result), indices);
+
+    _mm256_storeu_si256((__m256i *) out_p, result);
+    out_p += 32;
+  }
+
+  return i;
+}
+
+/**
+ * Translates 16 characters into their 6 bit values.
+ *
+ * @return false if any of them is not in the alphabet, including padding and whitespace.
+ */
+__attribute__((target("ssse3")))
+static bool b64_dec_translate_ssse3(__m128i in, __m128i * values_p) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_0f = _mm_set1_epi8(0x0F);
+
+  const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_0f);
+  const __m128i lo_nibbles = _mm_and_si128(in, mask_0f);
+  const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+  const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+
+  if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) {
+    return false;
+  }
+
+  const __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2F));
+  const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+  *values_p = _mm_add_epi8(in, roll);
+
+  return true;
+}
+
+/**
+ * Decodes complete blocks of 16 characters until a character outside of the alphabet shows up.
+ * Writes 16 bytes for every 12 that are decoded.
+ *
+ * @return The amount of characters consumed, which is a multiple of 4.
+ */
+__attribute__((target("ssse3")))
+static size_t b64_decode_ssse3(const char * b64_p, size_t b64_len, uint8_t * out_p, size_t out_size, size_t * out_len_p) {
+  size_t i = 0;
+  size_t out_len = 0;
+
+  for (; i + 16 <= b64_len && out_len + 16 <= out_size; i += 16) {
+    __m128i values;
+    if (!b64_dec_translate_ssse3(_mm_loadu_si128((const __m128i *) (b64_p + i)), &values)) {
+      break;
+    }
+
+    const __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+    _mm_storeu_si128((__m128i *) (out_p + out_len), packed);
+    out_len += 12;
+  }
+
+  *out_len_p = out_len;
+  return i;
+}
+
+// same as above, with blocks of 32 characters and 32 bytes written for every 24 decoded
+__attribute__((target("avx2")))
+static size_t b64_decode_avx2(const char * b64_p, size_t b64_len, uint8_t * out_p, size_t out_size, size_t * out_len_p) {
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                          0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                          0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i pack_shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i mask_0f = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  size_t out_len = 0;
+
+  for (; i + 32 <= b64_len && out_len + 32 <= out_size; i += 32) {
+    const __m256i in = _mm256_loadu_si256((const __m256i *) (b64_p + i));
+    const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_0f);
+    const __m256i lo_nibbles = _mm256_and_si256(in, mask_0f);
+    const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()))) {
+      break;
+    }
+
+    const __m256i eq_2f = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x2F));
+    const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    const __m256i values = _mm256_add_epi8(in, roll);
+
+    const __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    packed = _mm256_shuffle_epi8(packed, pack_shuffle);
+    // each lane now holds 12 bytes, move them together
+    packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+    _mm256_storeu_si256((__m256i *) (out_p + out_len), packed);
+    out_len += 24;
+  }
+
+  *out_len_p = out_len;
+  return i;
+}
+
+#endif /* B64_X86 */
+
+int omemo_b64_encode_into(const uint8_t * data_p, size_t data_len, char * out_p, size_t out_size, size_t * out_len_p) {
+  if ((!data_p && data_len) || !out_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  size_t enc_len = omemo_b64_encoded_len(data_len);
+  if (out_size < enc_len + 1) {
+    return OMEMO_ERR_BUFFER_TOO_SMALL;
+  }
+
+  size_t done = 0;
+  char * w_p = out_p;
+
+#if B64_X86
+  if (__builtin_cpu_supports("avx2")) {
+    done = b64_encode_avx2(data_p, data_len, w_p);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    done = b64_encode_ssse3(data_p, data_len, w_p);
+  }
+  w_p += done / 3 * 4;
+#endif
+
+  size_t scalar_done = b64_encode_scalar(data_p + done, data_len - done, w_p);
+  w_p += scalar_done / 3 * 4;
+  done += scalar_done;
+
+  if (data_len - done == 1) {
+    uint32_t triple = (uint32_t) data_p[done] << 16;
+    *w_p++ = b64_alphabet[(triple >> 18) & 0x3F];
+    *w_p++ = b64_alphabet[(triple >> 12) & 0x3F];
+    *w_p++ = B64_PAD;
+    *w_p++ = B64_PAD;
+  } else if (data_len - done == 2) {
+    uint32_t triple = (uint32_t) data_p[done] << 16 | (uint32_t) data_p[done + 1] << 8;
+    *w_p++ = b64_alphabet[(triple >> 18) & 0x3F];
+    *w_p++ = b64_alphabet[(triple >> 12) & 0x3F];
+    *w_p++ = b64_alphabet[(triple >> 6) & 0x3F];
+    *w_p++ = B64_PAD;
+  }
+  *w_p = '\0';
+
+  if (out_len_p) {
+    *out_len_p = enc_len;
+  }
+
+  return 0;
+}
+
+int omemo_b64_decode_into(const char * b64_p, size_t b64_len, uint8_t * out_p, size_t out_size, size_t * out_len_p) {
+  if ((!b64_p && b64_len) || (!out_p && out_size) || !out_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  size_t i = 0;
+  size_t out_len = 0;
+
+#if B64_X86
+  if (__builtin_cpu_supports("avx2")) {
+    i = b64_decode_avx2(b64_p, b64_len, out_p, out_size, &out_len);
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    size_t more = 0;
+    i += b64_decode_ssse3(b64_p + i, b64_len - i, out_p + out_len, out_size - out_len, &more);
+    out_len += more;
+  }
+#endif
+
+  // the rest, including whitespace and padding
+  uint32_t acc = 0;
+  size_t acc_amount = 0;
+  size_t pad_amount = 0;
+
+  for (; i < b64_len; i++) {
+    char c = b64_p[i];
+    uint8_t v = b64_value(c);
+
+    if (v == B64_SPACE) {
+      continue;
+    }
+
+    if (c == B64_PAD) {
+      // only allowed in place of the last one or two characters of a group
+      if (acc_amount < 2 || acc_amount + pad_amount == 4) {
+        return OMEMO_ERR_MALFORMED_BASE64;
+      }
+      pad_amount++;
+      continue;
+    }
+
+    if (v == B64_INVALID || pad_amount) {
+      return OMEMO_ERR_MALFORMED_BASE64;
+    }
+
+    acc = acc << 6 | v;
+    acc_amount++;
+
+    if (acc_amount == 4) {
+      if (out_len + 3 > out_size) {
+        return OMEMO_ERR_BUFFER_TOO_SMALL;
+      }
+      out_p[out_len++] = acc >> 16;
+      out_p[out_len++] = acc >> 8;
+      out_p[out_len++] = acc;
+      acc = 0;
+      acc_amount = 0;
+    }
+  }
+
+  // an incomplete group at the end, either padded or not
+  if (acc_amount == 1 || (pad_amount && acc_amount + pad_amount != 4)) {
+    return OMEMO_ERR_MALFORMED_BASE64;
+  }
+  if (acc_amount) {
+    if (out_len + acc_amount - 1 > out_size) {
+      return OMEMO_ERR_BUFFER_TOO_SMALL;
+    }
+    acc <<= 6 * (4 - acc_amount);
+    out_p[out_len++] = acc >> 16;
+    if (acc_amount == 3) {
+      out_p[out_len++] = acc >> 8;
+    }
+  }
+
+  *out_len_p = out_len;
+
+  return 0;
+}
+
+int omemo_b64_encode(const uint8_t * data_p, size_t data_len, char ** b64_pp) {
+  if (!b64_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  size_t size = omemo_b64_encoded_len(data_len) + 1;
+  char * b64_p = malloc(size);
+  if (!b64_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  ret_val = omemo_b64_encode_into(data_p, data_len, b64_p, size, (void *) 0);
+  if (ret_val) {
+    free(b64_p);
+    return ret_val;
+  }
+
+  *b64_pp = b64_p;
+
+  return 0;
+}
+
+int omemo_b64_decode(const char * b64, uint8_t ** data_pp, size_t * data_len_p) {
+  if (!b64 || !data_pp || !data_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  size_t b64_len = strlen(b64);
+  // one more, so that there always is something to allocate
+  size_t size = omemo_b64_decoded_len_max(b64_len) + 1;
+  uint8_t * data_p = malloc(size);
+  if (!data_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  ret_val = omemo_b64_decode_into(b64, b64_len, data_p, size, data_len_p);
+  if (ret_val) {
+    free(data_p);
+    return ret_val;
+  }
+
+  *data_pp = data_p;
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Internal base64 codec (RFC 4648, standard alphabet with padding).
+ * Not installed, the library uses it instead of g_base64_encode() and g_base64_decode().
+ *
+ * Long inputs are processed with SSSE3 or AVX2 if the CPU supports it, which is checked at runtime.
+ * Everything else, including the tails, goes through the scalar code.
+ */
+
+/**
+ * @param data_len Length of the binary data.
+ * @return The length of its base64 encoding, without the terminating null byte.
+ */
+size_t omemo_b64_encoded_len(size_t data_len);
+
+/**
+ * @param b64_len Length of a base64 string.
+ * @return An upper bound for the length of the decoded data.
+ */
+size_t omemo_b64_decoded_len_max(size_t b64_len);
+
+/**
+ * Encodes binary data into a caller-supplied buffer.
+ *
+ * @param data_p Pointer to the data.
+ * @param data_len Length of the data.
+ * @param out_p Pointer to the output buffer.
+ * @param out_size Size of the output buffer, which has to be at least omemo_b64_encoded_len() + 1.
+ * @param out_len_p Will be set to the length of the null-terminated result. Can be NULL.
+ * @return 0 on success, OMEMO_ERR_BUFFER_TOO_SMALL if the buffer is too small, negative on other errors.
+ */
+int omemo_b64_encode_into(const uint8_t * data_p, size_t data_len, char * out_p, size_t out_size, size_t * out_len_p);
+
+/**
+ * Decodes a base64 string into a caller-supplied buffer.
+ * Whitespace is skipped, as it may appear in XML text. Padding is optional.
+ *
+ * @param b64_p Pointer to the base64 string.
+ * @param b64_len Its length.
+ * @param out_p Pointer to the output buffer.
+ * @param out_size Size of the output buffer. omemo_b64_decoded_len_max() is always enough.
+ * @param out_len_p Will be set to the length of the decoded data.
+ * @return 0 on success, OMEMO_ERR_BUFFER_TOO_SMALL if the buffer is too small,
+ *         OMEMO_ERR_MALFORMED_BASE64 if the string is not valid base64, negative on other errors.
+ */
+int omemo_b64_decode_into(const char * b64_p, size_t b64_len, uint8_t * out_p, size_t out_size, size_t * out_len_p);
+
+/**
+ * Encodes binary data.
+ *
+ * @param data_p Pointer to the data.
+ * @param data_len Length of the data.
+ * @param b64_pp Will be set to the null-terminated base64 string. free() when done.
+ * @return 0 on success, negative on error.
+ */
+int omemo_b64_encode(const uint8_t * data_p, size_t data_len, char ** b64_pp);
+
+/**
+ * Decodes a null-terminated base64 string.
+ *
+ * @param b64 The base64 string.
+ * @param data_pp Will be set to the decoded data. free() when done.
+ * @param data_len_p Will be set to the length of the decoded data.
+ * @return 0 on success, negative on error.
+ */
+int omemo_b64_decode(const char * b64, uint8_t ** data_pp, size_t * data_len_p);
@@ -0,0 +1,364 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "libomemo.h"
+#include "libomemo_storage.h"
+#include "libomemo_bundle_cache.h"
+
+typedef struct bundle_cache_key {
+  const char * jid;
+  uint32_t device_id;
+} bundle_cache_key;
+
+typedef struct bundle_cache_entry {
+  bundle_cache_key key; // the JID points to jid below
+  char * jid;
+  char * item_id; // NULL if unknown
+  char * hash;    // hex SHA-256 of the <bundle> element, see bundle_content_hash(), NULL if unknown
+  omemo_bundle * bundle_p;
+  struct bundle_cache_entry * prev_p; // more recently used
+  struct bundle_cache_entry * next_p; // less recently used
+} bundle_cache_entry;
+
+struct omemo_bundle_cache {
+  GHashTable * entries_p; // bundle_cache_key -> bundle_cache_entry, the key is part of the entry
+  bundle_cache_entry * head_p; // most recently used
+  bundle_cache_entry * tail_p; // least recently used, the next one to drop
+  size_t capacity;
+  omemo_storage_ctx * storage_ctx_p;
+};
+
+static guint bundle_cache_key_hash(gconstpointer key_p) {
+  const bundle_cache_key * k_p = key_p;
+
+  return g_str_hash(k_p->jid) ^ (k_p->device_id * 2654435761u);
+}
+
+static gboolean bundle_cache_key_equal(gconstpointer a_p, gconstpointer b_p) {
+  const bundle_cache_key * ka_p = a_p;
+  const bundle_cache_key * kb_p = b_p;
+
+  return ka_p->device_id == kb_p->device_id && !strcmp(ka_p->jid, kb_p->jid);
+}
+
+static void bundle_cache_entry_free(gpointer data) {
+  bundle_cache_entry * entry_p = data;
+
+  if (entry_p) {
+    omemo_bundle_destroy(entry_p->bundle_p);
+    free(entry_p->jid);
+    free(entry_p->item_id);
+    free(entry_p->hash);
+    free(entry_p);
+  }
+}
+
+static char * str_dup(const char * in) {
+  if (!in) {
+    return (void *) 0;
+  }
+
+  size_t len = strlen(in);
+  char * out = malloc(len + 1);
+  if (out) {
+    memcpy(out, in, len + 1);
+  }
+
+  return out;
+}
+
+/**
+ * Hashes the <bundle> element of a received bundle, so that the surrounding <items> and <item> with its ID do not
+ * count as content. The XML is not parsed for this, so the same bundle serialized differently gets a different hash,
+ * which only means it is imported again.
+ * If there is no <bundle> element, the whole XML is hashed, and importing it will fail anyway.
+ *
+ * @param received_bundle The bundle XML, starting at the <items> node.
+ * @param hash_pp Will be set to the hex SHA-256 hash, or NULL if out of memory. g_free() when done.
+ */
+static void bundle_content_hash(const char * received_bundle, gchar ** hash_pp) {
+  const char * start_p = received_bundle;
+  const char * end_p = (void *) 0;
+
+  while ((start_p = strstr(start_p, "<bundle"))) {
+    char next = start_p[sizeof("<bundle") - 1];
+    if (next == '>' || next == '/' || next == ' ' || next == '\t' || next == '\n' || next == '\r') {
+      break;
+    }
+    start_p++;
+  }
+
+  if (start_p) {
+    end_p = strstr(start_p, "</bundle>");
+  }
+
+  if (!start_p || !end_p) {
+    *hash_pp = g_compute_checksum_for_string(G_CHECKSUM_SHA256, received_bundle, -1);
+    return;
+  }
+
+  end_p += sizeof("</bundle>") - 1;
+  *hash_pp = g_compute_checksum_for_string(G_CHECKSUM_SHA256, start_p, (gssize) (end_p - start_p));
+}
+
+static void lru_unlink(omemo_bundle_cache * cache_p, bundle_cache_entry * entry_p) {
+  if (entry_p->prev_p) {
+    entry_p->prev_p->next_p = entry_p->next_p;
+  } else {
+    cache_p->head_p = entry_p->next_p;
+  }
+  if (entry_p->next_p) {
+    entry_p->next_p->prev_p = entry_p->prev_p;
+  } else {
+    cache_p->tail_p = entry_p->prev_p;
+  }
+  entry_p->prev_p = (void *) 0;
+  entry_p->next_p = (void *) 0;
+}
+
+static void lru_push_front(omemo_bundle_cache * cache_p, bundle_cache_entry * entry_p) {
+  entry_p->next_p = cache_p->head_p;
+  if (cache_p->head_p) {
+    cache_p->head_p->prev_p = entry_p;
+  } else {
+    cache_p->tail_p = entry_p;
+  }
+  cache_p->head_p = entry_p;
+}
+
+// removes the entry from the memory cache and frees it
+static void bundle_cache_drop(omemo_bundle_cache * cache_p, bundle_cache_entry * entry_p) {
+  lru_unlink(cache_p, entry_p);
+  (void) g_hash_table_remove(cache_p->entries_p, &entry_p->key);
+}
+
+/**
+ * Puts a new entry into the memory cache, replacing the one for the same device and dropping the least recently
+ * used one if the cache is full. The cache takes ownership of everything, also on error.
+ */
+static int bundle_cache_insert(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id,
+                               char * item_id, char * hash, omemo_bundle * bundle_p, bundle_cache_entry ** entry_pp) {
+  bundle_cache_entry * entry_p = malloc(sizeof(bundle_cache_entry));
+  if (!entry_p) {
+    omemo_bundle_destroy(bundle_p);
+    free(item_id);
+    free(hash);
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(entry_p, 0, sizeof(bundle_cache_entry));
+  entry_p->item_id = item_id;
+  entry_p->hash = hash;
+  entry_p->bundle_p = bundle_p;
+
+  entry_p->jid = str_dup(jid);
+  if (!entry_p->jid) {
+    bundle_cache_entry_free(entry_p);
+    return OMEMO_ERR_NOMEM;
+  }
+  entry_p->key.jid = entry_p->jid;
+  entry_p->key.device_id = device_id;
+
+  bundle_cache_entry * old_p = g_hash_table_lookup(cache_p->entries_p, &entry_p->key);
+  if (old_p) {
+    bundle_cache_drop(cache_p, old_p);
+  }
+
+  while (g_hash_table_size(cache_p->entries_p) >= cache_p->capacity && cache_p->tail_p) {
+    bundle_cache_drop(cache_p, cache_p->tail_p);
+  }
+
+  g_hash_table_insert(cache_p->entries_p, &entry_p->key, entry_p);
+  lru_push_front(cache_p, entry_p);
+
+  *entry_pp = entry_p;
+
+  return 0;
+}
+
+// finds the entry in memory or loads it from the storage, and marks it as the most recently used one
+static int bundle_cache_lookup(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id, bundle_cache_entry ** entry_pp) {
+  int ret_val = 0;
+
+  bundle_cache_key key = {jid, device_id};
+  bundle_cache_entry * entry_p = g_hash_table_lookup(cache_p->entries_p, &key);
+  char * item_id = (void *) 0;
+  char * hash = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+
+  if (entry_p) {
+    lru_unlink(cache_p, entry_p);
+    lru_push_front(cache_p, entry_p);
+    *entry_pp = entry_p;
+    return 0;
+  }
+
+  *entry_pp = (void *) 0;
+  if (!cache_p->storage_ctx_p) {
+    return 0;
+  }
+
+  ret_val = omemo_storage_ctx_bundle_retrieve(cache_p->storage_ctx_p, jid, device_id, &item_id, &hash, &bundle_p);
+  if (ret_val || !bundle_p) {
+    return ret_val;
+  }
+
+  return bundle_cache_insert(cache_p, jid, device_id, item_id, hash, bundle_p, entry_pp);
+}
+
+int omemo_bundle_cache_create(size_t capacity, omemo_storage_ctx * storage_ctx_p, omemo_bundle_cache ** cache_pp) {
+  if (!cache_pp) {
+    return OMEMO_ERR_NULL;
+  }
+  if (!capacity) {
+    return OMEMO_ERR;
+  }
+
+  omemo_bundle_cache * cache_p = malloc(sizeof(omemo_bundle_cache));
+  if (!cache_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(cache_p, 0, sizeof(omemo_bundle_cache));
+
+  cache_p->entries_p = g_hash_table_new_full(bundle_cache_key_hash, bundle_cache_key_equal, (void *) 0, bundle_cache_entry_free);
+  cache_p->capacity = capacity;
+  cache_p->storage_ctx_p = storage_ctx_p;
+
+  *cache_pp = cache_p;
+
+  return 0;
+}
+
+int omemo_bundle_cache_import(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id,
+                              const char * item_id, const char * received_bundle, omemo_bundle ** bundle_pp) {
+  if (!cache_p || !jid || !received_bundle || !bundle_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  bundle_cache_entry * entry_p = (void *) 0;
+  gchar * hash_g = (void *) 0;
+  char * hash = (void *) 0;
+  char * item_id_copy = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+
+  ret_val = bundle_cache_lookup(cache_p, jid, device_id, &entry_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  // the hash decides even if the item ID is the same, as a bundle can be republished under a fixed one
+  bundle_content_hash(received_bundle, &hash_g);
+  hash = str_dup(hash_g);
+  item_id_copy = str_dup(item_id);
+  if (!hash_g || !hash || (item_id && !item_id_copy)) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  // unchanged, at most the item ID is new
+  if (entry_p && entry_p->hash && !strcmp(hash, entry_p->hash)) {
+    // set even if saving the new item ID fails, as the bundle is still cached
+    *bundle_pp = entry_p->bundle_p;
+
+    if (item_id_copy && (!entry_p->item_id || strcmp(item_id_copy, entry_p->item_id))) {
+      free(entry_p->item_id);
+      entry_p->item_id = item_id_copy;
+      item_id_copy = (void *) 0;
+
+      if (cache_p->storage_ctx_p) {
+        ret_val = omemo_storage_ctx_bundle_save(cache_p->storage_ctx_p, jid, device_id, entry_p->item_id, entry_p->hash, entry_p->bundle_p);
+      }
+    }
+
+    goto cleanup;
+  }
+
+  ret_val = omemo_bundle_import(received_bundle, &bundle_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = bundle_cache_insert(cache_p, jid, device_id, item_id_copy, hash, bundle_p, &entry_p);
+  item_id_copy = (void *) 0;
+  hash = (void *) 0;
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  // as it is in the memory cache now, the caller gets it even if saving it fails
+  *bundle_pp = entry_p->bundle_p;
+  if (cache_p->storage_ctx_p) {
+    ret_val = omemo_storage_ctx_bundle_save(cache_p->storage_ctx_p, jid, device_id, entry_p->item_id, entry_p->hash, entry_p->bundle_p);
+  }
+
+cleanup:
+  g_free(hash_g);
+  free(hash);
+  free(item_id_copy);
+
+  return ret_val;
+}
+
+int omemo_bundle_cache_get(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id, omemo_bundle ** bundle_pp) {
+  if (!cache_p || !jid || !bundle_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  bundle_cache_entry * entry_p = (void *) 0;
+  int ret_val = bundle_cache_lookup(cache_p, jid, device_id, &entry_p);
+  if (ret_val) {
+    return ret_val;
+  }
+  if (!entry_p) {
+    return 0;
+  }
+
+  *bundle_pp = entry_p->bundle_p;
+
+  return 1;
+}
+
+int omemo_bundle_cache_has_item(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id, const char * item_id) {
+  if (!cache_p || !jid || !item_id) {
+    return OMEMO_ERR_NULL;
+  }
+
+  bundle_cache_entry * entry_p = (void *) 0;
+  int ret_val = bundle_cache_lookup(cache_p, jid, device_id, &entry_p);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  return (entry_p && entry_p->item_id && !strcmp(entry_p->item_id, item_id)) ? 1 : 0;
+}
+
+int omemo_bundle_cache_remove(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id) {
+  if (!cache_p || !jid) {
+    return OMEMO_ERR_NULL;
+  }
+
+  bundle_cache_key key = {jid, device_id};
+  bundle_cache_entry * entry_p = g_hash_table_lookup(cache_p->entries_p, &key);
+  if (entry_p) {
+    bundle_cache_drop(cache_p, entry_p);
+  }
+
+  if (cache_p->storage_ctx_p) {
+    return omemo_storage_ctx_bundle_delete(cache_p->storage_ctx_p, jid, device_id);
+  }
+
+  return 0;
+}
+
+void omemo_bundle_cache_destroy(omemo_bundle_cache * cache_p) {
+  if (cache_p) {
+    g_hash_table_destroy(cache_p->entries_p);
+    free(cache_p);
+  }
+}
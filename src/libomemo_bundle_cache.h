@@ -0,0 +1,89 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "libomemo.h"
+#include "libomemo_storage.h"
+
+/*
+ * Cache for the bundles of other devices, keyed by JID and device ID.
+ *
+ * Parsed bundles are kept in memory, where the least recently used ones are dropped once the capacity is reached.
+ * If a storage context is given, they are also saved in its DB, so that they are still there after a restart
+ * and only have to be fetched again when they changed.
+ * A received bundle replaces the cached one unless it has the same content. The PEP item ID alone is not enough,
+ * as a bundle can be republished under the same one, but it is kept to skip fetching a bundle that is already known.
+ *
+ * A cache must not be used from multiple threads at the same time.
+ */
+
+typedef struct omemo_bundle_cache omemo_bundle_cache;
+
+/**
+ * Creates an empty bundle cache.
+ *
+ * @param capacity How many bundles are kept in memory at most. Has to be at least 1.
+ * @param storage_ctx_p Pointer to the storage context the bundles are saved with, NULL to only keep them in memory.
+ *                      Has to stay open as long as the cache is used.
+ * @param cache_pp Will be set to the allocated cache. Free with omemo_bundle_cache_destroy().
+ * @return 0 on success, negative on error.
+ */
+int omemo_bundle_cache_create(size_t capacity, omemo_storage_ctx * storage_ctx_p, omemo_bundle_cache ** cache_pp);
+
+/**
+ * Imports a received bundle into the cache, unless the cached one for the device has the same content,
+ * i.e. the <bundle> element has the same SHA-256 hash. The PEP item ID does not matter for this.
+ * Only if it changed the XML is parsed and, if there is a storage context, the bundle saved.
+ *
+ * @param cache_p Pointer to the cache.
+ * @param jid The bare JID the bundle belongs to.
+ * @param device_id The ID of the device the bundle belongs to.
+ * @param item_id The ID of the PEP item the bundle was received in, for omemo_bundle_cache_has_item(). Can be NULL.
+ * @param received_bundle The bundle XML, starting at the <items> node, as for omemo_bundle_import().
+ * @param bundle_pp Will be set to the bundle in the cache. Must not be destroyed, and is only valid until the next call
+ *                  of an omemo_bundle_cache function with this cache.
+ * @return 0 on success, negative on error. If the bundle could not be saved, it is still in the memory cache
+ *         and bundle_pp is set anyway.
+ */
+int omemo_bundle_cache_import(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id,
+                              const char * item_id, const char * received_bundle, omemo_bundle ** bundle_pp);
+
+/**
+ * Gets the cached bundle of a device, which is loaded from the storage if it is not in memory.
+ *
+ * @param cache_p Pointer to the cache.
+ * @param jid The bare JID the bundle belongs to.
+ * @param device_id The ID of the device the bundle belongs to.
+ * @param bundle_pp Will be set to the bundle in the cache, with the same restrictions as for omemo_bundle_cache_import().
+ * @return 1 if the bundle is cached, 0 if it is not, negative on error.
+ */
+int omemo_bundle_cache_get(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id, omemo_bundle ** bundle_pp);
+
+/**
+ * Checks whether the cached bundle of a device is the one from the given PEP item,
+ * e.g. to skip fetching it again when the item ID is already known from a notification.
+ *
+ * @param cache_p Pointer to the cache.
+ * @param jid The bare JID the bundle belongs to.
+ * @param device_id The ID of the device the bundle belongs to.
+ * @param item_id The PEP item ID.
+ * @return 1 if it is, 0 if it is not or there is none, negative on error.
+ */
+int omemo_bundle_cache_has_item(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id, const char * item_id);
+
+/**
+ * Removes the bundle of a device from the cache and the storage, e.g. when the device is no longer in the devicelist.
+ *
+ * @param cache_p Pointer to the cache.
+ * @param jid The bare JID the bundle belongs to.
+ * @param device_id The ID of the device the bundle belongs to.
+ * @return 0 on success, negative on error.
+ */
+int omemo_bundle_cache_remove(omemo_bundle_cache * cache_p, const char * jid, uint32_t device_id);
+
+/**
+ * Frees the cache and all bundles in memory. The storage is left as it is.
+ *
+ * @param cache_p Pointer to the cache. Can be NULL.
+ */
+void omemo_bundle_cache_destroy(omemo_bundle_cache * cache_p);
@@ -1,7 +1,11 @@
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <gcrypt.h>
+#include <glib.h>
 
 #include "libomemo.h"
 
@@ -16,89 +20,412 @@ void omemo_default_crypto_init(void) {
 
 }
 
-int omemo_default_crypto_random_bytes(uint8_t ** buf_pp, size_t buf_len, void * user_data_p) {
+#define RANDOM_POOL_SIZE 4096
+// larger requests are not worth going through the pool
+#define RANDOM_POOL_MAX_REQUEST (RANDOM_POOL_SIZE / 4)
+
+// random bytes of one thread that have not been handed out yet, which are the ones from pos to the end
+typedef struct random_pool {
+  uint8_t buf[RANDOM_POOL_SIZE];
+  size_t pos;
+  pid_t pid; // a forked child must not hand out the same bytes as its parent
+} random_pool;
+
+static void random_pool_free(gpointer data) {
+  random_pool * pool_p = data;
+
+  if (pool_p) {
+    memset(pool_p, 0, sizeof(random_pool));
+    free(pool_p);
+  }
+}
+
+// freed automatically when a thread exits
+static GPrivate random_pool_key = G_PRIVATE_INIT(random_pool_free);
+
+int omemo_default_crypto_random_bytes_into(uint8_t * buf_p, size_t buf_len, void * user_data_p) {
   (void) user_data_p;
 
+  if (!buf_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  if (buf_len > RANDOM_POOL_MAX_REQUEST) {
+    gcry_randomize(buf_p, buf_len, GCRY_STRONG_RANDOM);
+    return 0;
+  }
+
+  random_pool * pool_p = g_private_get(&random_pool_key);
+  if (!pool_p) {
+    pool_p = malloc(sizeof(random_pool));
+    if (!pool_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    memset(pool_p, 0, sizeof(random_pool));
+    pool_p->pos = RANDOM_POOL_SIZE;
+    g_private_set(&random_pool_key, pool_p);
+  }
+
+  if (pool_p->pid != getpid()) {
+    pool_p->pos = RANDOM_POOL_SIZE;
+  }
+
+  size_t written = 0;
+  while (written < buf_len) {
+    if (pool_p->pos == RANDOM_POOL_SIZE) {
+      gcry_randomize(pool_p->buf, RANDOM_POOL_SIZE, GCRY_STRONG_RANDOM);
+      pool_p->pos = 0;
+      pool_p->pid = getpid();
+    }
+
+    size_t amount = RANDOM_POOL_SIZE - pool_p->pos;
+    if (amount > buf_len - written) {
+      amount = buf_len - written;
+    }
+
+    // bytes are wiped as soon as they are handed out, so they can never be given out twice
+    memcpy(buf_p + written, pool_p->buf + pool_p->pos, amount);
+    memset(pool_p->buf + pool_p->pos, 0, amount);
+    pool_p->pos += amount;
+    written += amount;
+  }
+
+  return 0;
+}
+
+int omemo_default_crypto_random_bytes(uint8_t ** buf_pp, size_t buf_len, void * user_data_p) {
   if (!buf_pp) {
     return OMEMO_ERR_NULL;
   }
 
+  int ret_val = 0;
+
   uint8_t * buf_p = malloc(sizeof(uint8_t) * buf_len);
   if (!buf_p) {
     return OMEMO_ERR_NOMEM;
   }
 
-  gcry_randomize(buf_p, buf_len, GCRY_STRONG_RANDOM);
+  ret_val = omemo_default_crypto_random_bytes_into(buf_p, buf_len, user_data_p);
+  if (ret_val) {
+    free(buf_p);
+    return ret_val;
+  }
 
   *buf_pp = buf_p;
 
   return 0;
 }
 
-int omemo_default_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
-                                          const uint8_t * iv_p, size_t iv_len,
-                                          const uint8_t * key_p, size_t key_len,
-                                          size_t tag_len,
-                                          void * user_data_p,
-                                          uint8_t ** ciphertext_pp, size_t * ciphertext_len_p,
-                                          uint8_t ** tag_pp) {
-  (void) user_data_p;
+#define AES_GCM_HD_CACHE_SIZE 3
 
-  if (!plaintext_p || !iv_p || !key_p || !ciphertext_pp || !ciphertext_len_p) {
-    return OMEMO_ERR_NULL;
+// opened GCM handles of one thread, one for each AES key size
+typedef struct aes_gcm_hd_cache {
+  gcry_cipher_hd_t hds[AES_GCM_HD_CACHE_SIZE];
+} aes_gcm_hd_cache;
+
+static void aes_gcm_hd_cache_free(gpointer data) {
+  aes_gcm_hd_cache * cache_p = data;
+
+  if (cache_p) {
+    for (size_t i = 0; i < AES_GCM_HD_CACHE_SIZE; i++) {
+      if (cache_p->hds[i]) {
+        gcry_cipher_close(cache_p->hds[i]);
+      }
+    }
+    free(cache_p);
   }
+}
+
+// freed automatically when a thread exits
+static GPrivate aes_gcm_hd_cache_key = G_PRIVATE_INIT(aes_gcm_hd_cache_free);
 
+// sets key and IV of a fresh or reset handle
+static int aes_gcm_setup(gcry_cipher_hd_t cipher_hd, const uint8_t * key_p, size_t key_len, const uint8_t * iv_p, size_t iv_len) {
   int ret_val = 0;
-  int hd_is_init = 0;
 
+  ret_val = gcry_cipher_setkey(cipher_hd, key_p, key_len);
+  if (ret_val) {
+    return -ret_val;
+  }
+
+  ret_val = gcry_cipher_setiv(cipher_hd, iv_p, iv_len);
+  if (ret_val) {
+    return -ret_val;
+  }
+
+  return 0;
+}
+
+/**
+ * Gets a GCM cipher handle with the key and IV already set.
+ * The handle is taken from the cache of the calling thread, or opened if there is none for the key size yet.
+ *
+ * @param key_p Pointer to the key buffer.
+ * @param key_len Length of the key buffer, which also selects the AES variant.
+ * @param iv_p Pointer to the IV buffer.
+ * @param iv_len Length of the IV buffer.
+ * @param cipher_hd_p Will be set to the handle. Give it back with aes_gcm_release() when done.
+ * @return 0 on success, negative on error.
+ */
+static int aes_gcm_acquire(const uint8_t * key_p, size_t key_len, const uint8_t * iv_p, size_t iv_len, gcry_cipher_hd_t * cipher_hd_p) {
+  int ret_val = 0;
   int algo = 0;
+  size_t slot = 0;
+  aes_gcm_hd_cache * cache_p = (void *) 0;
   gcry_cipher_hd_t cipher_hd = NULL;
-  uint8_t * out_p = (void *) 0;
-  uint8_t * tag_p = (void *) 0;
 
   switch(key_len) {
     case 16:
       algo = GCRY_CIPHER_AES128;
+      slot = 0;
       break;
     case 24:
       algo = GCRY_CIPHER_AES192;
+      slot = 1;
       break;
     case 32:
       algo = GCRY_CIPHER_AES256;
+      slot = 2;
       break;
     default:
-      ret_val = OMEMO_ERR_CRYPTO;
-      goto cleanup;
+      return OMEMO_ERR_CRYPTO;
+  }
+
+  cache_p = g_private_get(&aes_gcm_hd_cache_key);
+  if (!cache_p) {
+    cache_p = malloc(sizeof(aes_gcm_hd_cache));
+    if (!cache_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    memset(cache_p, 0, sizeof(aes_gcm_hd_cache));
+    g_private_set(&aes_gcm_hd_cache_key, cache_p);
+  }
+
+  // taken out of the cache while in use, so a failed operation cannot leave a broken handle behind
+  cipher_hd = cache_p->hds[slot];
+  cache_p->hds[slot] = NULL;
+
+  if (cipher_hd) {
+    gcry_cipher_reset(cipher_hd);
+  } else {
+    ret_val = gcry_cipher_open(&cipher_hd, algo, GCRY_CIPHER_MODE_GCM, GCRY_CIPHER_SECURE);
+    if (ret_val) {
+      return -ret_val;
+    }
   }
 
-  ret_val = gcry_cipher_open(&cipher_hd, algo, GCRY_CIPHER_MODE_GCM, GCRY_CIPHER_SECURE);
+  ret_val = aes_gcm_setup(cipher_hd, key_p, key_len, iv_p, iv_len);
   if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
+    gcry_cipher_close(cipher_hd);
+    return ret_val;
   }
-  hd_is_init = 1;
 
-  ret_val = gcry_cipher_setkey(cipher_hd, key_p, key_len);
+  *cipher_hd_p = cipher_hd;
+
+  return 0;
+}
+
+/**
+ * Puts a handle from aes_gcm_acquire() back into the cache of the calling thread.
+ * If the operation failed, the handle is closed instead.
+ *
+ * @param cipher_hd The handle.
+ * @param key_len Length of the key it was acquired for.
+ * @param failed Whether the operation failed.
+ */
+static void aes_gcm_release(gcry_cipher_hd_t cipher_hd, size_t key_len, int failed) {
+  aes_gcm_hd_cache * cache_p = g_private_get(&aes_gcm_hd_cache_key);
+  size_t slot = (key_len == 16) ? 0 : (key_len == 24) ? 1 : 2;
+
+  if (failed || !cache_p || cache_p->hds[slot]) {
+    gcry_cipher_close(cipher_hd);
+    return;
+  }
+
+  cache_p->hds[slot] = cipher_hd;
+}
+
+// encrypts with a handle that has key and IV set, and gets the tag
+static int aes_gcm_encrypt_hd(gcry_cipher_hd_t cipher_hd, const uint8_t * in_p, size_t len, uint8_t * out_p,
+                              uint8_t * tag_p, size_t tag_len) {
+  int ret_val = 0;
+
+  // libgcrypt works in place if no separate input is given
+  if (out_p == in_p) {
+    ret_val = gcry_cipher_encrypt(cipher_hd, out_p, len, (void *) 0, 0);
+  } else {
+    ret_val = gcry_cipher_encrypt(cipher_hd, out_p, len, in_p, len);
+  }
   if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
+    return -ret_val;
   }
 
-  ret_val = gcry_cipher_setiv(cipher_hd, iv_p, iv_len);
+  ret_val = gcry_cipher_gettag(cipher_hd, tag_p, tag_len);
   if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
+    return -ret_val;
   }
 
-  out_p = malloc(sizeof(uint8_t) * plaintext_len);
-  if (!out_p) {
-    ret_val = OMEMO_ERR_NOMEM;
-    goto cleanup;
+  return 0;
+}
+
+// decrypts with a handle that has key and IV set, and checks the tag
+static int aes_gcm_decrypt_hd(gcry_cipher_hd_t cipher_hd, const uint8_t * in_p, size_t len, uint8_t * out_p,
+                              const uint8_t * tag_p, size_t tag_len) {
+  int ret_val = 0;
+
+  if (out_p == in_p) {
+    ret_val = gcry_cipher_decrypt(cipher_hd, out_p, len, (void *) 0, 0);
+  } else {
+    ret_val = gcry_cipher_decrypt(cipher_hd, out_p, len, in_p, len);
+  }
+  if (ret_val) {
+    return -ret_val;
   }
 
-  ret_val = gcry_cipher_encrypt(cipher_hd, out_p, plaintext_len, plaintext_p, plaintext_len);
+  ret_val = gcry_cipher_checktag(cipher_hd, tag_p, tag_len);
   if (ret_val) {
-    ret_val = -ret_val;
+    // unauthenticated plaintext must not be handed out
+    memset(out_p, 0, len);
+    return OMEMO_ERR_AUTH_FAIL;
+  }
+
+  return 0;
+}
+
+/**
+ * Runs a batch of operations. Consecutive operations with the same key size share one handle,
+ * which only gets the next key and IV set instead of going through the cache each time.
+ *
+ * @param ops_p Pointer to the array of operations.
+ * @param ops_len Length of the array.
+ * @param encrypt Whether to encrypt or decrypt.
+ * @return 0 if all operations succeeded, otherwise the status of the first one that failed.
+ */
+static int aes_gcm_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, bool encrypt) {
+  if (!ops_p && ops_len) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  gcry_cipher_hd_t cipher_hd = NULL;
+  size_t hd_key_len = 0;
+
+  for (size_t i = 0; i < ops_len; i++) {
+    omemo_aes_gcm_op * op_p = &ops_p[i];
+
+    if (!op_p->iv_p || !op_p->key_p || !op_p->in_p || !op_p->out_p || !op_p->tag_p) {
+      op_p->status = OMEMO_ERR_NULL;
+    } else if (cipher_hd && hd_key_len == op_p->key_len) {
+      gcry_cipher_reset(cipher_hd);
+      op_p->status = aes_gcm_setup(cipher_hd, op_p->key_p, op_p->key_len, op_p->iv_p, op_p->iv_len);
+    } else {
+      if (cipher_hd) {
+        aes_gcm_release(cipher_hd, hd_key_len, 0);
+        cipher_hd = NULL;
+      }
+      op_p->status = aes_gcm_acquire(op_p->key_p, op_p->key_len, op_p->iv_p, op_p->iv_len, &cipher_hd);
+      hd_key_len = op_p->key_len;
+    }
+
+    if (!op_p->status) {
+      if (encrypt) {
+        op_p->status = aes_gcm_encrypt_hd(cipher_hd, op_p->in_p, op_p->len, op_p->out_p, op_p->tag_p, op_p->tag_len);
+      } else {
+        op_p->status = aes_gcm_decrypt_hd(cipher_hd, op_p->in_p, op_p->len, op_p->out_p, op_p->tag_p, op_p->tag_len);
+      }
+    }
+
+    // a wrong tag leaves the handle usable, other errors might not
+    if (op_p->status && op_p->status != OMEMO_ERR_AUTH_FAIL && op_p->status != OMEMO_ERR_NULL && cipher_hd) {
+      aes_gcm_release(cipher_hd, hd_key_len, 1);
+      cipher_hd = NULL;
+    }
+
+    if (op_p->status && !ret_val) {
+      ret_val = op_p->status;
+    }
+  }
+
+  if (cipher_hd) {
+    aes_gcm_release(cipher_hd, hd_key_len, 0);
+  }
+
+  return ret_val;
+}
+
+int omemo_default_crypto_aes_gcm_encrypt_into( const uint8_t * plaintext_p, size_t plaintext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               void * user_data_p,
+                                               uint8_t * ciphertext_p,
+                                               uint8_t * tag_p, size_t tag_len) {
+  (void) user_data_p;
+
+  if (!plaintext_p || !iv_p || !key_p || !ciphertext_p || !tag_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  gcry_cipher_hd_t cipher_hd = NULL;
+
+  ret_val = aes_gcm_acquire(key_p, key_len, iv_p, iv_len, &cipher_hd);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  ret_val = aes_gcm_encrypt_hd(cipher_hd, plaintext_p, plaintext_len, ciphertext_p, tag_p, tag_len);
+
+  aes_gcm_release(cipher_hd, key_len, ret_val);
+
+  return ret_val;
+}
+
+int omemo_default_crypto_aes_gcm_decrypt_into( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               const uint8_t * tag_p, size_t tag_len,
+                                               void * user_data_p,
+                                               uint8_t * plaintext_p) {
+  (void) user_data_p;
+
+  if (!ciphertext_p || !iv_p || !key_p || !tag_p || !plaintext_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  gcry_cipher_hd_t cipher_hd = NULL;
+
+  ret_val = aes_gcm_acquire(key_p, key_len, iv_p, iv_len, &cipher_hd);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  ret_val = aes_gcm_decrypt_hd(cipher_hd, ciphertext_p, ciphertext_len, plaintext_p, tag_p, tag_len);
+
+  aes_gcm_release(cipher_hd, key_len, ret_val);
+
+  return ret_val;
+}
+
+int omemo_default_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
+                                          const uint8_t * iv_p, size_t iv_len,
+                                          const uint8_t * key_p, size_t key_len,
+                                          size_t tag_len,
+                                          void * user_data_p,
+                                          uint8_t ** ciphertext_pp, size_t * ciphertext_len_p,
+                                          uint8_t ** tag_pp) {
+  if (!plaintext_p || !iv_p || !key_p || !ciphertext_pp || !ciphertext_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  uint8_t * out_p = (void *) 0;
+  uint8_t * tag_p = (void *) 0;
+
+  out_p = malloc(sizeof(uint8_t) * plaintext_len);
+  if (!out_p) {
+    ret_val = OMEMO_ERR_NOMEM;
     goto cleanup;
   }
 
@@ -108,9 +435,13 @@ int omemo_default_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t pl
     goto cleanup;
   }
 
-  ret_val = gcry_cipher_gettag(cipher_hd, tag_p, tag_len);
+  ret_val = omemo_default_crypto_aes_gcm_encrypt_into(plaintext_p, plaintext_len,
+                                                      iv_p, iv_len,
+                                                      key_p, key_len,
+                                                      user_data_p,
+                                                      out_p,
+                                                      tag_p, tag_len);
   if (ret_val) {
-    ret_val = -ret_val;
     goto cleanup;
   }
 
@@ -123,9 +454,6 @@ cleanup:
     free(out_p);
     free(tag_p);
   }
-  if (hd_is_init) {
-    gcry_cipher_close(cipher_hd);
-  }
 
   return ret_val;
 }
@@ -136,68 +464,26 @@ int omemo_default_crypto_aes_gcm_decrypt( const uint8_t * ciphertext_p, size_t c
                                           uint8_t * tag_p, size_t tag_len,
                                           void * user_data_p,
                                           uint8_t ** plaintext_pp, size_t * plaintext_len_p) {
-  (void) user_data_p;
-
   if (!ciphertext_p || !iv_p || !key_p || !tag_p || !plaintext_pp || !plaintext_len_p) {
     return OMEMO_ERR_NULL;
   }
 
   int ret_val = 0;
-  int hd_is_init = 0;
-
-  int algo = 0;
-  gcry_cipher_hd_t cipher_hd = NULL;
   uint8_t * out_p = (void *) 0;
 
-  switch(key_len) {
-    case 16:
-      algo = GCRY_CIPHER_AES128;
-      break;
-    case 24:
-      algo = GCRY_CIPHER_AES192;
-      break;
-    case 32:
-      algo = GCRY_CIPHER_AES256;
-      break;
-    default:
-      ret_val = OMEMO_ERR_CRYPTO;
-      goto cleanup;
-  }
-
-  ret_val = gcry_cipher_open(&cipher_hd, algo, GCRY_CIPHER_MODE_GCM, GCRY_CIPHER_SECURE);
-  if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
-  }
-  hd_is_init = 1;
-
-  ret_val = gcry_cipher_setkey(cipher_hd, key_p, key_len);
-  if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
-  }
-
-  ret_val = gcry_cipher_setiv(cipher_hd, iv_p, iv_len);
-  if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
-  }
-
   out_p = malloc(sizeof(uint8_t) * ciphertext_len);
   if (!out_p) {
     ret_val = OMEMO_ERR_NOMEM;
     goto cleanup;
   }
 
-  ret_val = gcry_cipher_decrypt(cipher_hd, out_p, ciphertext_len, ciphertext_p, ciphertext_len);
-  if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
-  }
-
-  ret_val = gcry_cipher_checktag(cipher_hd, tag_p, tag_len);
+  ret_val = omemo_default_crypto_aes_gcm_decrypt_into(ciphertext_p, ciphertext_len,
+                                                      iv_p, iv_len,
+                                                      key_p, key_len,
+                                                      tag_p, tag_len,
+                                                      user_data_p,
+                                                      out_p);
   if (ret_val) {
-    ret_val = OMEMO_ERR_AUTH_FAIL;
     goto cleanup;
   }
 
@@ -209,14 +495,24 @@ cleanup:
     free(out_p);
   }
 
-  if (hd_is_init) {
-    gcry_cipher_close(cipher_hd);
-  }
-
   return ret_val;
 }
 
+int omemo_default_crypto_aes_gcm_encrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p) {
+  (void) user_data_p;
 
-void omemo_default_crypto_teardown(void) {
+  return aes_gcm_batch(ops_p, ops_len, true);
+}
 
+int omemo_default_crypto_aes_gcm_decrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p) {
+  (void) user_data_p;
+
+  return aes_gcm_batch(ops_p, ops_len, false);
+}
+
+
+void omemo_default_crypto_teardown(void) {
+  // the caches of other threads are freed when they exit
+  g_private_replace(&aes_gcm_hd_cache_key, (void *) 0);
+  g_private_replace(&random_pool_key, (void *) 0);
 }
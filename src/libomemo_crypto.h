@@ -2,6 +2,8 @@
 
 #include <inttypes.h>
 
+#include "libomemo.h"
+
 /**
  * If these default implementations are used, OpenSSL needs to be initialised.
  * In case it is used for providing axolotl crypto, the init functions must NOT be called.
@@ -10,6 +12,12 @@ void omemo_default_crypto_init(void);
 
 int omemo_default_crypto_random_bytes(uint8_t ** buf_pp, size_t buf_len, void * user_data_p);
 
+/**
+ * Small requests are served from a pool of random bytes per thread, which is refilled in large blocks.
+ * Handed out bytes are wiped from the pool right away.
+ */
+int omemo_default_crypto_random_bytes_into(uint8_t * buf_p, size_t buf_len, void * user_data_p);
+
 int omemo_default_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
                                           const uint8_t * iv_p, size_t iv_len,
                                           const uint8_t * key_p, size_t key_len,
@@ -25,4 +33,29 @@ int omemo_default_crypto_aes_gcm_decrypt( const uint8_t * ciphertext_p, size_t c
                                           void * user_data_p,
                                           uint8_t ** plaintext_pp, size_t * plaintext_len_p);
 
+int omemo_default_crypto_aes_gcm_encrypt_into( const uint8_t * plaintext_p, size_t plaintext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               void * user_data_p,
+                                               uint8_t * ciphertext_p,
+                                               uint8_t * tag_p, size_t tag_len);
+
+int omemo_default_crypto_aes_gcm_decrypt_into( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               const uint8_t * tag_p, size_t tag_len,
+                                               void * user_data_p,
+                                               uint8_t * plaintext_p);
+
+/**
+ * Consecutive operations with the same key size share one cipher handle, so sorting a batch by key size helps.
+ */
+int omemo_default_crypto_aes_gcm_encrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
+
+int omemo_default_crypto_aes_gcm_decrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
+
+/**
+ * Closes the cipher handles and wipes the random pool the default implementations keep for the calling thread.
+ * Those of other threads are freed when the threads exit.
+ */
 void omemo_default_crypto_teardown(void);
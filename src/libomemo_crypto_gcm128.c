@@ -0,0 +1,464 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libomemo.h"
+#include "libomemo_crypto.h"
+#include "libomemo_crypto_gcm128.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GCM128_X86 1
+#include <immintrin.h>
+#else
+#define GCM128_X86 0
+#endif
+
+#define GCM128_BLOCK_LEN 16
+// beyond this, the setup is amortized and the wider vector code of libgcrypt (AVX2, VAES) is faster
+#define GCM128_KERNEL_MAX_LEN 2048
+
+// whether the operation has the parameters the kernel is fixed to, and is short enough to profit from it
+static bool gcm128_use_kernel(size_t len, size_t iv_len, size_t key_len, size_t tag_len) {
+  return iv_len == OMEMO_AES_GCM_IV_LENGTH && key_len == OMEMO_AES_128_KEY_LENGTH && tag_len == OMEMO_AES_GCM_TAG_LENGTH
+         && len <= GCM128_KERNEL_MAX_LEN && omemo_gcm128_crypto_is_accelerated();
+}
+
+#if GCM128_X86
+
+#define GCM128_TARGET __attribute__((target("aes,pclmul,ssse3")))
+
+GCM128_TARGET
+static __m128i gcm128_key_step(__m128i key, __m128i gen) {
+  gen = _mm_shuffle_epi32(gen, 0xFF);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, gen);
+}
+
+// the round constant has to be an immediate
+#define GCM128_KEY_EXPAND(rk, i, rcon) rk[i] = gcm128_key_step(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+GCM128_TARGET
+static void gcm128_key_expand(const uint8_t * key_p, __m128i rk[11]) {
+  rk[0] = _mm_loadu_si128((const __m128i *) key_p);
+  GCM128_KEY_EXPAND(rk, 1, 0x01);
+  GCM128_KEY_EXPAND(rk, 2, 0x02);
+  GCM128_KEY_EXPAND(rk, 3, 0x04);
+  GCM128_KEY_EXPAND(rk, 4, 0x08);
+  GCM128_KEY_EXPAND(rk, 5, 0x10);
+  GCM128_KEY_EXPAND(rk, 6, 0x20);
+  GCM128_KEY_EXPAND(rk, 7, 0x40);
+  GCM128_KEY_EXPAND(rk, 8, 0x80);
+  GCM128_KEY_EXPAND(rk, 9, 0x1B);
+  GCM128_KEY_EXPAND(rk, 10, 0x36);
+}
+
+GCM128_TARGET
+static __m128i gcm128_aes(const __m128i rk[11], __m128i block) {
+  block = _mm_xor_si128(block, rk[0]);
+  for (size_t r = 1; r < 10; r++) {
+    block = _mm_aesenc_si128(block, rk[r]);
+  }
+  return _mm_aesenclast_si128(block, rk[10]);
+}
+
+/*
+ * Multiplication in GF(2^128) as defined for GHASH, on byte-reversed operands.
+ * Follows the carry-less multiplication and reduction by Gueron and Kounavis (Intel white paper, 2010):
+ * the 256 bit product is shifted left by one to account for the reflected bit order, then reduced.
+ * Both steps are linear, so the products of several blocks can be summed up and reduced only once.
+ */
+GCM128_TARGET
+static void gcm128_clmul(__m128i a, __m128i b, __m128i * lo_p, __m128i * hi_p) {
+  __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+
+  *lo_p = _mm_xor_si128(*lo_p, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+  *hi_p = _mm_xor_si128(*hi_p, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+GCM128_TARGET
+static __m128i gcm128_reduce(__m128i lo, __m128i hi) {
+  __m128i t1, t2, t3;
+
+  t1 = _mm_srli_epi32(lo, 31);
+  t2 = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  t3 = _mm_srli_si128(t1, 12);
+  t2 = _mm_slli_si128(t2, 4);
+  t1 = _mm_slli_si128(t1, 4);
+  lo = _mm_or_si128(lo, t1);
+  hi = _mm_or_si128(hi, t2);
+  hi = _mm_or_si128(hi, t3);
+
+  t1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+  t2 = _mm_srli_si128(t1, 4);
+  t1 = _mm_slli_si128(t1, 12);
+  lo = _mm_xor_si128(lo, t1);
+
+  t3 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+  t3 = _mm_xor_si128(t3, t2);
+  lo = _mm_xor_si128(lo, t3);
+
+  return _mm_xor_si128(hi, lo);
+}
+
+GCM128_TARGET
+static __m128i gcm128_gfmul(__m128i a, __m128i b) {
+  __m128i lo = _mm_setzero_si128();
+  __m128i hi = _mm_setzero_si128();
+
+  gcm128_clmul(a, b, &lo, &hi);
+
+  return gcm128_reduce(lo, hi);
+}
+
+// how many blocks are processed at a time
+#define GCM128_LANES 8
+// spelled out, so that the lanes stay in registers without relying on the optimizer to unroll
+#define GCM128_EACH_LANE(step) step(0) step(1) step(2) step(3) step(4) step(5) step(6) step(7)
+
+/**
+ * Encrypts or decrypts with AES-128-GCM and computes the tag over the ciphertext.
+ * Eight blocks are processed at a time, so their AES rounds can overlap in the pipeline,
+ * and they are hashed with the powers of H up to H^8 and a single reduction.
+ *
+ * @param key_p Pointer to the 16 byte key.
+ * @param iv_p Pointer to the 12 byte IV.
+ * @param in_p Pointer to the input.
+ * @param len Length of input and output.
+ * @param out_p Pointer to the output, can be the same as in_p.
+ * @param encrypt Whether the input is the plaintext or the ciphertext.
+ * @param tag_p Pointer to a 16 byte buffer the computed tag is written to.
+ */
+GCM128_TARGET
+static void gcm128_crypt_x86(const uint8_t * key_p, const uint8_t * iv_p, const uint8_t * in_p, size_t len,
+                             uint8_t * out_p, bool encrypt, uint8_t * tag_p) {
+  const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+  __m128i rk[11];
+  __m128i h;
+  __m128i h_pow[GCM128_LANES];
+  __m128i j0;
+  __m128i ctr;
+  __m128i ghash = _mm_setzero_si128();
+  uint8_t block[GCM128_BLOCK_LEN] = {0};
+  size_t i = 0;
+
+  gcm128_key_expand(key_p, rk);
+  h = _mm_shuffle_epi8(gcm128_aes(rk, _mm_setzero_si128()), bswap);
+
+  memcpy(block, iv_p, OMEMO_AES_GCM_IV_LENGTH);
+  block[GCM128_BLOCK_LEN - 1] = 1;
+  j0 = _mm_loadu_si128((const __m128i *) block);
+  // byte-reversed, the big endian counter is the lowest 32 bit lane and can be incremented with a plain add
+  ctr = _mm_shuffle_epi8(j0, bswap);
+
+  // short messages are not worth computing the powers for
+  if (len >= GCM128_LANES * GCM128_BLOCK_LEN) {
+    h_pow[0] = h;
+    for (size_t k = 1; k < GCM128_LANES; k++) {
+      h_pow[k] = gcm128_gfmul(h_pow[k - 1], h);
+    }
+  }
+
+  for (; i + GCM128_LANES * GCM128_BLOCK_LEN <= len; i += GCM128_LANES * GCM128_BLOCK_LEN) {
+    __m128i ks[GCM128_LANES];
+    __m128i c[GCM128_LANES];
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+
+#define GCM128_CTR(k) ctr = _mm_add_epi32(ctr, one); ks[k] = _mm_xor_si128(_mm_shuffle_epi8(ctr, bswap), rk[0]);
+#define GCM128_ROUND(k) ks[k] = _mm_aesenc_si128(ks[k], rk[r]);
+#define GCM128_LAST(k) ks[k] = _mm_aesenclast_si128(ks[k], rk[10]);
+#define GCM128_XOR(k) { \
+      __m128i in = _mm_loadu_si128((const __m128i *) (in_p + i + k * GCM128_BLOCK_LEN)); \
+      __m128i out = _mm_xor_si128(in, ks[k]); \
+      _mm_storeu_si128((__m128i *) (out_p + i + k * GCM128_BLOCK_LEN), out); \
+      c[k] = _mm_shuffle_epi8(encrypt ? out : in, bswap); \
+    }
+#define GCM128_HASH(k) gcm128_clmul(c[k], h_pow[GCM128_LANES - 1 - k], &lo, &hi);
+
+    GCM128_EACH_LANE(GCM128_CTR)
+    for (size_t r = 1; r < 10; r++) {
+      GCM128_EACH_LANE(GCM128_ROUND)
+    }
+    GCM128_EACH_LANE(GCM128_LAST)
+    GCM128_EACH_LANE(GCM128_XOR)
+
+    // (((Y ^ C1) * H ^ C2) * H ... ^ C8) * H = (Y ^ C1) * H^8 ^ C2 * H^7 ^ ... ^ C8 * H
+    c[0] = _mm_xor_si128(c[0], ghash);
+    GCM128_EACH_LANE(GCM128_HASH)
+    ghash = gcm128_reduce(lo, hi);
+
+#undef GCM128_CTR
+#undef GCM128_ROUND
+#undef GCM128_LAST
+#undef GCM128_XOR
+#undef GCM128_HASH
+  }
+
+  for (; i + GCM128_BLOCK_LEN <= len; i += GCM128_BLOCK_LEN) {
+    ctr = _mm_add_epi32(ctr, one);
+    __m128i in = _mm_loadu_si128((const __m128i *) (in_p + i));
+    __m128i out = _mm_xor_si128(in, gcm128_aes(rk, _mm_shuffle_epi8(ctr, bswap)));
+    _mm_storeu_si128((__m128i *) (out_p + i), out);
+    ghash = gcm128_gfmul(_mm_xor_si128(ghash, _mm_shuffle_epi8(encrypt ? out : in, bswap)), h);
+  }
+
+  if (i < len) {
+    size_t rest = len - i;
+
+    ctr = _mm_add_epi32(ctr, one);
+    memset(block, 0, sizeof(block));
+    memcpy(block, in_p + i, rest);
+    __m128i in = _mm_loadu_si128((const __m128i *) block);
+    __m128i out = _mm_xor_si128(in, gcm128_aes(rk, _mm_shuffle_epi8(ctr, bswap)));
+    _mm_storeu_si128((__m128i *) block, out);
+    memcpy(out_p + i, block, rest);
+
+    // the hashed ciphertext is padded with zeros, not with key stream
+    if (encrypt) {
+      memset(block + rest, 0, sizeof(block) - rest);
+      in = _mm_loadu_si128((const __m128i *) block);
+    }
+    ghash = gcm128_gfmul(_mm_xor_si128(ghash, _mm_shuffle_epi8(in, bswap)), h);
+  }
+
+  // lengths in bits, there is no additional data
+  ghash = gcm128_gfmul(_mm_xor_si128(ghash, _mm_set_epi64x(0, (long long) ((uint64_t) len * 8))), h);
+
+  _mm_storeu_si128((__m128i *) tag_p, _mm_xor_si128(_mm_shuffle_epi8(ghash, bswap), gcm128_aes(rk, j0)));
+
+  memset(rk, 0, sizeof(rk));
+  memset(h_pow, 0, sizeof(h_pow));
+  memset(block, 0, sizeof(block));
+}
+
+#endif /* GCM128_X86 */
+
+bool omemo_gcm128_crypto_is_accelerated(void) {
+#if GCM128_X86
+  return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#else
+  return false;
+#endif
+}
+
+int omemo_gcm128_crypto_aes_gcm_encrypt_into( const uint8_t * plaintext_p, size_t plaintext_len,
+                                              const uint8_t * iv_p, size_t iv_len,
+                                              const uint8_t * key_p, size_t key_len,
+                                              void * user_data_p,
+                                              uint8_t * ciphertext_p,
+                                              uint8_t * tag_p, size_t tag_len) {
+  if (!plaintext_p || !iv_p || !key_p || !ciphertext_p || !tag_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+#if GCM128_X86
+  if (gcm128_use_kernel(plaintext_len, iv_len, key_len, tag_len)) {
+    gcm128_crypt_x86(key_p, iv_p, plaintext_p, plaintext_len, ciphertext_p, true, tag_p);
+    return 0;
+  }
+#endif
+
+  return omemo_default_crypto_aes_gcm_encrypt_into(plaintext_p, plaintext_len,
+                                                   iv_p, iv_len,
+                                                   key_p, key_len,
+                                                   user_data_p,
+                                                   ciphertext_p,
+                                                   tag_p, tag_len);
+}
+
+int omemo_gcm128_crypto_aes_gcm_decrypt_into( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                              const uint8_t * iv_p, size_t iv_len,
+                                              const uint8_t * key_p, size_t key_len,
+                                              const uint8_t * tag_p, size_t tag_len,
+                                              void * user_data_p,
+                                              uint8_t * plaintext_p) {
+  if (!ciphertext_p || !iv_p || !key_p || !tag_p || !plaintext_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+#if GCM128_X86
+  if (gcm128_use_kernel(ciphertext_len, iv_len, key_len, tag_len)) {
+    uint8_t tag_computed[OMEMO_AES_GCM_TAG_LENGTH];
+    uint8_t diff = 0;
+
+    gcm128_crypt_x86(key_p, iv_p, ciphertext_p, ciphertext_len, plaintext_p, false, tag_computed);
+
+    // compared in constant time
+    for (size_t i = 0; i < OMEMO_AES_GCM_TAG_LENGTH; i++) {
+      diff |= tag_computed[i] ^ tag_p[i];
+    }
+    memset(tag_computed, 0, sizeof(tag_computed));
+
+    if (diff) {
+      // unauthenticated plaintext must not be handed out
+      memset(plaintext_p, 0, ciphertext_len);
+      return OMEMO_ERR_AUTH_FAIL;
+    }
+
+    return 0;
+  }
+#endif
+
+  return omemo_default_crypto_aes_gcm_decrypt_into(ciphertext_p, ciphertext_len,
+                                                   iv_p, iv_len,
+                                                   key_p, key_len,
+                                                   tag_p, tag_len,
+                                                   user_data_p,
+                                                   plaintext_p);
+}
+
+int omemo_gcm128_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
+                                         const uint8_t * iv_p, size_t iv_len,
+                                         const uint8_t * key_p, size_t key_len,
+                                         size_t tag_len,
+                                         void * user_data_p,
+                                         uint8_t ** ciphertext_pp, size_t * ciphertext_len_p,
+                                         uint8_t ** tag_pp) {
+  if (!plaintext_p || !iv_p || !key_p || !ciphertext_pp || !ciphertext_len_p || !tag_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  uint8_t * out_p = (void *) 0;
+  uint8_t * tag_p = (void *) 0;
+
+  // an empty ciphertext still needs a valid pointer
+  out_p = malloc(sizeof(uint8_t) * (plaintext_len ? plaintext_len : 1));
+  if (!out_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  tag_p = malloc(sizeof(uint8_t) * tag_len);
+  if (!tag_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  ret_val = omemo_gcm128_crypto_aes_gcm_encrypt_into(plaintext_p, plaintext_len,
+                                                     iv_p, iv_len,
+                                                     key_p, key_len,
+                                                     user_data_p,
+                                                     out_p,
+                                                     tag_p, tag_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  *ciphertext_pp = out_p;
+  *ciphertext_len_p = plaintext_len;
+  *tag_pp = tag_p;
+
+cleanup:
+  if (ret_val) {
+    free(out_p);
+    free(tag_p);
+  }
+
+  return ret_val;
+}
+
+int omemo_gcm128_crypto_aes_gcm_decrypt( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                         const uint8_t * iv_p, size_t iv_len,
+                                         const uint8_t * key_p, size_t key_len,
+                                         uint8_t * tag_p, size_t tag_len,
+                                         void * user_data_p,
+                                         uint8_t ** plaintext_pp, size_t * plaintext_len_p) {
+  if (!ciphertext_p || !iv_p || !key_p || !tag_p || !plaintext_pp || !plaintext_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  uint8_t * out_p = (void *) 0;
+
+  out_p = malloc(sizeof(uint8_t) * (ciphertext_len ? ciphertext_len : 1));
+  if (!out_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  ret_val = omemo_gcm128_crypto_aes_gcm_decrypt_into(ciphertext_p, ciphertext_len,
+                                                     iv_p, iv_len,
+                                                     key_p, key_len,
+                                                     tag_p, tag_len,
+                                                     user_data_p,
+                                                     out_p);
+  if (ret_val) {
+    free(out_p);
+    return ret_val;
+  }
+
+  *plaintext_pp = out_p;
+  *plaintext_len_p = ciphertext_len;
+
+  return 0;
+}
+
+// there is no per call setup to share, so a batch is simply run one operation after the other
+static int gcm128_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, bool encrypt, void * user_data_p) {
+  if (!ops_p && ops_len) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  for (size_t i = 0; i < ops_len; i++) {
+    omemo_aes_gcm_op * op_p = &ops_p[i];
+
+    if (encrypt) {
+      op_p->status = omemo_gcm128_crypto_aes_gcm_encrypt_into(op_p->in_p, op_p->len,
+                                                              op_p->iv_p, op_p->iv_len,
+                                                              op_p->key_p, op_p->key_len,
+                                                              user_data_p,
+                                                              op_p->out_p,
+                                                              op_p->tag_p, op_p->tag_len);
+    } else {
+      op_p->status = omemo_gcm128_crypto_aes_gcm_decrypt_into(op_p->in_p, op_p->len,
+                                                              op_p->iv_p, op_p->iv_len,
+                                                              op_p->key_p, op_p->key_len,
+                                                              op_p->tag_p, op_p->tag_len,
+                                                              user_data_p,
+                                                              op_p->out_p);
+    }
+
+    if (op_p->status && !ret_val) {
+      ret_val = op_p->status;
+    }
+  }
+
+  return ret_val;
+}
+
+int omemo_gcm128_crypto_aes_gcm_encrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p) {
+  return gcm128_batch(ops_p, ops_len, true, user_data_p);
+}
+
+int omemo_gcm128_crypto_aes_gcm_decrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p) {
+  return gcm128_batch(ops_p, ops_len, false, user_data_p);
+}
+
+int omemo_gcm128_crypto_provider_init(omemo_crypto_provider * crypto_p) {
+  if (!crypto_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  memset(crypto_p, 0, sizeof(omemo_crypto_provider));
+  crypto_p->random_bytes_func = omemo_default_crypto_random_bytes;
+  crypto_p->aes_gcm_encrypt_func = omemo_gcm128_crypto_aes_gcm_encrypt;
+  crypto_p->aes_gcm_decrypt_func = omemo_gcm128_crypto_aes_gcm_decrypt;
+  crypto_p->user_data_p = (void *) 0;
+  crypto_p->aes_gcm_encrypt_into_func = omemo_gcm128_crypto_aes_gcm_encrypt_into;
+  crypto_p->aes_gcm_decrypt_into_func = omemo_gcm128_crypto_aes_gcm_decrypt_into;
+  crypto_p->random_bytes_into_func = omemo_default_crypto_random_bytes_into;
+  crypto_p->aes_gcm_encrypt_batch_func = omemo_gcm128_crypto_aes_gcm_encrypt_batch;
+  crypto_p->aes_gcm_decrypt_batch_func = omemo_gcm128_crypto_aes_gcm_decrypt_batch;
+
+  return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "libomemo.h"
+
+/*
+ * Crypto provider specialized on what OMEMO actually uses: AES-128-GCM with 12 byte IVs and 16 byte tags.
+ *
+ * With exactly these parameters, payloads of up to 2 KiB are encrypted and decrypted by a built-in AES-NI and PCLMULQDQ
+ * kernel if the CPU supports it, which is checked at runtime. It needs no cipher handle, so there is no setup
+ * besides expanding the key, which is what dominates for the short bodies of chat messages.
+ * Everything else, i.e. other parameters, longer payloads, other CPUs and the random bytes,
+ * goes to the default libgcrypt implementation, which is why omemo_default_crypto_init() still has to be called.
+ *
+ * All functions are safe to call from multiple threads.
+ */
+
+/**
+ * @return Whether the CPU supports the built-in kernel.
+ */
+bool omemo_gcm128_crypto_is_accelerated(void);
+
+/**
+ * Fills in a crypto provider with the functions below and the default random bytes functions.
+ *
+ * @param crypto_p Pointer to the crypto provider to fill in.
+ * @return 0 on success, negative on error.
+ */
+int omemo_gcm128_crypto_provider_init(omemo_crypto_provider * crypto_p);
+
+int omemo_gcm128_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
+                                         const uint8_t * iv_p, size_t iv_len,
+                                         const uint8_t * key_p, size_t key_len,
+                                         size_t tag_len,
+                                         void * user_data_p,
+                                         uint8_t ** ciphertext_pp, size_t * ciphertext_len_p,
+                                         uint8_t ** tag_pp);
+
+int omemo_gcm128_crypto_aes_gcm_decrypt( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                         const uint8_t * iv_p, size_t iv_len,
+                                         const uint8_t * key_p, size_t key_len,
+                                         uint8_t * tag_p, size_t tag_len,
+                                         void * user_data_p,
+                                         uint8_t ** plaintext_pp, size_t * plaintext_len_p);
+
+int omemo_gcm128_crypto_aes_gcm_encrypt_into( const uint8_t * plaintext_p, size_t plaintext_len,
+                                              const uint8_t * iv_p, size_t iv_len,
+                                              const uint8_t * key_p, size_t key_len,
+                                              void * user_data_p,
+                                              uint8_t * ciphertext_p,
+                                              uint8_t * tag_p, size_t tag_len);
+
+int omemo_gcm128_crypto_aes_gcm_decrypt_into( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                              const uint8_t * iv_p, size_t iv_len,
+                                              const uint8_t * key_p, size_t key_len,
+                                              const uint8_t * tag_p, size_t tag_len,
+                                              void * user_data_p,
+                                              uint8_t * plaintext_p);
+
+int omemo_gcm128_crypto_aes_gcm_encrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
+
+int omemo_gcm128_crypto_aes_gcm_decrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
@@ -0,0 +1,436 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "libomemo.h"
+#include "libomemo_crypto_openssl.h"
+
+int omemo_openssl_crypto_random_bytes_into(uint8_t * buf_p, size_t buf_len, void * user_data_p) {
+  (void) user_data_p;
+
+  if (!buf_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  // RAND_bytes() takes an int
+  size_t written = 0;
+  while (written < buf_len) {
+    size_t amount = buf_len - written;
+    if (amount > INT_MAX) {
+      amount = INT_MAX;
+    }
+
+    if (RAND_bytes(buf_p + written, (int) amount) != 1) {
+      return OMEMO_ERR_CRYPTO;
+    }
+    written += amount;
+  }
+
+  return 0;
+}
+
+int omemo_openssl_crypto_random_bytes(uint8_t ** buf_pp, size_t buf_len, void * user_data_p) {
+  if (!buf_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  uint8_t * buf_p = malloc(sizeof(uint8_t) * buf_len);
+  if (!buf_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  ret_val = omemo_openssl_crypto_random_bytes_into(buf_p, buf_len, user_data_p);
+  if (ret_val) {
+    free(buf_p);
+    return ret_val;
+  }
+
+  *buf_pp = buf_p;
+
+  return 0;
+}
+
+#define EVP_GCM_CTX_CACHE_SIZE 3
+
+// cipher contexts of one thread, one for each AES key size
+typedef struct evp_gcm_ctx_cache {
+  EVP_CIPHER_CTX * ctxs[EVP_GCM_CTX_CACHE_SIZE];
+} evp_gcm_ctx_cache;
+
+static void evp_gcm_ctx_cache_free(gpointer data) {
+  evp_gcm_ctx_cache * cache_p = data;
+
+  if (cache_p) {
+    for (size_t i = 0; i < EVP_GCM_CTX_CACHE_SIZE; i++) {
+      EVP_CIPHER_CTX_free(cache_p->ctxs[i]);
+    }
+    free(cache_p);
+  }
+}
+
+// freed automatically when a thread exits
+static GPrivate evp_gcm_ctx_cache_key = G_PRIVATE_INIT(evp_gcm_ctx_cache_free);
+
+/**
+ * Gets a cipher context set up for AES-GCM with the given key size, but without key and IV.
+ * The context is taken from the cache of the calling thread, or created if there is none for the key size yet.
+ *
+ * @param key_len Length of the key, which selects the AES variant.
+ * @param ctx_pp Will be set to the context. Give it back with evp_gcm_release() when done.
+ * @return 0 on success, negative on error.
+ */
+static int evp_gcm_acquire(size_t key_len, EVP_CIPHER_CTX ** ctx_pp) {
+  const EVP_CIPHER * cipher_p = (void *) 0;
+  size_t slot = 0;
+  evp_gcm_ctx_cache * cache_p = (void *) 0;
+  EVP_CIPHER_CTX * ctx_p = (void *) 0;
+
+  switch(key_len) {
+    case 16:
+      cipher_p = EVP_aes_128_gcm();
+      slot = 0;
+      break;
+    case 24:
+      cipher_p = EVP_aes_192_gcm();
+      slot = 1;
+      break;
+    case 32:
+      cipher_p = EVP_aes_256_gcm();
+      slot = 2;
+      break;
+    default:
+      return OMEMO_ERR_CRYPTO;
+  }
+
+  cache_p = g_private_get(&evp_gcm_ctx_cache_key);
+  if (!cache_p) {
+    cache_p = malloc(sizeof(evp_gcm_ctx_cache));
+    if (!cache_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+    memset(cache_p, 0, sizeof(evp_gcm_ctx_cache));
+    g_private_set(&evp_gcm_ctx_cache_key, cache_p);
+  }
+
+  // taken out of the cache while in use, so a failed operation cannot leave a broken context behind
+  ctx_p = cache_p->ctxs[slot];
+  cache_p->ctxs[slot] = (void *) 0;
+
+  if (!ctx_p) {
+    ctx_p = EVP_CIPHER_CTX_new();
+    if (!ctx_p) {
+      return OMEMO_ERR_NOMEM;
+    }
+
+    if (EVP_CipherInit_ex(ctx_p, cipher_p, (void *) 0, (void *) 0, (void *) 0, 1) != 1) {
+      EVP_CIPHER_CTX_free(ctx_p);
+      return OMEMO_ERR_CRYPTO;
+    }
+  }
+
+  *ctx_pp = ctx_p;
+
+  return 0;
+}
+
+/**
+ * Puts a context from evp_gcm_acquire() back into the cache of the calling thread.
+ * If the operation failed for another reason than a wrong tag, the context is freed instead.
+ *
+ * @param ctx_p Pointer to the context.
+ * @param key_len Length of the key it was acquired for.
+ * @param status The result of the operation.
+ */
+static void evp_gcm_release(EVP_CIPHER_CTX * ctx_p, size_t key_len, int status) {
+  evp_gcm_ctx_cache * cache_p = g_private_get(&evp_gcm_ctx_cache_key);
+  size_t slot = (key_len == 16) ? 0 : (key_len == 24) ? 1 : 2;
+
+  if ((status && status != OMEMO_ERR_AUTH_FAIL) || !cache_p || cache_p->ctxs[slot]) {
+    EVP_CIPHER_CTX_free(ctx_p);
+    return;
+  }
+
+  cache_p->ctxs[slot] = ctx_p;
+}
+
+/**
+ * Runs one operation with a context from evp_gcm_acquire().
+ * Only key and IV are set, the cipher stays as it is.
+ *
+ * @return 0 on success, OMEMO_ERR_AUTH_FAIL if the tag does not match when decrypting, negative on other errors.
+ */
+static int evp_gcm_run(EVP_CIPHER_CTX * ctx_p, bool encrypt,
+                       const uint8_t * iv_p, size_t iv_len, const uint8_t * key_p,
+                       const uint8_t * in_p, size_t len, uint8_t * out_p,
+                       uint8_t * tag_p, size_t tag_len) {
+  int out_len = 0;
+  int final_len = 0;
+
+  if (len > INT_MAX || iv_len > INT_MAX || tag_len > INT_MAX) {
+    return OMEMO_ERR_CRYPTO;
+  }
+
+  if (EVP_CipherInit_ex(ctx_p, (void *) 0, (void *) 0, (void *) 0, (void *) 0, encrypt ? 1 : 0) != 1
+      || EVP_CIPHER_CTX_ctrl(ctx_p, EVP_CTRL_GCM_SET_IVLEN, (int) iv_len, (void *) 0) != 1
+      || EVP_CipherInit_ex(ctx_p, (void *) 0, (void *) 0, key_p, iv_p, -1) != 1) {
+    return OMEMO_ERR_CRYPTO;
+  }
+
+  // GCM is a stream mode, so the update writes all of the output and works in place
+  if (EVP_CipherUpdate(ctx_p, out_p, &out_len, in_p, (int) len) != 1) {
+    return OMEMO_ERR_CRYPTO;
+  }
+
+  if (encrypt) {
+    if (EVP_CipherFinal_ex(ctx_p, out_p + out_len, &final_len) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx_p, EVP_CTRL_GCM_GET_TAG, (int) tag_len, tag_p) != 1) {
+      return OMEMO_ERR_CRYPTO;
+    }
+    return 0;
+  }
+
+  if (EVP_CIPHER_CTX_ctrl(ctx_p, EVP_CTRL_GCM_SET_TAG, (int) tag_len, tag_p) != 1) {
+    return OMEMO_ERR_CRYPTO;
+  }
+  if (EVP_CipherFinal_ex(ctx_p, out_p + out_len, &final_len) != 1) {
+    // unauthenticated plaintext must not be handed out
+    memset(out_p, 0, len);
+    return OMEMO_ERR_AUTH_FAIL;
+  }
+
+  return 0;
+}
+
+int omemo_openssl_crypto_aes_gcm_encrypt_into( const uint8_t * plaintext_p, size_t plaintext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               void * user_data_p,
+                                               uint8_t * ciphertext_p,
+                                               uint8_t * tag_p, size_t tag_len) {
+  (void) user_data_p;
+
+  if (!plaintext_p || !iv_p || !key_p || !ciphertext_p || !tag_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  EVP_CIPHER_CTX * ctx_p = (void *) 0;
+
+  ret_val = evp_gcm_acquire(key_len, &ctx_p);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  ret_val = evp_gcm_run(ctx_p, true, iv_p, iv_len, key_p, plaintext_p, plaintext_len, ciphertext_p, tag_p, tag_len);
+
+  evp_gcm_release(ctx_p, key_len, ret_val);
+
+  return ret_val;
+}
+
+int omemo_openssl_crypto_aes_gcm_decrypt_into( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               const uint8_t * tag_p, size_t tag_len,
+                                               void * user_data_p,
+                                               uint8_t * plaintext_p) {
+  (void) user_data_p;
+
+  if (!ciphertext_p || !iv_p || !key_p || !tag_p || !plaintext_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  EVP_CIPHER_CTX * ctx_p = (void *) 0;
+
+  ret_val = evp_gcm_acquire(key_len, &ctx_p);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  // the tag is only read, EVP_CIPHER_CTX_ctrl() just does not take it as const
+  ret_val = evp_gcm_run(ctx_p, false, iv_p, iv_len, key_p, ciphertext_p, ciphertext_len, plaintext_p, (uint8_t *) tag_p, tag_len);
+
+  evp_gcm_release(ctx_p, key_len, ret_val);
+
+  return ret_val;
+}
+
+int omemo_openssl_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
+                                          const uint8_t * iv_p, size_t iv_len,
+                                          const uint8_t * key_p, size_t key_len,
+                                          size_t tag_len,
+                                          void * user_data_p,
+                                          uint8_t ** ciphertext_pp, size_t * ciphertext_len_p,
+                                          uint8_t ** tag_pp) {
+  if (!plaintext_p || !iv_p || !key_p || !ciphertext_pp || !ciphertext_len_p || !tag_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  uint8_t * out_p = (void *) 0;
+  uint8_t * tag_p = (void *) 0;
+
+  // an empty ciphertext still needs a valid pointer
+  out_p = malloc(sizeof(uint8_t) * (plaintext_len ? plaintext_len : 1));
+  if (!out_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  tag_p = malloc(sizeof(uint8_t) * tag_len);
+  if (!tag_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  ret_val = omemo_openssl_crypto_aes_gcm_encrypt_into(plaintext_p, plaintext_len,
+                                                      iv_p, iv_len,
+                                                      key_p, key_len,
+                                                      user_data_p,
+                                                      out_p,
+                                                      tag_p, tag_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  *ciphertext_pp = out_p;
+  *ciphertext_len_p = plaintext_len;
+  *tag_pp = tag_p;
+
+cleanup:
+  if (ret_val) {
+    free(out_p);
+    free(tag_p);
+  }
+
+  return ret_val;
+}
+
+int omemo_openssl_crypto_aes_gcm_decrypt( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                          const uint8_t * iv_p, size_t iv_len,
+                                          const uint8_t * key_p, size_t key_len,
+                                          uint8_t * tag_p, size_t tag_len,
+                                          void * user_data_p,
+                                          uint8_t ** plaintext_pp, size_t * plaintext_len_p) {
+  if (!ciphertext_p || !iv_p || !key_p || !tag_p || !plaintext_pp || !plaintext_len_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  uint8_t * out_p = (void *) 0;
+
+  out_p = malloc(sizeof(uint8_t) * (ciphertext_len ? ciphertext_len : 1));
+  if (!out_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  ret_val = omemo_openssl_crypto_aes_gcm_decrypt_into(ciphertext_p, ciphertext_len,
+                                                      iv_p, iv_len,
+                                                      key_p, key_len,
+                                                      tag_p, tag_len,
+                                                      user_data_p,
+                                                      out_p);
+  if (ret_val) {
+    free(out_p);
+    return ret_val;
+  }
+
+  *plaintext_pp = out_p;
+  *plaintext_len_p = ciphertext_len;
+
+  return 0;
+}
+
+// like the batch of the default implementation, consecutive operations with the same key size share one context
+static int evp_gcm_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, bool encrypt) {
+  if (!ops_p && ops_len) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  EVP_CIPHER_CTX * ctx_p = (void *) 0;
+  size_t ctx_key_len = 0;
+
+  for (size_t i = 0; i < ops_len; i++) {
+    omemo_aes_gcm_op * op_p = &ops_p[i];
+
+    if (!op_p->iv_p || !op_p->key_p || !op_p->in_p || !op_p->out_p || !op_p->tag_p) {
+      op_p->status = OMEMO_ERR_NULL;
+    } else {
+      op_p->status = 0;
+      if (ctx_p && ctx_key_len != op_p->key_len) {
+        evp_gcm_release(ctx_p, ctx_key_len, 0);
+        ctx_p = (void *) 0;
+      }
+      if (!ctx_p) {
+        op_p->status = evp_gcm_acquire(op_p->key_len, &ctx_p);
+        ctx_key_len = op_p->key_len;
+      }
+
+      if (!op_p->status) {
+        op_p->status = evp_gcm_run(ctx_p, encrypt, op_p->iv_p, op_p->iv_len, op_p->key_p,
+                                   op_p->in_p, op_p->len, op_p->out_p, op_p->tag_p, op_p->tag_len);
+        if (op_p->status && op_p->status != OMEMO_ERR_AUTH_FAIL) {
+          evp_gcm_release(ctx_p, ctx_key_len, op_p->status);
+          ctx_p = (void *) 0;
+        }
+      }
+    }
+
+    if (op_p->status && !ret_val) {
+      ret_val = op_p->status;
+    }
+  }
+
+  if (ctx_p) {
+    evp_gcm_release(ctx_p, ctx_key_len, 0);
+  }
+
+  return ret_val;
+}
+
+int omemo_openssl_crypto_aes_gcm_encrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p) {
+  (void) user_data_p;
+
+  return evp_gcm_batch(ops_p, ops_len, true);
+}
+
+int omemo_openssl_crypto_aes_gcm_decrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p) {
+  (void) user_data_p;
+
+  return evp_gcm_batch(ops_p, ops_len, false);
+}
+
+int omemo_openssl_crypto_provider_init(omemo_crypto_provider * crypto_p) {
+  if (!crypto_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  memset(crypto_p, 0, sizeof(omemo_crypto_provider));
+  crypto_p->random_bytes_func = omemo_openssl_crypto_random_bytes;
+  crypto_p->aes_gcm_encrypt_func = omemo_openssl_crypto_aes_gcm_encrypt;
+  crypto_p->aes_gcm_decrypt_func = omemo_openssl_crypto_aes_gcm_decrypt;
+  crypto_p->user_data_p = (void *) 0;
+  crypto_p->aes_gcm_encrypt_into_func = omemo_openssl_crypto_aes_gcm_encrypt_into;
+  crypto_p->aes_gcm_decrypt_into_func = omemo_openssl_crypto_aes_gcm_decrypt_into;
+  crypto_p->random_bytes_into_func = omemo_openssl_crypto_random_bytes_into;
+  crypto_p->aes_gcm_encrypt_batch_func = omemo_openssl_crypto_aes_gcm_encrypt_batch;
+  crypto_p->aes_gcm_decrypt_batch_func = omemo_openssl_crypto_aes_gcm_decrypt_batch;
+
+  return 0;
+}
+
+void omemo_openssl_crypto_teardown(void) {
+  // the caches of other threads are freed when they exit
+  g_private_replace(&evp_gcm_ctx_cache_key, (void *) 0);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "libomemo.h"
+
+/*
+ * Crypto provider built on OpenSSL's libcrypto, as an alternative to the default libgcrypt one.
+ * Only available if libomemo was built with -DOMEMO_WITH_OPENSSL=ON.
+ *
+ * AES-GCM goes through EVP_CIPHER_CTX contexts, which are kept per thread and key size
+ * and only get the next key and IV set between messages. Random bytes come from RAND_bytes().
+ * OpenSSL initialises itself, and the functions are safe to call from multiple threads.
+ */
+
+/**
+ * Fills in a crypto provider with the functions below.
+ *
+ * @param crypto_p Pointer to the crypto provider to fill in.
+ * @return 0 on success, negative on error.
+ */
+int omemo_openssl_crypto_provider_init(omemo_crypto_provider * crypto_p);
+
+int omemo_openssl_crypto_random_bytes(uint8_t ** buf_pp, size_t buf_len, void * user_data_p);
+
+int omemo_openssl_crypto_random_bytes_into(uint8_t * buf_p, size_t buf_len, void * user_data_p);
+
+int omemo_openssl_crypto_aes_gcm_encrypt( const uint8_t * plaintext_p, size_t plaintext_len,
+                                          const uint8_t * iv_p, size_t iv_len,
+                                          const uint8_t * key_p, size_t key_len,
+                                          size_t tag_len,
+                                          void * user_data_p,
+                                          uint8_t ** ciphertext_pp, size_t * ciphertext_len_p,
+                                          uint8_t ** tag_pp);
+
+int omemo_openssl_crypto_aes_gcm_decrypt( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                          const uint8_t * iv_p, size_t iv_len,
+                                          const uint8_t * key_p, size_t key_len,
+                                          uint8_t * tag_p, size_t tag_len,
+                                          void * user_data_p,
+                                          uint8_t ** plaintext_pp, size_t * plaintext_len_p);
+
+int omemo_openssl_crypto_aes_gcm_encrypt_into( const uint8_t * plaintext_p, size_t plaintext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               void * user_data_p,
+                                               uint8_t * ciphertext_p,
+                                               uint8_t * tag_p, size_t tag_len);
+
+int omemo_openssl_crypto_aes_gcm_decrypt_into( const uint8_t * ciphertext_p, size_t ciphertext_len,
+                                               const uint8_t * iv_p, size_t iv_len,
+                                               const uint8_t * key_p, size_t key_len,
+                                               const uint8_t * tag_p, size_t tag_len,
+                                               void * user_data_p,
+                                               uint8_t * plaintext_p);
+
+/**
+ * Consecutive operations with the same key size share one context, as for the default implementation.
+ */
+int omemo_openssl_crypto_aes_gcm_encrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
+
+int omemo_openssl_crypto_aes_gcm_decrypt_batch(omemo_aes_gcm_op * ops_p, size_t ops_len, void * user_data_p);
+
+/**
+ * Frees the cipher contexts kept for the calling thread.
+ * Those of other threads are freed when the threads exit.
+ */
+void omemo_openssl_crypto_teardown(void);
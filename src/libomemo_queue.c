@@ -0,0 +1,771 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include <glib.h>
+
+#include "libomemo.h"
+#include "libomemo_queue.h"
+
+static char * str_dup(const char * in) {
+  size_t len = strlen(in);
+  char * out = malloc(len + 1);
+  if (out) {
+    memcpy(out, in, len + 1);
+  }
+
+  return out;
+}
+
+/*
+ * Readiness signal for the collected results: an eventfd where available, a pipe otherwise.
+ * It is set when the first result is collected and cleared when the last one is picked up, both with the queue locked.
+ */
+
+typedef struct notify_fd {
+  int read_fd;
+  int write_fd;
+} notify_fd;
+
+static int notify_fd_open(notify_fd * nfd_p) {
+#ifdef __linux__
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    return OMEMO_ERR;
+  }
+  nfd_p->read_fd = fd;
+  nfd_p->write_fd = fd;
+#else
+  int fds[2];
+  if (pipe(fds)) {
+    return OMEMO_ERR;
+  }
+  for (int i = 0; i < 2; i++) {
+    (void) fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    (void) fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  nfd_p->read_fd = fds[0];
+  nfd_p->write_fd = fds[1];
+#endif
+
+  return 0;
+}
+
+static void notify_fd_set(notify_fd * nfd_p) {
+#ifdef __linux__
+  uint64_t one = 1;
+  (void) !write(nfd_p->write_fd, &one, sizeof(one));
+#else
+  char c = 0;
+  (void) !write(nfd_p->write_fd, &c, 1);
+#endif
+}
+
+static void notify_fd_clear(notify_fd * nfd_p) {
+#ifdef __linux__
+  uint64_t count = 0;
+  (void) !read(nfd_p->read_fd, &count, sizeof(count));
+#else
+  char c = 0;
+  (void) !read(nfd_p->read_fd, &c, 1);
+#endif
+}
+
+static void notify_fd_close(notify_fd * nfd_p) {
+  close(nfd_p->read_fd);
+  if (nfd_p->write_fd != nfd_p->read_fd) {
+    close(nfd_p->write_fd);
+  }
+}
+
+/*-------------------- DECRYPT QUEUE --------------------*/
+
+typedef struct decrypt_job decrypt_job;
+
+// the messages of one order key which were submitted while another one of it was in progress
+typedef struct decrypt_lane {
+  char * key;
+  decrypt_job * head_p;
+  decrypt_job * tail_p;
+} decrypt_lane;
+
+// the result is the first member, so a pointer to it is also one to the node
+typedef struct decrypt_result_node {
+  omemo_decrypt_result result;
+  struct decrypt_result_node * next_p;
+} decrypt_result_node;
+
+struct decrypt_job {
+  char * stanza;
+  void * tag_p;
+  decrypt_result_node * node_p; // allocated on submission, so that every message is sure to get a result
+  decrypt_lane * lane_p; // NULL if the message has no order key
+  decrypt_job * next_p;  // next one waiting in the lane
+};
+
+struct omemo_decrypt_queue {
+  GThreadPool * pool_p;
+  const omemo_crypto_provider * crypto_p;
+  omemo_decrypt_key_func key_func;
+  omemo_decrypt_done_func done_func;
+  void * user_data_p;
+
+  GMutex mutex;
+  GCond idle_cond;           // signalled when pending drops to 0
+  size_t pending;            // submitted, but not yet delivered
+  GHashTable * lanes_p;      // order key -> decrypt_lane, only while a message of it is in progress
+  decrypt_result_node * results_head_p;
+  decrypt_result_node * results_tail_p;
+  notify_fd nfd;
+  bool nfd_open;
+};
+
+static void decrypt_lane_free(gpointer data) {
+  decrypt_lane * lane_p = data;
+
+  if (lane_p) {
+    free(lane_p->key);
+    free(lane_p);
+  }
+}
+
+static void decrypt_job_free(decrypt_job * job_p) {
+  if (job_p) {
+    free(job_p->node_p);
+    free(job_p->stanza);
+    free(job_p);
+  }
+}
+
+// parses and decrypts the message, returns the status of the result
+static int decrypt_job_run(omemo_decrypt_queue * queue_p, decrypt_job * job_p, char ** msg_xml_p) {
+  int ret_val = 0;
+
+  omemo_message * msg_p = (void *) 0;
+  uint8_t * key_p = (void *) 0;
+  size_t key_len = 0;
+
+  ret_val = omemo_message_prepare_decryption_streaming(job_p->stanza, &msg_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = queue_p->key_func(msg_p, &key_p, &key_len, queue_p->user_data_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+  if (!key_p) {
+    ret_val = OMEMO_ERR_NULL;
+    goto cleanup;
+  }
+
+  ret_val = omemo_message_export_decrypted(msg_p, key_p, key_len, queue_p->crypto_p, msg_xml_p);
+
+cleanup:
+  if (key_p) {
+    memset(key_p, 0, key_len);
+    free(key_p);
+  }
+  omemo_message_destroy(msg_p);
+
+  return ret_val;
+}
+
+static void decrypt_queue_worker(gpointer data, gpointer user_data) {
+  decrypt_job * job_p = data;
+  omemo_decrypt_queue * queue_p = user_data;
+
+  // a message of the lane which could not be started is delivered with an error here, then the one after it is tried
+  bool started = true;
+  while (job_p) {
+    decrypt_result_node * node_p = job_p->node_p;
+    job_p->node_p = (void *) 0;
+    node_p->result.tag_p = job_p->tag_p;
+    node_p->result.status = started ? decrypt_job_run(queue_p, job_p, &node_p->result.msg_xml) : OMEMO_ERR;
+
+    // the next message of the lane is only started after this one is delivered, so that its result cannot overtake
+    if (queue_p->done_func) {
+      queue_p->done_func(&node_p->result, queue_p->user_data_p);
+    }
+
+    g_mutex_lock(&queue_p->mutex);
+
+    if (!queue_p->done_func) {
+      if (queue_p->results_tail_p) {
+        queue_p->results_tail_p->next_p = node_p;
+      } else {
+        queue_p->results_head_p = node_p;
+        notify_fd_set(&queue_p->nfd);
+      }
+      queue_p->results_tail_p = node_p;
+    }
+
+    decrypt_job * failed_p = (void *) 0;
+    decrypt_lane * lane_p = job_p->lane_p;
+    if (lane_p) {
+      decrypt_job * next_p = lane_p->head_p;
+      if (next_p) {
+        lane_p->head_p = next_p->next_p;
+        if (!lane_p->head_p) {
+          lane_p->tail_p = (void *) 0;
+        }
+        next_p->next_p = (void *) 0;
+        if (!g_thread_pool_push(queue_p->pool_p, next_p, (void *) 0)) {
+          failed_p = next_p;
+        }
+      } else {
+        (void) g_hash_table_remove(queue_p->lanes_p, lane_p->key);
+      }
+    }
+
+    // a failed one is still pending, so this cannot drop to 0 before it is delivered
+    queue_p->pending--;
+    if (!queue_p->pending) {
+      g_cond_broadcast(&queue_p->idle_cond);
+    }
+
+    g_mutex_unlock(&queue_p->mutex);
+
+    decrypt_job_free(job_p);
+    job_p = failed_p;
+    started = false;
+  }
+}
+
+int omemo_decrypt_queue_create(unsigned int threads, const omemo_crypto_provider * crypto_p,
+                               omemo_decrypt_key_func key_func, omemo_decrypt_done_func done_func, void * user_data_p,
+                               omemo_decrypt_queue ** queue_pp) {
+  if (!crypto_p || !key_func || !queue_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  omemo_decrypt_queue * queue_p = malloc(sizeof(omemo_decrypt_queue));
+  if (!queue_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(queue_p, 0, sizeof(omemo_decrypt_queue));
+
+  queue_p->crypto_p = crypto_p;
+  queue_p->key_func = key_func;
+  queue_p->done_func = done_func;
+  queue_p->user_data_p = user_data_p;
+  g_mutex_init(&queue_p->mutex);
+  g_cond_init(&queue_p->idle_cond);
+
+  queue_p->lanes_p = g_hash_table_new_full(g_str_hash, g_str_equal, (void *) 0, decrypt_lane_free);
+  if (!queue_p->lanes_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  if (!done_func) {
+    ret_val = notify_fd_open(&queue_p->nfd);
+    if (ret_val) {
+      goto cleanup;
+    }
+    queue_p->nfd_open = true;
+  }
+
+  if (!threads) {
+    threads = g_get_num_processors();
+  }
+  queue_p->pool_p = g_thread_pool_new(decrypt_queue_worker, queue_p, threads, TRUE, (void *) 0);
+  if (!queue_p->pool_p) {
+    ret_val = OMEMO_ERR;
+    goto cleanup;
+  }
+
+  *queue_pp = queue_p;
+
+cleanup:
+  if (ret_val) {
+    omemo_decrypt_queue_destroy(queue_p);
+  }
+
+  return ret_val;
+}
+
+int omemo_decrypt_queue_submit(omemo_decrypt_queue * queue_p, const char * incoming_message, const char * order_key, void * tag_p) {
+  if (!queue_p || !incoming_message) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  decrypt_job * job_p = (void *) 0;
+  decrypt_lane * lane_p = (void *) 0;
+  bool locked = false;
+
+  job_p = malloc(sizeof(decrypt_job));
+  if (!job_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  memset(job_p, 0, sizeof(decrypt_job));
+  job_p->tag_p = tag_p;
+
+  job_p->stanza = str_dup(incoming_message);
+  job_p->node_p = malloc(sizeof(decrypt_result_node));
+  if (!job_p->stanza || !job_p->node_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  memset(job_p->node_p, 0, sizeof(decrypt_result_node));
+
+  g_mutex_lock(&queue_p->mutex);
+  locked = true;
+
+  if (order_key) {
+    lane_p = g_hash_table_lookup(queue_p->lanes_p, order_key);
+    if (lane_p) {
+      // another message of the lane is in progress and starts this one when it is done
+      job_p->lane_p = lane_p;
+      if (lane_p->tail_p) {
+        lane_p->tail_p->next_p = job_p;
+      } else {
+        lane_p->head_p = job_p;
+      }
+      lane_p->tail_p = job_p;
+      queue_p->pending++;
+      job_p = (void *) 0;
+      goto cleanup;
+    }
+
+    lane_p = malloc(sizeof(decrypt_lane));
+    if (!lane_p) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    memset(lane_p, 0, sizeof(decrypt_lane));
+    lane_p->key = str_dup(order_key);
+    if (!lane_p->key) {
+      decrypt_lane_free(lane_p);
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    g_hash_table_insert(queue_p->lanes_p, lane_p->key, lane_p);
+    job_p->lane_p = lane_p;
+  }
+
+  if (!g_thread_pool_push(queue_p->pool_p, job_p, (void *) 0)) {
+    if (job_p->lane_p) {
+      (void) g_hash_table_remove(queue_p->lanes_p, job_p->lane_p->key);
+    }
+    ret_val = OMEMO_ERR;
+    goto cleanup;
+  }
+  queue_p->pending++;
+  job_p = (void *) 0;
+
+cleanup:
+  if (locked) {
+    g_mutex_unlock(&queue_p->mutex);
+  }
+  decrypt_job_free(job_p);
+
+  return ret_val;
+}
+
+int omemo_decrypt_queue_get_fd(omemo_decrypt_queue * queue_p) {
+  if (!queue_p) {
+    return OMEMO_ERR_NULL;
+  }
+  if (!queue_p->nfd_open) {
+    return OMEMO_ERR;
+  }
+
+  return queue_p->nfd.read_fd;
+}
+
+int omemo_decrypt_queue_poll(omemo_decrypt_queue * queue_p, omemo_decrypt_result ** result_pp) {
+  if (!queue_p || !result_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_mutex_lock(&queue_p->mutex);
+
+  decrypt_result_node * node_p = queue_p->results_head_p;
+  if (node_p) {
+    queue_p->results_head_p = node_p->next_p;
+    if (!queue_p->results_head_p) {
+      queue_p->results_tail_p = (void *) 0;
+      notify_fd_clear(&queue_p->nfd);
+    }
+    node_p->next_p = (void *) 0;
+    *result_pp = &node_p->result;
+  }
+
+  g_mutex_unlock(&queue_p->mutex);
+
+  return node_p ? 1 : 0;
+}
+
+int omemo_decrypt_queue_wait(omemo_decrypt_queue * queue_p) {
+  if (!queue_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_mutex_lock(&queue_p->mutex);
+  while (queue_p->pending) {
+    g_cond_wait(&queue_p->idle_cond, &queue_p->mutex);
+  }
+  g_mutex_unlock(&queue_p->mutex);
+
+  return 0;
+}
+
+void omemo_decrypt_queue_destroy(omemo_decrypt_queue * queue_p) {
+  if (!queue_p) {
+    return;
+  }
+
+  if (queue_p->pool_p) {
+    (void) omemo_decrypt_queue_wait(queue_p);
+    g_thread_pool_free(queue_p->pool_p, FALSE, TRUE);
+  }
+
+  decrypt_result_node * node_p = queue_p->results_head_p;
+  while (node_p) {
+    decrypt_result_node * next_p = node_p->next_p;
+    omemo_decrypt_result_destroy(&node_p->result);
+    node_p = next_p;
+  }
+
+  if (queue_p->lanes_p) {
+    g_hash_table_destroy(queue_p->lanes_p);
+  }
+  if (queue_p->nfd_open) {
+    notify_fd_close(&queue_p->nfd);
+  }
+  g_cond_clear(&queue_p->idle_cond);
+  g_mutex_clear(&queue_p->mutex);
+  free(queue_p);
+}
+
+void omemo_decrypt_result_destroy(omemo_decrypt_result * result_p) {
+  if (result_p) {
+    free(result_p->msg_xml);
+    free(result_p);
+  }
+}
+
+/*-------------------- ENCRYPT QUEUE --------------------*/
+
+// the result is the first member, so a pointer to it is also one to the node
+typedef struct encrypt_result_node {
+  omemo_encrypt_result result;
+  guint seq;
+  struct encrypt_result_node * next_p;
+} encrypt_result_node;
+
+typedef struct encrypt_job {
+  char * stanza;
+  void * tag_p;
+  guint seq;
+  encrypt_result_node * node_p; // allocated on submission, so that every message is sure to get a result
+} encrypt_job;
+
+struct omemo_encrypt_queue {
+  GThreadPool * pool_p;
+  uint32_t sender_device_id;
+  const omemo_crypto_provider * crypto_p;
+  int strip;
+  int add_msg;
+  omemo_encrypt_recipients_func recipients_func;
+  omemo_encrypt_done_func done_func;
+  void * user_data_p;
+
+  GMutex mutex;
+  GCond idle_cond;           // signalled when pending drops to 0
+  size_t pending;            // submitted, but not yet delivered
+  guint seq_next;            // handed out to the next submitted message, may wrap around
+  guint seq_deliver;         // the message whose result is delivered next
+  GHashTable * done_p;       // seq -> encrypt_result_node, finished but waiting for the ones before
+  bool delivering;           // a worker is passing results on
+  encrypt_result_node * results_head_p;
+  encrypt_result_node * results_tail_p;
+  notify_fd nfd;
+  bool nfd_open;
+};
+
+static void encrypt_job_free(encrypt_job * job_p) {
+  if (job_p) {
+    free(job_p->node_p);
+    free(job_p->stanza);
+    free(job_p);
+  }
+}
+
+static void encrypt_result_node_free(gpointer data) {
+  omemo_encrypt_result_destroy(data);
+}
+
+// encrypts the message and adds the recipients, returns the status of the result
+static int encrypt_job_run(omemo_encrypt_queue * queue_p, encrypt_job * job_p, char ** msg_xml_p) {
+  int ret_val = 0;
+
+  omemo_message * msg_p = (void *) 0;
+
+  ret_val = omemo_message_prepare_encryption(job_p->stanza, queue_p->sender_device_id, queue_p->crypto_p, queue_p->strip, &msg_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = queue_p->recipients_func(msg_p, job_p->tag_p, queue_p->user_data_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = omemo_message_export_encrypted(msg_p, queue_p->add_msg, msg_xml_p);
+
+cleanup:
+  omemo_message_destroy(msg_p);
+
+  return ret_val;
+}
+
+/**
+ * Passes on the finished results as long as the next one in submission order is among them.
+ * Only one worker does this at a time, the others just leave their result for it.
+ * Has to be called with the queue locked, which is released while the done_func runs.
+ */
+static void encrypt_queue_deliver(omemo_encrypt_queue * queue_p) {
+  if (queue_p->delivering) {
+    return;
+  }
+  queue_p->delivering = true;
+
+  encrypt_result_node * node_p;
+  while ((node_p = g_hash_table_lookup(queue_p->done_p, GUINT_TO_POINTER(queue_p->seq_deliver)))) {
+    g_hash_table_steal(queue_p->done_p, GUINT_TO_POINTER(queue_p->seq_deliver));
+    queue_p->seq_deliver++;
+
+    if (queue_p->done_func) {
+      g_mutex_unlock(&queue_p->mutex);
+      queue_p->done_func(&node_p->result, queue_p->user_data_p);
+      g_mutex_lock(&queue_p->mutex);
+    } else {
+      if (queue_p->results_tail_p) {
+        queue_p->results_tail_p->next_p = node_p;
+      } else {
+        queue_p->results_head_p = node_p;
+        notify_fd_set(&queue_p->nfd);
+      }
+      queue_p->results_tail_p = node_p;
+    }
+
+    queue_p->pending--;
+  }
+
+  queue_p->delivering = false;
+  if (!queue_p->pending) {
+    g_cond_broadcast(&queue_p->idle_cond);
+  }
+}
+
+static void encrypt_queue_worker(gpointer data, gpointer user_data) {
+  encrypt_job * job_p = data;
+  omemo_encrypt_queue * queue_p = user_data;
+
+  encrypt_result_node * node_p = job_p->node_p;
+  job_p->node_p = (void *) 0;
+  node_p->result.tag_p = job_p->tag_p;
+  node_p->result.status = encrypt_job_run(queue_p, job_p, &node_p->result.msg_xml);
+  node_p->seq = job_p->seq;
+
+  g_mutex_lock(&queue_p->mutex);
+  g_hash_table_insert(queue_p->done_p, GUINT_TO_POINTER(node_p->seq), node_p);
+  encrypt_queue_deliver(queue_p);
+  g_mutex_unlock(&queue_p->mutex);
+
+  encrypt_job_free(job_p);
+}
+
+int omemo_encrypt_queue_create(unsigned int threads, uint32_t sender_device_id, const omemo_crypto_provider * crypto_p,
+                               int strip, int add_msg, omemo_encrypt_recipients_func recipients_func,
+                               omemo_encrypt_done_func done_func, void * user_data_p, omemo_encrypt_queue ** queue_pp) {
+  if (!crypto_p || !recipients_func || !queue_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  omemo_encrypt_queue * queue_p = malloc(sizeof(omemo_encrypt_queue));
+  if (!queue_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(queue_p, 0, sizeof(omemo_encrypt_queue));
+
+  queue_p->sender_device_id = sender_device_id;
+  queue_p->crypto_p = crypto_p;
+  queue_p->strip = strip;
+  queue_p->add_msg = add_msg;
+  queue_p->recipients_func = recipients_func;
+  queue_p->done_func = done_func;
+  queue_p->user_data_p = user_data_p;
+  g_mutex_init(&queue_p->mutex);
+  g_cond_init(&queue_p->idle_cond);
+
+  queue_p->done_p = g_hash_table_new_full(g_direct_hash, g_direct_equal, (void *) 0, encrypt_result_node_free);
+  if (!queue_p->done_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+
+  if (!done_func) {
+    ret_val = notify_fd_open(&queue_p->nfd);
+    if (ret_val) {
+      goto cleanup;
+    }
+    queue_p->nfd_open = true;
+  }
+
+  if (!threads) {
+    threads = g_get_num_processors();
+  }
+  queue_p->pool_p = g_thread_pool_new(encrypt_queue_worker, queue_p, threads, TRUE, (void *) 0);
+  if (!queue_p->pool_p) {
+    ret_val = OMEMO_ERR;
+    goto cleanup;
+  }
+
+  *queue_pp = queue_p;
+
+cleanup:
+  if (ret_val) {
+    omemo_encrypt_queue_destroy(queue_p);
+  }
+
+  return ret_val;
+}
+
+int omemo_encrypt_queue_submit(omemo_encrypt_queue * queue_p, const char * outgoing_message, void * tag_p) {
+  if (!queue_p || !outgoing_message) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  encrypt_job * job_p = malloc(sizeof(encrypt_job));
+  if (!job_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(job_p, 0, sizeof(encrypt_job));
+  job_p->tag_p = tag_p;
+
+  job_p->stanza = str_dup(outgoing_message);
+  job_p->node_p = malloc(sizeof(encrypt_result_node));
+  if (!job_p->stanza || !job_p->node_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  memset(job_p->node_p, 0, sizeof(encrypt_result_node));
+
+  g_mutex_lock(&queue_p->mutex);
+  job_p->seq = queue_p->seq_next;
+  if (g_thread_pool_push(queue_p->pool_p, job_p, (void *) 0)) {
+    queue_p->seq_next++;
+    queue_p->pending++;
+    job_p = (void *) 0;
+  } else {
+    ret_val = OMEMO_ERR;
+  }
+  g_mutex_unlock(&queue_p->mutex);
+
+cleanup:
+  encrypt_job_free(job_p);
+
+  return ret_val;
+}
+
+int omemo_encrypt_queue_get_fd(omemo_encrypt_queue * queue_p) {
+  if (!queue_p) {
+    return OMEMO_ERR_NULL;
+  }
+  if (!queue_p->nfd_open) {
+    return OMEMO_ERR;
+  }
+
+  return queue_p->nfd.read_fd;
+}
+
+int omemo_encrypt_queue_poll(omemo_encrypt_queue * queue_p, omemo_encrypt_result ** result_pp) {
+  if (!queue_p || !result_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_mutex_lock(&queue_p->mutex);
+
+  encrypt_result_node * node_p = queue_p->results_head_p;
+  if (node_p) {
+    queue_p->results_head_p = node_p->next_p;
+    if (!queue_p->results_head_p) {
+      queue_p->results_tail_p = (void *) 0;
+      notify_fd_clear(&queue_p->nfd);
+    }
+    node_p->next_p = (void *) 0;
+    *result_pp = &node_p->result;
+  }
+
+  g_mutex_unlock(&queue_p->mutex);
+
+  return node_p ? 1 : 0;
+}
+
+int omemo_encrypt_queue_wait(omemo_encrypt_queue * queue_p) {
+  if (!queue_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_mutex_lock(&queue_p->mutex);
+  while (queue_p->pending) {
+    g_cond_wait(&queue_p->idle_cond, &queue_p->mutex);
+  }
+  g_mutex_unlock(&queue_p->mutex);
+
+  return 0;
+}
+
+void omemo_encrypt_queue_destroy(omemo_encrypt_queue * queue_p) {
+  if (!queue_p) {
+    return;
+  }
+
+  if (queue_p->pool_p) {
+    (void) omemo_encrypt_queue_wait(queue_p);
+    g_thread_pool_free(queue_p->pool_p, FALSE, TRUE);
+  }
+
+  encrypt_result_node * node_p = queue_p->results_head_p;
+  while (node_p) {
+    encrypt_result_node * next_p = node_p->next_p;
+    omemo_encrypt_result_destroy(&node_p->result);
+    node_p = next_p;
+  }
+
+  if (queue_p->done_p) {
+    g_hash_table_destroy(queue_p->done_p);
+  }
+  if (queue_p->nfd_open) {
+    notify_fd_close(&queue_p->nfd);
+  }
+  g_cond_clear(&queue_p->idle_cond);
+  g_mutex_clear(&queue_p->mutex);
+  free(queue_p);
+}
+
+void omemo_encrypt_result_destroy(omemo_encrypt_result * result_p) {
+  if (result_p) {
+    free(result_p->msg_xml);
+    free(result_p);
+  }
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "libomemo.h"
+
+/*
+ * Queues which process messages on a pool of worker threads, e.g. to decrypt the archive fetched after a reconnect
+ * or to send a message to many rooms without blocking the thread handling the XMPP connection.
+ *
+ * The crypto provider and the callbacks are called from the worker threads, possibly at the same time.
+ */
+
+typedef struct omemo_decrypt_queue omemo_decrypt_queue;
+
+/**
+ * Result of a submitted message.
+ */
+typedef struct omemo_decrypt_result {
+  void * tag_p;   // as passed to omemo_decrypt_queue_submit()
+  int status;     // 0 on success, otherwise the error of the step that failed
+  char * msg_xml; // the decrypted stanza as by omemo_message_export_decrypted(), NULL if status is not 0
+} omemo_decrypt_result;
+
+/**
+ * Called on a worker thread to get the decrypted symmetric key of a message, i.e. usually to look up
+ * the encrypted key for the own device with omemo_message_get_encrypted_key() and decrypt it with the session.
+ * Messages with the same order key are never passed to it at the same time, others are.
+ *
+ * @param msg_p Pointer to the parsed message. Must not be destroyed.
+ * @param key_pp Will be set to the decrypted key, including the tag, as expected by omemo_message_export_decrypted().
+ *               Is free()d by the queue.
+ * @param key_len_p Will be set to the length of the key.
+ * @param user_data_p As passed to omemo_decrypt_queue_create().
+ * @return 0 on success, negative on error. The error is passed on as the status of the result.
+ */
+typedef int (*omemo_decrypt_key_func)(omemo_message * msg_p, uint8_t ** key_pp, size_t * key_len_p, void * user_data_p);
+
+/**
+ * Called on a worker thread with each result, if set.
+ *
+ * @param result_p Pointer to the result. Free with omemo_decrypt_result_destroy().
+ * @param user_data_p As passed to omemo_decrypt_queue_create().
+ */
+typedef void (*omemo_decrypt_done_func)(omemo_decrypt_result * result_p, void * user_data_p);
+
+/**
+ * Creates a decrypt queue and starts its worker threads.
+ *
+ * @param threads The maximum amount of worker threads, 0 for one per processor.
+ * @param crypto_p Pointer to the crypto provider. Has to be safe to call from multiple threads, as the default one is.
+ * @param key_func The function that decrypts the symmetric key of a message.
+ * @param done_func The function the results are passed to. Can be NULL, then they are collected to be picked up
+ *                  with omemo_decrypt_queue_poll().
+ * @param user_data_p Passed to the callbacks.
+ * @param queue_pp Will be set to the created queue. Free with omemo_decrypt_queue_destroy().
+ * @return 0 on success, negative on error.
+ */
+int omemo_decrypt_queue_create(unsigned int threads, const omemo_crypto_provider * crypto_p,
+                               omemo_decrypt_key_func key_func, omemo_decrypt_done_func done_func, void * user_data_p,
+                               omemo_decrypt_queue ** queue_pp);
+
+/**
+ * Submits an incoming stanza for decryption. It is parsed as by omemo_message_prepare_decryption_streaming().
+ *
+ * @param queue_p Pointer to the queue.
+ * @param incoming_message The incoming <message> stanza. Is copied.
+ * @param order_key If not NULL, the message is processed and its result delivered only after all messages submitted
+ *                  before with the same key, e.g. the sender's bare JID. Messages without a key are processed in any order.
+ * @param tag_p Passed back in the result to identify the message.
+ * @return 0 on success, negative on error.
+ */
+int omemo_decrypt_queue_submit(omemo_decrypt_queue * queue_p, const char * incoming_message, const char * order_key, void * tag_p);
+
+/**
+ * Gets a file descriptor which is readable while there are results to pick up with omemo_decrypt_queue_poll(),
+ * e.g. to add it to the event loop. Only available if the queue has no done_func.
+ *
+ * @param queue_p Pointer to the queue.
+ * @return The file descriptor, negative on error.
+ */
+int omemo_decrypt_queue_get_fd(omemo_decrypt_queue * queue_p);
+
+/**
+ * Picks up the next collected result, in the order they were finished.
+ *
+ * @param queue_p Pointer to the queue.
+ * @param result_pp Will be set to the result if there is one. Free with omemo_decrypt_result_destroy().
+ * @return 1 if there was a result, 0 if there was none, negative on error.
+ */
+int omemo_decrypt_queue_poll(omemo_decrypt_queue * queue_p, omemo_decrypt_result ** result_pp);
+
+/**
+ * Blocks until all submitted messages are processed.
+ *
+ * @param queue_p Pointer to the queue.
+ * @return 0 on success, negative on error.
+ */
+int omemo_decrypt_queue_wait(omemo_decrypt_queue * queue_p);
+
+/**
+ * Waits for all submitted messages to be processed, then stops the worker threads
+ * and frees the queue including the results that were not picked up.
+ *
+ * @param queue_p Pointer to the queue. Can be NULL.
+ */
+void omemo_decrypt_queue_destroy(omemo_decrypt_queue * queue_p);
+
+/**
+ * Frees a result.
+ *
+ * @param result_p Pointer to the result. Can be NULL.
+ */
+void omemo_decrypt_result_destroy(omemo_decrypt_result * result_p);
+
+typedef struct omemo_encrypt_queue omemo_encrypt_queue;
+
+/**
+ * Result of a submitted message.
+ */
+typedef struct omemo_encrypt_result {
+  void * tag_p;   // as passed to omemo_encrypt_queue_submit()
+  int status;     // 0 on success, otherwise the error of the step that failed
+  char * msg_xml; // the encrypted stanza as by omemo_message_export_encrypted(), NULL if status is not 0
+} omemo_encrypt_result;
+
+/**
+ * Called on a worker thread to add the recipients to a message, i.e. usually to encrypt the key from
+ * omemo_message_get_key() with the session of each recipient device and add it with omemo_message_add_recipients().
+ * It may be called for several messages at the same time.
+ *
+ * @param msg_p Pointer to the message, with the payload already encrypted. Must not be destroyed.
+ * @param tag_p As passed to omemo_encrypt_queue_submit(), e.g. to identify the recipients.
+ * @param user_data_p As passed to omemo_encrypt_queue_create().
+ * @return 0 on success, negative on error. The error is passed on as the status of the result.
+ */
+typedef int (*omemo_encrypt_recipients_func)(omemo_message * msg_p, void * tag_p, void * user_data_p);
+
+/**
+ * Called with each result, if set. The results are passed on one at a time, in the order the messages were submitted,
+ * from whichever worker thread finished the message that was next.
+ *
+ * @param result_p Pointer to the result. Free with omemo_encrypt_result_destroy().
+ * @param user_data_p As passed to omemo_encrypt_queue_create().
+ */
+typedef void (*omemo_encrypt_done_func)(omemo_encrypt_result * result_p, void * user_data_p);
+
+/**
+ * Creates an encrypt queue and starts its worker threads.
+ *
+ * @param threads The maximum amount of worker threads, 0 for one per processor.
+ * @param sender_device_id The own device ID, as for omemo_message_prepare_encryption().
+ * @param crypto_p Pointer to the crypto provider. Has to be safe to call from multiple threads, as the default one is.
+ * @param strip Whether to remove possible plaintext, as for omemo_message_prepare_encryption().
+ * @param add_msg Which hints to add, as for omemo_message_export_encrypted().
+ * @param recipients_func The function that adds the recipients to a message.
+ * @param done_func The function the results are passed to. Can be NULL, then they are collected to be picked up
+ *                  with omemo_encrypt_queue_poll().
+ * @param user_data_p Passed to the callbacks.
+ * @param queue_pp Will be set to the created queue. Free with omemo_encrypt_queue_destroy().
+ * @return 0 on success, negative on error.
+ */
+int omemo_encrypt_queue_create(unsigned int threads, uint32_t sender_device_id, const omemo_crypto_provider * crypto_p,
+                               int strip, int add_msg, omemo_encrypt_recipients_func recipients_func,
+                               omemo_encrypt_done_func done_func, void * user_data_p, omemo_encrypt_queue ** queue_pp);
+
+/**
+ * Submits an outgoing stanza for encryption.
+ *
+ * @param queue_p Pointer to the queue.
+ * @param outgoing_message The outgoing <message> stanza with a <body>. Is copied.
+ * @param tag_p Passed to the recipients_func and back in the result.
+ * @return 0 on success, negative on error.
+ */
+int omemo_encrypt_queue_submit(omemo_encrypt_queue * queue_p, const char * outgoing_message, void * tag_p);
+
+/**
+ * Gets a file descriptor which is readable while there are results to pick up with omemo_encrypt_queue_poll().
+ * Only available if the queue has no done_func.
+ *
+ * @param queue_p Pointer to the queue.
+ * @return The file descriptor, negative on error.
+ */
+int omemo_encrypt_queue_get_fd(omemo_encrypt_queue * queue_p);
+
+/**
+ * Picks up the next result, in the order the messages were submitted.
+ * A result is only available once all messages submitted before it are done as well.
+ *
+ * @param queue_p Pointer to the queue.
+ * @param result_pp Will be set to the result if there is one. Free with omemo_encrypt_result_destroy().
+ * @return 1 if there was a result, 0 if there was none, negative on error.
+ */
+int omemo_encrypt_queue_poll(omemo_encrypt_queue * queue_p, omemo_encrypt_result ** result_pp);
+
+/**
+ * Blocks until all submitted messages are processed and their results delivered.
+ *
+ * @param queue_p Pointer to the queue.
+ * @return 0 on success, negative on error.
+ */
+int omemo_encrypt_queue_wait(omemo_encrypt_queue * queue_p);
+
+/**
+ * Waits for all submitted messages to be processed, then stops the worker threads
+ * and frees the queue including the results that were not picked up.
+ *
+ * @param queue_p Pointer to the queue. Can be NULL.
+ */
+void omemo_encrypt_queue_destroy(omemo_encrypt_queue * queue_p);
+
+/**
+ * Frees a result.
+ *
+ * @param result_p Pointer to the result. Can be NULL.
+ */
+void omemo_encrypt_result_destroy(omemo_encrypt_result * result_p);
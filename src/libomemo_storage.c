@@ -1,10 +1,13 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <sqlite3.h>
 
 #include "libomemo.h"
+#include "libomemo_storage.h"
 
 #define xstr(s) str(s)
 #define str(s) #s
@@ -19,6 +22,17 @@
 #define CHATLIST_TABLE_NAME "cl"
 #define CHATLIST_CHAT_NAME_NAME "chat_name"
 
+#define BUNDLE_TABLE_NAME "bundles"
+#define BUNDLE_NAME_NAME "name"
+#define BUNDLE_ID_NAME "id"
+#define BUNDLE_ITEM_ID_NAME "item_id"
+#define BUNDLE_HASH_NAME "hash"
+#define BUNDLE_SPK_ID_NAME "spk_id"
+#define BUNDLE_SPK_NAME "spk"
+#define BUNDLE_SIGNATURE_NAME "signature"
+#define BUNDLE_IK_NAME "ik"
+#define BUNDLE_PRE_KEYS_NAME "pre_keys"
+
 #define LURCH_TRUST_NONE 0
 
 #define STMT_PROLOG "BEGIN TRANSACTION;"\
@@ -30,80 +44,174 @@
                     DEVICELIST_TRUST_STATUS_NAME " INTEGER NOT NULL, "\
                     "PRIMARY KEY("DEVICELIST_NAME_NAME", "DEVICELIST_ID_NAME"));"\
                     "CREATE TABLE IF NOT EXISTS " CHATLIST_TABLE_NAME " ("\
-                    CHATLIST_CHAT_NAME_NAME " TEXT PRIMARY KEY);"
+                    CHATLIST_CHAT_NAME_NAME " TEXT PRIMARY KEY);"\
+                    "CREATE TABLE IF NOT EXISTS " BUNDLE_TABLE_NAME "("\
+                    BUNDLE_NAME_NAME " TEXT NOT NULL, "\
+                    BUNDLE_ID_NAME " INTEGER NOT NULL, "\
+                    BUNDLE_ITEM_ID_NAME " TEXT, "\
+                    BUNDLE_HASH_NAME " TEXT, "\
+                    BUNDLE_SPK_ID_NAME " INTEGER NOT NULL, "\
+                    BUNDLE_SPK_NAME " BLOB NOT NULL, "\
+                    BUNDLE_SIGNATURE_NAME " BLOB NOT NULL, "\
+                    BUNDLE_IK_NAME " BLOB NOT NULL, "\
+                    BUNDLE_PRE_KEYS_NAME " BLOB NOT NULL, "\
+                    "PRIMARY KEY(" BUNDLE_NAME_NAME ", " BUNDLE_ID_NAME "));"
 
 #define STMT_EPILOG "COMMIT TRANSACTION;"
 
+#define STMT_USER_DEVICE_ID_SAVE "INSERT INTO " DEVICELIST_TABLE_NAME " VALUES("\
+                                 "?1, "\
+                                 "?2, "\
+                                 "datetime('now'), "\
+                                 "datetime('now'), "\
+                                 xstr(LURCH_TRUST_NONE)\
+                                 ");"
+
+#define STMT_USER_DEVICE_ID_DELETE "DELETE FROM " DEVICELIST_TABLE_NAME\
+                                   " WHERE " DEVICELIST_NAME_NAME " IS ?1"\
+                                   " AND " DEVICELIST_ID_NAME " IS ?2;"
+
+#define STMT_USER_DEVICELIST_RETRIEVE "SELECT " DEVICELIST_ID_NAME " FROM " DEVICELIST_TABLE_NAME\
+                                      " WHERE " DEVICELIST_NAME_NAME " IS ?1;"
+
+#define STMT_CHATLIST_SAVE "INSERT OR REPLACE INTO " CHATLIST_TABLE_NAME " VALUES(?1);"
+
+#define STMT_CHATLIST_EXISTS "SELECT " CHATLIST_CHAT_NAME_NAME " FROM " CHATLIST_TABLE_NAME\
+                             " WHERE " CHATLIST_CHAT_NAME_NAME " IS ?1;"
+
+#define STMT_CHATLIST_DELETE "DELETE FROM " CHATLIST_TABLE_NAME " WHERE " CHATLIST_CHAT_NAME_NAME " IS ?1;"
+
+#define STMT_GLOBAL_DEVICE_ID_EXISTS "SELECT " DEVICELIST_ID_NAME " FROM " DEVICELIST_TABLE_NAME\
+                                     " WHERE " DEVICELIST_ID_NAME " IS ?1;"
+
+#define STMT_BUNDLE_SAVE "INSERT OR REPLACE INTO " BUNDLE_TABLE_NAME " VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9);"
+
+#define STMT_BUNDLE_RETRIEVE "SELECT " BUNDLE_ITEM_ID_NAME ", " BUNDLE_HASH_NAME ", " BUNDLE_SPK_ID_NAME ", " BUNDLE_SPK_NAME ", "\
+                             BUNDLE_SIGNATURE_NAME ", " BUNDLE_IK_NAME ", " BUNDLE_PRE_KEYS_NAME " FROM " BUNDLE_TABLE_NAME\
+                             " WHERE " BUNDLE_NAME_NAME " IS ?1 AND " BUNDLE_ID_NAME " IS ?2;"
+
+#define STMT_BUNDLE_DELETE "DELETE FROM " BUNDLE_TABLE_NAME " WHERE " BUNDLE_NAME_NAME " IS ?1 AND " BUNDLE_ID_NAME " IS ?2;"
+
+// indices into the statement cache of a storage context
+#define STMT_IDX_USER_DEVICE_ID_SAVE      0
+#define STMT_IDX_USER_DEVICE_ID_DELETE    1
+#define STMT_IDX_USER_DEVICELIST_RETRIEVE 2
+#define STMT_IDX_CHATLIST_SAVE            3
+#define STMT_IDX_CHATLIST_EXISTS          4
+#define STMT_IDX_CHATLIST_DELETE          5
+#define STMT_IDX_GLOBAL_DEVICE_ID_EXISTS  6
+#define STMT_IDX_BUNDLE_SAVE              7
+#define STMT_IDX_BUNDLE_RETRIEVE          8
+#define STMT_IDX_BUNDLE_DELETE            9
+#define STMT_IDX_AMOUNT                   10
+
+static const char * const stmt_strings[STMT_IDX_AMOUNT] = {
+  STMT_USER_DEVICE_ID_SAVE,
+  STMT_USER_DEVICE_ID_DELETE,
+  STMT_USER_DEVICELIST_RETRIEVE,
+  STMT_CHATLIST_SAVE,
+  STMT_CHATLIST_EXISTS,
+  STMT_CHATLIST_DELETE,
+  STMT_GLOBAL_DEVICE_ID_EXISTS,
+  STMT_BUNDLE_SAVE,
+  STMT_BUNDLE_RETRIEVE,
+  STMT_BUNDLE_DELETE
+};
+
+struct omemo_storage_ctx {
+  sqlite3 * db_p;
+  sqlite3_stmt * pstmts[STMT_IDX_AMOUNT];
+};
+
+/**
+ * Gets the cached prepared statement for the given index, preparing it on first use.
+ * The statement has to be given back using ctx_stmt_release() after stepping through it.
+ */
+static int ctx_stmt_get(omemo_storage_ctx * ctx_p, int stmt_idx, sqlite3_stmt ** pstmt_pp) {
+  int ret_val = 0;
+
+  if (!ctx_p->pstmts[stmt_idx]) {
+    ret_val = sqlite3_prepare_v2(ctx_p->db_p, stmt_strings[stmt_idx], -1, &ctx_p->pstmts[stmt_idx], (void *) 0);
+    if (ret_val) {
+      sqlite3_finalize(ctx_p->pstmts[stmt_idx]);
+      ctx_p->pstmts[stmt_idx] = (void *) 0;
+      return -ret_val;
+    }
+  }
+
+  *pstmt_pp = ctx_p->pstmts[stmt_idx];
+
+  return 0;
+}
+
+// resets the statement so that it can be reused and does not hold on to the bound values
+static void ctx_stmt_release(sqlite3_stmt * pstmt_p) {
+  if (pstmt_p) {
+    (void) sqlite3_reset(pstmt_p);
+    (void) sqlite3_clear_bindings(pstmt_p);
+  }
+}
+
+int omemo_storage_ctx_open(const char * db_fn, omemo_storage_ctx ** ctx_pp) {
+  if (!db_fn || !ctx_pp) {
+    return OMEMO_ERR_NULL;
+  }
 
-static int db_conn_open_and_prepare(sqlite3 ** db_pp, sqlite3_stmt ** pstmt_pp, const char * stmt, const char * db_fn) {
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
-  sqlite3_stmt * pstmt_p = (void *) 0;
+  omemo_storage_ctx * ctx_p = (void *) 0;
   char * err_msg = (void *) 0;
 
+  ctx_p = malloc(sizeof(omemo_storage_ctx));
+  if (!ctx_p) {
+    ret_val = OMEMO_ERR_NOMEM;
+    goto cleanup;
+  }
+  memset(ctx_p, 0, sizeof(omemo_storage_ctx));
 
-  ret_val = sqlite3_open(db_fn, &db_p);
+  ret_val = sqlite3_open(db_fn, &ctx_p->db_p);
   if (ret_val) {
     ret_val = -ret_val;
     goto cleanup;
   }
 
-  (void) sqlite3_exec(db_p, STMT_PROLOG, (void *) 0, (void *) 0, &err_msg);
+  (void) sqlite3_exec(ctx_p->db_p, STMT_PROLOG STMT_EPILOG, (void *) 0, (void *) 0, &err_msg);
   if (err_msg) {
     ret_val = OMEMO_ERR_STORAGE;
     goto cleanup;
   }
 
-  ret_val = sqlite3_prepare_v2(db_p, stmt, -1, &pstmt_p, (void *) 0);
-  if (ret_val) {
-    ret_val = -ret_val;
-    goto cleanup;
-  }
-
-  *db_pp = db_p;
-  *pstmt_pp = pstmt_p;
+  *ctx_pp = ctx_p;
 
 cleanup:
   if (ret_val) {
-    sqlite3_finalize(pstmt_p);
-    sqlite3_close(db_p);
-    sqlite3_free(err_msg);
+    omemo_storage_ctx_close(ctx_p);
   }
+  sqlite3_free(err_msg);
 
   return ret_val;
 }
 
-static int db_conn_commit(sqlite3 * db_p) {
-  if (!db_p) {
-    return OMEMO_ERR_NULL;
-  }
-
-  char * err_msg = (void *) 0;
-  (void) sqlite3_exec(db_p, STMT_EPILOG, (void *) 0, (void *) 0, &err_msg);
-  if (err_msg) {
-    sqlite3_free(err_msg);
-    return OMEMO_ERR_STORAGE;
+void omemo_storage_ctx_close(omemo_storage_ctx * ctx_p) {
+  if (ctx_p) {
+    for (int i = 0; i < STMT_IDX_AMOUNT; i++) {
+      sqlite3_finalize(ctx_p->pstmts[i]);
+    }
+    sqlite3_close(ctx_p->db_p);
+    free(ctx_p);
   }
-
-  return 0;
 }
 
-int omemo_storage_user_device_id_save(const char * user, uint32_t device_id, const char * db_fn) {
-  const char * stmt = "INSERT INTO " DEVICELIST_TABLE_NAME " VALUES("
-                    "?1, "
-                    "?2, "
-                    "datetime('now'), "
-                    "datetime('now'), "
-                    xstr(LURCH_TRUST_NONE)
-                 ");";
+int omemo_storage_ctx_user_device_id_save(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id) {
+  if (!ctx_p || !user) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_USER_DEVICE_ID_SAVE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
@@ -125,31 +233,24 @@ int omemo_storage_user_device_id_save(const char * user, uint32_t device_id, con
     ret_val = -ret_val;
     goto cleanup;
   }
-
-  ret_val = db_conn_commit(db_p);
-  if (ret_val) {
-    goto cleanup;
-  }
-
+  ret_val = 0;
 
 cleanup:
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
 
   return ret_val;
 }
 
-int omemo_storage_user_device_id_delete(const char * user, uint32_t device_id, const char * db_fn) {
-  const char * stmt = "DELETE FROM " DEVICELIST_TABLE_NAME
-                      " WHERE " DEVICELIST_NAME_NAME " IS ?1"
-                      " AND " DEVICELIST_ID_NAME " IS ?2;";
+int omemo_storage_ctx_user_device_id_delete(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id) {
+  if (!ctx_p || !user) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_USER_DEVICE_ID_DELETE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
@@ -171,26 +272,22 @@ int omemo_storage_user_device_id_delete(const char * user, uint32_t device_id, c
     ret_val = -ret_val;
     goto cleanup;
   }
-
-  ret_val = db_conn_commit(db_p);
-  if (ret_val) {
-    goto cleanup;
-  }
+  ret_val = 0;
 
 cleanup:
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
 
   return ret_val;
 }
 
-int omemo_storage_user_devicelist_retrieve(const char * user, const char * db_fn, omemo_devicelist ** dl_pp) {
-  const char * stmt = "SELECT * FROM " DEVICELIST_TABLE_NAME " WHERE name IS ?1;";
+int omemo_storage_ctx_user_devicelist_retrieve(omemo_storage_ctx * ctx_p, const char * user, omemo_devicelist ** dl_pp) {
+  if (!ctx_p || !user || !dl_pp) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
   omemo_devicelist * dl_p = (void *) 0;
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
 
   ret_val = omemo_devicelist_create(user, &dl_p);
@@ -198,7 +295,7 @@ int omemo_storage_user_devicelist_retrieve(const char * user, const char * db_fn
     goto cleanup;
   }
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_USER_DEVICELIST_RETRIEVE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
@@ -211,18 +308,18 @@ int omemo_storage_user_devicelist_retrieve(const char * user, const char * db_fn
 
   ret_val = sqlite3_step(pstmt_p);
   while (ret_val == SQLITE_ROW) {
-    ret_val = omemo_devicelist_add(dl_p, sqlite3_column_int(pstmt_p, 1));
+    ret_val = omemo_devicelist_add(dl_p, sqlite3_column_int(pstmt_p, 0));
     if (ret_val) {
       goto cleanup;
     }
 
     ret_val = sqlite3_step(pstmt_p);
   }
-
-  ret_val = db_conn_commit(db_p);
-  if (ret_val) {
+  if (ret_val != SQLITE_DONE) {
+    ret_val = -ret_val;
     goto cleanup;
   }
+  ret_val = 0;
 
   *dl_pp = dl_p;
 
@@ -230,21 +327,21 @@ cleanup:
   if (ret_val) {
     omemo_devicelist_destroy(dl_p);
   }
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
 
   return ret_val;
 }
 
-int omemo_storage_chatlist_save(const char * chat, const char * db_fn) {
-  const char * stmt = "INSERT OR REPLACE INTO " CHATLIST_TABLE_NAME " VALUES(?1);";
+int omemo_storage_ctx_chatlist_save(omemo_storage_ctx * ctx_p, const char * chat) {
+  if (!ctx_p || !chat) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_CHATLIST_SAVE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
@@ -260,30 +357,57 @@ int omemo_storage_chatlist_save(const char * chat, const char * db_fn) {
     ret_val = -ret_val;
     goto cleanup;
   }
+  ret_val = 0;
+
+cleanup:
+  ctx_stmt_release(pstmt_p);
 
-  ret_val = db_conn_commit(db_p);
+  return ret_val;
+}
+
+int omemo_storage_ctx_chatlist_exists(omemo_storage_ctx * ctx_p, const char * chat) {
+  if (!ctx_p || !chat) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  sqlite3_stmt * pstmt_p = (void *) 0;
+
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_CHATLIST_EXISTS, &pstmt_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = sqlite3_bind_text(pstmt_p, 1, chat, -1, SQLITE_STATIC);
   if (ret_val) {
+    ret_val = -ret_val;
     goto cleanup;
   }
 
+  ret_val = sqlite3_step(pstmt_p);
+  if (ret_val != SQLITE_ROW) {
+    ret_val = (ret_val == SQLITE_DONE) ? 0 : -ret_val;
+  } else {
+    ret_val = 1;
+  }
 
 cleanup:
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
 
   return ret_val;
 }
 
-int omemo_storage_chatlist_exists(const char * chat, const char * db_fn) {
-  const char * stmt = "SELECT " CHATLIST_CHAT_NAME_NAME " FROM " CHATLIST_TABLE_NAME
-                      " WHERE " CHATLIST_CHAT_NAME_NAME " IS ?1;";
+int omemo_storage_ctx_chatlist_delete(omemo_storage_ctx * ctx_p, const char * chat) {
+  if (!ctx_p || !chat) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_CHATLIST_DELETE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
@@ -294,6 +418,39 @@ int omemo_storage_chatlist_exists(const char * chat, const char * db_fn) {
     goto cleanup;
   }
 
+  ret_val = sqlite3_step(pstmt_p);
+  if (ret_val != SQLITE_DONE) {
+    ret_val = -ret_val;
+    goto cleanup;
+  }
+  ret_val = 0;
+
+cleanup:
+  ctx_stmt_release(pstmt_p);
+
+  return ret_val;
+}
+
+int omemo_storage_ctx_global_device_id_exists(omemo_storage_ctx * ctx_p, uint32_t device_id) {
+  if (!ctx_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  sqlite3_stmt * pstmt_p = (void *) 0;
+
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_GLOBAL_DEVICE_ID_EXISTS, &pstmt_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = sqlite3_bind_int(pstmt_p, 1, device_id);
+  if (ret_val) {
+    ret_val = -ret_val;
+    goto cleanup;
+  }
+
   ret_val = sqlite3_step(pstmt_p);
   if (ret_val != SQLITE_ROW) {
     ret_val = (ret_val == SQLITE_DONE) ? 0 : -ret_val;
@@ -302,80 +459,460 @@ int omemo_storage_chatlist_exists(const char * chat, const char * db_fn) {
   }
 
 cleanup:
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
 
   return ret_val;
 }
 
-int omemo_storage_chatlist_delete(const char * chat, const char * db_fn) {
-  const char * stmt = "DELETE FROM " CHATLIST_TABLE_NAME " WHERE " CHATLIST_CHAT_NAME_NAME " IS ?1;";
+static void uint32_to_be(uint32_t in, uint8_t * out_p) {
+  out_p[0] = in >> 24;
+  out_p[1] = in >> 16;
+  out_p[2] = in >> 8;
+  out_p[3] = in;
+}
+
+static uint32_t uint32_from_be(const uint8_t * in_p) {
+  return ((uint32_t) in_p[0] << 24) | ((uint32_t) in_p[1] << 16) | ((uint32_t) in_p[2] << 8) | in_p[3];
+}
+
+/**
+ * The pre keys of a bundle are stored in a single blob.
+ * Each one is its ID and the length of its data as 32 bit big endian numbers, followed by the data.
+ */
+static int bundle_pre_keys_pack(const omemo_bundle * bundle_p, uint8_t ** blob_pp, size_t * blob_len_p) {
+  size_t amount = omemo_bundle_get_pre_key_amount(bundle_p);
+  size_t blob_len = 0;
+  uint32_t pre_key_id = 0;
+  const uint8_t * data_p = (void *) 0;
+  size_t data_len = 0;
+
+  for (size_t i = 0; i < amount; i++) {
+    (void) omemo_bundle_get_pre_key(bundle_p, i, &pre_key_id, &data_p, &data_len);
+    blob_len += 8 + data_len;
+  }
+
+  uint8_t * blob_p = malloc(blob_len ? blob_len : 1);
+  if (!blob_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+
+  uint8_t * pos_p = blob_p;
+  for (size_t i = 0; i < amount; i++) {
+    (void) omemo_bundle_get_pre_key(bundle_p, i, &pre_key_id, &data_p, &data_len);
+    uint32_to_be(pre_key_id, pos_p);
+    uint32_to_be(data_len, pos_p + 4);
+    memcpy(pos_p + 8, data_p, data_len);
+    pos_p += 8 + data_len;
+  }
+
+  *blob_pp = blob_p;
+  *blob_len_p = blob_len;
+
+  return 0;
+}
+
+static int bundle_pre_keys_unpack(const uint8_t * blob_p, size_t blob_len, omemo_bundle * bundle_p) {
+  int ret_val = 0;
+  size_t pos = 0;
+
+  while (pos < blob_len) {
+    if (blob_len - pos < 8) {
+      return OMEMO_ERR_STORAGE;
+    }
+    uint32_t pre_key_id = uint32_from_be(blob_p + pos);
+    size_t data_len = uint32_from_be(blob_p + pos + 4);
+    pos += 8;
+    if (blob_len - pos < data_len) {
+      return OMEMO_ERR_STORAGE;
+    }
+
+    ret_val = omemo_bundle_add_pre_key(bundle_p, pre_key_id, (uint8_t *) blob_p + pos, data_len);
+    if (ret_val) {
+      return ret_val;
+    }
+    pos += data_len;
+  }
+
+  return 0;
+}
+
+// binds the data with SQLITE_TRANSIENT, as it is freed before the statement is stepped through
+static int bundle_bind_blob(sqlite3_stmt * pstmt_p, int index, uint8_t * data_p, size_t data_len) {
+  int ret_val = sqlite3_bind_blob(pstmt_p, index, data_p, data_len, SQLITE_TRANSIENT);
+  free(data_p);
+
+  return ret_val ? -ret_val : 0;
+}
+
+int omemo_storage_ctx_bundle_save(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id,
+                                  const char * item_id, const char * hash, omemo_bundle * bundle_p) {
+  if (!ctx_p || !user || !bundle_p) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
+  uint32_t spk_id = 0;
+  uint8_t * data_p = (void *) 0;
+  size_t data_len = 0;
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_BUNDLE_SAVE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
 
-  ret_val = sqlite3_bind_text(pstmt_p, 1, chat, -1, SQLITE_STATIC);
+  ret_val = sqlite3_bind_text(pstmt_p, 1, user, -1, SQLITE_STATIC);
+  if (!ret_val) {
+    ret_val = sqlite3_bind_int(pstmt_p, 2, device_id);
+  }
+  if (!ret_val) {
+    ret_val = item_id ? sqlite3_bind_text(pstmt_p, 3, item_id, -1, SQLITE_STATIC) : sqlite3_bind_null(pstmt_p, 3);
+  }
+  if (!ret_val) {
+    ret_val = hash ? sqlite3_bind_text(pstmt_p, 4, hash, -1, SQLITE_STATIC) : sqlite3_bind_null(pstmt_p, 4);
+  }
   if (ret_val) {
     ret_val = -ret_val;
     goto cleanup;
   }
 
-  ret_val = sqlite3_step(pstmt_p);
-  if (ret_val != SQLITE_DONE) {
+  ret_val = omemo_bundle_get_signed_pre_key(bundle_p, &spk_id, &data_p, &data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+  ret_val = sqlite3_bind_int64(pstmt_p, 5, spk_id);
+  if (ret_val) {
+    free(data_p);
     ret_val = -ret_val;
     goto cleanup;
   }
+  ret_val = bundle_bind_blob(pstmt_p, 6, data_p, data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = omemo_bundle_get_signature(bundle_p, &data_p, &data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+  ret_val = bundle_bind_blob(pstmt_p, 7, data_p, data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
 
-  ret_val = db_conn_commit(db_p);
+  ret_val = omemo_bundle_get_identity_key(bundle_p, &data_p, &data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+  ret_val = bundle_bind_blob(pstmt_p, 8, data_p, data_len);
   if (ret_val) {
     goto cleanup;
   }
 
+  ret_val = bundle_pre_keys_pack(bundle_p, &data_p, &data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+  ret_val = bundle_bind_blob(pstmt_p, 9, data_p, data_len);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = sqlite3_step(pstmt_p);
+  if (ret_val != SQLITE_DONE) {
+    ret_val = -ret_val;
+    goto cleanup;
+  }
+  ret_val = 0;
+
 cleanup:
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
 
   return ret_val;
 }
 
+// copies a text column, which can be NULL
+static int column_text_dup(sqlite3_stmt * pstmt_p, int col, char ** out_pp) {
+  const unsigned char * text_p = sqlite3_column_text(pstmt_p, col);
+  if (!text_p) {
+    *out_pp = (void *) 0;
+    return 0;
+  }
 
-int omemo_storage_global_device_id_exists(uint32_t device_id, const char * db_fn) {
-  const char * stmt = "SELECT " DEVICELIST_ID_NAME " FROM " DEVICELIST_TABLE_NAME
-                      " WHERE " DEVICELIST_ID_NAME " IS ?1;";
+  size_t len = sqlite3_column_bytes(pstmt_p, col);
+  char * out_p = malloc(len + 1);
+  if (!out_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memcpy(out_p, text_p, len + 1);
+
+  *out_pp = out_p;
+
+  return 0;
+}
+
+int omemo_storage_ctx_bundle_retrieve(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id,
+                                      char ** item_id_pp, char ** hash_pp, omemo_bundle ** bundle_pp) {
+  if (!ctx_p || !user || !bundle_pp) {
+    return OMEMO_ERR_NULL;
+  }
 
   int ret_val = 0;
 
-  sqlite3 * db_p = (void *) 0;
   sqlite3_stmt * pstmt_p = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+  char * item_id = (void *) 0;
+  char * hash = (void *) 0;
 
-  ret_val = db_conn_open_and_prepare(&db_p, &pstmt_p, stmt, db_fn);
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_BUNDLE_RETRIEVE, &pstmt_p);
   if (ret_val) {
     goto cleanup;
   }
 
-  ret_val = sqlite3_bind_int(pstmt_p, 1, device_id);
+  ret_val = sqlite3_bind_text(pstmt_p, 1, user, -1, SQLITE_STATIC);
+  if (!ret_val) {
+    ret_val = sqlite3_bind_int(pstmt_p, 2, device_id);
+  }
   if (ret_val) {
     ret_val = -ret_val;
     goto cleanup;
   }
 
   ret_val = sqlite3_step(pstmt_p);
+  if (ret_val == SQLITE_DONE) {
+    ret_val = 0;
+    goto cleanup;
+  }
   if (ret_val != SQLITE_ROW) {
-    ret_val = (ret_val == SQLITE_DONE) ? 0 : -ret_val;
+    ret_val = -ret_val;
+    goto cleanup;
+  }
+
+  ret_val = omemo_bundle_create(&bundle_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  // sqlite3_column_blob() returns NULL for empty blobs, which the setters only accept with a length of 0 anyway
+  ret_val = omemo_bundle_set_device_id(bundle_p, device_id);
+  if (!ret_val) {
+    ret_val = omemo_bundle_set_signed_pre_key(bundle_p, sqlite3_column_int64(pstmt_p, 2),
+                                              (uint8_t *) sqlite3_column_blob(pstmt_p, 3), sqlite3_column_bytes(pstmt_p, 3));
+  }
+  if (!ret_val) {
+    ret_val = omemo_bundle_set_signature(bundle_p, (uint8_t *) sqlite3_column_blob(pstmt_p, 4), sqlite3_column_bytes(pstmt_p, 4));
+  }
+  if (!ret_val) {
+    ret_val = omemo_bundle_set_identity_key(bundle_p, (uint8_t *) sqlite3_column_blob(pstmt_p, 5), sqlite3_column_bytes(pstmt_p, 5));
+  }
+  if (!ret_val) {
+    ret_val = bundle_pre_keys_unpack(sqlite3_column_blob(pstmt_p, 6), sqlite3_column_bytes(pstmt_p, 6), bundle_p);
+  }
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  if (item_id_pp) {
+    ret_val = column_text_dup(pstmt_p, 0, &item_id);
+    if (ret_val) {
+      goto cleanup;
+    }
+  }
+  if (hash_pp) {
+    ret_val = column_text_dup(pstmt_p, 1, &hash);
+    if (ret_val) {
+      goto cleanup;
+    }
+  }
+
+cleanup:
+  if (ret_val) {
+    omemo_bundle_destroy(bundle_p);
+    free(item_id);
+    free(hash);
   } else {
-    ret_val = 1;
+    *bundle_pp = bundle_p;
+    if (item_id_pp) {
+      *item_id_pp = item_id;
+    }
+    if (hash_pp) {
+      *hash_pp = hash;
+    }
+  }
+  ctx_stmt_release(pstmt_p);
+
+  return ret_val;
+}
+
+int omemo_storage_ctx_bundle_delete(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id) {
+  if (!ctx_p || !user) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+
+  sqlite3_stmt * pstmt_p = (void *) 0;
+
+  ret_val = ctx_stmt_get(ctx_p, STMT_IDX_BUNDLE_DELETE, &pstmt_p);
+  if (ret_val) {
+    goto cleanup;
+  }
+
+  ret_val = sqlite3_bind_text(pstmt_p, 1, user, -1, SQLITE_STATIC);
+  if (!ret_val) {
+    ret_val = sqlite3_bind_int(pstmt_p, 2, device_id);
+  }
+  if (ret_val) {
+    ret_val = -ret_val;
+    goto cleanup;
   }
 
+  ret_val = sqlite3_step(pstmt_p);
+  if (ret_val != SQLITE_DONE) {
+    ret_val = -ret_val;
+    goto cleanup;
+  }
+  ret_val = 0;
+
 cleanup:
-  sqlite3_finalize(pstmt_p);
-  sqlite3_close(db_p);
+  ctx_stmt_release(pstmt_p);
+
+  return ret_val;
+}
+
+int omemo_storage_user_device_id_save(const char * user, uint32_t device_id, const char * db_fn) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_user_device_id_save(ctx_p, user, device_id);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
+
+  return ret_val;
+}
+
+int omemo_storage_user_device_id_delete(const char * user, uint32_t device_id, const char * db_fn) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_user_device_id_delete(ctx_p, user, device_id);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
 
   return ret_val;
 }
+
+int omemo_storage_user_devicelist_retrieve(const char * user, const char * db_fn, omemo_devicelist ** dl_pp) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_user_devicelist_retrieve(ctx_p, user, dl_pp);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
+
+  return ret_val;
+}
+
+int omemo_storage_chatlist_save(const char * chat, const char * db_fn) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_chatlist_save(ctx_p, chat);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
+
+  return ret_val;
+}
+
+int omemo_storage_chatlist_exists(const char * chat, const char * db_fn) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_chatlist_exists(ctx_p, chat);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
+
+  return ret_val;
+}
+
+int omemo_storage_chatlist_delete(const char * chat, const char * db_fn) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_chatlist_delete(ctx_p, chat);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
+
+  return ret_val;
+}
+
+int omemo_storage_global_device_id_exists(uint32_t device_id, const char * db_fn) {
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  int ret_val = omemo_storage_ctx_open(db_fn, &ctx_p);
+  if (!ret_val) {
+    ret_val = omemo_storage_ctx_global_device_id_exists(ctx_p, device_id);
+  }
+
+  omemo_storage_ctx_close(ctx_p);
+
+  return ret_val;
+}
+
+static int sqlite_provider_user_device_id_save(const char * user, uint32_t device_id, void * user_data_p) {
+  return omemo_storage_ctx_user_device_id_save(user_data_p, user, device_id);
+}
+
+static int sqlite_provider_user_device_id_delete(const char * user, uint32_t device_id, void * user_data_p) {
+  return omemo_storage_ctx_user_device_id_delete(user_data_p, user, device_id);
+}
+
+static int sqlite_provider_user_devicelist_retrieve(const char * user, void * user_data_p, omemo_devicelist ** dl_pp) {
+  return omemo_storage_ctx_user_devicelist_retrieve(user_data_p, user, dl_pp);
+}
+
+static int sqlite_provider_chatlist_save(const char * chat, void * user_data_p) {
+  return omemo_storage_ctx_chatlist_save(user_data_p, chat);
+}
+
+static int sqlite_provider_chatlist_exists(const char * chat, void * user_data_p) {
+  return omemo_storage_ctx_chatlist_exists(user_data_p, chat);
+}
+
+static int sqlite_provider_chatlist_delete(const char * chat, void * user_data_p) {
+  return omemo_storage_ctx_chatlist_delete(user_data_p, chat);
+}
+
+static int sqlite_provider_global_device_id_exists(uint32_t device_id, void * user_data_p) {
+  return omemo_storage_ctx_global_device_id_exists(user_data_p, device_id);
+}
+
+int omemo_storage_ctx_provider_init(omemo_storage_ctx * ctx_p, omemo_storage_provider * provider_p) {
+  if (!ctx_p || !provider_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  provider_p->user_device_id_save_func = sqlite_provider_user_device_id_save;
+  provider_p->user_device_id_delete_func = sqlite_provider_user_device_id_delete;
+  provider_p->user_devicelist_retrieve_func = sqlite_provider_user_devicelist_retrieve;
+  provider_p->chatlist_save_func = sqlite_provider_chatlist_save;
+  provider_p->chatlist_exists_func = sqlite_provider_chatlist_exists;
+  provider_p->chatlist_delete_func = sqlite_provider_chatlist_delete;
+  provider_p->global_device_id_exists_func = sqlite_provider_global_device_id_exists;
+  provider_p->user_data_p = ctx_p;
+
+  return 0;
+}
@@ -70,3 +70,199 @@ int omemo_storage_chatlist_delete(const char * chat, const char * db_fn);
  * @return 1 if true, 0 if false, negative on error
  */
 int omemo_storage_global_device_id_exists(uint32_t device_id, const char * db_fn);
+
+/*
+ * Storage context API.
+ *
+ * The functions above open the database, make sure the tables exist and close it again on every call.
+ * A storage context instead keeps the connection open and caches the prepared statements,
+ * which makes it the better choice for frequent lookups (e.g. for every incoming message).
+ * A context must not be used from multiple threads at the same time.
+ */
+
+typedef struct omemo_storage_ctx omemo_storage_ctx;
+
+/**
+ * Opens the DB and creates the tables if necessary.
+ *
+ * @param db_fn Path to the DB.
+ * @param ctx_pp Will be set to the allocated storage context. Free with omemo_storage_ctx_close().
+ * @return 0 on success, negative on error (e.g. negated SQLite3 error codes).
+ */
+int omemo_storage_ctx_open(const char * db_fn, omemo_storage_ctx ** ctx_pp);
+
+/**
+ * Finalizes the cached statements, closes the DB and frees the context.
+ *
+ * @param ctx_p Pointer to the storage context. Can be NULL.
+ */
+void omemo_storage_ctx_close(omemo_storage_ctx * ctx_p);
+
+/**
+ * Same as omemo_storage_user_device_id_save(), but uses an open storage context.
+ */
+int omemo_storage_ctx_user_device_id_save(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id);
+
+/**
+ * Same as omemo_storage_user_device_id_delete(), but uses an open storage context.
+ */
+int omemo_storage_ctx_user_device_id_delete(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id);
+
+/**
+ * Same as omemo_storage_user_devicelist_retrieve(), but uses an open storage context.
+ */
+int omemo_storage_ctx_user_devicelist_retrieve(omemo_storage_ctx * ctx_p, const char * user, omemo_devicelist ** dl_pp);
+
+/**
+ * Same as omemo_storage_chatlist_save(), but uses an open storage context.
+ */
+int omemo_storage_ctx_chatlist_save(omemo_storage_ctx * ctx_p, const char * chat);
+
+/**
+ * Same as omemo_storage_chatlist_exists(), but uses an open storage context.
+ *
+ * @return 1 if it exists, 0 if it does not, negative on error.
+ */
+int omemo_storage_ctx_chatlist_exists(omemo_storage_ctx * ctx_p, const char * chat);
+
+/**
+ * Same as omemo_storage_chatlist_delete(), but uses an open storage context.
+ */
+int omemo_storage_ctx_chatlist_delete(omemo_storage_ctx * ctx_p, const char * chat);
+
+/**
+ * Same as omemo_storage_global_device_id_exists(), but uses an open storage context.
+ *
+ * @return 1 if true, 0 if false, negative on error
+ */
+int omemo_storage_ctx_global_device_id_exists(omemo_storage_ctx * ctx_p, uint32_t device_id);
+
+/**
+ * Saves the bundle of a device, replacing the one saved before.
+ * The keys are stored as binary data, so retrieving the bundle again does not involve any XML.
+ * There are no functions without a context for bundles, as they are meant to be used by omemo_bundle_cache.
+ *
+ * @param ctx_p Pointer to the open storage context.
+ * @param user Owner of the device.
+ * @param device_id The device ID.
+ * @param item_id The ID of the PEP item the bundle was received in. Can be NULL.
+ * @param hash Hash of the received XML. Can be NULL.
+ * @param bundle_p Pointer to the complete bundle.
+ * @return 0 on success, negative on error (e.g. negated SQLite3 error codes).
+ */
+int omemo_storage_ctx_bundle_save(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id,
+                                  const char * item_id, const char * hash, omemo_bundle * bundle_p);
+
+/**
+ * Retrieves the saved bundle of a device.
+ *
+ * @param ctx_p Pointer to the open storage context.
+ * @param user Owner of the device.
+ * @param device_id The device ID.
+ * @param item_id_pp Will be set to the saved item ID or NULL. free() when done. Can be NULL if not needed.
+ * @param hash_pp Will be set to the saved hash or NULL. free() when done. Can be NULL if not needed.
+ * @param bundle_pp Will be set to the bundle, or NULL if none is saved for the device.
+ * @return 0 on success, negative on error (e.g. negated SQLite3 error codes).
+ */
+int omemo_storage_ctx_bundle_retrieve(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id,
+                                      char ** item_id_pp, char ** hash_pp, omemo_bundle ** bundle_pp);
+
+/**
+ * Deletes the saved bundle of a device.
+ *
+ * @param ctx_p Pointer to the open storage context.
+ * @param user Owner of the device.
+ * @param device_id The device ID.
+ * @return 0 on success, negative on error.
+ */
+int omemo_storage_ctx_bundle_delete(omemo_storage_ctx * ctx_p, const char * user, uint32_t device_id);
+
+/*
+ * Storage provider API.
+ *
+ * Similar to the crypto provider, this allows swapping the storage backend.
+ * A SQLite implementation working on a storage context and an in-memory one (see libomemo_storage_mem.h) are included.
+ */
+
+typedef struct omemo_storage_provider {
+  /**
+   * Saves a device ID for a username.
+   *
+   * @param user Owner of the devicelist.
+   * @param device_id The device ID.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @return 0 on success, negative on error.
+   */
+  int (*user_device_id_save_func)(const char * user, uint32_t device_id, void * user_data_p);
+
+  /**
+   * Deletes a device ID for a username.
+   *
+   * @param user Owner of the devicelist.
+   * @param device_id The device ID.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @return 0 on success, negative on error.
+   */
+  int (*user_device_id_delete_func)(const char * user, uint32_t device_id, void * user_data_p);
+
+  /**
+   * Retrieves the list of devices for a user.
+   *
+   * @param user User to look for.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @param dl_pp Will be set to the devicelist, which is empty if there are no entries.
+   * @return 0 on success, negative on error.
+   */
+  int (*user_devicelist_retrieve_func)(const char * user, void * user_data_p, omemo_devicelist ** dl_pp);
+
+  /**
+   * Saves a chat to "the list".
+   *
+   * @param chat The name of the chat.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @return 0 on success, negative on error.
+   */
+  int (*chatlist_save_func)(const char * chat, void * user_data_p);
+
+  /**
+   * Looks up a chat in "the list".
+   *
+   * @param chat The name of the chat.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @return 1 if it exists, 0 if it does not, negative on error.
+   */
+  int (*chatlist_exists_func)(const char * chat, void * user_data_p);
+
+  /**
+   * Deletes a chat from "the list".
+   *
+   * @param chat The name of the chat.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @return 0 on success, negative on error.
+   */
+  int (*chatlist_delete_func)(const char * chat, void * user_data_p);
+
+  /**
+   * Checks if the device ID is saved for any user.
+   *
+   * @param device_id The device ID to look for.
+   * @param user_data_p Pointer to the user data set in the storage provider.
+   * @return 1 if true, 0 if false, negative on error.
+   */
+  int (*global_device_id_exists_func)(uint32_t device_id, void * user_data_p);
+
+  /**
+   * User data which will be passed to the storage functions.
+   */
+  void * user_data_p;
+} omemo_storage_provider;
+
+/**
+ * Fills in a storage provider which uses the given SQLite storage context.
+ * The context has to stay open as long as the provider is used.
+ *
+ * @param ctx_p Pointer to the open storage context.
+ * @param provider_p Pointer to the storage provider to fill in.
+ * @return 0 on success, negative on error.
+ */
+int omemo_storage_ctx_provider_init(omemo_storage_ctx * ctx_p, omemo_storage_provider * provider_p);
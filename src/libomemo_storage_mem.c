@@ -0,0 +1,282 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "libomemo.h"
+#include "libomemo_storage.h"
+#include "libomemo_storage_mem.h"
+
+// sorted set of the device IDs of one user
+typedef struct mem_id_set {
+  uint32_t * ids_p;
+  size_t len;
+  size_t cap;
+} mem_id_set;
+
+struct omemo_storage_mem {
+  GRWLock lock;
+  GHashTable * devicelists_p; // user name -> mem_id_set
+  GHashTable * id_counts_p;   // device ID -> amount of users it is saved for
+  GHashTable * chatlist_p;    // chat name -> chat name
+};
+
+static void mem_id_set_free(gpointer data) {
+  mem_id_set * set_p = data;
+
+  if (set_p) {
+    free(set_p->ids_p);
+    free(set_p);
+  }
+}
+
+/**
+ * Finds the position of the ID in the set, or where it would have to be inserted.
+ */
+static size_t mem_id_set_lower_bound(const mem_id_set * set_p, uint32_t device_id) {
+  size_t lo = 0;
+  size_t hi = set_p->len;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (set_p->ids_p[mid] < device_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+int omemo_storage_mem_create(omemo_storage_mem ** mem_pp) {
+  if (!mem_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  omemo_storage_mem * mem_p = malloc(sizeof(omemo_storage_mem));
+  if (!mem_p) {
+    return OMEMO_ERR_NOMEM;
+  }
+  memset(mem_p, 0, sizeof(omemo_storage_mem));
+
+  g_rw_lock_init(&mem_p->lock);
+  mem_p->devicelists_p = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, mem_id_set_free);
+  mem_p->id_counts_p = g_hash_table_new_full(g_direct_hash, g_direct_equal, (void *) 0, (void *) 0);
+  mem_p->chatlist_p = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (void *) 0);
+
+  *mem_pp = mem_p;
+
+  return 0;
+}
+
+static int mem_user_device_id_save(const char * user, uint32_t device_id, void * user_data_p) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p || !user) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  mem_id_set * set_p = (void *) 0;
+
+  g_rw_lock_writer_lock(&mem_p->lock);
+
+  set_p = g_hash_table_lookup(mem_p->devicelists_p, user);
+  if (!set_p) {
+    set_p = malloc(sizeof(mem_id_set));
+    if (!set_p) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    memset(set_p, 0, sizeof(mem_id_set));
+    (void) g_hash_table_insert(mem_p->devicelists_p, g_strdup(user), set_p);
+  }
+
+  size_t pos = mem_id_set_lower_bound(set_p, device_id);
+  if (pos < set_p->len && set_p->ids_p[pos] == device_id) {
+    ret_val = OMEMO_ERR_STORAGE;
+    goto cleanup;
+  }
+
+  if (set_p->len == set_p->cap) {
+    size_t new_cap = set_p->cap ? set_p->cap * 2 : 4;
+    uint32_t * ids_p = realloc(set_p->ids_p, sizeof(uint32_t) * new_cap);
+    if (!ids_p) {
+      ret_val = OMEMO_ERR_NOMEM;
+      goto cleanup;
+    }
+    set_p->ids_p = ids_p;
+    set_p->cap = new_cap;
+  }
+
+  memmove(&set_p->ids_p[pos + 1], &set_p->ids_p[pos], sizeof(uint32_t) * (set_p->len - pos));
+  set_p->ids_p[pos] = device_id;
+  set_p->len++;
+
+  guint count = GPOINTER_TO_UINT(g_hash_table_lookup(mem_p->id_counts_p, GUINT_TO_POINTER(device_id)));
+  (void) g_hash_table_replace(mem_p->id_counts_p, GUINT_TO_POINTER(device_id), GUINT_TO_POINTER(count + 1));
+
+cleanup:
+  g_rw_lock_writer_unlock(&mem_p->lock);
+
+  return ret_val;
+}
+
+static int mem_user_device_id_delete(const char * user, uint32_t device_id, void * user_data_p) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p || !user) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_rw_lock_writer_lock(&mem_p->lock);
+
+  mem_id_set * set_p = g_hash_table_lookup(mem_p->devicelists_p, user);
+  if (set_p) {
+    size_t pos = mem_id_set_lower_bound(set_p, device_id);
+    if (pos < set_p->len && set_p->ids_p[pos] == device_id) {
+      memmove(&set_p->ids_p[pos], &set_p->ids_p[pos + 1], sizeof(uint32_t) * (set_p->len - pos - 1));
+      set_p->len--;
+
+      guint count = GPOINTER_TO_UINT(g_hash_table_lookup(mem_p->id_counts_p, GUINT_TO_POINTER(device_id)));
+      if (count > 1) {
+        (void) g_hash_table_replace(mem_p->id_counts_p, GUINT_TO_POINTER(device_id), GUINT_TO_POINTER(count - 1));
+      } else {
+        (void) g_hash_table_remove(mem_p->id_counts_p, GUINT_TO_POINTER(device_id));
+      }
+    }
+
+    if (set_p->len == 0) {
+      (void) g_hash_table_remove(mem_p->devicelists_p, user);
+    }
+  }
+
+  g_rw_lock_writer_unlock(&mem_p->lock);
+
+  return 0;
+}
+
+static int mem_user_devicelist_retrieve(const char * user, void * user_data_p, omemo_devicelist ** dl_pp) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p || !user || !dl_pp) {
+    return OMEMO_ERR_NULL;
+  }
+
+  int ret_val = 0;
+  omemo_devicelist * dl_p = (void *) 0;
+
+  ret_val = omemo_devicelist_create(user, &dl_p);
+  if (ret_val) {
+    return ret_val;
+  }
+
+  g_rw_lock_reader_lock(&mem_p->lock);
+
+  mem_id_set * set_p = g_hash_table_lookup(mem_p->devicelists_p, user);
+  for (size_t i = 0; set_p && i < set_p->len; i++) {
+    ret_val = omemo_devicelist_add(dl_p, set_p->ids_p[i]);
+    if (ret_val) {
+      goto cleanup;
+    }
+  }
+
+  *dl_pp = dl_p;
+
+cleanup:
+  g_rw_lock_reader_unlock(&mem_p->lock);
+  if (ret_val) {
+    omemo_devicelist_destroy(dl_p);
+  }
+
+  return ret_val;
+}
+
+static int mem_chatlist_save(const char * chat, void * user_data_p) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p || !chat) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_rw_lock_writer_lock(&mem_p->lock);
+  if (!g_hash_table_contains(mem_p->chatlist_p, chat)) {
+    char * key = g_strdup(chat);
+    (void) g_hash_table_insert(mem_p->chatlist_p, key, key);
+  }
+  g_rw_lock_writer_unlock(&mem_p->lock);
+
+  return 0;
+}
+
+static int mem_chatlist_exists(const char * chat, void * user_data_p) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p || !chat) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_rw_lock_reader_lock(&mem_p->lock);
+  int ret_val = g_hash_table_contains(mem_p->chatlist_p, chat) ? 1 : 0;
+  g_rw_lock_reader_unlock(&mem_p->lock);
+
+  return ret_val;
+}
+
+static int mem_chatlist_delete(const char * chat, void * user_data_p) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p || !chat) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_rw_lock_writer_lock(&mem_p->lock);
+  (void) g_hash_table_remove(mem_p->chatlist_p, chat);
+  g_rw_lock_writer_unlock(&mem_p->lock);
+
+  return 0;
+}
+
+static int mem_global_device_id_exists(uint32_t device_id, void * user_data_p) {
+  omemo_storage_mem * mem_p = user_data_p;
+
+  if (!mem_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  g_rw_lock_reader_lock(&mem_p->lock);
+  int ret_val = g_hash_table_contains(mem_p->id_counts_p, GUINT_TO_POINTER(device_id)) ? 1 : 0;
+  g_rw_lock_reader_unlock(&mem_p->lock);
+
+  return ret_val;
+}
+
+int omemo_storage_mem_provider_init(omemo_storage_mem * mem_p, omemo_storage_provider * provider_p) {
+  if (!mem_p || !provider_p) {
+    return OMEMO_ERR_NULL;
+  }
+
+  provider_p->user_device_id_save_func = mem_user_device_id_save;
+  provider_p->user_device_id_delete_func = mem_user_device_id_delete;
+  provider_p->user_devicelist_retrieve_func = mem_user_devicelist_retrieve;
+  provider_p->chatlist_save_func = mem_chatlist_save;
+  provider_p->chatlist_exists_func = mem_chatlist_exists;
+  provider_p->chatlist_delete_func = mem_chatlist_delete;
+  provider_p->global_device_id_exists_func = mem_global_device_id_exists;
+  provider_p->user_data_p = mem_p;
+
+  return 0;
+}
+
+void omemo_storage_mem_destroy(omemo_storage_mem * mem_p) {
+  if (mem_p) {
+    g_hash_table_destroy(mem_p->devicelists_p);
+    g_hash_table_destroy(mem_p->id_counts_p);
+    g_hash_table_destroy(mem_p->chatlist_p);
+    g_rw_lock_clear(&mem_p->lock);
+    free(mem_p);
+  }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "libomemo.h"
+#include "libomemo_storage.h"
+
+/*
+ * In-memory storage backend.
+ *
+ * Keeps devicelists and "the list" in hash tables, so nothing is persisted.
+ * Useful for hot lookups and for tests without disk I/O.
+ * All functions of the provider can be called from multiple threads at the same time:
+ * lookups only take a shared lock, changes an exclusive one.
+ */
+
+typedef struct omemo_storage_mem omemo_storage_mem;
+
+/**
+ * Allocates an empty in-memory storage.
+ *
+ * @param mem_pp Will be set to the allocated storage. Free with omemo_storage_mem_destroy().
+ * @return 0 on success, negative on error.
+ */
+int omemo_storage_mem_create(omemo_storage_mem ** mem_pp);
+
+/**
+ * Fills in a storage provider which uses the given in-memory storage.
+ * The storage has to stay alive as long as the provider is used.
+ *
+ * Saving a device ID which already exists for the user fails with OMEMO_ERR_STORAGE, like the SQLite backend.
+ * The IDs of a retrieved devicelist are in ascending order.
+ *
+ * @param mem_p Pointer to the in-memory storage.
+ * @param provider_p Pointer to the storage provider to fill in.
+ * @return 0 on success, negative on error.
+ */
+int omemo_storage_mem_provider_init(omemo_storage_mem * mem_p, omemo_storage_provider * provider_p);
+
+/**
+ * Frees the in-memory storage and everything in it.
+ *
+ * @param mem_p Pointer to the in-memory storage. Can be NULL.
+ */
+void omemo_storage_mem_destroy(omemo_storage_mem * mem_p);
@@ -0,0 +1,227 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <glib.h>
+
+#include "../src/libomemo_b64.c"
+
+// RFC 4648, section 10
+static const char * rfc_plain[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+static const char * rfc_b64[] = {"", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy"};
+
+void test_encode_rfc_vectors(void ** state) {
+  (void) state;
+
+  char out[16];
+  size_t out_len = 0;
+
+  for (size_t i = 0; i < sizeof(rfc_plain) / sizeof(rfc_plain[0]); i++) {
+    assert_int_equal(omemo_b64_encode_into((const uint8_t *) rfc_plain[i], strlen(rfc_plain[i]), out, sizeof(out), &out_len), 0);
+    assert_string_equal(out, rfc_b64[i]);
+    assert_int_equal(out_len, strlen(rfc_b64[i]));
+    assert_int_equal(omemo_b64_encoded_len(strlen(rfc_plain[i])), strlen(rfc_b64[i]));
+  }
+
+  assert_int_equal(omemo_b64_encode_into((const uint8_t *) "foo", 3, out, 4, &out_len), OMEMO_ERR_BUFFER_TOO_SMALL);
+  assert_int_equal(omemo_b64_encode_into((void *) 0, 3, out, sizeof(out), &out_len), OMEMO_ERR_NULL);
+}
+
+void test_decode_rfc_vectors(void ** state) {
+  (void) state;
+
+  uint8_t out[16];
+  size_t out_len = 0;
+
+  for (size_t i = 0; i < sizeof(rfc_plain) / sizeof(rfc_plain[0]); i++) {
+    assert_int_equal(omemo_b64_decode_into(rfc_b64[i], strlen(rfc_b64[i]), out, sizeof(out), &out_len), 0);
+    assert_int_equal(out_len, strlen(rfc_plain[i]));
+    assert_memory_equal(out, rfc_plain[i], out_len);
+  }
+
+  assert_int_equal(omemo_b64_decode_into("Zm9vYmFy", 8, out, 5, &out_len), OMEMO_ERR_BUFFER_TOO_SMALL);
+}
+
+void test_decode_lenient(void ** state) {
+  (void) state;
+
+  uint8_t * data_p = (void *) 0;
+  size_t data_len = 0;
+
+  // whitespace as some clients wrap lines
+  assert_int_equal(omemo_b64_decode(" Zm9v\nYmE=\r\n", &data_p, &data_len), 0);
+  assert_int_equal(data_len, 5);
+  assert_memory_equal(data_p, "fooba", 5);
+  free(data_p);
+
+  // missing padding
+  assert_int_equal(omemo_b64_decode("Zm9vYg", &data_p, &data_len), 0);
+  assert_int_equal(data_len, 4);
+  assert_memory_equal(data_p, "foob", 4);
+  free(data_p);
+}
+
+void test_decode_malformed(void ** state) {
+  (void) state;
+
+  static const char * malformed[] = {"Z", "Zm9vY", "Zm9v!mFy", "=Zm9", "Z===", "Zm==Zm9v", "Zm8==", "Zm8=x", "Zm9vYmFy====",
+                                     "Zm9vYmFyZm9vYmFyZm9vYmFyZm9vYmF\xC3\xA4Zm9vYmFyZm9vYmFyZm9vYmFyZm9vYmFy"};
+  uint8_t * data_p = (void *) 0;
+  size_t data_len = 0;
+
+  for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+    assert_int_equal(omemo_b64_decode(malformed[i], &data_p, &data_len), OMEMO_ERR_MALFORMED_BASE64);
+  }
+
+  assert_int_equal(omemo_b64_decode((void *) 0, &data_p, &data_len), OMEMO_ERR_NULL);
+}
+
+// lengths around the block sizes of the vector kernels, compared to GLib
+void test_round_trip(void ** state) {
+  (void) state;
+
+  uint8_t data[1024];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (i * 167 + 13) & 0xFF;
+  }
+
+  for (size_t len = 0; len <= sizeof(data); len += (len < 128) ? 1 : 37) {
+    char * b64_p = (void *) 0;
+    assert_int_equal(omemo_b64_encode(data, len, &b64_p), 0);
+
+    gchar * expected_p = g_base64_encode(data, len);
+    assert_string_equal(b64_p, expected_p);
+    g_free(expected_p);
+
+    uint8_t * decoded_p = (void *) 0;
+    size_t decoded_len = 0;
+    assert_int_equal(omemo_b64_decode(b64_p, &decoded_p, &decoded_len), 0);
+    assert_int_equal(decoded_len, len);
+    assert_memory_equal(decoded_p, data, len);
+    assert_true(decoded_len <= omemo_b64_decoded_len_max(strlen(b64_p)));
+
+    free(decoded_p);
+    free(b64_p);
+  }
+}
+
+// a character outside of the alphabet in the middle of a long string has to be found by the vector kernels as well
+void test_decode_malformed_long(void ** state) {
+  (void) state;
+
+  uint8_t data[300];
+  memset(data, 0xA5, sizeof(data));
+
+  char * b64_p = (void *) 0;
+  assert_int_equal(omemo_b64_encode(data, sizeof(data), &b64_p), 0);
+
+  uint8_t * decoded_p = (void *) 0;
+  size_t decoded_len = 0;
+  for (size_t pos = 0; pos < strlen(b64_p); pos += 7) {
+    char saved = b64_p[pos];
+    b64_p[pos] = '*';
+    assert_int_equal(omemo_b64_decode(b64_p, &decoded_p, &decoded_len), OMEMO_ERR_MALFORMED_BASE64);
+    b64_p[pos] = saved;
+  }
+
+  free(b64_p);
+}
+
+#if B64_X86
+typedef size_t (*b64_encode_kernel)(const uint8_t * data_p, size_t data_len, char * out_p);
+typedef size_t (*b64_decode_kernel)(const char * b64_p, size_t b64_len, uint8_t * out_p, size_t out_size, size_t * out_len_p);
+
+static void check_encode_kernel(b64_encode_kernel kernel, size_t block_len) {
+  uint8_t data[512];
+  char out[700];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (i * 167 + 13) & 0xFF;
+  }
+
+  for (size_t len = 0; len <= sizeof(data); len++) {
+    size_t done = kernel(data, len, out);
+    assert_int_equal(done % 3, 0);
+    assert_true(done <= len);
+    // stops only when there is not enough input left for another block
+    assert_true(done + block_len > len);
+
+    gchar * expected_p = g_base64_encode(data, len);
+    assert_memory_equal(out, expected_p, done / 3 * 4);
+    g_free(expected_p);
+  }
+}
+
+static void check_decode_kernel(b64_decode_kernel kernel, size_t block_len) {
+  uint8_t data[510];
+  uint8_t out[520];
+  size_t out_len = 0;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (i * 167 + 13) & 0xFF;
+  }
+
+  // without padding, so that all of the input is in the alphabet
+  for (size_t len = 0; len <= sizeof(data); len += 3) {
+    gchar * b64_p = g_base64_encode(data, len);
+    size_t b64_len = strlen(b64_p);
+
+    size_t done = kernel(b64_p, b64_len, out, sizeof(out), &out_len);
+    assert_int_equal(done % 4, 0);
+    assert_true(done + block_len > b64_len);
+    assert_int_equal(out_len, done / 4 * 3);
+    assert_memory_equal(out, data, out_len);
+
+    // a character outside of the alphabet stops it before the block it is in
+    if (b64_len) {
+      size_t pos = b64_len / 2;
+      char saved = b64_p[pos];
+      b64_p[pos] = '*';
+      done = kernel(b64_p, b64_len, out, sizeof(out), &out_len);
+      assert_true(done <= pos);
+      assert_true(done + block_len > pos);
+      b64_p[pos] = saved;
+    }
+
+    g_free(b64_p);
+  }
+
+  // and so does an output buffer without room for the next whole block store
+  gchar * b64_p = g_base64_encode(data, sizeof(data));
+  size_t done = kernel(b64_p, strlen(b64_p), out, block_len, &out_len);
+  assert_int_equal(done, block_len);
+  assert_int_equal(out_len, block_len / 4 * 3);
+  g_free(b64_p);
+}
+#endif
+
+// the dispatch only ever uses the widest kernel the CPU supports, so each one is also called directly
+void test_kernels(void ** state) {
+  (void) state;
+
+#if B64_X86
+  if (__builtin_cpu_supports("ssse3")) {
+    check_encode_kernel(b64_encode_ssse3, 16);
+    check_decode_kernel(b64_decode_ssse3, 16);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    check_encode_kernel(b64_encode_avx2, 28);
+    check_decode_kernel(b64_decode_avx2, 32);
+  }
+#else
+  skip();
+#endif
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_encode_rfc_vectors),
+      cmocka_unit_test(test_decode_rfc_vectors),
+      cmocka_unit_test(test_decode_lenient),
+      cmocka_unit_test(test_decode_malformed),
+      cmocka_unit_test(test_round_trip),
+      cmocka_unit_test(test_decode_malformed_long),
+      cmocka_unit_test(test_kernels)
+  };
+
+  return cmocka_run_group_tests(tests, (void *) 0, (void *) 0);
+}
@@ -0,0 +1,256 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdio.h>
+
+#include <sqlite3.h>
+
+#include "../src/libomemo.h"
+#include "../src/libomemo_bundle_cache.c"
+
+#define TEST_DB_PATH "test_bundle_cache.sqlite"
+
+#define BUNDLE_START "<items node='eu.siacs.conversations.axolotl.bundles:31415'>"\
+                       "<item>"\
+                         "<bundle xmlns='eu.siacs.conversations.axolotl'>"\
+                           "<signedPreKeyPublic signedPreKeyId='1'>sWsAtQ==</signedPreKeyPublic>"\
+                           "<signedPreKeySignature>sWsAtQ==</signedPreKeySignature>"\
+                           "<identityKey>sWsAtQ==</identityKey>"\
+                           "<prekeys>"\
+                             "<preKeyPublic preKeyId='10'>sWsAtQ==</preKeyPublic>"\
+                             "<preKeyPublic preKeyId='20'>sWsAtQ==</preKeyPublic>"
+
+#define BUNDLE_END           "</prekeys>"\
+                         "</bundle>"\
+                       "</item>"\
+                     "</items>"
+
+static const char * bundle = BUNDLE_START BUNDLE_END;
+static const char * bundle_other = BUNDLE_START "<preKeyPublic preKeyId='30'>sWsAtQ==</preKeyPublic>" BUNDLE_END;
+// the same bundle in an item with an ID, and different whitespace outside the <bundle> element
+static const char * bundle_republished = "<items node='eu.siacs.conversations.axolotl.bundles:31415'>\n"
+                                           "  <item id='current'>"
+                                             "<bundle xmlns='eu.siacs.conversations.axolotl'>"
+                                               "<signedPreKeyPublic signedPreKeyId='1'>sWsAtQ==</signedPreKeyPublic>"
+                                               "<signedPreKeySignature>sWsAtQ==</signedPreKeySignature>"
+                                               "<identityKey>sWsAtQ==</identityKey>"
+                                               "<prekeys>"
+                                                 "<preKeyPublic preKeyId='10'>sWsAtQ==</preKeyPublic>"
+                                                 "<preKeyPublic preKeyId='20'>sWsAtQ==</preKeyPublic>"
+                                               "</prekeys>"
+                                             "</bundle>"
+                                           "</item>\n"
+                                         "</items>";
+
+int db_cleanup(void ** state) {
+  (void) state;
+
+  remove(TEST_DB_PATH);
+
+  return 0;
+}
+
+void test_create(void ** state) {
+  (void) state;
+
+  omemo_bundle_cache * cache_p = (void *) 0;
+  assert_int_equal(omemo_bundle_cache_create(10, (void *) 0, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_bundle_cache_create(0, (void *) 0, &cache_p), OMEMO_ERR);
+  assert_int_equal(omemo_bundle_cache_create(10, (void *) 0, &cache_p), 0);
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 31415, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "item"), 0);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, (void *) 0, (void *) 0, &bundle_p), OMEMO_ERR_NULL);
+
+  omemo_bundle_cache_destroy(cache_p);
+  omemo_bundle_cache_destroy((void *) 0);
+}
+
+void test_import(void ** state) {
+  (void) state;
+
+  omemo_bundle_cache * cache_p = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+  omemo_bundle * cached_p = (void *) 0;
+  assert_int_equal(omemo_bundle_cache_create(10, (void *) 0, &cache_p), 0);
+
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "item-1", bundle, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 2);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 31415, &cached_p), 1);
+  assert_ptr_equal(cached_p, bundle_p);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 27182, &cached_p), 0);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "bob@example.com", 31415, &cached_p), 0);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "item-1"), 1);
+
+  // the same item with the same content is not parsed again
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "item-1", bundle, &cached_p), 0);
+  assert_ptr_equal(cached_p, bundle_p);
+
+  // but the same item ID is not enough
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "item-1", "not XML", &cached_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 31415, &cached_p), 1);
+  assert_ptr_equal(cached_p, bundle_p);
+
+  // a new item with the same content only updates the item ID
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "item-2", bundle, &cached_p), 0);
+  assert_ptr_equal(cached_p, bundle_p);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "item-1"), 0);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "item-2"), 1);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, (void *) 0, bundle, &cached_p), 0);
+  assert_ptr_equal(cached_p, bundle_p);
+
+  // the item around the bundle is not part of the content
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "current", bundle_republished, &cached_p), 0);
+  assert_ptr_equal(cached_p, bundle_p);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "current"), 1);
+
+  // changed content replaces the bundle, also if it is republished under the same item ID
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "current", bundle_other, &bundle_p), 0);
+  assert_ptr_not_equal(bundle_p, cached_p);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 3);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "current"), 1);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, (void *) 0, bundle, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 2);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 31415, "current"), 0);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, (void *) 0, bundle_other, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 3);
+  assert_int_equal(g_hash_table_size(cache_p->entries_p), 1);
+
+  // a malformed bundle leaves the cached one alone
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 31415, "item-3", "<items/>", &cached_p), OMEMO_ERR_MALFORMED_BUNDLE_NO_NODE_ATTR);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 31415, &cached_p), 1);
+  assert_ptr_equal(cached_p, bundle_p);
+
+  assert_int_equal(omemo_bundle_cache_remove(cache_p, "alice@example.com", 31415), 0);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 31415, &cached_p), 0);
+  assert_int_equal(omemo_bundle_cache_remove(cache_p, "alice@example.com", 31415), 0);
+
+  omemo_bundle_cache_destroy(cache_p);
+}
+
+void test_lru(void ** state) {
+  (void) state;
+
+  omemo_bundle_cache * cache_p = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_cache_create(2, (void *) 0, &cache_p), 0);
+
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 1, (void *) 0, bundle, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 2, (void *) 0, bundle, &bundle_p), 0);
+  assert_int_equal(cache_p->head_p->key.device_id, 2);
+  assert_int_equal(cache_p->tail_p->key.device_id, 1);
+
+  // using 1 makes 2 the one to drop
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 1, &bundle_p), 1);
+  assert_int_equal(cache_p->head_p->key.device_id, 1);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "bob@example.com", 3, (void *) 0, bundle, &bundle_p), 0);
+  assert_int_equal(g_hash_table_size(cache_p->entries_p), 2);
+
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 2, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 1, &bundle_p), 1);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "bob@example.com", 3, &bundle_p), 1);
+  assert_int_equal(cache_p->head_p->key.device_id, 3);
+  assert_int_equal(cache_p->tail_p->key.device_id, 1);
+  assert_ptr_equal(cache_p->head_p->next_p, cache_p->tail_p);
+  assert_ptr_equal(cache_p->tail_p->prev_p, cache_p->head_p);
+
+  omemo_bundle_cache_destroy(cache_p);
+}
+
+void test_persistence(void ** state) {
+  (void) state;
+
+  omemo_storage_ctx * ctx_p = (void *) 0;
+  omemo_bundle_cache * cache_p = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_storage_ctx_open(TEST_DB_PATH, &ctx_p), 0);
+
+  assert_int_equal(omemo_bundle_cache_create(1, ctx_p, &cache_p), 0);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 1, "item-1", bundle, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 2, "item-2", bundle_other, &bundle_p), 0);
+
+  // dropped from memory, but still in the DB
+  assert_int_equal(g_hash_table_size(cache_p->entries_p), 1);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 1, "item-1"), 1);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 1, "item-2"), 0);
+  omemo_bundle_cache_destroy(cache_p);
+
+  // as after a restart
+  assert_int_equal(omemo_bundle_cache_create(10, ctx_p, &cache_p), 0);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 2, &bundle_p), 1);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 3);
+
+  uint32_t pre_key_id = 0;
+  uint8_t * data_p = (void *) 0;
+  size_t data_len = 0;
+  assert_int_equal(omemo_bundle_get_signed_pre_key(bundle_p, &pre_key_id, &data_p, &data_len), 0);
+  assert_int_equal(pre_key_id, 1);
+  assert_int_equal(data_len, 4);
+  assert_memory_equal(data_p, "\xB1\x6B\x00\xB5", 4);
+  free(data_p);
+
+  // the same content is recognized by the hash, without parsing it
+  omemo_bundle * cached_p = (void *) 0;
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 2, "item-3", bundle_other, &cached_p), 0);
+  assert_ptr_equal(cached_p, bundle_p);
+
+  assert_int_equal(omemo_bundle_cache_remove(cache_p, "alice@example.com", 2), 0);
+  omemo_bundle_cache_destroy(cache_p);
+
+  assert_int_equal(omemo_bundle_cache_create(10, ctx_p, &cache_p), 0);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 2, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 1, &bundle_p), 1);
+  omemo_bundle_cache_destroy(cache_p);
+
+  omemo_storage_ctx_close(ctx_p);
+}
+
+void test_save_fail(void ** state) {
+  (void) state;
+
+  omemo_storage_ctx * ctx_p = (void *) 0;
+  omemo_bundle_cache * cache_p = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_storage_ctx_open(TEST_DB_PATH, &ctx_p), 0);
+  assert_int_equal(omemo_bundle_cache_create(10, ctx_p, &cache_p), 0);
+  assert_int_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 1, "item-1", bundle, &bundle_p), 0);
+
+  // saving fails from now on
+  sqlite3 * db_p = (void *) 0;
+  assert_int_equal(sqlite3_open(TEST_DB_PATH, &db_p), SQLITE_OK);
+  assert_int_equal(sqlite3_exec(db_p, "DROP TABLE bundles;", (void *) 0, (void *) 0, (void *) 0), SQLITE_OK);
+  sqlite3_close(db_p);
+
+  // a changed bundle
+  omemo_bundle * other_p = (void *) 0;
+  assert_int_not_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 1, "item-2", bundle_other, &other_p), 0);
+  assert_non_null(other_p);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(other_p), 3);
+  assert_int_equal(omemo_bundle_cache_get(cache_p, "alice@example.com", 1, &bundle_p), 1);
+  assert_ptr_equal(bundle_p, other_p);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 1, "item-2"), 1);
+
+  // the same bundle under a new item ID
+  other_p = (void *) 0;
+  assert_int_not_equal(omemo_bundle_cache_import(cache_p, "alice@example.com", 1, "item-3", bundle_other, &other_p), 0);
+  assert_ptr_equal(other_p, bundle_p);
+  assert_int_equal(omemo_bundle_cache_has_item(cache_p, "alice@example.com", 1, "item-3"), 1);
+
+  omemo_bundle_cache_destroy(cache_p);
+  omemo_storage_ctx_close(ctx_p);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_create),
+      cmocka_unit_test(test_import),
+      cmocka_unit_test(test_lru),
+      cmocka_unit_test_teardown(test_persistence, db_cleanup),
+      cmocka_unit_test_teardown(test_save_fail, db_cleanup)
+  };
+
+  return cmocka_run_group_tests(tests, (void *) 0, (void *) 0);
+}
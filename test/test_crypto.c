@@ -31,6 +31,37 @@ void test_random_bytes(void ** state) {
   free(buf);
 }
 
+void test_random_bytes_into(void ** state) {
+  (void) state;
+
+  uint8_t zeros[2048] = {0};
+  uint8_t a[2048] = {0};
+  uint8_t b[2048] = {0};
+
+  assert_int_equal(omemo_default_crypto_random_bytes_into((void *) 0, 4, (void *) 0), OMEMO_ERR_NULL);
+
+  // consecutive small requests from the pool must not repeat
+  assert_int_equal(omemo_default_crypto_random_bytes_into(a, 28, (void *) 0), 0);
+  assert_int_equal(omemo_default_crypto_random_bytes_into(b, 28, (void *) 0), 0);
+  assert_memory_not_equal(a, zeros, 28);
+  assert_memory_not_equal(a, b, 28);
+
+  // crosses the end of the pool at some point
+  for (size_t i = 0; i < 8; i++) {
+    assert_int_equal(omemo_default_crypto_random_bytes_into(a, 1000, (void *) 0), 0);
+    assert_memory_not_equal(a, b, 1000);
+    memcpy(b, a, 1000);
+  }
+
+  // bypasses the pool
+  assert_int_equal(omemo_default_crypto_random_bytes_into(a, sizeof(a), (void *) 0), 0);
+  assert_memory_not_equal(a, zeros, sizeof(a));
+
+  omemo_default_crypto_teardown();
+  assert_int_equal(omemo_default_crypto_random_bytes_into(a, 28, (void *) 0), 0);
+  assert_memory_not_equal(a, b, 28);
+}
+
 void test_aes_gcm_encrypt_decrypt(void ** state) {
   (void) state;
   char * msg = "hello aes";
@@ -90,10 +121,196 @@ void test_aes_gcm_encrypt_decrypt(void ** state) {
   free(iv_p);
 }
 
+void test_aes_gcm_encrypt_decrypt_into(void ** state) {
+  (void) state;
+  char * msg = "hello aes, in place";
+  size_t plaintext_len = strlen(msg) + 1;
+
+  uint8_t iv[OMEMO_AES_GCM_IV_LENGTH] = {0};
+  uint8_t key[OMEMO_AES_128_KEY_LENGTH] = {1};
+  uint8_t tag[OMEMO_AES_GCM_TAG_LENGTH] = {0};
+  uint8_t tag_in_place[OMEMO_AES_GCM_TAG_LENGTH] = {0};
+  uint8_t ciphertext[64] = {0};
+  uint8_t buf[64] = {0};
+  uint8_t result[64] = {0};
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into((uint8_t *) msg, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, sizeof(key),
+                                                             (void *) 0,
+                                                             (void *) 0,
+                                                             tag, sizeof(tag)), OMEMO_ERR_NULL);
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into((uint8_t *) msg, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, sizeof(key),
+                                                             (void *) 0,
+                                                             ciphertext,
+                                                             tag, sizeof(tag)), 0);
+
+  // encrypting in place has to give the same result
+  memcpy(buf, msg, plaintext_len);
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(buf, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, sizeof(key),
+                                                             (void *) 0,
+                                                             buf,
+                                                             tag_in_place, sizeof(tag_in_place)), 0);
+  assert_memory_equal(buf, ciphertext, plaintext_len);
+  assert_memory_equal(tag_in_place, tag, sizeof(tag));
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_decrypt_into(ciphertext, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, sizeof(key),
+                                                             tag, sizeof(tag),
+                                                             (void *) 0,
+                                                             result), 0);
+  assert_memory_equal(result, msg, plaintext_len);
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_decrypt_into(buf, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, sizeof(key),
+                                                             tag, sizeof(tag),
+                                                             (void *) 0,
+                                                             buf), 0);
+  assert_memory_equal(buf, msg, plaintext_len);
+
+  // the output must not contain unauthenticated plaintext
+  uint8_t zeros[64] = {0};
+  ciphertext[0] += 1;
+  assert_int_equal(omemo_default_crypto_aes_gcm_decrypt_into(ciphertext, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, sizeof(key),
+                                                             tag, sizeof(tag),
+                                                             (void *) 0,
+                                                             result), OMEMO_ERR_AUTH_FAIL);
+  assert_memory_equal(result, zeros, plaintext_len);
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_decrypt_into(ciphertext, plaintext_len,
+                                                             iv, sizeof(iv),
+                                                             key, 17,
+                                                             tag, sizeof(tag),
+                                                             (void *) 0,
+                                                             result), OMEMO_ERR_CRYPTO);
+}
+
+// handles are reused per key size, which must not make a difference in the results
+void test_aes_gcm_handle_cache(void ** state) {
+  (void) state;
+  char * msg = "hello cache";
+  size_t plaintext_len = strlen(msg);
+
+  uint8_t iv[OMEMO_AES_GCM_IV_LENGTH] = {2};
+  uint8_t key[32] = {3};
+  uint8_t ct_first[3][32];
+  uint8_t tag_first[3][OMEMO_AES_GCM_TAG_LENGTH];
+  uint8_t ct[32];
+  uint8_t tag[OMEMO_AES_GCM_TAG_LENGTH];
+  size_t key_lens[] = {16, 24, 32};
+
+  for (size_t round = 0; round < 3; round++) {
+    for (size_t i = 0; i < 3; i++) {
+      assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into((uint8_t *) msg, plaintext_len,
+                                                                 iv, sizeof(iv),
+                                                                 key, key_lens[i],
+                                                                 (void *) 0,
+                                                                 ct,
+                                                                 tag, sizeof(tag)), 0);
+      if (round == 0) {
+        memcpy(ct_first[i], ct, plaintext_len);
+        memcpy(tag_first[i], tag, sizeof(tag));
+      } else {
+        assert_memory_equal(ct, ct_first[i], plaintext_len);
+        assert_memory_equal(tag, tag_first[i], sizeof(tag));
+      }
+    }
+
+    // a failed decryption drops the handle, the next one has to work regardless
+    tag[0] ^= 0x01;
+    assert_int_equal(omemo_default_crypto_aes_gcm_decrypt_into(ct, plaintext_len,
+                                                               iv, sizeof(iv),
+                                                               key, 32,
+                                                               tag, sizeof(tag),
+                                                               (void *) 0,
+                                                               ct), OMEMO_ERR_AUTH_FAIL);
+
+    if (round == 1) {
+      omemo_default_crypto_teardown();
+    }
+  }
+}
+
+#define BATCH_AMOUNT 6
+
+// a batch has to give the same results as single calls, and a failing operation must not affect the others
+void test_aes_gcm_batch(void ** state) {
+  (void) state;
+  size_t lens[BATCH_AMOUNT] = {0, 1, 15, 16, 33, 200};
+  size_t key_lens[BATCH_AMOUNT] = {16, 16, 32, 16, 24, 16};
+
+  uint8_t iv[BATCH_AMOUNT][OMEMO_AES_GCM_IV_LENGTH];
+  uint8_t key[BATCH_AMOUNT][32];
+  uint8_t pt[BATCH_AMOUNT][200];
+  uint8_t ct[BATCH_AMOUNT][200];
+  uint8_t tag[BATCH_AMOUNT][OMEMO_AES_GCM_TAG_LENGTH];
+  uint8_t ct_single[200];
+  uint8_t tag_single[OMEMO_AES_GCM_TAG_LENGTH];
+  uint8_t zeros[200] = {0};
+  omemo_aes_gcm_op ops[BATCH_AMOUNT];
+
+  for (size_t i = 0; i < BATCH_AMOUNT; i++) {
+    assert_int_equal(omemo_default_crypto_random_bytes_into(iv[i], sizeof(iv[i]), (void *) 0), 0);
+    assert_int_equal(omemo_default_crypto_random_bytes_into(key[i], sizeof(key[i]), (void *) 0), 0);
+    assert_int_equal(omemo_default_crypto_random_bytes_into(pt[i], sizeof(pt[i]), (void *) 0), 0);
+
+    ops[i] = (omemo_aes_gcm_op) {iv[i], sizeof(iv[i]), key[i], key_lens[i], pt[i], lens[i], ct[i], tag[i], sizeof(tag[i]), 1};
+  }
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_batch((void *) 0, 1, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_batch(ops, 0, (void *) 0), 0);
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_batch(ops, BATCH_AMOUNT, (void *) 0), 0);
+  for (size_t i = 0; i < BATCH_AMOUNT; i++) {
+    assert_int_equal(ops[i].status, 0);
+    assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(pt[i], lens[i],
+                                                               iv[i], sizeof(iv[i]),
+                                                               key[i], key_lens[i],
+                                                               (void *) 0,
+                                                               ct_single,
+                                                               tag_single, sizeof(tag_single)), 0);
+    assert_memory_equal(ct[i], ct_single, lens[i]);
+    assert_memory_equal(tag[i], tag_single, sizeof(tag_single));
+  }
+
+  // decrypt in place, with one wrong tag and one unsupported key length
+  tag[2][0] ^= 0x01;
+  key_lens[4] = 17;
+  for (size_t i = 0; i < BATCH_AMOUNT; i++) {
+    ops[i] = (omemo_aes_gcm_op) {iv[i], sizeof(iv[i]), key[i], key_lens[i], ct[i], lens[i], ct[i], tag[i], sizeof(tag[i]), 1};
+  }
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_decrypt_batch(ops, BATCH_AMOUNT, (void *) 0), OMEMO_ERR_AUTH_FAIL);
+  for (size_t i = 0; i < BATCH_AMOUNT; i++) {
+    if (i == 2) {
+      assert_int_equal(ops[i].status, OMEMO_ERR_AUTH_FAIL);
+      assert_memory_equal(ct[i], zeros, lens[i]);
+    } else if (i == 4) {
+      assert_int_equal(ops[i].status, OMEMO_ERR_CRYPTO);
+    } else {
+      assert_int_equal(ops[i].status, 0);
+      assert_memory_equal(ct[i], pt[i], lens[i]);
+    }
+  }
+}
+
 int main(void) {
   const struct CMUnitTest tests[] = {
       cmocka_unit_test(test_random_bytes),
-      cmocka_unit_test(test_aes_gcm_encrypt_decrypt)
+      cmocka_unit_test(test_random_bytes_into),
+      cmocka_unit_test(test_aes_gcm_encrypt_decrypt),
+      cmocka_unit_test(test_aes_gcm_encrypt_decrypt_into),
+      cmocka_unit_test(test_aes_gcm_handle_cache),
+      cmocka_unit_test(test_aes_gcm_batch)
   };
 
   return cmocka_run_group_tests_name("omemo default crypto", tests, openssl_init, openssl_teardown);
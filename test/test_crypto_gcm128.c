@@ -0,0 +1,257 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <cmocka.h>
+
+#include "../src/libomemo_crypto.c"
+#include "../src/libomemo_crypto_gcm128.c"
+
+int crypto_setup(void ** state) {
+  (void) state;
+
+  omemo_default_crypto_init();
+
+  return 0;
+}
+
+int crypto_teardown(void ** state) {
+  (void) state;
+
+  omemo_default_crypto_teardown();
+
+  return 0;
+}
+
+// known answers from the test cases of the GCM specification (McGrew and Viega), those for AES-128 without additional data
+typedef struct gcm128_kat {
+  const char * key;
+  const char * iv;
+  const char * pt;
+  const char * ct;
+  const char * tag;
+} gcm128_kat;
+
+static const gcm128_kat kats[] = {
+  {
+    "00000000000000000000000000000000",
+    "000000000000000000000000",
+    "",
+    "",
+    "58e2fccefa7e3061367f1d57a4e7455a"
+  },
+  {
+    "00000000000000000000000000000000",
+    "000000000000000000000000",
+    "00000000000000000000000000000000",
+    "0388dace60b6a392f328c2b971b2fe78",
+    "ab6e47d42cec13bdf53a67b21257bddf"
+  },
+  {
+    "feffe9928665731c6d6a8f9467308308",
+    "cafebabefacedbaddecaf888",
+    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+    "4d5c2af327cd64a62cf35abd2ba6fab4"
+  }
+};
+
+static size_t hex_decode(const char * hex, uint8_t * out_p) {
+  size_t len = strlen(hex) / 2;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned int byte = 0;
+    assert_int_equal(sscanf(hex + 2 * i, "%2x", &byte), 1);
+    out_p[i] = (uint8_t) byte;
+  }
+
+  return len;
+}
+
+void test_is_accelerated(void ** state) {
+  (void) state;
+
+#if GCM128_X86
+  assert_int_equal(omemo_gcm128_crypto_is_accelerated(),
+                   __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"));
+#else
+  assert_false(omemo_gcm128_crypto_is_accelerated());
+#endif
+}
+
+// the default implementation has to give the same answers, as it is the fallback
+void test_kat(void ** state) {
+  (void) state;
+
+  uint8_t key[16];
+  uint8_t iv[12];
+  uint8_t pt[64];
+  uint8_t ct_expected[64];
+  uint8_t tag_expected[16];
+  uint8_t ct[64];
+  uint8_t tag[16];
+  uint8_t buf[64];
+
+  for (size_t i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+    assert_int_equal(hex_decode(kats[i].key, key), sizeof(key));
+    assert_int_equal(hex_decode(kats[i].iv, iv), sizeof(iv));
+    size_t len = hex_decode(kats[i].pt, pt);
+    assert_int_equal(hex_decode(kats[i].ct, ct_expected), len);
+    assert_int_equal(hex_decode(kats[i].tag, tag_expected), sizeof(tag_expected));
+
+    assert_int_equal(omemo_gcm128_crypto_aes_gcm_encrypt_into(pt, len, iv, sizeof(iv), key, sizeof(key), (void *) 0, ct, tag, sizeof(tag)), 0);
+    assert_memory_equal(ct, ct_expected, len);
+    assert_memory_equal(tag, tag_expected, sizeof(tag));
+
+    assert_int_equal(omemo_gcm128_crypto_aes_gcm_decrypt_into(ct_expected, len, iv, sizeof(iv), key, sizeof(key), tag_expected, sizeof(tag_expected), (void *) 0, buf), 0);
+    assert_memory_equal(buf, pt, len);
+
+    assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(pt, len, iv, sizeof(iv), key, sizeof(key), (void *) 0, ct, tag, sizeof(tag)), 0);
+    assert_memory_equal(ct, ct_expected, len);
+    assert_memory_equal(tag, tag_expected, sizeof(tag));
+  }
+}
+
+static void check_length(size_t len) {
+  uint8_t key[16];
+  uint8_t iv[12];
+  uint8_t pt[2100];
+  uint8_t ct_expected[2100];
+  uint8_t tag_expected[16];
+  uint8_t buf[2100];
+  uint8_t tag[16];
+
+  assert_true(len <= sizeof(pt));
+  assert_int_equal(omemo_default_crypto_random_bytes_into(key, sizeof(key), (void *) 0), 0);
+  assert_int_equal(omemo_default_crypto_random_bytes_into(iv, sizeof(iv), (void *) 0), 0);
+  assert_int_equal(omemo_default_crypto_random_bytes_into(pt, len, (void *) 0), 0);
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(pt, len, iv, sizeof(iv), key, sizeof(key), (void *) 0, ct_expected, tag_expected, sizeof(tag_expected)), 0);
+
+  memcpy(buf, pt, len);
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_encrypt_into(buf, len, iv, sizeof(iv), key, sizeof(key), (void *) 0, buf, tag, sizeof(tag)), 0);
+  assert_memory_equal(buf, ct_expected, len);
+  assert_memory_equal(tag, tag_expected, sizeof(tag));
+
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_decrypt_into(buf, len, iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, buf), 0);
+  assert_memory_equal(buf, pt, len);
+}
+
+// every length around the block and lane boundaries has to match the default implementation, also in place
+void test_lengths(void ** state) {
+  (void) state;
+
+  for (size_t len = 0; len <= 300; len++) {
+    check_length(len);
+  }
+
+  // around the point where the kernel hands over to libgcrypt
+  for (size_t len = GCM128_KERNEL_MAX_LEN - 20; len <= GCM128_KERNEL_MAX_LEN + 20; len++) {
+    check_length(len);
+  }
+}
+
+void test_auth_fail(void ** state) {
+  (void) state;
+
+  uint8_t key[16] = {1};
+  uint8_t iv[12] = {2};
+  uint8_t pt[40] = {3};
+  uint8_t ct[40];
+  uint8_t tag[16];
+  uint8_t buf[40];
+  uint8_t zeros[40] = {0};
+
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, sizeof(iv), key, sizeof(key), (void *) 0, ct, tag, sizeof(tag)), 0);
+
+  tag[15] ^= 0x80;
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_decrypt_into(ct, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, buf), OMEMO_ERR_AUTH_FAIL);
+  assert_memory_equal(buf, zeros, sizeof(buf));
+  tag[15] ^= 0x80;
+
+  ct[39] ^= 0x01;
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_decrypt_into(ct, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, ct), OMEMO_ERR_AUTH_FAIL);
+  assert_memory_equal(ct, zeros, sizeof(ct));
+
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_decrypt_into((void *) 0, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, buf), OMEMO_ERR_NULL);
+}
+
+// other parameters than the ones the kernel is fixed to are passed on to libgcrypt
+void test_fallback(void ** state) {
+  (void) state;
+
+  uint8_t key[32] = {4};
+  uint8_t iv[16] = {5};
+  uint8_t pt[50] = {6};
+  uint8_t ct_expected[50];
+  uint8_t tag_expected[16];
+  uint8_t ct[50];
+  uint8_t tag[16];
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, sizeof(iv), key, sizeof(key), (void *) 0, ct_expected, tag_expected, sizeof(tag_expected)), 0);
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, sizeof(iv), key, sizeof(key), (void *) 0, ct, tag, sizeof(tag)), 0);
+  assert_memory_equal(ct, ct_expected, sizeof(ct));
+  assert_memory_equal(tag, tag_expected, sizeof(tag));
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, 12, key, 16, (void *) 0, ct_expected, tag_expected, 12), 0);
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, 12, key, 16, (void *) 0, ct, tag, 12), 0);
+  assert_memory_equal(ct, ct_expected, sizeof(ct));
+  assert_memory_equal(tag, tag_expected, 12);
+
+  assert_int_equal(omemo_gcm128_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, 12, key, 17, (void *) 0, ct, tag, sizeof(tag)), OMEMO_ERR_CRYPTO);
+}
+
+void test_provider(void ** state) {
+  (void) state;
+
+  omemo_crypto_provider crypto;
+  uint8_t key[16] = {7};
+  uint8_t iv[12] = {8};
+  uint8_t pt[20] = {9};
+  uint8_t * ct_p = (void *) 0;
+  size_t ct_len = 0;
+  uint8_t * tag_p = (void *) 0;
+  uint8_t * pt_p = (void *) 0;
+  size_t pt_len = 0;
+
+  assert_int_equal(omemo_gcm128_crypto_provider_init((void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_gcm128_crypto_provider_init(&crypto), 0);
+  assert_non_null(crypto.random_bytes_func);
+  assert_non_null(crypto.random_bytes_into_func);
+  assert_non_null(crypto.aes_gcm_encrypt_batch_func);
+  assert_non_null(crypto.aes_gcm_decrypt_batch_func);
+
+  assert_int_equal(crypto.aes_gcm_encrypt_func(pt, sizeof(pt), iv, sizeof(iv), key, sizeof(key), 16, crypto.user_data_p, &ct_p, &ct_len, &tag_p), 0);
+  assert_int_equal(ct_len, sizeof(pt));
+  assert_int_equal(crypto.aes_gcm_decrypt_func(ct_p, ct_len, iv, sizeof(iv), key, sizeof(key), tag_p, 16, crypto.user_data_p, &pt_p, &pt_len), 0);
+  assert_int_equal(pt_len, sizeof(pt));
+  assert_memory_equal(pt_p, pt, sizeof(pt));
+
+  omemo_aes_gcm_op ops[2] = {
+    {iv, sizeof(iv), key, sizeof(key), ct_p, ct_len, ct_p, tag_p, 16, 1},
+    {iv, sizeof(iv), key, sizeof(key), ct_p, ct_len, ct_p, tag_p, 16, 1}
+  };
+  // the second one decrypts the plaintext of the first
+  assert_int_equal(crypto.aes_gcm_decrypt_batch_func(ops, 2, crypto.user_data_p), OMEMO_ERR_AUTH_FAIL);
+  assert_int_equal(ops[0].status, 0);
+  assert_int_equal(ops[1].status, OMEMO_ERR_AUTH_FAIL);
+
+  free(ct_p);
+  free(tag_p);
+  free(pt_p);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_is_accelerated),
+      cmocka_unit_test(test_kat),
+      cmocka_unit_test(test_lengths),
+      cmocka_unit_test(test_auth_fail),
+      cmocka_unit_test(test_fallback),
+      cmocka_unit_test(test_provider)
+  };
+
+  return cmocka_run_group_tests_name("omemo gcm128 crypto", tests, crypto_setup, crypto_teardown);
+}
@@ -0,0 +1,183 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "../src/libomemo_crypto.c"
+#include "../src/libomemo_crypto_openssl.c"
+
+int crypto_setup(void ** state) {
+  (void) state;
+
+  omemo_default_crypto_init();
+
+  return 0;
+}
+
+int crypto_teardown(void ** state) {
+  (void) state;
+
+  omemo_default_crypto_teardown();
+  omemo_openssl_crypto_teardown();
+
+  return 0;
+}
+
+void test_random_bytes(void ** state) {
+  (void) state;
+
+  uint8_t buf[32] = {0};
+  uint8_t zeros[32] = {0};
+  uint8_t * buf_p = (void *) 0;
+
+  assert_int_equal(omemo_openssl_crypto_random_bytes_into((void *) 0, sizeof(buf), (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_openssl_crypto_random_bytes((void *) 0, sizeof(buf), (void *) 0), OMEMO_ERR_NULL);
+
+  assert_int_equal(omemo_openssl_crypto_random_bytes_into(buf, sizeof(buf), (void *) 0), 0);
+  assert_memory_not_equal(buf, zeros, sizeof(buf));
+
+  assert_int_equal(omemo_openssl_crypto_random_bytes(&buf_p, sizeof(buf), (void *) 0), 0);
+  assert_non_null(buf_p);
+  assert_memory_not_equal(buf_p, buf, sizeof(buf));
+
+  free(buf_p);
+}
+
+static void check_against_gcrypt(size_t len, size_t key_len, size_t iv_len, size_t tag_len) {
+  uint8_t key[32];
+  uint8_t iv[16];
+  uint8_t pt[1100];
+  uint8_t ct_expected[1100];
+  uint8_t tag_expected[16];
+  uint8_t buf[1100];
+  uint8_t tag[16];
+
+  assert_true(len <= sizeof(pt));
+  assert_int_equal(omemo_openssl_crypto_random_bytes_into(key, key_len, (void *) 0), 0);
+  assert_int_equal(omemo_openssl_crypto_random_bytes_into(iv, iv_len, (void *) 0), 0);
+  assert_int_equal(omemo_openssl_crypto_random_bytes_into(pt, len, (void *) 0), 0);
+
+  assert_int_equal(omemo_default_crypto_aes_gcm_encrypt_into(pt, len, iv, iv_len, key, key_len, (void *) 0, ct_expected, tag_expected, tag_len), 0);
+
+  memcpy(buf, pt, len);
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_encrypt_into(buf, len, iv, iv_len, key, key_len, (void *) 0, buf, tag, tag_len), 0);
+  assert_memory_equal(buf, ct_expected, len);
+  assert_memory_equal(tag, tag_expected, tag_len);
+
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_decrypt_into(buf, len, iv, iv_len, key, key_len, tag, tag_len, (void *) 0, buf), 0);
+  assert_memory_equal(buf, pt, len);
+}
+
+// both libraries have to produce the same ciphertexts and tags, so messages can be exchanged between them
+void test_aes_gcm_against_gcrypt(void ** state) {
+  (void) state;
+
+  const size_t key_lens[] = {16, 24, 32};
+
+  for (size_t k = 0; k < sizeof(key_lens) / sizeof(key_lens[0]); k++) {
+    for (size_t len = 0; len <= 70; len++) {
+      check_against_gcrypt(len, key_lens[k], 12, 16);
+    }
+    check_against_gcrypt(1100, key_lens[k], 12, 16);
+    check_against_gcrypt(100, key_lens[k], 16, 16);
+    check_against_gcrypt(100, key_lens[k], 12, 12);
+  }
+}
+
+void test_aes_gcm_auth_fail(void ** state) {
+  (void) state;
+
+  uint8_t key[16] = {1};
+  uint8_t iv[12] = {2};
+  uint8_t pt[40] = {3};
+  uint8_t ct[40];
+  uint8_t tag[16];
+  uint8_t buf[40];
+  uint8_t zeros[40] = {0};
+
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, sizeof(iv), key, sizeof(key), (void *) 0, ct, tag, sizeof(tag)), 0);
+
+  tag[15] ^= 0x80;
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_decrypt_into(ct, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, buf), OMEMO_ERR_AUTH_FAIL);
+  assert_memory_equal(buf, zeros, sizeof(buf));
+  tag[15] ^= 0x80;
+
+  // the context stays usable after a failed tag check
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_decrypt_into(ct, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, buf), 0);
+  assert_memory_equal(buf, pt, sizeof(pt));
+
+  ct[39] ^= 0x01;
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_decrypt_into(ct, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, ct), OMEMO_ERR_AUTH_FAIL);
+  assert_memory_equal(ct, zeros, sizeof(ct));
+
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_decrypt_into((void *) 0, sizeof(ct), iv, sizeof(iv), key, sizeof(key), tag, sizeof(tag), (void *) 0, buf), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_openssl_crypto_aes_gcm_encrypt_into(pt, sizeof(pt), iv, sizeof(iv), key, 17, (void *) 0, ct, tag, sizeof(tag)), OMEMO_ERR_CRYPTO);
+}
+
+void test_provider(void ** state) {
+  (void) state;
+
+  omemo_crypto_provider crypto;
+  uint8_t key[16] = {7};
+  uint8_t key_256[32] = {8};
+  uint8_t iv[12] = {9};
+  uint8_t pt[20] = {10};
+  uint8_t * ct_p = (void *) 0;
+  size_t ct_len = 0;
+  uint8_t * tag_p = (void *) 0;
+  uint8_t * pt_p = (void *) 0;
+  size_t pt_len = 0;
+  uint8_t buf[3][20];
+  uint8_t tags[3][16];
+
+  assert_int_equal(omemo_openssl_crypto_provider_init((void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_openssl_crypto_provider_init(&crypto), 0);
+  assert_non_null(crypto.random_bytes_into_func);
+  assert_non_null(crypto.aes_gcm_encrypt_into_func);
+  assert_non_null(crypto.aes_gcm_decrypt_into_func);
+
+  assert_int_equal(crypto.aes_gcm_encrypt_func(pt, sizeof(pt), iv, sizeof(iv), key, sizeof(key), 16, crypto.user_data_p, &ct_p, &ct_len, &tag_p), 0);
+  assert_int_equal(ct_len, sizeof(pt));
+  assert_int_equal(crypto.aes_gcm_decrypt_func(ct_p, ct_len, iv, sizeof(iv), key, sizeof(key), tag_p, 16, crypto.user_data_p, &pt_p, &pt_len), 0);
+  assert_int_equal(pt_len, sizeof(pt));
+  assert_memory_equal(pt_p, pt, sizeof(pt));
+
+  // switching key sizes within a batch
+  omemo_aes_gcm_op ops[3] = {
+    {iv, sizeof(iv), key, sizeof(key), pt, sizeof(pt), buf[0], tags[0], 16, 1},
+    {iv, sizeof(iv), key_256, sizeof(key_256), pt, sizeof(pt), buf[1], tags[1], 16, 1},
+    {iv, sizeof(iv), key, sizeof(key), pt, sizeof(pt), buf[2], tags[2], 16, 1}
+  };
+  assert_int_equal(crypto.aes_gcm_encrypt_batch_func(ops, 3, crypto.user_data_p), 0);
+  assert_memory_equal(buf[0], ct_p, sizeof(pt));
+  assert_memory_equal(tags[0], tag_p, 16);
+  assert_memory_equal(buf[2], ct_p, sizeof(pt));
+  assert_memory_not_equal(buf[1], ct_p, sizeof(pt));
+
+  for (size_t i = 0; i < 3; i++) {
+    ops[i].in_p = buf[i];
+    ops[i].out_p = buf[i];
+  }
+  tags[1][0] ^= 0x01;
+  assert_int_equal(crypto.aes_gcm_decrypt_batch_func(ops, 3, crypto.user_data_p), OMEMO_ERR_AUTH_FAIL);
+  assert_int_equal(ops[0].status, 0);
+  assert_int_equal(ops[1].status, OMEMO_ERR_AUTH_FAIL);
+  assert_int_equal(ops[2].status, 0);
+  assert_memory_equal(buf[0], pt, sizeof(pt));
+  assert_memory_equal(buf[2], pt, sizeof(pt));
+
+  free(ct_p);
+  free(tag_p);
+  free(pt_p);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_random_bytes),
+      cmocka_unit_test(test_aes_gcm_against_gcrypt),
+      cmocka_unit_test(test_aes_gcm_auth_fail),
+      cmocka_unit_test(test_provider)
+  };
+
+  return cmocka_run_group_tests_name("omemo openssl crypto", tests, crypto_setup, crypto_teardown);
+}
@@ -50,6 +50,71 @@ omemo_crypto_provider crypto = {
     (void *) 0
 };
 
+omemo_crypto_provider crypto_into = {
+    .random_bytes_func = omemo_default_crypto_random_bytes,
+    .aes_gcm_encrypt_func = omemo_default_crypto_aes_gcm_encrypt,
+    .aes_gcm_decrypt_func = omemo_default_crypto_aes_gcm_decrypt,
+    .user_data_p = (void *) 0,
+    .aes_gcm_encrypt_into_func = omemo_default_crypto_aes_gcm_encrypt_into,
+    .aes_gcm_decrypt_into_func = omemo_default_crypto_aes_gcm_decrypt_into,
+    .random_bytes_into_func = omemo_default_crypto_random_bytes_into
+};
+
+omemo_crypto_provider crypto_batch = {
+    .random_bytes_func = omemo_default_crypto_random_bytes,
+    .aes_gcm_encrypt_func = omemo_default_crypto_aes_gcm_encrypt,
+    .aes_gcm_decrypt_func = omemo_default_crypto_aes_gcm_decrypt,
+    .user_data_p = (void *) 0,
+    .aes_gcm_encrypt_batch_func = omemo_default_crypto_aes_gcm_encrypt_batch,
+    .aes_gcm_decrypt_batch_func = omemo_default_crypto_aes_gcm_decrypt_batch
+};
+
+// collects the output of the *_export_to() functions
+typedef struct write_buf {
+  char * data_p;
+  size_t len;
+  size_t calls;
+} write_buf;
+
+static int write_buf_append(const char * data_p, size_t data_len, void * user_data_p) {
+  write_buf * buf_p = user_data_p;
+
+  char * new_p = realloc(buf_p->data_p, buf_p->len + data_len + 1);
+  assert_ptr_not_equal(new_p, (void *) 0);
+  memcpy(new_p + buf_p->len, data_p, data_len);
+  buf_p->data_p = new_p;
+  buf_p->len += data_len;
+  buf_p->data_p[buf_p->len] = '\0';
+  buf_p->calls++;
+
+  return 0;
+}
+
+static int write_fail(const char * data_p, size_t data_len, void * user_data_p) {
+  (void) data_p;
+  (void) data_len;
+  (void) user_data_p;
+
+  return -4711;
+}
+
+// the written XML has to be the same as the exported one, apart from formatting
+static void assert_xml_equivalent(const char * written, const char * exported) {
+  mxml_node_t * written_node_p = mxmlLoadString((void *) 0, written, MXML_OPAQUE_CALLBACK);
+  assert_ptr_not_equal(written_node_p, (void *) 0);
+  mxml_node_t * exported_node_p = mxmlLoadString((void *) 0, exported, MXML_OPAQUE_CALLBACK);
+  assert_ptr_not_equal(exported_node_p, (void *) 0);
+
+  char * written_resaved = mxmlSaveAllocString(written_node_p, MXML_NO_CALLBACK);
+  char * exported_resaved = mxmlSaveAllocString(exported_node_p, MXML_NO_CALLBACK);
+  assert_string_equal(written_resaved, exported_resaved);
+
+  free(written_resaved);
+  free(exported_resaved);
+  mxmlDelete(written_node_p);
+  mxmlDelete(exported_node_p);
+}
+
 void test_devicelist_create(void ** state) {
   (void) state;
 
@@ -85,13 +150,9 @@ void test_devicelist_import(void ** state) {
   assert_ptr_equal(mxmlGetNextSibling(device_node_p), (void *) 0);
   assert_ptr_equal(mxmlGetNextSibling(dl_p->list_node_p), (void *) 0);
 
-  uint32_t * id_p = dl_p->id_list_p->data;
-  assert_int_equal(*id_p, 4223);
-
-  id_p = dl_p->id_list_p->next->data;
-  assert_int_equal(*id_p, 1337);
-
-  assert_ptr_equal(dl_p->id_list_p->next->next, (void *) 0);
+  assert_int_equal(dl_p->ids_len, 2);
+  assert_int_equal(dl_p->ids_p[0], 1337);
+  assert_int_equal(dl_p->ids_p[1], 4223);
 
   omemo_devicelist_destroy(dl_p);
 }
@@ -127,6 +188,100 @@ void test_devicelist_import_empty_alt(void ** state) {
   omemo_devicelist_destroy(dl_p);
 }
 
+void test_devicelist_import_if_changed(void ** state) {
+  (void) state;
+
+  char * devicelist_reordered = "<items node='eu.siacs.conversations.axolotl.devicelist'>\n"
+                                  "<item id='current'>\n"
+                                    "<list xmlns='eu.siacs.conversations.axolotl'>\n"
+                                      "<device id='1337' label='phone'/>\n"
+                                      "<device id='4223'></device>\n"
+                                      "<device id='1337' />\n"
+                                    "</list>\n"
+                                  "</item>\n"
+                                "</items>";
+  char * devicelist_changed = "<items node='eu.siacs.conversations.axolotl.devicelist'>"
+                                "<item>"
+                                  "<list xmlns='eu.siacs.conversations.axolotl'>"
+                                    "<device id='4223' />"
+                                    "<device id='31415' />"
+                                  "</list>"
+                                "</item>"
+                              "</items>";
+
+  omemo_devicelist * prev_dl_p = (void *) 0;
+  omemo_devicelist * dl_p = (void *) 0;
+  omemo_devicelist * unused_p = (void *) 0;
+
+  // without a previous list it is always imported, the same as by omemo_devicelist_import()
+  assert_int_equal(omemo_devicelist_import_if_changed(devicelist, "bob", (void *) 0, &prev_dl_p), 0);
+  assert_string_equal(prev_dl_p->from, "bob");
+  assert_int_equal(prev_dl_p->ids_len, 2);
+  assert_int_equal(prev_dl_p->ids_p[0], 1337);
+  assert_int_equal(prev_dl_p->ids_p[1], 4223);
+
+  char * exported = (void *) 0;
+  char * expected = (void *) 0;
+  assert_int_equal(omemo_devicelist_import(devicelist, "bob", &dl_p), 0);
+  assert_int_equal(omemo_devicelist_export(prev_dl_p, &exported), 0);
+  assert_int_equal(omemo_devicelist_export(dl_p, &expected), 0);
+  assert_int_equal(strlen(exported), strlen(expected));
+  free(exported);
+  free(expected);
+
+  // the same devices in a different order and with duplicates
+  assert_int_equal(omemo_devicelist_import_if_changed(devicelist_reordered, "bob", prev_dl_p, &unused_p), OMEMO_DEVICELIST_UNCHANGED);
+  assert_int_equal(omemo_devicelist_import_if_changed(devicelist, "bob", dl_p, &unused_p), OMEMO_DEVICELIST_UNCHANGED);
+  assert_ptr_equal(unused_p, (void *) 0);
+  omemo_devicelist_destroy(dl_p);
+
+  // another owner is not the same list
+  assert_int_equal(omemo_devicelist_import_if_changed(devicelist, "alice", prev_dl_p, &dl_p), 0);
+  assert_string_equal(dl_p->from, "alice");
+  omemo_devicelist_destroy(dl_p);
+
+  assert_int_equal(omemo_devicelist_import_if_changed(devicelist_changed, "bob", prev_dl_p, &dl_p), 0);
+  assert_int_equal(dl_p->ids_len, 2);
+  assert_int_equal(dl_p->ids_p[0], 4223);
+  assert_int_equal(dl_p->ids_p[1], 31415);
+  assert_int_equal(omemo_devicelist_contains_id(dl_p, 31415), 1);
+  assert_int_equal(omemo_devicelist_remove(dl_p, 4223), 0);
+  assert_int_equal(omemo_devicelist_add(dl_p, 1), 0);
+  assert_int_equal(omemo_devicelist_import_if_changed(devicelist_changed, "bob", dl_p, &unused_p), 0);
+  omemo_devicelist_destroy(unused_p);
+  omemo_devicelist_destroy(dl_p);
+
+  // empty lists
+  assert_int_equal(omemo_devicelist_import_if_changed("<items node='eu.siacs.conversations.axolotl.devicelist' />", "bob", prev_dl_p, &dl_p), 0);
+  assert_int_equal(omemo_devicelist_is_empty(dl_p), 1);
+  assert_int_equal(omemo_devicelist_import_if_changed("<items><item><list/></item></items>", "bob", dl_p, &unused_p), OMEMO_DEVICELIST_UNCHANGED);
+  omemo_devicelist_destroy(dl_p);
+
+  // more devices than fit on the stack
+  char many[8192];
+  size_t many_len = snprintf(many, sizeof(many), "<items><item><list>");
+  for (int i = 200; i > 0; i--) {
+    many_len += snprintf(many + many_len, sizeof(many) - many_len, "<device id='%d'/>", i);
+  }
+  snprintf(many + many_len, sizeof(many) - many_len, "</list></item></items>");
+  assert_int_equal(omemo_devicelist_import_if_changed(many, "bob", prev_dl_p, &dl_p), 0);
+  assert_int_equal(dl_p->ids_len, 200);
+  assert_int_equal(dl_p->ids_p[0], 1);
+  assert_int_equal(dl_p->ids_p[199], 200);
+  assert_int_equal(omemo_devicelist_import_if_changed(many, "bob", dl_p, &unused_p), OMEMO_DEVICELIST_UNCHANGED);
+  omemo_devicelist_destroy(dl_p);
+
+  assert_int_equal(omemo_devicelist_import_if_changed("<list/>", "bob", prev_dl_p, &dl_p), OMEMO_ERR_MALFORMED_DEVICELIST_NO_ITEMS_ELEM);
+  assert_int_equal(omemo_devicelist_import_if_changed("<items><list/></items>", "bob", prev_dl_p, &dl_p), OMEMO_ERR_MALFORMED_DEVICELIST_NO_ITEM_ELEM);
+  assert_int_equal(omemo_devicelist_import_if_changed("<items><item></item></items>", "bob", prev_dl_p, &dl_p), OMEMO_ERR_MALFORMED_DEVICELIST_NO_LIST_ELEM);
+  assert_int_equal(omemo_devicelist_import_if_changed("<items><item><device id='1'/></item></items>", "bob", prev_dl_p, &dl_p), OMEMO_ERR_MALFORMED_DEVICELIST_NO_LIST_ELEM);
+  assert_int_equal(omemo_devicelist_import_if_changed("<items><item><list><device/></list></item></items>", "bob", prev_dl_p, &dl_p), OMEMO_ERR_MALFORMED_DEVICELIST_NO_DEVICE_ID_ATTR);
+  assert_int_equal(omemo_devicelist_import_if_changed("<items><item><list>", "bob", prev_dl_p, &dl_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_devicelist_import_if_changed((void *) 0, "bob", prev_dl_p, &dl_p), OMEMO_ERR_NULL);
+
+  omemo_devicelist_destroy(prev_dl_p);
+}
+
 void test_devicelist_add(void ** state) {
   (void) state;
 
@@ -140,9 +295,8 @@ void test_devicelist_add(void ** state) {
   assert_string_equal(mxmlElementGetAttr(device_node_p, "id"), "123456");
   assert_ptr_equal(mxmlGetNextSibling(device_node_p), (void *) 0);
 
-  uint32_t * id_p = dl_p->id_list_p->data;
-  assert_int_equal(*id_p, 123456);
-  assert_ptr_equal(dl_p->id_list_p->next, (void *) 0);
+  assert_int_equal(dl_p->ids_len, 1);
+  assert_int_equal(dl_p->ids_p[0], 123456);
 
   GList * dl_l_p = omemo_devicelist_get_id_list(dl_p);
   assert_ptr_not_equal(dl_l_p, (void *) 0);
@@ -237,6 +391,57 @@ void test_devicelist_diff(void ** state) {
   omemo_devicelist_destroy(dl_b_p);
 }
 
+void test_devicelist_diff_ids(void ** state) {
+  (void) state;
+
+  omemo_devicelist * dl_a_p, * dl_b_p;
+  assert_int_equal(omemo_devicelist_create("alice", &dl_a_p), 0);
+  assert_int_equal(omemo_devicelist_create("alice", &dl_b_p), 0);
+
+  uint32_t amb[4], bma[4];
+  size_t amb_len = 4, bma_len = 4;
+
+  assert_int_equal(omemo_devicelist_diff_ids((void *) 0, dl_b_p, amb, &amb_len, bma, &bma_len), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_devicelist_diff_ids(dl_a_p, dl_b_p, amb, (void *) 0, bma, &bma_len), OMEMO_ERR_NULL);
+
+  assert_int_equal(omemo_devicelist_diff_ids(dl_a_p, dl_b_p, amb, &amb_len, bma, &bma_len), 0);
+  assert_int_equal(amb_len, 0);
+  assert_int_equal(bma_len, 0);
+
+  assert_int_equal(omemo_devicelist_add(dl_a_p, 5), 0);
+  assert_int_equal(omemo_devicelist_add(dl_a_p, 1), 0);
+  assert_int_equal(omemo_devicelist_add(dl_a_p, 3), 0);
+  assert_int_equal(omemo_devicelist_add(dl_b_p, 3), 0);
+  assert_int_equal(omemo_devicelist_add(dl_b_p, 4), 0);
+  assert_int_equal(omemo_devicelist_add(dl_b_p, 2), 0);
+
+  amb_len = 4;
+  bma_len = 4;
+  assert_int_equal(omemo_devicelist_diff_ids(dl_a_p, dl_b_p, amb, &amb_len, bma, &bma_len), 0);
+  assert_int_equal(amb_len, 2);
+  assert_int_equal(amb[0], 1);
+  assert_int_equal(amb[1], 5);
+  assert_int_equal(bma_len, 2);
+  assert_int_equal(bma[0], 2);
+  assert_int_equal(bma[1], 4);
+
+  // query the sizes only
+  amb_len = 0;
+  bma_len = 0;
+  assert_int_equal(omemo_devicelist_diff_ids(dl_a_p, dl_b_p, (void *) 0, &amb_len, (void *) 0, &bma_len), OMEMO_ERR_BUFFER_TOO_SMALL);
+  assert_int_equal(amb_len, 2);
+  assert_int_equal(bma_len, 2);
+
+  amb_len = 1;
+  bma_len = 4;
+  assert_int_equal(omemo_devicelist_diff_ids(dl_a_p, dl_b_p, amb, &amb_len, bma, &bma_len), OMEMO_ERR_BUFFER_TOO_SMALL);
+  assert_int_equal(amb_len, 2);
+  assert_int_equal(amb[0], 1);
+
+  omemo_devicelist_destroy(dl_a_p);
+  omemo_devicelist_destroy(dl_b_p);
+}
+
 void test_devicelist_export(void ** state) {
   (void) state;
 
@@ -273,6 +478,32 @@ void test_devicelist_export(void ** state) {
   omemo_devicelist_destroy(dl_p);
 }
 
+void test_devicelist_export_to(void ** state) {
+  (void) state;
+
+  omemo_devicelist * dl_p;
+  assert_int_equal(omemo_devicelist_create("alice", &dl_p), 0);
+  for (uint32_t id = 1; id <= 200; id++) {
+    assert_int_equal(omemo_devicelist_add(dl_p, id * 7919), 0);
+  }
+
+  write_buf buf = {0};
+  assert_int_equal(omemo_devicelist_export_to(dl_p, (void *) 0, &buf), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_devicelist_export_to(dl_p, write_fail, (void *) 0), -4711);
+  assert_int_equal(omemo_devicelist_export_to(dl_p, write_buf_append, &buf), 0);
+  // the output is buffered, but does not go through a single call either
+  assert_true(buf.calls > 1);
+  assert_true(buf.calls < 200);
+
+  char * xml;
+  assert_int_equal(omemo_devicelist_export(dl_p, &xml), 0);
+  assert_xml_equivalent(buf.data_p, xml);
+
+  free(xml);
+  free(buf.data_p);
+  omemo_devicelist_destroy(dl_p);
+}
+
 void test_devicelist_get_pep_node_name(void ** state) {
   (void) state;
 
@@ -291,16 +522,64 @@ void test_devicelist_get_id_list(void ** state) {
 
   GList * dl_l_p = omemo_devicelist_get_id_list(dl_p);
   assert_ptr_not_equal(dl_l_p, (void *) 0);
-  assert_int_equal(4223, omemo_devicelist_list_data(dl_l_p));
+  assert_int_equal(1337, omemo_devicelist_list_data(dl_l_p));
 
   dl_l_p = dl_l_p->next;
-  assert_int_equal(1337, omemo_devicelist_list_data(dl_l_p));
+  assert_int_equal(4223, omemo_devicelist_list_data(dl_l_p));
   assert_ptr_equal(dl_l_p->next, (void *) 0);
 
   g_list_free_full(dl_l_p->prev, free);
   omemo_devicelist_destroy(dl_p);
 }
 
+void test_devicelist_get_ids(void ** state) {
+  (void) state;
+
+  char * devicelist_unsorted = "<items node='eu.siacs.conversations.axolotl.devicelist'>"
+                                 "<item>"
+                                   "<list xmlns='eu.siacs.conversations.axolotl'>"
+                                     "<device id='3' />"
+                                     "<device id='1' />"
+                                     "<device id='3' />"
+                                     "<device id='2' />"
+                                   "</list>"
+                                 "</item>"
+                               "</items>";
+
+  omemo_devicelist * dl_p;
+  const uint32_t * ids_p = (void *) 0;
+  size_t ids_len = 0;
+
+  assert_int_equal(omemo_devicelist_create("alice", &dl_p), 0);
+  assert_int_equal(omemo_devicelist_get_ids((void *) 0, &ids_p, &ids_len), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_devicelist_get_ids(dl_p, (void *) 0, &ids_len), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_devicelist_get_ids(dl_p, &ids_p, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_devicelist_get_ids(dl_p, &ids_p, &ids_len), 0);
+  assert_int_equal(ids_len, 0);
+
+  assert_int_equal(omemo_devicelist_add(dl_p, 4223), 0);
+  assert_int_equal(omemo_devicelist_add(dl_p, 1337), 0);
+  assert_int_equal(omemo_devicelist_add(dl_p, 4223), 0);
+  assert_int_equal(omemo_devicelist_get_ids(dl_p, &ids_p, &ids_len), 0);
+  assert_int_equal(ids_len, 2);
+  assert_int_equal(ids_p[0], 1337);
+  assert_int_equal(ids_p[1], 4223);
+
+  // adding a duplicate does not add another <device> element either
+  mxml_node_t * device_node_p = mxmlGetFirstChild(dl_p->list_node_p);
+  assert_ptr_not_equal(mxmlGetNextSibling(device_node_p), (void *) 0);
+  assert_ptr_equal(mxmlGetNextSibling(mxmlGetNextSibling(device_node_p)), (void *) 0);
+  omemo_devicelist_destroy(dl_p);
+
+  assert_int_equal(omemo_devicelist_import(devicelist_unsorted, "bob", &dl_p), 0);
+  assert_int_equal(omemo_devicelist_get_ids(dl_p, &ids_p, &ids_len), 0);
+  assert_int_equal(ids_len, 3);
+  assert_int_equal(ids_p[0], 1);
+  assert_int_equal(ids_p[1], 2);
+  assert_int_equal(ids_p[2], 3);
+  omemo_devicelist_destroy(dl_p);
+}
+
 void test_bundle_create(void ** state) {
   (void) state;
 
@@ -333,10 +612,9 @@ void test_bundle_set_signed_pre_key(void ** state) {
   uint8_t data[] = {0xB1, 0x6B, 0x00, 0xB5};
   assert_int_equal(omemo_bundle_set_signed_pre_key(bundle_p, 1, &data[0], 4), 0);
 
-  mxml_node_t * spkn_p = bundle_p->signed_pk_node_p;
-  assert_ptr_not_equal(spkn_p, (void *) 0);
-  assert_string_equal(mxmlElementGetAttr(spkn_p, SIGNED_PRE_KEY_NODE_ID_ATTR_NAME), "1");
-  assert_string_equal(mxmlGetOpaque(spkn_p), g_base64_encode(&data[0], 4));
+  assert_int_equal(bundle_p->signed_pre_key_id, 1);
+  assert_int_equal(bundle_p->signed_pre_key.data_len, 4);
+  assert_memory_equal(bundle_p->signed_pre_key.data_p, &data[0], 4);
 
   omemo_bundle_destroy(bundle_p);
 }
@@ -350,9 +628,8 @@ void test_bundle_set_signature(void ** state) {
   uint8_t data[] = {0xB1, 0x6B, 0x00, 0xB5};
   assert_int_equal(omemo_bundle_set_signature(bundle_p, &data[0], 4), 0);
 
-  mxml_node_t * signature_p = bundle_p->signature_node_p;
-  assert_ptr_not_equal(signature_p, (void *) 0);
-  assert_string_equal(mxmlGetOpaque(signature_p), g_base64_encode(&data[0], 4));
+  assert_int_equal(bundle_p->signature.data_len, 4);
+  assert_memory_equal(bundle_p->signature.data_p, &data[0], 4);
 
   omemo_bundle_destroy(bundle_p);
 }
@@ -366,8 +643,8 @@ void test_bundle_set_identity_key(void ** state) {
   uint8_t data[] = {0xB1, 0x6B, 0x00, 0xB5};
   assert_int_equal(omemo_bundle_set_identity_key(bundle_p, &data[0], 4), 0);
 
-  assert_ptr_not_equal(bundle_p->identity_key_node_p, (void *) 0);
-  assert_string_equal(mxmlGetOpaque(bundle_p->identity_key_node_p), g_base64_encode(&data[0], 4));
+  assert_int_equal(bundle_p->identity_key.data_len, 4);
+  assert_memory_equal(bundle_p->identity_key.data_p, &data[0], 4);
 
   omemo_bundle_destroy(bundle_p);
 }
@@ -380,26 +657,17 @@ void test_bundle_add_pre_key(void ** state) {
 
   uint8_t data[] = {0xB1, 0x6B, 0x00, 0xB5};
   assert_int_equal(omemo_bundle_add_pre_key(bundle_p, 1, &data[0], 4), 0);
-  assert_ptr_not_equal(bundle_p->pre_keys_node_p, (void *) 0);
   assert_int_equal(bundle_p->pre_keys_amount, 1);
-  assert_string_equal(mxmlGetElement(bundle_p->pre_keys_node_p), PREKEYS_NODE_NAME);
-
-  mxml_node_t * pre_key_node_p = mxmlFindPath(bundle_p->pre_keys_node_p, PRE_KEY_NODE_NAME);
-  pre_key_node_p = mxmlGetParent(pre_key_node_p);
-  assert_ptr_not_equal(pre_key_node_p, (void *) 0);
-  assert_string_equal(mxmlElementGetAttr(pre_key_node_p, PRE_KEY_NODE_ID_ATTR_NAME), "1");
-  assert_string_equal(mxmlGetOpaque(pre_key_node_p), g_base64_encode(&data[0], 4));
+  assert_int_equal(bundle_p->pre_keys_p[0].id, 1);
+  assert_int_equal(bundle_p->pre_keys_p[0].data_len, 4);
+  assert_memory_equal(bundle_p->pre_key_data_p + bundle_p->pre_keys_p[0].data_offset, &data[0], 4);
 
-  mxml_node_t * pk_node_before = bundle_p->pre_keys_node_p;
   uint8_t data2[] = {0xBA, 0xDF, 0xEE, 0x75};
   assert_int_equal(omemo_bundle_add_pre_key(bundle_p, 2, &data2[0], 4), 0);
-  assert_ptr_equal(pk_node_before, bundle_p->pre_keys_node_p);
   assert_int_equal(bundle_p->pre_keys_amount, 2);
-
-  pre_key_node_p = mxmlGetNextSibling(pre_key_node_p);
-  assert_ptr_not_equal(pre_key_node_p, (void *) 0);
-  assert_string_equal(mxmlElementGetAttr(pre_key_node_p, PRE_KEY_NODE_ID_ATTR_NAME), "2");
-  assert_string_equal(mxmlGetOpaque(pre_key_node_p), g_base64_encode(&data2[0], 4));
+  assert_int_equal(bundle_p->pre_keys_p[1].id, 2);
+  assert_int_equal(bundle_p->pre_keys_p[1].data_len, 4);
+  assert_memory_equal(bundle_p->pre_key_data_p + bundle_p->pre_keys_p[1].data_offset, &data2[0], 4);
 
   omemo_bundle_destroy(bundle_p);
 }
@@ -482,6 +750,296 @@ void test_bundle_export(void ** state) {
    mxmlDelete(publish_node_p);
 }
 
+void test_bundle_export_to(void ** state) {
+  (void) state;
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+
+  write_buf buf = {0};
+  assert_int_not_equal(omemo_bundle_export_to(bundle_p, write_buf_append, &buf), 0);
+  assert_int_equal(buf.len, 0);
+
+  assert_int_equal(omemo_bundle_set_device_id(bundle_p, 1337), 0);
+  assert_int_equal(omemo_bundle_set_signed_pre_key(bundle_p, 1, data, sizeof(data)), 0);
+  assert_int_equal(omemo_bundle_set_signature(bundle_p, data, sizeof(data)), 0);
+  assert_int_equal(omemo_bundle_set_identity_key(bundle_p, data, sizeof(data)), 0);
+  for (uint32_t i = 1; i <= 100; i++) {
+    assert_int_equal(omemo_bundle_add_pre_key(bundle_p, i, data, sizeof(data)), 0);
+  }
+
+  assert_int_equal(omemo_bundle_export_to(bundle_p, write_fail, (void *) 0), -4711);
+  assert_int_equal(omemo_bundle_export_to(bundle_p, write_buf_append, &buf), 0);
+
+  char * publish;
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish), 0);
+  assert_xml_equivalent(buf.data_p, publish);
+
+  free(publish);
+  free(buf.data_p);
+  omemo_bundle_destroy(bundle_p);
+}
+
+void test_bundle_export_cached(void ** state) {
+  (void) state;
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+  assert_int_equal(omemo_bundle_set_device_id(bundle_p, 1337), 0);
+  assert_int_equal(omemo_bundle_set_signed_pre_key(bundle_p, 1, data, sizeof(data)), 0);
+  assert_int_equal(omemo_bundle_set_signature(bundle_p, data, sizeof(data)), 0);
+  assert_int_equal(omemo_bundle_set_identity_key(bundle_p, data, sizeof(data)), 0);
+  for (uint32_t i = 1; i <= 20; i++) {
+    assert_int_equal(omemo_bundle_add_pre_key(bundle_p, i, data, sizeof(data)), 0);
+  }
+  assert_ptr_equal(bundle_p->export_cache.str_p, (void *) 0);
+
+  char * publish_1 = (void *) 0;
+  char * publish_2 = (void *) 0;
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish_1), 0);
+  const char * cache_p = bundle_p->export_cache.str_p;
+  assert_ptr_not_equal(cache_p, (void *) 0);
+
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish_2), 0);
+  assert_ptr_equal(bundle_p->export_cache.str_p, cache_p);
+  assert_string_equal(publish_1, publish_2);
+  free(publish_2);
+
+  write_buf buf = {0};
+  assert_int_equal(omemo_bundle_export_to(bundle_p, write_buf_append, &buf), 0);
+  assert_ptr_equal(bundle_p->export_cache.str_p, cache_p);
+  assert_string_equal(buf.data_p, publish_1);
+  free(buf.data_p);
+
+  // every change has to show up in the next export
+  uint8_t other[] = {0xBA, 0xDF, 0xEE, 0x75};
+  assert_int_equal(omemo_bundle_set_signature(bundle_p, other, sizeof(other)), 0);
+  assert_ptr_equal(bundle_p->export_cache.str_p, (void *) 0);
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish_2), 0);
+  assert_string_not_equal(publish_1, publish_2);
+  assert_non_null(strstr(publish_2, "<signedPreKeySignature>ut/udQ==</signedPreKeySignature>"));
+  free(publish_2);
+
+  // pre keys are inserted into the cached XML instead
+  assert_int_equal(omemo_bundle_add_pre_key(bundle_p, 4294967295u, other, sizeof(other)), 0);
+  assert_ptr_not_equal(bundle_p->export_cache.str_p, (void *) 0);
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish_2), 0);
+  assert_non_null(strstr(publish_2, "<preKeyPublic preKeyId=\"4294967295\">ut/udQ==</preKeyPublic></prekeys>"));
+  free(publish_2);
+
+  assert_int_equal(omemo_bundle_set_device_id(bundle_p, 4711), 0);
+  assert_ptr_equal(bundle_p->export_cache.str_p, (void *) 0);
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish_2), 0);
+  assert_non_null(strstr(publish_2, "<publish node=\"eu.siacs.conversations.axolotl.bundles:4711\">"));
+  free(publish_2);
+
+  free(publish_1);
+  omemo_bundle_destroy(bundle_p);
+}
+
+// the data differs in length as well, so that the offsets of the following keys change
+static void bundle_add_test_pre_key(omemo_bundle * bundle_p, uint32_t pre_key_id) {
+  uint8_t pre_key_data[40];
+  memset(pre_key_data, pre_key_id & 0xFF, sizeof(pre_key_data));
+  assert_int_equal(omemo_bundle_add_pre_key(bundle_p, pre_key_id, pre_key_data, 30 + pre_key_id % 10), 0);
+}
+
+static void bundle_fill(omemo_bundle * bundle_p, const uint32_t * pre_key_ids_p, size_t pre_keys_amount) {
+  assert_int_equal(omemo_bundle_set_device_id(bundle_p, 1337), 0);
+  assert_int_equal(omemo_bundle_set_signed_pre_key(bundle_p, 1, data, sizeof(data)), 0);
+  assert_int_equal(omemo_bundle_set_signature(bundle_p, data, sizeof(data)), 0);
+  assert_int_equal(omemo_bundle_set_identity_key(bundle_p, data, sizeof(data)), 0);
+  for (size_t i = 0; i < pre_keys_amount; i++) {
+    bundle_add_test_pre_key(bundle_p, pre_key_ids_p[i]);
+  }
+}
+
+void test_bundle_remove_pre_key(void ** state) {
+  (void) state;
+
+  uint32_t ids[25];
+  for (size_t i = 0; i < 25; i++) {
+    ids[i] = i + 1;
+  }
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+  bundle_fill(bundle_p, ids, 25);
+
+  char * publish = (void *) 0;
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish), 0);
+  free(publish);
+
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 1), 0);
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 13), 0);
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 25), 0);
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 13), OMEMO_ERR);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 22);
+  assert_ptr_not_equal(bundle_p->export_cache.str_p, (void *) 0);
+
+  uint32_t new_ids[OMEMO_BUNDLE_PRE_KEYS_TARGET];
+  size_t new_ids_len = 0;
+  assert_int_equal(omemo_bundle_next_pre_key_ids(bundle_p, new_ids, 3, &new_ids_len), 0);
+  assert_int_equal(new_ids_len, 3);
+  for (size_t i = 0; i < new_ids_len; i++) {
+    assert_int_equal(new_ids[i], 26 + i);
+  }
+  for (size_t i = 0; i < new_ids_len; i++) {
+    bundle_add_test_pre_key(bundle_p, new_ids[i]);
+  }
+
+  // has to be the same as if the bundle was created with these keys
+  uint32_t expected_ids[25];
+  size_t expected_len = 0;
+  for (uint32_t id = 2; id <= 28; id++) {
+    if (id != 13 && id != 25) {
+      expected_ids[expected_len++] = id;
+    }
+  }
+  omemo_bundle * expected_p = (void *) 0;
+  assert_int_equal(omemo_bundle_create(&expected_p), 0);
+  bundle_fill(expected_p, expected_ids, expected_len);
+
+  char * expected = (void *) 0;
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish), 0);
+  assert_int_equal(omemo_bundle_export(expected_p, &expected), 0);
+  assert_string_equal(publish, expected);
+  free(publish);
+  free(expected);
+
+  for (size_t i = 0; i < expected_len; i++) {
+    uint32_t pre_key_id = 0;
+    const uint8_t * data_p = (void *) 0;
+    size_t data_len = 0;
+    assert_int_equal(omemo_bundle_get_pre_key(bundle_p, i, &pre_key_id, &data_p, &data_len), 0);
+    assert_int_equal(pre_key_id, expected_ids[i]);
+    assert_int_equal(data_len, 30 + pre_key_id % 10);
+    for (size_t j = 0; j < data_len; j++) {
+      assert_int_equal(data_p[j], pre_key_id & 0xFF);
+    }
+  }
+
+  // not enough left to publish
+  for (size_t i = 0; i < 6; i++) {
+    assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, expected_ids[i]), 0);
+  }
+  assert_int_equal(omemo_bundle_export(bundle_p, &publish), -2);
+
+  omemo_bundle_destroy(expected_p);
+  omemo_bundle_destroy(bundle_p);
+}
+
+void test_bundle_next_pre_key_ids(void ** state) {
+  (void) state;
+
+  uint32_t ids[OMEMO_BUNDLE_PRE_KEYS_TARGET];
+  size_t ids_len = 0;
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_import(bundle, &bundle_p), 0);
+
+  assert_int_equal(omemo_bundle_next_pre_key_ids(bundle_p, ids, sizeof(ids) / sizeof(ids[0]), &ids_len), 0);
+  assert_int_equal(ids_len, OMEMO_BUNDLE_PRE_KEYS_TARGET - 4);
+  assert_int_equal(ids[0], 41);
+  assert_int_equal(ids[ids_len - 1], 41 + ids_len - 1);
+
+  // already handed out
+  assert_int_equal(omemo_bundle_next_pre_key_ids(bundle_p, ids, 1, &ids_len), 0);
+  assert_int_equal(ids_len, 1);
+  assert_int_equal(ids[0], 41 + OMEMO_BUNDLE_PRE_KEYS_TARGET - 4);
+  omemo_bundle_destroy(bundle_p);
+
+  // wraps around, skipping what is still in the bundle
+  uint32_t full_ids[OMEMO_BUNDLE_PRE_KEYS_TARGET];
+  for (size_t i = 0; i < OMEMO_BUNDLE_PRE_KEYS_TARGET; i++) {
+    full_ids[i] = i == 0 ? OMEMO_BUNDLE_PRE_KEY_ID_MAX : i + 1;
+  }
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+  bundle_fill(bundle_p, full_ids, OMEMO_BUNDLE_PRE_KEYS_TARGET);
+  assert_int_equal(omemo_bundle_next_pre_key_ids(bundle_p, ids, sizeof(ids) / sizeof(ids[0]), &ids_len), 0);
+  assert_int_equal(ids_len, 0);
+
+  // and what was consumed
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, OMEMO_BUNDLE_PRE_KEY_ID_MAX), 0);
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 50), 0);
+  assert_int_equal(omemo_bundle_next_pre_key_ids(bundle_p, ids, sizeof(ids) / sizeof(ids[0]), &ids_len), 0);
+  assert_int_equal(ids_len, 2);
+  assert_int_equal(ids[0], 1);
+  assert_int_equal(ids[1], OMEMO_BUNDLE_PRE_KEYS_TARGET + 1);
+
+  const uint32_t * consumed_p = (void *) 0;
+  size_t consumed_len = 0;
+  assert_int_equal(omemo_bundle_get_consumed_pre_key_ids(bundle_p, &consumed_p, &consumed_len), 0);
+  assert_int_equal(consumed_len, 2);
+  assert_int_equal(consumed_p[0], 50);
+  assert_int_equal(consumed_p[1], OMEMO_BUNDLE_PRE_KEY_ID_MAX);
+
+  // once they are allowed again
+  assert_int_equal(omemo_bundle_set_consumed_pre_key_ids(bundle_p, (void *) 0, 0), 0);
+  assert_int_equal(omemo_bundle_set_pre_key_id_last(bundle_p, OMEMO_BUNDLE_PRE_KEY_ID_MAX), 0);
+  assert_int_equal(omemo_bundle_next_pre_key_ids(bundle_p, ids, sizeof(ids) / sizeof(ids[0]), &ids_len), 0);
+  assert_int_equal(ids_len, 2);
+  assert_int_equal(ids[0], 1);
+  assert_int_equal(ids[1], 50);
+
+  omemo_bundle_destroy(bundle_p);
+}
+
+void test_bundle_pre_key_ids_restore(void ** state) {
+  (void) state;
+
+  uint32_t ids[25];
+  for (size_t i = 0; i < 25; i++) {
+    ids[i] = i + 1;
+  }
+  uint32_t new_id = 0;
+  size_t new_ids_len = 0;
+
+  // the pre key with the highest ID is used
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+  bundle_fill(bundle_p, ids, 25);
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 25), 0);
+
+  uint32_t id_last = 0;
+  const uint32_t * consumed_p = (void *) 0;
+  size_t consumed_len = 0;
+  assert_int_equal(omemo_bundle_get_pre_key_id_last(bundle_p, &id_last), 0);
+  assert_int_equal(id_last, 25);
+  assert_int_equal(omemo_bundle_get_consumed_pre_key_ids(bundle_p, &consumed_p, &consumed_len), 0);
+  assert_int_equal(consumed_len, 1);
+  uint32_t consumed[1] = {consumed_p[0]};
+
+  // after a restart the bundle only knows the keys left in it, so its ID would come back
+  omemo_bundle * restored_p = (void *) 0;
+  assert_int_equal(omemo_bundle_create(&restored_p), 0);
+  bundle_fill(restored_p, ids, 24);
+  assert_int_equal(omemo_bundle_next_pre_key_ids(restored_p, &new_id, 1, &new_ids_len), 0);
+  assert_int_equal(new_id, 25);
+  omemo_bundle_destroy(restored_p);
+
+  // either of the persisted values prevents that
+  assert_int_equal(omemo_bundle_create(&restored_p), 0);
+  bundle_fill(restored_p, ids, 24);
+  assert_int_equal(omemo_bundle_set_pre_key_id_last(restored_p, id_last), 0);
+  assert_int_equal(omemo_bundle_next_pre_key_ids(restored_p, &new_id, 1, &new_ids_len), 0);
+  assert_int_equal(new_id, 26);
+  omemo_bundle_destroy(restored_p);
+
+  assert_int_equal(omemo_bundle_create(&restored_p), 0);
+  bundle_fill(restored_p, ids, 24);
+  assert_int_equal(omemo_bundle_set_consumed_pre_key_ids(restored_p, consumed, 1), 0);
+  assert_int_equal(omemo_bundle_next_pre_key_ids(restored_p, &new_id, 1, &new_ids_len), 0);
+  assert_int_equal(new_id, 26);
+  omemo_bundle_destroy(restored_p);
+
+  assert_int_equal(omemo_bundle_set_pre_key_id_last(bundle_p, OMEMO_BUNDLE_PRE_KEY_ID_MAX + 1), OMEMO_ERR);
+  assert_int_equal(omemo_bundle_set_consumed_pre_key_ids(bundle_p, (void *) 0, 1), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_bundle_get_pre_key_id_last(bundle_p, (void *) 0), OMEMO_ERR_NULL);
+
+  omemo_bundle_destroy(bundle_p);
+}
+
 void test_bundle_get_pep_node_name(void ** state) {
   (void) state;
 
@@ -581,17 +1139,15 @@ void test_bundle_import(void ** state) {
   assert_int_equal(omemo_bundle_import(bundle, &bundle_p), 0);
   assert_string_equal(bundle_p->device_id, "31415");
 
-  assert_ptr_not_equal(bundle_p->signed_pk_node_p, (void *) 0);
-  assert_string_equal(mxmlGetElement(bundle_p->signed_pk_node_p), "signedPreKeyPublic");
-
-  assert_ptr_not_equal(bundle_p->signature_node_p, (void *) 0);
-  assert_string_equal(mxmlGetElement(bundle_p->signature_node_p), "signedPreKeySignature");
+  assert_int_equal(bundle_p->signed_pre_key_id, 1);
+  assert_int_equal(bundle_p->signed_pre_key.data_len, 4);
+  assert_memory_equal(bundle_p->signed_pre_key.data_p, &data[0], 4);
 
-  assert_ptr_not_equal(bundle_p->identity_key_node_p, (void *) 0);
-  assert_string_equal(mxmlGetElement(bundle_p->identity_key_node_p), "identityKey");
+  assert_int_equal(bundle_p->signature.data_len, 4);
+  assert_memory_equal(bundle_p->signature.data_p, &data[0], 4);
 
-  assert_ptr_not_equal(bundle_p->pre_keys_node_p, (void *) 0);
-  assert_string_equal(mxmlGetElement(bundle_p->pre_keys_node_p), "prekeys");
+  assert_int_equal(bundle_p->identity_key.data_len, 4);
+  assert_memory_equal(bundle_p->identity_key.data_p, &data[0], 4);
 
   assert_int_equal(bundle_p->pre_keys_amount, 4);
 
@@ -679,6 +1235,93 @@ void test_bundle_get_random_pre_key(void ** state) {
   omemo_bundle_destroy(bundle_p);
 }
 
+void test_bundle_get_pre_key(void ** state) {
+  (void) state;
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_import(bundle, &bundle_p), 0);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 4);
+
+  uint32_t pre_key_id = 0;
+  const uint8_t * data_p = (void *) 0;
+  size_t data_len = 0;
+  for (size_t i = 0; i < omemo_bundle_get_pre_key_amount(bundle_p); i++) {
+    assert_int_equal(omemo_bundle_get_pre_key(bundle_p, i, &pre_key_id, &data_p, &data_len), 0);
+    assert_int_equal(pre_key_id, (i + 1) * 10);
+    assert_int_equal(data_len, 4);
+    assert_memory_equal(data_p, data, data_len);
+  }
+  assert_int_not_equal(omemo_bundle_get_pre_key(bundle_p, 4, &pre_key_id, &data_p, &data_len), 0);
+
+  // every pre key can be picked
+  bool picked[4] = {false};
+  for (int i = 0; i < 200; i++) {
+    uint8_t * random_data_p = (void *) 0;
+    assert_int_equal(omemo_bundle_get_random_pre_key(bundle_p, &pre_key_id, &random_data_p, &data_len), 0);
+    assert_true(pre_key_id >= 10 && pre_key_id <= 40 && pre_key_id % 10 == 0);
+    picked[pre_key_id / 10 - 1] = true;
+    free(random_data_p);
+  }
+  assert_true(picked[0] && picked[1] && picked[2] && picked[3]);
+  omemo_bundle_destroy(bundle_p);
+
+  // pre keys added to an own bundle
+  uint8_t key_data[33];
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 0);
+  uint8_t * random_data_p = (void *) 0;
+  assert_int_equal(omemo_bundle_get_random_pre_key(bundle_p, &pre_key_id, &random_data_p, &data_len), OMEMO_ERR_NULL);
+  for (uint32_t id = 1; id <= 100; id++) {
+    memset(key_data, id, sizeof(key_data));
+    assert_int_equal(omemo_bundle_add_pre_key(bundle_p, id, key_data, sizeof(key_data)), 0);
+  }
+  assert_int_equal(omemo_bundle_get_pre_key_amount(bundle_p), 100);
+
+  for (size_t i = 0; i < 100; i++) {
+    assert_int_equal(omemo_bundle_get_pre_key(bundle_p, i, &pre_key_id, &data_p, &data_len), 0);
+    assert_int_equal(pre_key_id, i + 1);
+    memset(key_data, pre_key_id, sizeof(key_data));
+    assert_int_equal(data_len, sizeof(key_data));
+    assert_memory_equal(data_p, key_data, data_len);
+  }
+
+  omemo_bundle_destroy(bundle_p);
+}
+
+void test_bundle_import_malformed_pre_key(void ** state) {
+  (void) state;
+
+  char * bundle_no_id = "<items node='eu.siacs.conversations.axolotl.bundles:31415'>"
+                          "<item>"
+                            "<bundle xmlns='eu.siacs.conversations.axolotl'>"
+                              "<signedPreKeyPublic signedPreKeyId='1'>sWsAtQ==</signedPreKeyPublic>"
+                              "<signedPreKeySignature>sWsAtQ==</signedPreKeySignature>"
+                              "<identityKey>sWsAtQ==</identityKey>"
+                              "<prekeys>"
+                                "<preKeyPublic preKeyId='10'>sWsAtQ==</preKeyPublic>"
+                                "<preKeyPublic>sWsAtQ==</preKeyPublic>"
+                              "</prekeys>"
+                            "</bundle>"
+                          "</item>"
+                        "</items>";
+  char * bundle_bad_b64 = "<items node='eu.siacs.conversations.axolotl.bundles:31415'>"
+                            "<item>"
+                              "<bundle xmlns='eu.siacs.conversations.axolotl'>"
+                                "<signedPreKeyPublic signedPreKeyId='1'>sWsAtQ==</signedPreKeyPublic>"
+                                "<signedPreKeySignature>sWsAtQ==</signedPreKeySignature>"
+                                "<identityKey>sWsAtQ==</identityKey>"
+                                "<prekeys>"
+                                  "<preKeyPublic preKeyId='10'>sWsA*Q==</preKeyPublic>"
+                                "</prekeys>"
+                              "</bundle>"
+                            "</item>"
+                          "</items>";
+
+  omemo_bundle * bundle_p = (void *) 0;
+  assert_int_equal(omemo_bundle_import(bundle_no_id, &bundle_p), OMEMO_ERR_MALFORMED_BUNDLE_NO_PREKEY_ID_ATTR);
+  assert_int_equal(omemo_bundle_import(bundle_bad_b64, &bundle_p), OMEMO_ERR_MALFORMED_BASE64);
+}
+
 void test_message_prepare_encryption(void ** state) {
   (void) state;
 
@@ -895,6 +1538,63 @@ void test_message_get_encrypted_key_no_keys(void ** state) {
   omemo_message_destroy(msg_p);
 }
 
+void test_message_get_encrypted_key_many(void ** state) {
+  (void) state;
+
+  char msg[16384];
+  size_t msg_len = 0;
+
+  msg_len += snprintf(msg + msg_len, sizeof(msg) - msg_len, "%s",
+                      "<message to='bob@example.com' from='alice@example.com'>"
+                        "<encrypted xmlns='eu.siacs.conversations.axolotl'>"
+                          "<header sid='1111'>"
+                            "<key rid='123'>AAAA</key>"
+                            "<key rid='12' prekey='true'>sWsAtQ==</key>"
+                            "<key rid='12'>AAAA</key>"
+                            "<key rid='0x10'>AAAA</key>");
+  for (int i = 0; i < 300; i++) {
+    msg_len += snprintf(msg + msg_len, sizeof(msg) - msg_len, "<key rid='%d'>AAAA</key>", 100000 + i * 4096);
+  }
+  msg_len += snprintf(msg + msg_len, sizeof(msg) - msg_len, "%s",
+                          "<iv>BASE64ENCODED</iv>"
+                        "</header>"
+                        "<payload>BASE64ENCODED</payload>"
+                      "</encrypted>"
+                    "</message>");
+  assert_true(msg_len < sizeof(msg));
+
+  omemo_message * msg_p;
+  assert_int_equal(omemo_message_prepare_decryption(msg, &msg_p), 0);
+
+  uint8_t * key_p;
+  size_t key_len;
+  bool is_prekey = false;
+
+  // no prefix matching, and the first key for a rid wins
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 1, &key_p, &key_len), 0);
+  assert_ptr_equal(key_p, (void *) 0);
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 12, &key_p, &key_len), 0);
+  assert_int_equal(key_len, 4);
+  assert_memory_equal(key_p, data, key_len);
+  g_free(key_p);
+  assert_int_equal(omemo_message_is_encrypted_key_prekey(msg_p, 12, &is_prekey), 0);
+  assert_int_equal(is_prekey, true);
+
+  // rids are decimal
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 16, &key_p, &key_len), 0);
+  assert_ptr_equal(key_p, (void *) 0);
+
+  for (int i = 0; i < 300; i++) {
+    assert_int_equal(omemo_message_get_encrypted_key(msg_p, 100000 + i * 4096, &key_p, &key_len), 0);
+    assert_int_equal(key_len, 3);
+    g_free(key_p);
+  }
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 100001, &key_p, &key_len), 0);
+  assert_ptr_equal(key_p, (void *) 0);
+
+  omemo_message_destroy(msg_p);
+}
+
 void test_message_add_recipient(void ** state) {
   (void) state;
 
@@ -915,10 +1615,21 @@ void test_message_add_recipient(void ** state) {
   assert_string_equal(mxmlElementGetAttr(key_node_p, "rid"), "1234");
   assert_string_equal(mxmlGetOpaque(key_node_p), data_b64);
 
+  uint8_t * key_p;
+  size_t key_len;
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, sid, &key_p, &key_len), 0);
+  assert_ptr_equal(key_p, (void *) 0);
+
+  // adding a recipient after a lookup has to be visible to the next one
   assert_int_equal(omemo_message_add_recipient(msg_p, sid, &data[0], 4), 0);
   key_node_p = mxmlGetNextSibling(key_node_p);
   assert_ptr_not_equal(key_node_p, (void *) 0);
 
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, sid, &key_p, &key_len), 0);
+  assert_int_equal(key_len, 4);
+  assert_memory_equal(key_p, data, key_len);
+  g_free(key_p);
+
   mxml_node_t * iv_node_p = mxmlGetLastChild(msg_p->header_node_p);
   assert_ptr_not_equal(iv_node_p, (void *) 0);
   assert_string_equal(mxmlGetElement(iv_node_p), "iv");
@@ -952,6 +1663,76 @@ void test_message_add_recipient_w_prekey(void ** state) {
   omemo_message_destroy(msg_p);
 }
 
+void test_message_add_recipients(void ** state) {
+  (void) state;
+
+  uint32_t sid = 4321;
+  const size_t amount = 300;
+
+  uint8_t keys[300][40];
+  omemo_raw_recipient recipients[300];
+  for (size_t i = 0; i < amount; i++) {
+    memset(keys[i], (int) i, sizeof(keys[i]));
+    recipients[i].device_id = 100000 + i;
+    recipients[i].prekey = (i % 7 == 0);
+    recipients[i].encrypted_key_p = keys[i];
+    recipients[i].encrypted_key_len = 30 + i % 11;
+  }
+
+  omemo_message * msg_bulk_p;
+  omemo_message * msg_single_p;
+  assert_int_equal(omemo_message_prepare_encryption(msg_out, sid, &crypto, OMEMO_STRIP_NONE, &msg_bulk_p), 0);
+  assert_int_equal(omemo_message_prepare_encryption(msg_out, sid, &crypto, OMEMO_STRIP_NONE, &msg_single_p), 0);
+
+  assert_int_equal(omemo_message_add_recipients(msg_bulk_p, (void *) 0, 1), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_message_add_recipients(msg_bulk_p, recipients, 0), 0);
+
+  // nothing is added if one of the entries is invalid
+  recipients[amount - 1].encrypted_key_p = (void *) 0;
+  assert_int_equal(omemo_message_add_recipients(msg_bulk_p, recipients, amount), OMEMO_ERR_NULL);
+  assert_string_equal(mxmlGetElement(mxmlGetFirstChild(msg_bulk_p->header_node_p)), "iv");
+  recipients[amount - 1].encrypted_key_p = keys[amount - 1];
+
+  assert_int_equal(omemo_message_add_recipients(msg_bulk_p, recipients, amount), 0);
+  for (size_t i = 0; i < amount; i++) {
+    if (recipients[i].prekey) {
+      assert_int_equal(omemo_message_add_recipient_w_prekey(msg_single_p, recipients[i].device_id, recipients[i].encrypted_key_p, recipients[i].encrypted_key_len), 0);
+    } else {
+      assert_int_equal(omemo_message_add_recipient(msg_single_p, recipients[i].device_id, recipients[i].encrypted_key_p, recipients[i].encrypted_key_len), 0);
+    }
+  }
+
+  mxml_node_t * bulk_node_p = mxmlGetFirstChild(msg_bulk_p->header_node_p);
+  mxml_node_t * single_node_p = mxmlGetFirstChild(msg_single_p->header_node_p);
+  for (size_t i = 0; i < amount; i++) {
+    assert_string_equal(mxmlGetElement(bulk_node_p), "key");
+    assert_string_equal(mxmlElementGetAttr(bulk_node_p, "rid"), mxmlElementGetAttr(single_node_p, "rid"));
+    assert_string_equal(mxmlGetOpaque(bulk_node_p), mxmlGetOpaque(single_node_p));
+    if (mxmlElementGetAttr(single_node_p, "prekey")) {
+      assert_string_equal(mxmlElementGetAttr(bulk_node_p, "prekey"), "true");
+    } else {
+      assert_ptr_equal(mxmlElementGetAttr(bulk_node_p, "prekey"), (void *) 0);
+    }
+
+    bulk_node_p = mxmlGetNextSibling(bulk_node_p);
+    single_node_p = mxmlGetNextSibling(single_node_p);
+  }
+  assert_string_equal(mxmlGetElement(bulk_node_p), "iv");
+
+  uint8_t * key_p;
+  size_t key_len;
+  bool is_prekey;
+  assert_int_equal(omemo_message_get_encrypted_key(msg_bulk_p, 100000 + 77, &key_p, &key_len), 0);
+  assert_int_equal(key_len, recipients[77].encrypted_key_len);
+  assert_memory_equal(key_p, keys[77], key_len);
+  assert_int_equal(omemo_message_is_encrypted_key_prekey(msg_bulk_p, 100000 + 77, &is_prekey), 0);
+  assert_true(is_prekey);
+  free(key_p);
+
+  omemo_message_destroy(msg_bulk_p);
+  omemo_message_destroy(msg_single_p);
+}
+
 void test_message_export_encrypted(void ** state) {
   (void) state;
 
@@ -1380,6 +2161,317 @@ void test_message_encrypt_decrypt_with_added_eme(void ** state) {
   free(key_retrieved_p);
 }
 
+void test_message_export_encrypted_to(void ** state) {
+  (void) state;
+
+  uint32_t sid = 4321;
+  char * msg_escaped = "<message xmlns='jabber:client' type='chat' to='bob@example.com' id='&quot;&amp;&lt;'>"
+                         "<body>hello</body>"
+                         "<thread>&lt;&gt;&amp;</thread>"
+                       "</message>";
+
+  omemo_message * msg_p;
+  assert_int_equal(omemo_message_prepare_encryption(msg_escaped, sid, &crypto, OMEMO_STRIP_NONE, &msg_p), 0);
+  for (uint32_t rid = 1; rid <= 100; rid++) {
+    assert_int_equal(omemo_message_add_recipient(msg_p, rid, omemo_message_get_key(msg_p), omemo_message_get_key_len(msg_p)), 0);
+  }
+
+  // a failed export leaves the message intact
+  assert_int_equal(omemo_message_export_encrypted_to(msg_p, OMEMO_ADD_MSG_BOTH, write_fail, (void *) 0), -4711);
+
+  write_buf buf = {0};
+  assert_int_equal(omemo_message_export_encrypted_to(msg_p, OMEMO_ADD_MSG_BOTH, write_buf_append, &buf), 0);
+
+  char * xml;
+  assert_int_equal(omemo_message_export_encrypted(msg_p, OMEMO_ADD_MSG_BOTH, &xml), 0);
+  assert_xml_equivalent(buf.data_p, xml);
+
+  omemo_message * msg_in_p;
+  assert_int_equal(omemo_message_prepare_decryption(buf.data_p, &msg_in_p), 0);
+  assert_int_equal(omemo_message_get_sender_id(msg_in_p), sid);
+  uint8_t * key_p;
+  size_t key_len;
+  assert_int_equal(omemo_message_get_encrypted_key(msg_in_p, 100, &key_p, &key_len), 0);
+  assert_ptr_not_equal(key_p, (void *) 0);
+
+  char * body_p;
+  size_t body_len;
+  assert_int_equal(omemo_message_decrypt_body(msg_in_p, key_p, key_len, &crypto, &body_p, &body_len), 0);
+  assert_string_equal(body_p, "hello");
+
+  mxml_node_t * thread_node_p = mxmlFindPath(msg_in_p->message_node_p, "thread");
+  assert_string_equal(mxmlGetOpaque(thread_node_p), "<>&");
+  assert_string_equal(mxmlElementGetAttr(msg_in_p->message_node_p, "id"), "\"&<");
+
+  free(body_p);
+  free(key_p);
+  free(xml);
+  free(buf.data_p);
+  omemo_message_destroy(msg_in_p);
+  omemo_message_destroy(msg_p);
+}
+
+void test_message_encrypt_decrypt_into(void ** state) {
+  (void) state;
+
+  uint32_t sid = 4321;
+  uint32_t rid = 1234;
+
+  omemo_message * msg_out_p;
+  assert_int_equal(omemo_message_prepare_encryption(msg_out, sid, &crypto_into, OMEMO_STRIP_NONE, &msg_out_p), 0);
+
+  const uint8_t * key_p = omemo_message_get_key(msg_out_p);
+  assert_int_equal(omemo_message_get_key_len(msg_out_p), OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH);
+
+  omemo_message * msg_other_p;
+  assert_int_equal(omemo_message_prepare_encryption(msg_out, sid, &crypto_into, OMEMO_STRIP_NONE, &msg_other_p), 0);
+  assert_memory_not_equal(msg_other_p->iv_p, msg_out_p->iv_p, msg_out_p->iv_len);
+  assert_memory_not_equal(omemo_message_get_key(msg_other_p), key_p, OMEMO_AES_128_KEY_LENGTH);
+  assert_memory_not_equal(msg_out_p->iv_p, key_p, OMEMO_AES_GCM_IV_LENGTH);
+  omemo_message_destroy(msg_other_p);
+  assert_int_equal(omemo_message_add_recipient(msg_out_p, rid, key_p, omemo_message_get_key_len(msg_out_p)), 0);
+
+  char * xml_out;
+  assert_int_equal(omemo_message_export_encrypted(msg_out_p, OMEMO_ADD_MSG_NONE, &xml_out), 0);
+
+  omemo_message * msg_in_p;
+  assert_int_equal(omemo_message_prepare_decryption(xml_out, &msg_in_p), 0);
+
+  uint8_t * key_retrieved_p;
+  size_t key_retrieved_len;
+  assert_int_equal(omemo_message_get_encrypted_key(msg_in_p, rid, &key_retrieved_p, &key_retrieved_len), 0);
+
+  // both ways have to be interchangeable
+  char * xml_in;
+  assert_int_equal(omemo_message_export_decrypted(msg_in_p, key_retrieved_p, key_retrieved_len, &crypto, &xml_in), 0);
+  mxml_node_t * message_node_decrypted_p = mxmlLoadString((void *) 0, xml_in, MXML_OPAQUE_CALLBACK);
+  assert_string_equal(mxmlGetOpaque(mxmlFindPath(message_node_decrypted_p, "body")), "hello");
+  mxmlDelete(message_node_decrypted_p);
+  free(xml_in);
+
+  assert_int_equal(omemo_message_export_decrypted(msg_in_p, key_retrieved_p, key_retrieved_len, &crypto_into, &xml_in), 0);
+  message_node_decrypted_p = mxmlLoadString((void *) 0, xml_in, MXML_OPAQUE_CALLBACK);
+  assert_string_equal(mxmlGetOpaque(mxmlFindPath(message_node_decrypted_p, "body")), "hello");
+  mxmlDelete(message_node_decrypted_p);
+  free(xml_in);
+
+  key_retrieved_p[0] ^= 0x01;
+  assert_int_equal(omemo_message_export_decrypted(msg_in_p, key_retrieved_p, key_retrieved_len, &crypto_into, &xml_in), OMEMO_ERR_AUTH_FAIL);
+
+  omemo_message_destroy(msg_out_p);
+  omemo_message_destroy(msg_in_p);
+  free(xml_out);
+  free(key_retrieved_p);
+}
+
+void test_message_encrypt_decrypt_raw(void ** state) {
+  (void) state;
+
+  const omemo_crypto_provider * providers[] = {&crypto, &crypto_into};
+  const char * pt = "hello";
+  uint32_t sid = 4321;
+
+  omemo_raw_message * raw_p = (void *) 0;
+  assert_int_equal(omemo_message_encrypt_raw((void *) 0, 5, sid, &crypto, &raw_p), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_message_encrypt_raw((const uint8_t *) pt, 5, sid, &crypto, (void *) 0), OMEMO_ERR_NULL);
+
+  for (size_t i = 0; i < sizeof(providers) / sizeof(providers[0]); i++) {
+    assert_int_equal(omemo_message_encrypt_raw((const uint8_t *) pt, strlen(pt), sid, providers[i], &raw_p), 0);
+    assert_int_equal(raw_p->sender_device_id, sid);
+    assert_int_equal(raw_p->ciphertext_len, strlen(pt));
+    assert_memory_not_equal(raw_p->ciphertext_p, pt, strlen(pt));
+    assert_int_equal(raw_p->recipients_len, 0);
+
+    for (uint32_t rid = 1; rid <= 20; rid++) {
+      assert_int_equal(omemo_raw_message_add_recipient(raw_p, rid, rid == 7, raw_p->key, sizeof(raw_p->key)), 0);
+    }
+    assert_int_equal(raw_p->recipients_len, 20);
+    assert_int_equal(raw_p->recipients_p[19].device_id, 20);
+    assert_true(raw_p->recipients_p[6].prekey);
+    assert_false(raw_p->recipients_p[7].prekey);
+    assert_int_equal(raw_p->recipients_p[0].encrypted_key_len, sizeof(raw_p->key));
+    assert_memory_equal(raw_p->recipients_p[0].encrypted_key_p, raw_p->key, sizeof(raw_p->key));
+
+    // decrypting has to work with either provider
+    for (size_t j = 0; j < sizeof(providers) / sizeof(providers[0]); j++) {
+      uint8_t * pt_p = (void *) 0;
+      size_t pt_len = 0;
+      assert_int_equal(omemo_message_decrypt_raw(raw_p->ciphertext_p, raw_p->ciphertext_len, raw_p->iv, sizeof(raw_p->iv),
+                                                 raw_p->key, sizeof(raw_p->key), providers[j], &pt_p, &pt_len), 0);
+      assert_int_equal(pt_len, strlen(pt));
+      assert_string_equal((char *) pt_p, pt);
+      free(pt_p);
+    }
+
+    // the tag can also be appended to the ciphertext instead
+    uint8_t ct_w_tag[5 + OMEMO_AES_GCM_TAG_LENGTH];
+    memcpy(ct_w_tag, raw_p->ciphertext_p, raw_p->ciphertext_len);
+    memcpy(ct_w_tag + raw_p->ciphertext_len, raw_p->key + OMEMO_AES_128_KEY_LENGTH, OMEMO_AES_GCM_TAG_LENGTH);
+    uint8_t * pt_p = (void *) 0;
+    size_t pt_len = 0;
+    assert_int_equal(omemo_message_decrypt_raw(ct_w_tag, sizeof(ct_w_tag), raw_p->iv, sizeof(raw_p->iv),
+                                               raw_p->key, OMEMO_AES_128_KEY_LENGTH, providers[i], &pt_p, &pt_len), 0);
+    assert_memory_equal(pt_p, pt, pt_len);
+    free(pt_p);
+
+    assert_int_equal(omemo_message_decrypt_raw(ct_w_tag, OMEMO_AES_GCM_TAG_LENGTH - 1, raw_p->iv, sizeof(raw_p->iv),
+                                               raw_p->key, OMEMO_AES_128_KEY_LENGTH, providers[i], &pt_p, &pt_len), OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_PAYLOAD_DATA);
+    assert_int_equal(omemo_message_decrypt_raw(raw_p->ciphertext_p, raw_p->ciphertext_len, raw_p->iv, sizeof(raw_p->iv),
+                                               raw_p->key, 20, providers[i], &pt_p, &pt_len), OMEMO_ERR_UNSUPPORTED_KEY_LEN);
+
+    raw_p->ciphertext_p[0] ^= 0x01;
+    assert_int_equal(omemo_message_decrypt_raw(raw_p->ciphertext_p, raw_p->ciphertext_len, raw_p->iv, sizeof(raw_p->iv),
+                                               raw_p->key, sizeof(raw_p->key), providers[i], &pt_p, &pt_len), OMEMO_ERR_AUTH_FAIL);
+
+    omemo_raw_message_destroy(raw_p);
+  }
+}
+
+void test_message_decrypt_body(void ** state) {
+  (void) state;
+
+  uint32_t sid = 4321;
+  uint32_t rid = 1234;
+  char * msg_escaped = "<message xmlns='jabber:client' type='chat' to='bob@example.com'>"
+                         "<body>1 &lt; 2 &amp;&amp; 3 &gt; 2</body>"
+                       "</message>";
+  const char * body_expected = "1 < 2 && 3 > 2";
+
+  omemo_message * msg_out_p;
+  assert_int_equal(omemo_message_prepare_encryption(msg_escaped, sid, &crypto, OMEMO_STRIP_NONE, &msg_out_p), 0);
+  const uint8_t * key_p = omemo_message_get_key(msg_out_p);
+  size_t key_len = omemo_message_get_key_len(msg_out_p);
+  assert_int_equal(omemo_message_add_recipient(msg_out_p, rid, key_p, key_len), 0);
+
+  char * xml_out;
+  assert_int_equal(omemo_message_export_encrypted(msg_out_p, OMEMO_ADD_MSG_NONE, &xml_out), 0);
+
+  omemo_message * msg_in_p[2];
+  assert_int_equal(omemo_message_prepare_decryption(xml_out, &msg_in_p[0]), 0);
+  assert_int_equal(omemo_message_prepare_decryption_streaming(xml_out, &msg_in_p[1]), 0);
+
+  const omemo_crypto_provider * providers[] = {&crypto, &crypto_into};
+  for (size_t i = 0; i < 2; i++) {
+    for (size_t j = 0; j < sizeof(providers) / sizeof(providers[0]); j++) {
+      char * body_p = (void *) 0;
+      size_t body_len = 0;
+      assert_int_equal(omemo_message_decrypt_body(msg_in_p[i], key_p, key_len, providers[j], &body_p, &body_len), 0);
+      assert_string_equal(body_p, body_expected);
+      assert_int_equal(body_len, strlen(body_expected));
+      free(body_p);
+
+      char body[64];
+      body_len = 0;
+      assert_int_equal(omemo_message_decrypt_body_into(msg_in_p[i], key_p, key_len, providers[j], body, sizeof(body), &body_len), 0);
+      assert_string_equal(body, body_expected);
+      assert_int_equal(body_len, strlen(body_expected));
+
+      body_len = 0;
+      assert_int_equal(omemo_message_decrypt_body_into(msg_in_p[i], key_p, key_len, providers[j], body, strlen(body_expected), &body_len), OMEMO_ERR_BUFFER_TOO_SMALL);
+      assert_int_equal(body_len, strlen(body_expected));
+    }
+  }
+
+  // the tree is left as it was
+  assert_ptr_equal(mxmlFindPath(msg_in_p[0]->message_node_p, "body"), (void *) 0);
+
+  uint8_t key_wrong[OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH];
+  memcpy(key_wrong, key_p, key_len);
+  key_wrong[0] ^= 0x01;
+  char body[64];
+  size_t body_len = 0;
+  assert_int_equal(omemo_message_decrypt_body_into(msg_in_p[1], key_wrong, key_len, &crypto_into, body, sizeof(body), &body_len), OMEMO_ERR_AUTH_FAIL);
+  char * body_p = (void *) 0;
+  assert_int_equal(omemo_message_decrypt_body(msg_in_p[0], key_p, 17, &crypto, &body_p, &body_len), OMEMO_ERR_UNSUPPORTED_KEY_LEN);
+  assert_int_equal(omemo_message_decrypt_body(msg_in_p[0], key_p, key_len, &crypto, (void *) 0, &body_len), OMEMO_ERR_NULL);
+
+  omemo_message_destroy(msg_out_p);
+  omemo_message_destroy(msg_in_p[0]);
+  omemo_message_destroy(msg_in_p[1]);
+  free(xml_out);
+}
+
+#define BATCH_MSG_AMOUNT 4
+
+void test_message_export_decrypted_batch(void ** state) {
+  (void) state;
+
+  uint32_t sid = 4321;
+  uint32_t rid = 1234;
+  char * msgs[BATCH_MSG_AMOUNT] = {
+    "<message xmlns='jabber:client' type='chat' to='bob@example.com'><body>first</body></message>",
+    "<message xmlns='jabber:client' type='chat' to='bob@example.com'><body>1 &lt; 2</body></message>",
+    "<message xmlns='jabber:client' type='chat' to='bob@example.com'><body>x</body></message>",
+    "<message xmlns='jabber:client' type='chat' to='bob@example.com'><body>last</body></message>"
+  };
+
+  omemo_message * msg_out_p[BATCH_MSG_AMOUNT];
+  omemo_message * msg_in_p[BATCH_MSG_AMOUNT];
+  char * xml_out[BATCH_MSG_AMOUNT];
+  char * xml_expected[BATCH_MSG_AMOUNT];
+  uint8_t key_wrong[OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH];
+  omemo_decrypt_batch_entry entries[BATCH_MSG_AMOUNT + 1];
+
+  for (size_t i = 0; i < BATCH_MSG_AMOUNT; i++) {
+    assert_int_equal(omemo_message_prepare_encryption(msgs[i], sid, &crypto, OMEMO_STRIP_NONE, &msg_out_p[i]), 0);
+    assert_int_equal(omemo_message_add_recipient(msg_out_p[i], rid, omemo_message_get_key(msg_out_p[i]), omemo_message_get_key_len(msg_out_p[i])), 0);
+    assert_int_equal(omemo_message_export_encrypted(msg_out_p[i], OMEMO_ADD_MSG_NONE, &xml_out[i]), 0);
+
+    // both kinds of parsed messages can be mixed
+    if (i % 2) {
+      assert_int_equal(omemo_message_prepare_decryption_streaming(xml_out[i], &msg_in_p[i]), 0);
+    } else {
+      assert_int_equal(omemo_message_prepare_decryption(xml_out[i], &msg_in_p[i]), 0);
+    }
+    assert_int_equal(omemo_message_export_decrypted(msg_in_p[i], (uint8_t *) omemo_message_get_key(msg_out_p[i]), omemo_message_get_key_len(msg_out_p[i]), &crypto, &xml_expected[i]), 0);
+  }
+
+  memcpy(key_wrong, omemo_message_get_key(msg_out_p[1]), sizeof(key_wrong));
+  key_wrong[0] ^= 0x01;
+
+  assert_int_equal(omemo_message_export_decrypted_batch((void *) 0, 1, &crypto_batch), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_message_export_decrypted_batch(entries, 1, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_message_export_decrypted_batch(entries, 0, &crypto_batch), 0);
+
+  // the same results with and without a batch function
+  const omemo_crypto_provider * providers[] = {&crypto_batch, &crypto, &crypto_into};
+  for (size_t j = 0; j < sizeof(providers) / sizeof(providers[0]); j++) {
+    for (size_t i = 0; i < BATCH_MSG_AMOUNT; i++) {
+      entries[i] = (omemo_decrypt_batch_entry) {msg_in_p[i], omemo_message_get_key(msg_out_p[i]), omemo_message_get_key_len(msg_out_p[i]), (void *) 0, 1};
+    }
+    assert_int_equal(omemo_message_export_decrypted_batch(entries, BATCH_MSG_AMOUNT, providers[j]), 0);
+    for (size_t i = 0; i < BATCH_MSG_AMOUNT; i++) {
+      assert_int_equal(entries[i].status, 0);
+      assert_string_equal(entries[i].msg_xml, xml_expected[i]);
+      free(entries[i].msg_xml);
+    }
+
+    // failing entries do not affect the others
+    entries[1].key_p = key_wrong;
+    entries[2].key_len = 17;
+    entries[BATCH_MSG_AMOUNT] = (omemo_decrypt_batch_entry) {(void *) 0, key_wrong, sizeof(key_wrong), (void *) 0, 1};
+    assert_int_equal(omemo_message_export_decrypted_batch(entries, BATCH_MSG_AMOUNT + 1, providers[j]), OMEMO_ERR_AUTH_FAIL);
+    assert_int_equal(entries[0].status, 0);
+    assert_string_equal(entries[0].msg_xml, xml_expected[0]);
+    assert_int_equal(entries[1].status, OMEMO_ERR_AUTH_FAIL);
+    assert_ptr_equal(entries[1].msg_xml, (void *) 0);
+    assert_int_equal(entries[2].status, OMEMO_ERR_UNSUPPORTED_KEY_LEN);
+    assert_ptr_equal(entries[2].msg_xml, (void *) 0);
+    assert_int_equal(entries[3].status, 0);
+    assert_string_equal(entries[3].msg_xml, xml_expected[3]);
+    assert_int_equal(entries[BATCH_MSG_AMOUNT].status, OMEMO_ERR_NULL);
+    free(entries[0].msg_xml);
+    free(entries[3].msg_xml);
+  }
+
+  for (size_t i = 0; i < BATCH_MSG_AMOUNT; i++) {
+    omemo_message_destroy(msg_out_p[i]);
+    omemo_message_destroy(msg_in_p[i]);
+    free(xml_out[i]);
+    free(xml_expected[i]);
+  }
+}
+
 void test_message_get_names(void ** state) {
   (void) state;
 
@@ -1397,19 +2489,137 @@ void test_message_get_names(void ** state) {
   omemo_message_destroy(msg_p);
 }
 
+void test_message_prepare_decryption_streaming(void ** state) {
+  (void) state;
+
+  char * msg = "<message to='bob@example.com/res' from='alice@example.com/hurr&amp;durr'>"
+                 "<encrypted xmlns='eu.siacs.conversations.axolotl'>"
+                   "<header sid='1111'>"
+                     "<key rid='2222' prekey='true'>sWsAtQ==</key>"
+                     "<key prekey=\"1\" rid=\"3333\">sWsAtQ==</key>"
+                     "<key rid='4444'/>"
+                     "<iv>BASE64ENCODED</iv>"
+                   "</header>"
+                   "<payload>BASE64ENCODED</payload>"
+                 "</encrypted>"
+                 "<store xmlns='urn:xmpp:hints'/>"
+               "</message>";
+
+  omemo_message * msg_p;
+  assert_int_equal(omemo_message_prepare_decryption_streaming((void *) 0, &msg_p), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_message_prepare_decryption_streaming(msg, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_message_prepare_decryption_streaming(msg, &msg_p), 0);
+
+  assert_ptr_equal(msg_p->message_node_p, (void *) 0);
+  assert_int_equal(omemo_message_get_sender_id(msg_p), 1111);
+  assert_string_equal(omemo_message_get_sender_name_full(msg_p), "alice@example.com/hurr&durr");
+  assert_string_equal(omemo_message_get_recipient_name_full(msg_p), "bob@example.com/res");
+  assert_int_equal(omemo_message_has_payload(msg_p), 1);
+
+  uint8_t * key_p;
+  size_t key_len;
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 1111, &key_p, &key_len), 0);
+  assert_ptr_equal(key_p, (void *) 0);
+
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 2222, &key_p, &key_len), 0);
+  assert_int_equal(key_len, 4);
+  assert_memory_equal(key_p, data, key_len);
+  free(key_p);
+
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, 4444, &key_p, &key_len), OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_KEY_DATA);
+
+  bool is_prekey = false;
+  assert_int_equal(omemo_message_is_encrypted_key_prekey(msg_p, 2222, &is_prekey), 0);
+  assert_int_equal(is_prekey, true);
+  assert_int_equal(omemo_message_is_encrypted_key_prekey(msg_p, 3333, &is_prekey), 0);
+  assert_int_equal(is_prekey, true);
+  assert_int_equal(omemo_message_is_encrypted_key_prekey(msg_p, 4444, &is_prekey), 0);
+  assert_int_equal(is_prekey, false);
+
+  assert_int_equal(omemo_message_add_recipient(msg_p, 5555, data, sizeof(data)), OMEMO_ERR_NULL);
+
+  omemo_message_destroy(msg_p);
+}
+
+void test_message_prepare_decryption_streaming_malformed(void ** state) {
+  (void) state;
+
+  omemo_message * msg_p = (void *) 0;
+
+  assert_int_equal(omemo_message_prepare_decryption_streaming("asdf", &msg_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_message_prepare_decryption_streaming("<message><encrypted>", &msg_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_message_prepare_decryption_streaming("<message><encrypted></message></encrypted>", &msg_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_message_prepare_decryption_streaming("<message to='bob></message>", &msg_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_message_prepare_decryption_streaming("<message/><message/>", &msg_p), OMEMO_ERR_MALFORMED_XML);
+  assert_int_equal(omemo_message_prepare_decryption_streaming("<message><body>hi</body></message>", &msg_p), OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_ENCRYPTED_ELEM);
+  assert_int_equal(omemo_message_prepare_decryption_streaming("<message><encrypted><payload>x</payload></encrypted></message>", &msg_p), OMEMO_ERR_MALFORMED_INCOMING_MESSAGE_NO_HEADER_ELEM);
+  assert_ptr_equal(msg_p, (void *) 0);
+}
+
+void test_message_encrypt_decrypt_streaming(void ** state) {
+  (void) state;
+
+  uint32_t sid = 4321;
+  uint32_t rid = 1234;
+
+  omemo_message * msg_out_p;
+  assert_int_equal(omemo_message_prepare_encryption(msg_out_extra, sid, &crypto, OMEMO_STRIP_NONE, &msg_out_p), 0);
+
+  const uint8_t * key_p = omemo_message_get_key(msg_out_p);
+
+  assert_int_equal(omemo_message_add_recipient(msg_out_p, rid, key_p, omemo_message_get_key_len(msg_out_p)), 0);
+
+  char * xml_out;
+  assert_int_equal(omemo_message_export_encrypted(msg_out_p, OMEMO_ADD_MSG_BOTH, &xml_out), 0);
+
+  omemo_message * msg_in_p;
+  assert_int_equal(omemo_message_prepare_decryption_streaming(xml_out, &msg_in_p), 0);
+  assert_int_equal(omemo_message_get_sender_id(msg_in_p), sid);
+
+  uint8_t * key_retrieved_p;
+  size_t key_retrieved_len;
+  assert_int_equal(omemo_message_get_encrypted_key(msg_in_p, rid, &key_retrieved_p, &key_retrieved_len), 0);
+  assert_int_equal(key_retrieved_len, OMEMO_AES_128_KEY_LENGTH + OMEMO_AES_GCM_TAG_LENGTH);
+  assert_memory_equal(key_p, key_retrieved_p, key_retrieved_len);
+
+  char * xml_in;
+  assert_int_equal(omemo_message_export_decrypted(msg_in_p, key_retrieved_p, key_retrieved_len, &crypto, &xml_in), 0);
+  mxml_node_t * message_node_decrypted_p = mxmlLoadString((void *) 0, xml_in, MXML_OPAQUE_CALLBACK);
+  assert_ptr_not_equal(message_node_decrypted_p, (void *) 0);
+
+  mxml_node_t * active_node_p;
+  assert_int_equal(expect_next_node(message_node_decrypted_p, mxmlGetFirstChild, "active", &active_node_p), 0);
+  assert_ptr_equal(mxmlFindPath(message_node_decrypted_p, "encrypted"), (void *) 0);
+  assert_ptr_equal(mxmlFindPath(message_node_decrypted_p, "encryption"), (void *) 0);
+  assert_ptr_equal(mxmlFindPath(message_node_decrypted_p, "store"), (void *) 0);
+  mxml_node_t * body_text_node_p = mxmlFindPath(message_node_decrypted_p, "body");
+  assert_string_equal(mxmlGetOpaque(body_text_node_p), "hello");
+
+  mxmlDelete(message_node_decrypted_p);
+  omemo_message_destroy(msg_out_p);
+  omemo_message_destroy(msg_in_p);
+  free(xml_out);
+  free(xml_in);
+  free(key_retrieved_p);
+}
+
 int main(void) {
   const struct CMUnitTest tests[] = {
       cmocka_unit_test(test_devicelist_create),
       cmocka_unit_test(test_devicelist_import),
       cmocka_unit_test(test_devicelist_import_empty),
       cmocka_unit_test(test_devicelist_import_empty_alt),
+      cmocka_unit_test(test_devicelist_import_if_changed),
       cmocka_unit_test(test_devicelist_add),
       cmocka_unit_test(test_devicelist_contains_id),
       cmocka_unit_test(test_devicelist_remove),
       cmocka_unit_test(test_devicelist_export),
+      cmocka_unit_test(test_devicelist_export_to),
       cmocka_unit_test(test_devicelist_get_pep_node_name),
       cmocka_unit_test(test_devicelist_get_id_list),
+      cmocka_unit_test(test_devicelist_get_ids),
       cmocka_unit_test(test_devicelist_diff),
+      cmocka_unit_test(test_devicelist_diff_ids),
 
       cmocka_unit_test(test_bundle_create),
       cmocka_unit_test(test_bundle_set_device_id),
@@ -1418,6 +2628,11 @@ int main(void) {
       cmocka_unit_test(test_bundle_set_identity_key),
       cmocka_unit_test(test_bundle_add_pre_key),
       cmocka_unit_test(test_bundle_export),
+      cmocka_unit_test(test_bundle_export_to),
+      cmocka_unit_test(test_bundle_export_cached),
+      cmocka_unit_test(test_bundle_remove_pre_key),
+      cmocka_unit_test(test_bundle_next_pre_key_ids),
+      cmocka_unit_test(test_bundle_pre_key_ids_restore),
       cmocka_unit_test(test_bundle_get_pep_node_name),
       cmocka_unit_test(test_bundle_import_malformed),
       cmocka_unit_test(test_bundle_import),
@@ -1426,6 +2641,8 @@ int main(void) {
       cmocka_unit_test(test_bundle_get_signature),
       cmocka_unit_test(test_bundle_get_identity_key),
       cmocka_unit_test(test_bundle_get_random_pre_key),
+      cmocka_unit_test(test_bundle_get_pre_key),
+      cmocka_unit_test(test_bundle_import_malformed_pre_key),
 
       cmocka_unit_test(test_message_prepare_encryption),
       cmocka_unit_test(test_message_prepare_encryption_with_extra_data),
@@ -1433,9 +2650,11 @@ int main(void) {
       cmocka_unit_test(test_message_get_encrypted_key),
       cmocka_unit_test(test_message_get_encrypted_key_after_iv),
       cmocka_unit_test(test_message_get_encrypted_key_no_keys),
+      cmocka_unit_test(test_message_get_encrypted_key_many),
       cmocka_unit_test(test_message_is_encrypted_key_prekey),
       cmocka_unit_test(test_message_add_recipient),
       cmocka_unit_test(test_message_add_recipient_w_prekey),
+      cmocka_unit_test(test_message_add_recipients),
       cmocka_unit_test(test_message_export_encrypted),
       cmocka_unit_test(test_message_export_encrypted_strip_xhtml),
       cmocka_unit_test(test_message_export_encrypted_strip_multiple_body),
@@ -1446,7 +2665,15 @@ int main(void) {
       cmocka_unit_test(test_message_encrypt_decrypt_with_extra_nodes),
       cmocka_unit_test(test_message_encrypt_decrypt_with_added_body),
       cmocka_unit_test(test_message_encrypt_decrypt_with_added_eme),
-      cmocka_unit_test(test_message_get_names)
+      cmocka_unit_test(test_message_export_encrypted_to),
+      cmocka_unit_test(test_message_encrypt_decrypt_into),
+      cmocka_unit_test(test_message_encrypt_decrypt_raw),
+      cmocka_unit_test(test_message_decrypt_body),
+      cmocka_unit_test(test_message_export_decrypted_batch),
+      cmocka_unit_test(test_message_get_names),
+      cmocka_unit_test(test_message_prepare_decryption_streaming),
+      cmocka_unit_test(test_message_prepare_decryption_streaming_malformed),
+      cmocka_unit_test(test_message_encrypt_decrypt_streaming)
   };
 
   return cmocka_run_group_tests(tests, NULL, NULL);
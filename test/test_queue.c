@@ -0,0 +1,479 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <poll.h>
+#include <stdio.h>
+
+#include "../src/libomemo.c"
+#include "../src/libomemo_crypto.c"
+
+// how many more jobs can be pushed to a thread pool, negative for no limit; only changed while no queue is busy
+static int pushes_left = -1;
+
+static gboolean thread_pool_push_limited(GThreadPool * pool_p, gpointer data, GError ** error_pp) {
+  if (!pushes_left) {
+    return FALSE;
+  }
+  if (pushes_left > 0) {
+    pushes_left--;
+  }
+
+  return g_thread_pool_push(pool_p, data, error_pp);
+}
+
+#define g_thread_pool_push thread_pool_push_limited
+#include "../src/libomemo_queue.c"
+#undef g_thread_pool_push
+
+#define OWN_DEVICE_ID 1234
+#define MSG_AMOUNT 64
+
+omemo_crypto_provider crypto = {
+    .random_bytes_func = omemo_default_crypto_random_bytes,
+    .aes_gcm_encrypt_func = omemo_default_crypto_aes_gcm_encrypt,
+    .aes_gcm_decrypt_func = omemo_default_crypto_aes_gcm_decrypt,
+    (void *) 0
+};
+
+// the key for the own device is the plain one, as there is no session to encrypt it with
+static int key_func_plain(omemo_message * msg_p, uint8_t ** key_pp, size_t * key_len_p, void * user_data_p) {
+  (void) user_data_p;
+
+  return omemo_message_get_encrypted_key(msg_p, OWN_DEVICE_ID, key_pp, key_len_p);
+}
+
+static int key_func_fail(omemo_message * msg_p, uint8_t ** key_pp, size_t * key_len_p, void * user_data_p) {
+  (void) msg_p;
+  (void) key_pp;
+  (void) key_len_p;
+  (void) user_data_p;
+
+  return OMEMO_ERR_CRYPTO;
+}
+
+// holds the key until the gate is opened, so that further messages of a lane queue up behind the first one
+typedef struct key_gate {
+  GMutex mutex;
+  GCond cond;
+  bool open;
+} key_gate;
+
+static int key_func_gated(omemo_message * msg_p, uint8_t ** key_pp, size_t * key_len_p, void * user_data_p) {
+  key_gate * gate_p = user_data_p;
+
+  g_mutex_lock(&gate_p->mutex);
+  while (!gate_p->open) {
+    g_cond_wait(&gate_p->cond, &gate_p->mutex);
+  }
+  g_mutex_unlock(&gate_p->mutex);
+
+  return key_func_plain(msg_p, key_pp, key_len_p, (void *) 0);
+}
+
+// encrypts a message with the body "message <i>" for the own device
+static char * encrypt_test_message(int i) {
+  char stanza[128];
+  snprintf(stanza, sizeof(stanza), "<message xmlns='jabber:client' type='chat' to='bob@example.com'><body>message %d</body></message>", i);
+
+  omemo_message * msg_p = (void *) 0;
+  assert_int_equal(omemo_message_prepare_encryption(stanza, 4321, &crypto, OMEMO_STRIP_NONE, &msg_p), 0);
+  assert_int_equal(omemo_message_add_recipient(msg_p, OWN_DEVICE_ID, omemo_message_get_key(msg_p), omemo_message_get_key_len(msg_p)), 0);
+
+  char * xml = (void *) 0;
+  assert_int_equal(omemo_message_export_encrypted(msg_p, OMEMO_ADD_MSG_NONE, &xml), 0);
+  omemo_message_destroy(msg_p);
+
+  return xml;
+}
+
+static void assert_decrypted_body(const char * msg_xml, int i) {
+  char body[64];
+  snprintf(body, sizeof(body), "<body>message %d</body>", i);
+
+  assert_ptr_not_equal(msg_xml, (void *) 0);
+  assert_ptr_not_equal(strstr(msg_xml, body), (void *) 0);
+}
+
+static bool fd_is_readable(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+// collects the results in the order of delivery, to be checked on the test thread
+typedef struct done_log {
+  GMutex mutex;
+  omemo_decrypt_result * results[MSG_AMOUNT];
+  size_t len;
+} done_log;
+
+static void done_func_log(omemo_decrypt_result * result_p, void * user_data_p) {
+  done_log * log_p = user_data_p;
+
+  g_mutex_lock(&log_p->mutex);
+  log_p->results[log_p->len++] = result_p;
+  g_mutex_unlock(&log_p->mutex);
+}
+
+void test_decrypt_queue_create(void ** state) {
+  (void) state;
+
+  omemo_decrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_decrypt_queue_create(2, (void *) 0, key_func_plain, (void *) 0, (void *) 0, &queue_p), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_decrypt_queue_create(2, &crypto, (void *) 0, (void *) 0, (void *) 0, &queue_p), OMEMO_ERR_NULL);
+
+  done_log log = {0};
+  assert_int_equal(omemo_decrypt_queue_create(0, &crypto, key_func_plain, done_func_log, &log, &queue_p), 0);
+  // results are passed to the callback, so there is nothing to poll
+  assert_int_equal(omemo_decrypt_queue_get_fd(queue_p), OMEMO_ERR);
+  assert_int_equal(omemo_decrypt_queue_submit(queue_p, (void *) 0, (void *) 0, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_decrypt_queue_wait(queue_p), 0);
+  omemo_decrypt_queue_destroy(queue_p);
+  omemo_decrypt_queue_destroy((void *) 0);
+}
+
+void test_decrypt_queue_poll(void ** state) {
+  (void) state;
+
+  char * stanzas[MSG_AMOUNT];
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    stanzas[i] = encrypt_test_message(i);
+  }
+
+  omemo_decrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_decrypt_queue_create(4, &crypto, key_func_plain, (void *) 0, (void *) 0, &queue_p), 0);
+  int fd = omemo_decrypt_queue_get_fd(queue_p);
+  assert_true(fd >= 0);
+  assert_false(fd_is_readable(fd));
+
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    assert_int_equal(omemo_decrypt_queue_submit(queue_p, stanzas[i], (void *) 0, (void *) (intptr_t) i), 0);
+  }
+  assert_int_equal(omemo_decrypt_queue_submit(queue_p, "<message>", (void *) 0, (void *) (intptr_t) MSG_AMOUNT), 0);
+  assert_int_equal(omemo_decrypt_queue_wait(queue_p), 0);
+  assert_true(fd_is_readable(fd));
+
+  bool seen[MSG_AMOUNT + 1] = {false};
+  omemo_decrypt_result * result_p = (void *) 0;
+  for (int i = 0; i <= MSG_AMOUNT; i++) {
+    assert_int_equal(omemo_decrypt_queue_poll(queue_p, &result_p), 1);
+
+    int tag = (int) (intptr_t) result_p->tag_p;
+    assert_false(seen[tag]);
+    seen[tag] = true;
+    if (tag == MSG_AMOUNT) {
+      assert_int_equal(result_p->status, OMEMO_ERR_MALFORMED_XML);
+      assert_ptr_equal(result_p->msg_xml, (void *) 0);
+    } else {
+      assert_int_equal(result_p->status, 0);
+      assert_decrypted_body(result_p->msg_xml, tag);
+    }
+    omemo_decrypt_result_destroy(result_p);
+  }
+
+  assert_int_equal(omemo_decrypt_queue_poll(queue_p, &result_p), 0);
+  assert_false(fd_is_readable(fd));
+
+  // results which are not picked up are freed with the queue
+  assert_int_equal(omemo_decrypt_queue_submit(queue_p, stanzas[0], (void *) 0, (void *) 0), 0);
+  omemo_decrypt_queue_destroy(queue_p);
+
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    free(stanzas[i]);
+  }
+}
+
+void test_decrypt_queue_key_func_fail(void ** state) {
+  (void) state;
+
+  char * stanza = encrypt_test_message(0);
+
+  omemo_decrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_decrypt_queue_create(1, &crypto, key_func_fail, (void *) 0, (void *) 0, &queue_p), 0);
+  assert_int_equal(omemo_decrypt_queue_submit(queue_p, stanza, "alice@example.com", (void *) 0), 0);
+  assert_int_equal(omemo_decrypt_queue_wait(queue_p), 0);
+
+  omemo_decrypt_result * result_p = (void *) 0;
+  assert_int_equal(omemo_decrypt_queue_poll(queue_p, &result_p), 1);
+  assert_int_equal(result_p->status, OMEMO_ERR_CRYPTO);
+  omemo_decrypt_result_destroy(result_p);
+
+  omemo_decrypt_queue_destroy(queue_p);
+  free(stanza);
+}
+
+void test_decrypt_queue_order(void ** state) {
+  (void) state;
+
+  const char * senders[] = {"alice@example.com", "bob@example.com", "carol@example.com"};
+  char * stanzas[MSG_AMOUNT];
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    stanzas[i] = encrypt_test_message(i);
+  }
+
+  done_log log = {0};
+  g_mutex_init(&log.mutex);
+
+  omemo_decrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_decrypt_queue_create(4, &crypto, key_func_plain, done_func_log, &log, &queue_p), 0);
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    assert_int_equal(omemo_decrypt_queue_submit(queue_p, stanzas[i], senders[i % 3], (void *) (intptr_t) i), 0);
+  }
+  assert_int_equal(omemo_decrypt_queue_wait(queue_p), 0);
+
+  // within each sender, the results arrive in the order of submission
+  assert_int_equal(log.len, MSG_AMOUNT);
+  int last[3] = {-1, -1, -1};
+  for (size_t i = 0; i < log.len; i++) {
+    int tag = (int) (intptr_t) log.results[i]->tag_p;
+    assert_int_equal(log.results[i]->status, 0);
+    assert_decrypted_body(log.results[i]->msg_xml, tag);
+    assert_true(tag > last[tag % 3]);
+    last[tag % 3] = tag;
+    omemo_decrypt_result_destroy(log.results[i]);
+  }
+
+  omemo_decrypt_queue_destroy(queue_p);
+  g_mutex_clear(&log.mutex);
+
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    free(stanzas[i]);
+  }
+}
+
+void test_decrypt_queue_push_fail(void ** state) {
+  (void) state;
+
+  char * stanzas[4];
+  for (int i = 0; i < 4; i++) {
+    stanzas[i] = encrypt_test_message(i);
+  }
+
+  key_gate gate = {0};
+  g_mutex_init(&gate.mutex);
+  g_cond_init(&gate.cond);
+
+  omemo_decrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_decrypt_queue_create(1, &crypto, key_func_gated, (void *) 0, &gate, &queue_p), 0);
+
+  // only the first message can be started, the others of the lane cannot be pushed after it
+  pushes_left = 1;
+  for (int i = 0; i < 3; i++) {
+    assert_int_equal(omemo_decrypt_queue_submit(queue_p, stanzas[i], "alice@example.com", (void *) (intptr_t) i), 0);
+  }
+  g_mutex_lock(&gate.mutex);
+  gate.open = true;
+  g_cond_broadcast(&gate.cond);
+  g_mutex_unlock(&gate.mutex);
+  assert_int_equal(omemo_decrypt_queue_wait(queue_p), 0);
+
+  // they still get a result each, in order
+  omemo_decrypt_result * result_p = (void *) 0;
+  for (int i = 0; i < 3; i++) {
+    assert_int_equal(omemo_decrypt_queue_poll(queue_p, &result_p), 1);
+    assert_int_equal((int) (intptr_t) result_p->tag_p, i);
+    if (i == 0) {
+      assert_int_equal(result_p->status, 0);
+      assert_decrypted_body(result_p->msg_xml, 0);
+    } else {
+      assert_int_equal(result_p->status, OMEMO_ERR);
+      assert_ptr_equal(result_p->msg_xml, (void *) 0);
+    }
+    omemo_decrypt_result_destroy(result_p);
+  }
+  assert_int_equal(omemo_decrypt_queue_poll(queue_p, &result_p), 0);
+
+  // the lane is usable again
+  pushes_left = -1;
+  assert_int_equal(omemo_decrypt_queue_submit(queue_p, stanzas[3], "alice@example.com", (void *) (intptr_t) 3), 0);
+  assert_int_equal(omemo_decrypt_queue_wait(queue_p), 0);
+  assert_int_equal(omemo_decrypt_queue_poll(queue_p, &result_p), 1);
+  assert_int_equal(result_p->status, 0);
+  assert_decrypted_body(result_p->msg_xml, 3);
+  omemo_decrypt_result_destroy(result_p);
+
+  omemo_decrypt_queue_destroy(queue_p);
+  g_cond_clear(&gate.cond);
+  g_mutex_clear(&gate.mutex);
+
+  for (int i = 0; i < 4; i++) {
+    free(stanzas[i]);
+  }
+}
+
+// adds the own device with the plain key, and another one, unless the tag is the one passed as user data
+static int recipients_func_test(omemo_message * msg_p, void * tag_p, void * user_data_p) {
+  intptr_t fail_tag = (intptr_t) user_data_p;
+  if ((intptr_t) tag_p == fail_tag) {
+    return OMEMO_ERR_CRYPTO;
+  }
+
+  omemo_raw_recipient recipients[] = {
+      {OWN_DEVICE_ID, false, (uint8_t *) omemo_message_get_key(msg_p), omemo_message_get_key_len(msg_p)},
+      {5678, true, (uint8_t *) omemo_message_get_key(msg_p), omemo_message_get_key_len(msg_p)}
+  };
+
+  return omemo_message_add_recipients(msg_p, recipients, 2);
+}
+
+static void assert_encrypted_body(const char * msg_xml, int i) {
+  omemo_message * msg_p = (void *) 0;
+  uint8_t * key_p = (void *) 0;
+  size_t key_len = 0;
+  char * body = (void *) 0;
+  size_t body_len = 0;
+  char expected[32];
+  snprintf(expected, sizeof(expected), "message %d", i);
+
+  assert_ptr_not_equal(msg_xml, (void *) 0);
+  assert_int_equal(omemo_message_prepare_decryption_streaming(msg_xml, &msg_p), 0);
+  assert_int_equal(omemo_message_get_sender_id(msg_p), 4321);
+  assert_int_equal(omemo_message_get_encrypted_key(msg_p, OWN_DEVICE_ID, &key_p, &key_len), 0);
+  assert_int_equal(omemo_message_decrypt_body(msg_p, key_p, key_len, &crypto, &body, &body_len), 0);
+  assert_string_equal(body, expected);
+
+  free(body);
+  free(key_p);
+  omemo_message_destroy(msg_p);
+}
+
+typedef struct encrypt_done_log {
+  GMutex mutex;
+  omemo_encrypt_result * results[MSG_AMOUNT + 1];
+  size_t len;
+  bool concurrent; // set if a result was passed while another one was still being handled
+  bool busy;
+} encrypt_done_log;
+
+static void encrypt_done_func_log(omemo_encrypt_result * result_p, void * user_data_p) {
+  encrypt_done_log * log_p = user_data_p;
+
+  g_mutex_lock(&log_p->mutex);
+  if (log_p->busy) {
+    log_p->concurrent = true;
+  }
+  log_p->busy = true;
+  log_p->results[log_p->len++] = result_p;
+  g_mutex_unlock(&log_p->mutex);
+
+  // give the other workers time to finish their messages meanwhile
+  usleep(100);
+
+  g_mutex_lock(&log_p->mutex);
+  log_p->busy = false;
+  g_mutex_unlock(&log_p->mutex);
+}
+
+static char * test_stanza(int i) {
+  char * stanza = malloc(128);
+  snprintf(stanza, 128, "<message xmlns='jabber:client' type='chat' to='room%d@muc.example.com'><body>message %d</body></message>", i, i);
+
+  return stanza;
+}
+
+void test_encrypt_queue_create(void ** state) {
+  (void) state;
+
+  omemo_encrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_encrypt_queue_create(2, 4321, (void *) 0, OMEMO_STRIP_ALL, OMEMO_ADD_MSG_NONE, recipients_func_test, (void *) 0, (void *) 0, &queue_p), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_encrypt_queue_create(2, 4321, &crypto, OMEMO_STRIP_ALL, OMEMO_ADD_MSG_NONE, (void *) 0, (void *) 0, (void *) 0, &queue_p), OMEMO_ERR_NULL);
+
+  encrypt_done_log log = {0};
+  assert_int_equal(omemo_encrypt_queue_create(0, 4321, &crypto, OMEMO_STRIP_ALL, OMEMO_ADD_MSG_NONE, recipients_func_test, encrypt_done_func_log, &log, &queue_p), 0);
+  assert_int_equal(omemo_encrypt_queue_get_fd(queue_p), OMEMO_ERR);
+  assert_int_equal(omemo_encrypt_queue_submit(queue_p, (void *) 0, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_encrypt_queue_wait(queue_p), 0);
+  omemo_encrypt_queue_destroy(queue_p);
+  omemo_encrypt_queue_destroy((void *) 0);
+}
+
+void test_encrypt_queue_order(void ** state) {
+  (void) state;
+
+  encrypt_done_log log = {0};
+  g_mutex_init(&log.mutex);
+
+  omemo_encrypt_queue * queue_p = (void *) 0;
+  // the address of the log is never a tag, so nothing fails in recipients_func_test()
+  assert_int_equal(omemo_encrypt_queue_create(4, 4321, &crypto, OMEMO_STRIP_ALL, OMEMO_ADD_MSG_BOTH, recipients_func_test, encrypt_done_func_log, &log, &queue_p), 0);
+
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    char * stanza = test_stanza(i);
+    assert_int_equal(omemo_encrypt_queue_submit(queue_p, stanza, (void *) (intptr_t) i), 0);
+    free(stanza);
+  }
+  // not a message which can be encrypted
+  assert_int_equal(omemo_encrypt_queue_submit(queue_p, "<message/>", (void *) (intptr_t) MSG_AMOUNT), 0);
+  assert_int_equal(omemo_encrypt_queue_wait(queue_p), 0);
+  omemo_encrypt_queue_destroy(queue_p);
+
+  assert_int_equal(log.len, MSG_AMOUNT + 1);
+  assert_false(log.concurrent);
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    assert_int_equal((intptr_t) log.results[i]->tag_p, i);
+    assert_int_equal(log.results[i]->status, 0);
+    assert_encrypted_body(log.results[i]->msg_xml, i);
+    omemo_encrypt_result_destroy(log.results[i]);
+  }
+  assert_int_equal(log.results[MSG_AMOUNT]->status, OMEMO_ERR_MALFORMED_OUTGOING_MESSAGE_NO_BODY_ELEM);
+  omemo_encrypt_result_destroy(log.results[MSG_AMOUNT]);
+  g_mutex_clear(&log.mutex);
+}
+
+void test_encrypt_queue_poll(void ** state) {
+  (void) state;
+
+  omemo_encrypt_queue * queue_p = (void *) 0;
+  assert_int_equal(omemo_encrypt_queue_create(4, 4321, &crypto, OMEMO_STRIP_ALL, OMEMO_ADD_MSG_NONE, recipients_func_test, (void *) 0, (void *) 5, &queue_p), 0);
+  int fd = omemo_encrypt_queue_get_fd(queue_p);
+  assert_true(fd >= 0);
+  assert_false(fd_is_readable(fd));
+
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    char * stanza = test_stanza(i);
+    assert_int_equal(omemo_encrypt_queue_submit(queue_p, stanza, (void *) (intptr_t) i), 0);
+    free(stanza);
+  }
+  assert_int_equal(omemo_encrypt_queue_wait(queue_p), 0);
+  assert_true(fd_is_readable(fd));
+
+  // a failed message keeps its place
+  omemo_encrypt_result * result_p = (void *) 0;
+  for (int i = 0; i < MSG_AMOUNT; i++) {
+    assert_int_equal(omemo_encrypt_queue_poll(queue_p, &result_p), 1);
+    assert_int_equal((intptr_t) result_p->tag_p, i);
+    if (i == 5) {
+      assert_int_equal(result_p->status, OMEMO_ERR_CRYPTO);
+      assert_ptr_equal(result_p->msg_xml, (void *) 0);
+    } else {
+      assert_int_equal(result_p->status, 0);
+      assert_encrypted_body(result_p->msg_xml, i);
+    }
+    omemo_encrypt_result_destroy(result_p);
+  }
+
+  assert_int_equal(omemo_encrypt_queue_poll(queue_p, &result_p), 0);
+  assert_false(fd_is_readable(fd));
+
+  char * stanza = test_stanza(0);
+  assert_int_equal(omemo_encrypt_queue_submit(queue_p, stanza, (void *) 0), 0);
+  free(stanza);
+  omemo_encrypt_queue_destroy(queue_p);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_decrypt_queue_create),
+      cmocka_unit_test(test_decrypt_queue_poll),
+      cmocka_unit_test(test_decrypt_queue_key_func_fail),
+      cmocka_unit_test(test_decrypt_queue_order),
+      cmocka_unit_test(test_decrypt_queue_push_fail),
+      cmocka_unit_test(test_encrypt_queue_create),
+      cmocka_unit_test(test_encrypt_queue_order),
+      cmocka_unit_test(test_encrypt_queue_poll)
+  };
+
+  return cmocka_run_group_tests(tests, (void *) 0, (void *) 0);
+}
@@ -141,6 +141,144 @@ void test_global_device_id_exists(void ** state) {
   assert_int_equal(omemo_storage_global_device_id_exists(55555, TEST_DB_PATH), 1);
 }
 
+void test_ctx_devicelist(void ** state) {
+  (void) state;
+
+  omemo_storage_ctx * ctx_p = (void *) 0;
+  omemo_devicelist * dl_p = (void *) 0;
+
+  assert_int_equal(omemo_storage_ctx_open(TEST_DB_PATH, &ctx_p), 0);
+  assert_ptr_not_equal(ctx_p, (void *) 0);
+
+  assert_int_equal(omemo_storage_ctx_user_device_id_save(ctx_p, "alice", 1337), 0);
+  assert_int_not_equal(omemo_storage_ctx_user_device_id_save(ctx_p, "alice", 1337), 0);
+  assert_int_equal(omemo_storage_ctx_user_device_id_save(ctx_p, "alice", 1338), 0);
+  assert_int_equal(omemo_storage_ctx_user_device_id_save(ctx_p, "bob", 4223), 0);
+
+  assert_int_equal(omemo_storage_ctx_user_devicelist_retrieve(ctx_p, "alice", &dl_p), 0);
+  assert_int_equal(omemo_devicelist_list_data(omemo_devicelist_get_id_list(dl_p)), 1337);
+  assert_int_equal(omemo_devicelist_list_data(omemo_devicelist_get_id_list(dl_p)->next), 1338);
+  assert_ptr_equal(omemo_devicelist_get_id_list(dl_p)->next->next, (void *) 0);
+  omemo_devicelist_destroy(dl_p);
+
+  assert_int_equal(omemo_storage_ctx_global_device_id_exists(ctx_p, 4223), 1);
+  assert_int_equal(omemo_storage_ctx_user_device_id_delete(ctx_p, "bob", 4223), 0);
+  assert_int_equal(omemo_storage_ctx_global_device_id_exists(ctx_p, 4223), 0);
+
+  omemo_storage_ctx_close(ctx_p);
+
+  // changes made through the context are visible to the old API
+  assert_int_equal(omemo_storage_global_device_id_exists(1338, TEST_DB_PATH), 1);
+}
+
+void test_ctx_chatlist(void ** state) {
+  (void) state;
+
+  omemo_storage_ctx * ctx_p = (void *) 0;
+
+  assert_int_equal(omemo_storage_ctx_open(TEST_DB_PATH, &ctx_p), 0);
+
+  for (int i = 0; i < 3; i++) {
+    assert_int_equal(omemo_storage_ctx_chatlist_exists(ctx_p, "test"), 0);
+    assert_int_equal(omemo_storage_ctx_chatlist_save(ctx_p, "test"), 0);
+    assert_int_equal(omemo_storage_ctx_chatlist_exists(ctx_p, "test"), 1);
+    assert_int_equal(omemo_storage_ctx_chatlist_exists(ctx_p, "other"), 0);
+    assert_int_equal(omemo_storage_ctx_chatlist_delete(ctx_p, "test"), 0);
+  }
+
+  assert_int_equal(omemo_storage_ctx_chatlist_exists((void *) 0, "test"), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_storage_ctx_chatlist_exists(ctx_p, (void *) 0), OMEMO_ERR_NULL);
+
+  omemo_storage_ctx_close(ctx_p);
+  omemo_storage_ctx_close((void *) 0);
+}
+
+void test_ctx_provider(void ** state) {
+  (void) state;
+
+  omemo_storage_ctx * ctx_p = (void *) 0;
+  omemo_storage_provider sp;
+  omemo_devicelist * dl_p = (void *) 0;
+
+  assert_int_equal(omemo_storage_ctx_open(TEST_DB_PATH, &ctx_p), 0);
+  assert_int_equal(omemo_storage_ctx_provider_init((void *) 0, &sp), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_storage_ctx_provider_init(ctx_p, &sp), 0);
+  assert_ptr_equal(sp.user_data_p, ctx_p);
+
+  assert_int_equal(sp.user_device_id_save_func("alice", 1337, sp.user_data_p), 0);
+  assert_int_equal(sp.global_device_id_exists_func(1337, sp.user_data_p), 1);
+  assert_int_equal(sp.user_devicelist_retrieve_func("alice", sp.user_data_p, &dl_p), 0);
+  assert_int_equal(omemo_devicelist_list_data(omemo_devicelist_get_id_list(dl_p)), 1337);
+  omemo_devicelist_destroy(dl_p);
+  assert_int_equal(sp.user_device_id_delete_func("alice", 1337, sp.user_data_p), 0);
+  assert_int_equal(sp.global_device_id_exists_func(1337, sp.user_data_p), 0);
+
+  assert_int_equal(sp.chatlist_save_func("test", sp.user_data_p), 0);
+  assert_int_equal(sp.chatlist_exists_func("test", sp.user_data_p), 1);
+  assert_int_equal(sp.chatlist_delete_func("test", sp.user_data_p), 0);
+  assert_int_equal(sp.chatlist_exists_func("test", sp.user_data_p), 0);
+
+  omemo_storage_ctx_close(ctx_p);
+}
+
+void test_ctx_bundle(void ** state) {
+  (void) state;
+
+  omemo_storage_ctx * ctx_p = (void *) 0;
+  omemo_bundle * bundle_p = (void *) 0;
+  omemo_bundle * retrieved_p = (void *) 0;
+  char * item_id = (void *) 0;
+  char * hash = (void *) 0;
+  uint8_t data[] = {0xB1, 0x6B, 0x00, 0xB5, 0x05};
+
+  assert_int_equal(omemo_storage_ctx_open(TEST_DB_PATH, &ctx_p), 0);
+
+  assert_int_equal(omemo_storage_ctx_bundle_retrieve(ctx_p, "alice", 1337, &item_id, &hash, &retrieved_p), 0);
+  assert_ptr_equal(retrieved_p, (void *) 0);
+  assert_ptr_equal(item_id, (void *) 0);
+
+  assert_int_equal(omemo_bundle_create(&bundle_p), 0);
+  assert_int_equal(omemo_bundle_set_device_id(bundle_p, 1337), 0);
+  assert_int_equal(omemo_bundle_set_signed_pre_key(bundle_p, 4294967295u, data, 5), 0);
+  assert_int_equal(omemo_bundle_set_signature(bundle_p, data, 4), 0);
+  assert_int_equal(omemo_bundle_set_identity_key(bundle_p, data, 3), 0);
+  for (uint32_t i = 1; i <= 30; i++) {
+    assert_int_equal(omemo_bundle_add_pre_key(bundle_p, i * 1000, data, i % 6), 0);
+  }
+
+  assert_int_equal(omemo_storage_ctx_bundle_save(ctx_p, "alice", 1337, "item", "hash", bundle_p), 0);
+  assert_int_equal(omemo_storage_ctx_bundle_retrieve(ctx_p, "alice", 1337, &item_id, &hash, &retrieved_p), 0);
+  assert_string_equal(item_id, "item");
+  assert_string_equal(hash, "hash");
+  free(item_id);
+  free(hash);
+
+  // the same XML means the same content
+  char * expected = (void *) 0;
+  char * actual = (void *) 0;
+  assert_int_equal(omemo_bundle_export(bundle_p, &expected), 0);
+  assert_int_equal(omemo_bundle_export(retrieved_p, &actual), 0);
+  assert_string_equal(actual, expected);
+  free(expected);
+  free(actual);
+  omemo_bundle_destroy(retrieved_p);
+
+  // replaced, and both IDs optional
+  assert_int_equal(omemo_bundle_remove_pre_key(bundle_p, 1000), 0);
+  assert_int_equal(omemo_storage_ctx_bundle_save(ctx_p, "alice", 1337, (void *) 0, (void *) 0, bundle_p), 0);
+  assert_int_equal(omemo_storage_ctx_bundle_retrieve(ctx_p, "alice", 1337, &item_id, (void *) 0, &retrieved_p), 0);
+  assert_ptr_equal(item_id, (void *) 0);
+  assert_int_equal(omemo_bundle_get_pre_key_amount(retrieved_p), 29);
+  omemo_bundle_destroy(retrieved_p);
+
+  assert_int_equal(omemo_storage_ctx_bundle_delete(ctx_p, "alice", 1337), 0);
+  assert_int_equal(omemo_storage_ctx_bundle_retrieve(ctx_p, "alice", 1337, (void *) 0, (void *) 0, &retrieved_p), 0);
+  assert_ptr_equal(retrieved_p, (void *) 0);
+
+  omemo_bundle_destroy(bundle_p);
+  omemo_storage_ctx_close(ctx_p);
+}
+
 int main(void) {
   const struct CMUnitTest tests[] = {
       //cmocka_unit_test(test_test),
@@ -150,7 +288,11 @@ int main(void) {
       cmocka_unit_test_teardown(test_chatlist_save, db_cleanup),
       cmocka_unit_test_teardown(test_chatlist_exists, db_cleanup),
       cmocka_unit_test_teardown(test_chatlist_delete, db_cleanup),
-      cmocka_unit_test_teardown(test_global_device_id_exists, db_cleanup)
+      cmocka_unit_test_teardown(test_global_device_id_exists, db_cleanup),
+      cmocka_unit_test_teardown(test_ctx_devicelist, db_cleanup),
+      cmocka_unit_test_teardown(test_ctx_chatlist, db_cleanup),
+      cmocka_unit_test_teardown(test_ctx_provider, db_cleanup),
+      cmocka_unit_test_teardown(test_ctx_bundle, db_cleanup)
   };
 
   return cmocka_run_group_tests(tests, (void *) 0, (void *) 0);
@@ -0,0 +1,124 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdio.h>
+
+#include "../src/libomemo.h"
+#include "../src/libomemo.c"
+#include "../src/libomemo_storage_mem.c"
+
+int storage_setup(void ** state) {
+  omemo_storage_mem * mem_p = (void *) 0;
+  omemo_storage_provider * sp_p = malloc(sizeof(omemo_storage_provider));
+
+  if (!sp_p || omemo_storage_mem_create(&mem_p) || omemo_storage_mem_provider_init(mem_p, sp_p)) {
+    return -1;
+  }
+
+  *state = sp_p;
+
+  return 0;
+}
+
+int storage_teardown(void ** state) {
+  omemo_storage_provider * sp_p = *state;
+
+  omemo_storage_mem_destroy(sp_p->user_data_p);
+  free(sp_p);
+
+  return 0;
+}
+
+void test_provider_init(void ** state) {
+  (void) state;
+
+  omemo_storage_mem * mem_p = (void *) 0;
+  omemo_storage_provider sp;
+
+  assert_int_equal(omemo_storage_mem_create((void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_storage_mem_create(&mem_p), 0);
+  assert_int_equal(omemo_storage_mem_provider_init((void *) 0, &sp), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_storage_mem_provider_init(mem_p, (void *) 0), OMEMO_ERR_NULL);
+  assert_int_equal(omemo_storage_mem_provider_init(mem_p, &sp), 0);
+  assert_ptr_equal(sp.user_data_p, mem_p);
+
+  omemo_storage_mem_destroy(mem_p);
+  omemo_storage_mem_destroy((void *) 0);
+}
+
+void test_devicelist_save_delete_id(void ** state) {
+  omemo_storage_provider * sp_p = *state;
+
+  assert_int_equal(sp_p->user_device_id_save_func("alice", 1111, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->user_device_id_save_func("alice", 1111, sp_p->user_data_p), OMEMO_ERR_STORAGE);
+  assert_int_equal(sp_p->global_device_id_exists_func(1111, sp_p->user_data_p), 1);
+  assert_int_equal(sp_p->user_device_id_delete_func("alice", 2222, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->user_device_id_delete_func("bob", 1111, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->global_device_id_exists_func(1111, sp_p->user_data_p), 1);
+  assert_int_equal(sp_p->user_device_id_delete_func("alice", 1111, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->global_device_id_exists_func(1111, sp_p->user_data_p), 0);
+}
+
+void test_devicelist_retrieve(void ** state) {
+  omemo_storage_provider * sp_p = *state;
+
+  omemo_devicelist * dl_p = (void *) 0;
+
+  assert_int_equal(sp_p->user_devicelist_retrieve_func("alice", sp_p->user_data_p, &dl_p), 0);
+  assert_ptr_not_equal(dl_p, (void *) 0);
+  assert_ptr_equal(omemo_devicelist_get_id_list(dl_p), (void *) 0);
+  omemo_devicelist_destroy(dl_p);
+
+  assert_int_equal(sp_p->user_device_id_save_func("alice", 1338, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->user_device_id_save_func("alice", 1337, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->user_device_id_save_func("bob", 4223, sp_p->user_data_p), 0);
+
+  assert_int_equal(sp_p->user_devicelist_retrieve_func("alice", sp_p->user_data_p, &dl_p), 0);
+  assert_string_equal(omemo_devicelist_get_owner(dl_p), "alice");
+  assert_int_equal(omemo_devicelist_list_data(omemo_devicelist_get_id_list(dl_p)), 1337);
+  assert_int_equal(omemo_devicelist_list_data(omemo_devicelist_get_id_list(dl_p)->next), 1338);
+  assert_ptr_equal(omemo_devicelist_get_id_list(dl_p)->next->next, (void *) 0);
+  omemo_devicelist_destroy(dl_p);
+}
+
+void test_global_device_id_exists(void ** state) {
+  omemo_storage_provider * sp_p = *state;
+
+  assert_int_equal(sp_p->global_device_id_exists_func(55555, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->user_device_id_save_func("alice", 55555, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->user_device_id_save_func("bob", 55555, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->global_device_id_exists_func(55555, sp_p->user_data_p), 1);
+  assert_int_equal(sp_p->user_device_id_delete_func("alice", 55555, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->global_device_id_exists_func(55555, sp_p->user_data_p), 1);
+  assert_int_equal(sp_p->user_device_id_delete_func("bob", 55555, sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->global_device_id_exists_func(55555, sp_p->user_data_p), 0);
+}
+
+void test_chatlist(void ** state) {
+  omemo_storage_provider * sp_p = *state;
+
+  assert_int_equal(sp_p->chatlist_exists_func("test", sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->chatlist_save_func("test", sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->chatlist_save_func("test", sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->chatlist_exists_func("test", sp_p->user_data_p), 1);
+  assert_int_equal(sp_p->chatlist_exists_func("other", sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->chatlist_delete_func("test", sp_p->user_data_p), 0);
+  assert_int_equal(sp_p->chatlist_exists_func("test", sp_p->user_data_p), 0);
+
+  assert_int_equal(sp_p->chatlist_exists_func((void *) 0, sp_p->user_data_p), OMEMO_ERR_NULL);
+  assert_int_equal(sp_p->chatlist_exists_func("test", (void *) 0), OMEMO_ERR_NULL);
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_provider_init),
+      cmocka_unit_test_setup_teardown(test_devicelist_save_delete_id, storage_setup, storage_teardown),
+      cmocka_unit_test_setup_teardown(test_devicelist_retrieve, storage_setup, storage_teardown),
+      cmocka_unit_test_setup_teardown(test_global_device_id_exists, storage_setup, storage_teardown),
+      cmocka_unit_test_setup_teardown(test_chatlist, storage_setup, storage_teardown)
+  };
+
+  return cmocka_run_group_tests(tests, (void *) 0, (void *) 0);
+}